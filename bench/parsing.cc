@@ -0,0 +1,278 @@
+// Micro benchmarks of the parsing hot paths. Runs on the pbf fixtures in
+// test/data and writes one json object per benchmark so results can be
+// compared between builds. The fixtures and lua/graph.lua are found under
+// the srcdir environment variable, the current directory if it is unset.
+//
+// Usage: bench/parsing [results file] [pbf files...]
+#include <cstdint>
+#include "mjolnir/idtable.h"
+#include "mjolnir/luatagtransform.h"
+#include "mjolnir/osmpbfparser.h"
+#include "mjolnir/osmway.h"
+#include "mjolnir/uniquenames.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+
+using namespace valhalla::mjolnir;
+
+namespace {
+
+// Each timing is repeated and the fastest run is kept
+constexpr size_t kRepeats = 5;
+
+// Elements of each type kept from a fixture for the tag transform
+constexpr size_t kSampleSize = 20000;
+
+struct Result {
+  std::string name;
+  std::string fixture;
+  size_t items;
+  double seconds;
+};
+
+// Counts what a pass sees and keeps a sample of it for the other benchmarks
+struct Collector : public OSMPBF::Callback {
+  size_t count = 0;
+  bool keep = false;
+  std::vector<Tags> node_tags;
+  std::vector<Tags> way_tags;
+  std::vector<Tags> relation_tags;
+  std::vector<uint64_t> way_ids;
+  std::vector<uint64_t> node_refs;
+  std::vector<std::string> names;
+
+  void node_callback(const uint64_t osmid, const double lng, const double lat,
+                     const OSMPBF::Tags& tags) override {
+    ++count;
+    if (keep && !tags.empty() && node_tags.size() < kSampleSize) {
+      node_tags.push_back(tags);
+    }
+  }
+  void way_callback(const uint64_t osmid, const OSMPBF::Tags& tags,
+                    const std::vector<uint64_t>& nodes) override {
+    ++count;
+    if (keep) {
+      node_refs.insert(node_refs.end(), nodes.begin(), nodes.end());
+      for (const auto& tag : tags) {
+        if (tag.first == "name" || tag.first == "ref") {
+          names.push_back(tag.second);
+        }
+      }
+      if (way_tags.size() < kSampleSize) {
+        way_tags.push_back(tags);
+        way_ids.push_back(osmid);
+      }
+    }
+  }
+  void relation_callback(const uint64_t osmid, const OSMPBF::Tags& tags,
+                         const std::vector<OSMPBF::Member>& members) override {
+    ++count;
+    if (keep && relation_tags.size() < kSampleSize) {
+      relation_tags.push_back(tags);
+    }
+  }
+};
+
+// Fastest of several runs of a function, in seconds
+template <class F>
+double Time(F f) {
+  double best = 0.0;
+  for (size_t i = 0; i < kRepeats; i++) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    best = (i == 0) ? seconds : std::min(best, seconds);
+  }
+  return best;
+}
+
+// One pass of the parser per interest, the way the graph parser reads a file
+void ParserPasses(const std::string& fixture, Collector& collector,
+                  std::vector<Result>& results) {
+  const std::pair<OSMPBF::Interest, std::string> passes[] = {
+    { OSMPBF::Interest::WAYS, "parser.ways" },
+    { OSMPBF::Interest::RELATIONS, "parser.relations" },
+    { OSMPBF::Interest::NODES, "parser.nodes" } };
+  for (const auto& pass : passes) {
+    collector.keep = true;
+    size_t items = 0;
+    double seconds = Time([&]() {
+      std::ifstream file(fixture, std::ios::binary);
+      if (!file.is_open()) {
+        throw std::runtime_error("Unable to open: " + fixture);
+      }
+      collector.count = 0;
+      OSMPBF::Parser::parse(file, pass.first, collector);
+      items = collector.count;
+      collector.keep = false;
+    });
+    results.push_back({ pass.second, fixture, items, seconds });
+  }
+  OSMPBF::Parser::free();
+}
+
+void TagTransform(const std::string& fixture, const Collector& collector,
+                  LuaTagTransform& lua, std::vector<Result>& results) {
+  const std::pair<OSMType, const std::vector<Tags>*> types[] = {
+    { OSMType::kNode, &collector.node_tags },
+    { OSMType::kWay, &collector.way_tags },
+    { OSMType::kRelation, &collector.relation_tags } };
+  const std::string names[] = { "lua.node", "lua.way", "lua.relation" };
+  for (size_t i = 0; i < 3; i++) {
+    size_t kept = 0;
+    double seconds = Time([&]() {
+      kept = 0;
+      for (const auto& tags : *types[i].second) {
+        kept += !lua.Transform(types[i].first, tags).empty();
+      }
+    });
+    results.push_back({ names[i], fixture, types[i].second->size(), seconds });
+  }
+}
+
+void IdTables(const std::string& fixture, const Collector& collector,
+              std::vector<Result>& results) {
+  const auto& refs = collector.node_refs;
+  uint64_t maxosmid = refs.empty() ? 0 : *std::max_element(refs.begin(), refs.end());
+  IdTable table(maxosmid + 1);
+  double seconds = Time([&]() {
+    for (auto id : refs) {
+      table.set(id);
+    }
+  });
+  results.push_back({ "idtable.set", fixture, refs.size(), seconds });
+
+  size_t used = 0;
+  seconds = Time([&]() {
+    used = 0;
+    for (auto id : refs) {
+      used += table.IsUsed(id);
+    }
+  });
+  if (used != refs.size()) {
+    throw std::runtime_error("IdTable lost ids of " + fixture);
+  }
+  results.push_back({ "idtable.isused", fixture, refs.size(), seconds });
+}
+
+void Names(const std::string& fixture, const Collector& collector,
+           std::vector<Result>& results) {
+  double seconds = Time([&]() {
+    UniqueNames names;
+    for (const auto& name : collector.names) {
+      names.index(name);
+    }
+  });
+  results.push_back({ "uniquenames.index", fixture, collector.names.size(), seconds });
+}
+
+// Sets up ways from their transformed tags as the graph parser does for the
+// attributes most ways carry
+void Ways(const std::string& fixture, const Collector& collector, LuaTagTransform& lua,
+          std::vector<Result>& results) {
+  std::vector<Tags> transformed;
+  std::vector<uint64_t> ids;
+  for (size_t i = 0; i < collector.way_tags.size(); i++) {
+    Tags tags = lua.Transform(OSMType::kWay, collector.way_tags[i]);
+    if (!tags.empty()) {
+      transformed.emplace_back(std::move(tags));
+      ids.push_back(collector.way_ids[i]);
+    }
+  }
+  std::vector<OSMWay> ways;
+  ways.reserve(transformed.size());
+  double seconds = Time([&]() {
+    ways.clear();
+    UniqueNames names;
+    for (size_t i = 0; i < transformed.size(); i++) {
+      OSMWay w{ids[i]};
+      for (const auto& tag : transformed[i]) {
+        if (tag.first == "road_class") {
+          w.set_road_class(static_cast<valhalla::baldr::RoadClass>(std::stoi(tag.second)));
+        } else if (tag.first == "default_speed" || tag.first == "speed") {
+          w.set_speed(std::stof(tag.second));
+        } else if (tag.first == "auto_forward") {
+          w.set_auto_forward(tag.second == "true");
+        } else if (tag.first == "pedestrian") {
+          w.set_pedestrian(tag.second == "true");
+        } else if (tag.first == "name") {
+          w.set_name_index(names.index(tag.second));
+        }
+      }
+      ways.push_back(w);
+    }
+  });
+  results.push_back({ "osmway.construct", fixture, transformed.size(), seconds });
+}
+
+void Write(std::ostream& out, const std::vector<Result>& results) {
+  for (const auto& result : results) {
+    double rate = result.seconds > 0.0 ? result.items / result.seconds : 0.0;
+    out << "{\"benchmark\":\"" << result.name << "\",\"fixture\":\""
+        << boost::filesystem::path(result.fixture).filename().string()
+        << "\",\"items\":" << result.items << ",\"seconds\":" << result.seconds
+        << ",\"items_per_second\":" << rate << "}\n";
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string output = argc > 1 ? argv[1] : "-";
+  std::vector<std::string> fixtures(argv + std::min(argc, 2), argv + argc);
+  const char* srcdir = std::getenv("srcdir");
+  boost::filesystem::path source_dir(srcdir != nullptr && *srcdir != '\0' ? srcdir : ".");
+  if (fixtures.empty()) {
+    for (boost::filesystem::directory_iterator i(source_dir / "test/data"), end; i != end; ++i) {
+      std::string file = i->path().string();
+      if (file.size() > 8 && file.compare(file.size() - 8, 8, ".osm.pbf") == 0) {
+        fixtures.push_back(file);
+      }
+    }
+    std::sort(fixtures.begin(), fixtures.end());
+  }
+
+  std::vector<Result> results;
+  try {
+    // The transform runs the same lua the graph parser is built with
+    std::string script_file = (source_dir / "lua/graph.lua").string();
+    std::ifstream script(script_file);
+    if (!script.is_open()) {
+      throw std::runtime_error("Unable to open: " + script_file);
+    }
+    std::stringstream lua_code;
+    lua_code << script.rdbuf();
+    LuaTagTransform lua(lua_code.str());
+
+    for (const auto& fixture : fixtures) {
+      Collector collector;
+      ParserPasses(fixture, collector, results);
+      TagTransform(fixture, collector, lua, results);
+      IdTables(fixture, collector, results);
+      Names(fixture, collector, results);
+      Ways(fixture, collector, lua, results);
+      std::cerr << fixture << " done" << std::endl;
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (output == "-") {
+    Write(std::cout, results);
+  } else {
+    std::ofstream file(output, std::ios::trunc);
+    Write(file, results);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,164 @@
+// Compares a full graph build with an update of it for a change to one way.
+// Each pbf fixture in test/data is built into a scratch dir, then updated
+// as pbfgraphbuilder --changes does up to the end of the build stage, and
+// one json object per measure is written like bench/parsing does. The
+// fixtures are found under the srcdir environment variable, the current
+// directory if it is unset.
+//
+// Usage: bench/update [results file] [pbf files...]
+#include "mjolnir/buildsnapshot.h"
+#include "mjolnir/graphbuilder.h"
+#include "mjolnir/osmchange.h"
+#include "mjolnir/pbfgraphparser.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/sequence.h>
+
+using namespace valhalla::mjolnir;
+
+namespace {
+
+const std::string kScratchDir = "bench/update";
+const std::vector<std::string> kFiles{
+  "ways.bin", "way_nodes.bin", "nodes.bin", "edges.bin", "relation_members.bin" };
+
+struct Result {
+  std::string name;
+  std::string fixture;
+  size_t items;
+  double seconds;
+};
+
+template <class F>
+double Time(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+OSMData Parse(const boost::property_tree::ptree& pt, const std::string& fixture) {
+  for (const auto& file : kFiles) {
+    boost::filesystem::remove(file);
+  }
+  return PBFGraphParser::Parse(pt.get_child("mjolnir"), { fixture }, "ways.bin", "way_nodes.bin",
+                               nullptr, "relation_members.bin");
+}
+
+size_t CountTiles(const std::string& dir) {
+  size_t count = 0;
+  for (boost::filesystem::recursive_directory_iterator i(dir), end; i != end; ++i) {
+    count += boost::filesystem::is_regular_file(i->path());
+  }
+  return count;
+}
+
+// The parse is measured on its own, an update parses the input in full too
+void Update(const std::string& fixture, std::vector<Result>& results) {
+  boost::property_tree::ptree pt;
+  pt.put("mjolnir.tile_dir", kScratchDir + "/tiles");
+  pt.put("mjolnir.snapshot_dir", kScratchDir + "/snapshot");
+  boost::filesystem::remove_all(kScratchDir);
+  valhalla::baldr::TileHierarchy hierarchy(kScratchDir + "/tiles");
+  BuildSnapshot snapshot(pt.get_child("mjolnir"));
+
+  OSMData osmdata;
+  double seconds = Time([&]() { osmdata = Parse(pt, fixture); });
+  results.push_back({ "update.parse", fixture, osmdata.osm_way_count, seconds });
+  seconds = Time([&]() { GraphBuilder::Build(pt, osmdata, "ways.bin", "way_nodes.bin"); });
+  snapshot.Save(kFiles);
+  size_t tiles = CountTiles(kScratchDir + "/tiles");
+  results.push_back({ "update.full_build", fixture, tiles, seconds });
+
+  uint64_t way_id;
+  {
+    valhalla::midgard::sequence<OSMWay> ways(snapshot.file("ways.bin"), false);
+    way_id = (*ways[ways.size() / 2]).way_id();
+  }
+  std::string change_file = kScratchDir + "/change.osc";
+  {
+    std::ofstream osc(change_file, std::ios::trunc);
+    osc << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<osmChange version=\"0.6\">\n"
+        << "<modify><way id=\"" << way_id << "\" version=\"2\"/></modify>\n</osmChange>\n";
+  }
+
+  osmdata = Parse(pt, fixture);
+  std::set<valhalla::baldr::GraphId> rebuild;
+  seconds = Time([&]() {
+    OSMChange change;
+    change.Load(change_file);
+    change.AddRelationMembers(snapshot.file("relation_members.bin"));
+    snapshot.Restore();
+    rebuild = change.DirtyTiles(hierarchy, {
+        { snapshot.file("ways.bin"), snapshot.file("way_nodes.bin") },
+        { "ways.bin", "way_nodes.bin" } });
+    GraphBuilder::AddConnectedTiles(snapshot.file("nodes.bin"), snapshot.file("edges.bin"),
+                                    rebuild);
+    GraphBuilder::Build(pt, osmdata, "ways.bin", "way_nodes.bin", BuildObserver(), &rebuild);
+  });
+  results.push_back({ "update.rebuild", fixture, rebuild.size(), seconds });
+
+  for (const auto& file : kFiles) {
+    boost::filesystem::remove(file);
+  }
+  boost::filesystem::remove_all(kScratchDir);
+}
+
+void Write(std::ostream& out, const std::vector<Result>& results) {
+  for (const auto& result : results) {
+    double rate = result.seconds > 0.0 ? result.items / result.seconds : 0.0;
+    out << "{\"benchmark\":\"" << result.name << "\",\"fixture\":\""
+        << boost::filesystem::path(result.fixture).filename().string()
+        << "\",\"items\":" << result.items << ",\"seconds\":" << result.seconds
+        << ",\"items_per_second\":" << rate << "}\n";
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  std::string output = argc > 1 ? argv[1] : "-";
+  std::vector<std::string> fixtures(argv + std::min(argc, 2), argv + argc);
+  const char* srcdir = std::getenv("srcdir");
+  boost::filesystem::path source_dir(srcdir != nullptr && *srcdir != '\0' ? srcdir : ".");
+  if (fixtures.empty()) {
+    for (boost::filesystem::directory_iterator i(source_dir / "test/data"), end; i != end; ++i) {
+      std::string file = i->path().string();
+      if (file.size() > 8 && file.compare(file.size() - 8, 8, ".osm.pbf") == 0) {
+        fixtures.push_back(file);
+      }
+    }
+    std::sort(fixtures.begin(), fixtures.end());
+  }
+
+  std::vector<Result> results;
+  try {
+    for (const auto& fixture : fixtures) {
+      Update(fixture, results);
+      std::cerr << fixture << " done" << std::endl;
+    }
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  if (output == "-") {
+    Write(std::cout, results);
+  } else {
+    std::ofstream file(output, std::ios::trunc);
+    Write(file, results);
+  }
+  return EXIT_SUCCESS;
+}
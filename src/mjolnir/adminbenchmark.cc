@@ -1,12 +1,9 @@
 #include <memory>
-#include <future>
-#include <thread>
-#include <mutex>
 #include <vector>
-#include <list>
-#include <queue>
-#include <unordered_set>
 #include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <random>
 #include <cinttypes>
 #include <limits>
 
@@ -19,20 +16,22 @@
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/optional.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/format.hpp>
 #include <boost/geometry.hpp>
 #include <boost/geometry/geometries/point_xy.hpp>
 #include <boost/geometry/geometries/polygon.hpp>
+#include <boost/geometry/geometries/box.hpp>
 #include <boost/geometry/multi/geometries/multi_polygon.hpp>
 #include <boost/geometry/io/wkt/wkt.hpp>
+#include <boost/geometry/index/rtree.hpp>
 
-#include <valhalla/midgard/distanceapproximator.h>
 #include <valhalla/midgard/pointll.h>
 #include <valhalla/baldr/tilehierarchy.h>
 #include <valhalla/baldr/graphid.h>
 #include <valhalla/baldr/graphconstants.h>
 #include <valhalla/baldr/graphtile.h>
 #include <valhalla/baldr/graphreader.h>
-#include <valhalla/baldr/admininfo.h>
 #include <valhalla/midgard/aabb2.h>
 #include <valhalla/midgard/constants.h>
 #include <valhalla/midgard/logging.h>
@@ -46,177 +45,408 @@ using namespace valhalla::baldr;
 typedef boost::geometry::model::d2::point_xy<double> point_type;
 typedef boost::geometry::model::polygon<point_type> polygon_type;
 typedef boost::geometry::model::multi_polygon<polygon_type> multi_polygon_type;
+typedef boost::geometry::model::box<point_type> box_type;
+typedef boost::geometry::index::rtree<std::pair<box_type, size_t>,
+                                      boost::geometry::index::quadratic<16> > rtree_type;
 
 boost::filesystem::path config_file_path;
+size_t sample_count = 10000;
+uint32_t seed = 0;
+std::vector<std::string> strategies = { "sql", "tile", "rtree" };
+
+namespace {
+
+// A location to resolve and the tile it came from
+struct sample_t {
+  PointLL ll;
+  uint32_t tileid;
+};
+
+// Polygons of one kind of lookup (admins or time zones). Admins are found
+// at the state level first and then at the country level.
+struct lookup_t {
+  std::string name;
+  sqlite3* db_handle;
+  std::string table;
+  bool admin;
+};
+
+// Results of one strategy for one kind of lookup. Ids are the rowid of the
+// polygon each sample resolved to, 0 if none.
+struct strategy_result_t {
+  std::string strategy;
+  double setup_secs = 0.0;
+  std::vector<uint32_t> ids;
+  std::vector<uint32_t> nanos;
+};
+
+using clock_type = std::chrono::steady_clock;
+
+uint32_t Nanos(const clock_type::time_point& start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - start).count();
+}
 
-std::unordered_map<uint32_t,multi_polygon_type> GetAdminInfo(
-            sqlite3* db_handle, std::unordered_map<uint32_t,
-            bool>& drive_on_right, const AABB2<PointLL>& aabb) {
-  // Polys (return)
-  std::unordered_map<uint32_t, multi_polygon_type> polys;
-
-  // Form query
-  std::string sql = "SELECT state.rowid, country.name, state.name, country.iso_code, ";
-  sql += "state.iso_code, state.drive_on_right, st_astext(state.geom) ";
-  sql += "from admins state, admins country where ";
-  sql += "ST_Intersects(state.geom, BuildMBR(" + std::to_string(aabb.minx()) + ",";
-  sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-  sql += std::to_string(aabb.maxy()) + ")) and ";
-  sql += "country.rowid = state.parent_admin and state.admin_level=4 ";
-  sql += "and state.rowid IN (SELECT rowid FROM SpatialIndex WHERE f_table_name = ";
-  sql += "'admins' AND search_frame = BuildMBR(" + std::to_string(aabb.minx()) + ",";
-  sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-  sql += std::to_string(aabb.maxy()) + "));";
-
-  sqlite3_stmt* stmt = 0;
-  uint32_t ret = sqlite3_prepare_v2(db_handle, sql.c_str(),
-                                    sql.length(), &stmt, 0);
-  if (ret == SQLITE_OK) {
-    uint32_t result = sqlite3_step(stmt);
-    if (result == SQLITE_DONE) {
-      // state/prov not found, try to find country
-      sql = "SELECT rowid, name, "", iso_code, "", drive_on_right, st_astext(geom) from ";
-      sql += " admins where ST_Intersects(geom, BuildMBR(" + std::to_string(aabb.minx()) + ",";
-      sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-      sql += std::to_string(aabb.maxy()) + ")) and admin_level=2 ";
-      sql += "and rowid IN (SELECT rowid FROM SpatialIndex WHERE f_table_name = ";
-      sql += "'admins' AND search_frame = BuildMBR(" + std::to_string(aabb.minx()) + ",";
-      sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-      sql += std::to_string(aabb.maxy()) + "));";
+double Secs(const clock_type::time_point& start) {
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
 
-      sqlite3_finalize(stmt);
-      stmt = 0;
-      ret = sqlite3_prepare_v2(db_handle, sql.c_str(), sql.length(), &stmt, 0);
-      if (ret == SQLITE_OK) {
-        result = 0;
-        result = sqlite3_step(stmt);
-      }
-    }
+// Open a spatialite database read only
+sqlite3* OpenDb(const std::string& database) {
+  if (!boost::filesystem::exists(database)) {
+    LOG_WARN("Database " + database + " not found.");
+    return nullptr;
+  }
 
-    uint32_t index = 1;
-    while (result == SQLITE_ROW) {
+  spatialite_init(0);
+  sqlite3* db_handle = nullptr;
+  char* err_msg = nullptr;
+  uint32_t ret = sqlite3_open_v2(database.c_str(), &db_handle,
+                      SQLITE_OPEN_READONLY, nullptr);
+  if (ret != SQLITE_OK) {
+    LOG_ERROR("cannot open " + database);
+    sqlite3_close(db_handle);
+    return nullptr;
+  }
 
-      uint32_t id = sqlite3_column_int(stmt, 0);
-      std::string country_name = "";
-      std::string state_name = "";
-      std::string country_iso = "";
-      std::string state_iso = "";
+  // loading SpatiaLite as an extension
+  sqlite3_enable_load_extension(db_handle, 1);
+  std::string sql = "SELECT load_extension('mod_spatialite')";
+  ret = sqlite3_exec(db_handle, sql.c_str(), nullptr, nullptr, &err_msg);
+  if (ret != SQLITE_OK) {
+    LOG_ERROR("load_extension() error: " + std::string(err_msg));
+    sqlite3_free(err_msg);
+    sqlite3_close(db_handle);
+    return nullptr;
+  }
+  return db_handle;
+}
 
-      if (sqlite3_column_type(stmt, 1) == SQLITE_TEXT)
-        country_name = std::string( reinterpret_cast< const char* >(sqlite3_column_text(stmt, 1)));
+// Reservoir sample of the node locations in the local level tiles. Samples
+// are ordered by tile so per tile strategies see each tile once.
+std::vector<sample_t> SampleNodes(GraphReader& reader) {
+  const auto& tile_hierarchy = reader.GetTileHierarchy();
+  auto local_level = tile_hierarchy.levels().rbegin()->second.level;
+  const auto& tiles = tile_hierarchy.levels().rbegin()->second.tiles;
 
-      if (sqlite3_column_type(stmt, 2) == SQLITE_TEXT)
-        state_name = std::string( reinterpret_cast< const char* >(sqlite3_column_text(stmt, 2)));
+  std::mt19937 generator(seed);
+  std::vector<sample_t> samples;
+  uint64_t seen = 0;
+  for (uint32_t id = 0; id < tiles.TileCount(); id++) {
+    GraphId tile_id(id, local_level, 0);
+    if (!GraphReader::DoesTileExist(tile_hierarchy, tile_id)) {
+      continue;
+    }
+    const GraphTile* tile = reader.GetGraphTile(tile_id);
+    for (uint32_t i = 0; i < tile->header()->nodecount(); i++, seen++) {
+      sample_t sample{ tile->node(i)->latlng(), id };
+      if (samples.size() < sample_count) {
+        samples.push_back(sample);
+      } else {
+        uint64_t j = std::uniform_int_distribution<uint64_t>(0, seen)(generator);
+        if (j < sample_count) {
+          samples[j] = sample;
+        }
+      }
+    }
+    reader.Clear();
+  }
+  std::stable_sort(samples.begin(), samples.end(),
+                   [](const sample_t& a, const sample_t& b) { return a.tileid < b.tileid; });
+  LOG_INFO("Sampled " + std::to_string(samples.size()) + " of " + std::to_string(seen) + " nodes");
+  return samples;
+}
 
-      if (sqlite3_column_type(stmt, 3) == SQLITE_TEXT)
-        country_iso = std::string( reinterpret_cast< const char* >(sqlite3_column_text(stmt, 3)));
+// Read (rowid, polygon) rows from a query
+std::vector<std::pair<uint32_t, multi_polygon_type> > ReadPolygons(sqlite3* db_handle,
+                                                                   const std::string& sql) {
+  std::vector<std::pair<uint32_t, multi_polygon_type> > polys;
+  sqlite3_stmt* stmt = 0;
+  if (sqlite3_prepare_v2(db_handle, sql.c_str(), sql.length(), &stmt, 0) == SQLITE_OK) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      if (sqlite3_column_type(stmt, 1) != SQLITE_TEXT)
+        continue;
+      polys.emplace_back(sqlite3_column_int(stmt, 0), multi_polygon_type());
+      boost::geometry::read_wkt(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)),
+                                polys.back().second);
+    }
+  }
+  else {
+    LOG_ERROR("SQL error: " + sql);
+  }
+  if (stmt) {
+    sqlite3_finalize(stmt);
+  }
+  return polys;
+}
 
-      if (sqlite3_column_type(stmt, 4) == SQLITE_TEXT)
-        state_iso = std::string( reinterpret_cast< const char* >(sqlite3_column_text(stmt, 4)));
+// Spatial index filter for a bounding box
+std::string SearchFrame(const std::string& table, const std::string& column,
+                        const AABB2<PointLL>& aabb) {
+  std::string mbr = "BuildMBR(" + std::to_string(aabb.minx()) + "," +
+    std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + "," +
+    std::to_string(aabb.maxy()) + ")";
+  return "ST_Intersects(" + column + "geom, " + mbr + ") and " + column + "rowid IN " +
+    "(SELECT rowid FROM SpatialIndex WHERE f_table_name = '" + table +
+    "' AND search_frame = " + mbr + ")";
+}
 
-      bool dor = true;
-      if (sqlite3_column_type(stmt, 5) == SQLITE_INTEGER)
-        dor = sqlite3_column_int(stmt, 5);
+// States must have a parent country, the same as the graph enhancer
+std::string StateQuery(const std::string& filter) {
+  return "SELECT state.rowid, st_astext(state.geom) from admins state, admins country where " +
+    filter + (filter.empty() ? "" : " and ") +
+    "country.rowid = state.parent_admin and state.admin_level=4";
+}
 
-      std::string geom = "";
-      if (sqlite3_column_type(stmt, 6) == SQLITE_TEXT)
-        geom = std::string( reinterpret_cast< const char* >(sqlite3_column_text(stmt, 6)));
+std::string CountryQuery(const std::string& filter) {
+  return "SELECT rowid, st_astext(geom) from admins where " + filter +
+    (filter.empty() ? "" : " and ") + "admin_level=2";
+}
 
-      multi_polygon_type multi_poly;
-      boost::geometry::read_wkt(geom, multi_poly);
-      polys.emplace(index, multi_poly);
-      drive_on_right.emplace(index, dor);
-      index++;
+std::string TimeZoneQuery(const std::string& filter) {
+  return "SELECT rowid, st_astext(geom) from tz_world" +
+    (filter.empty() ? "" : " where " + filter);
+}
 
-      result = sqlite3_step(stmt);
+// A point query per sample, answered entirely by spatialite
+strategy_result_t SqlStrategy(const lookup_t& lookup, const std::vector<sample_t>& samples) {
+  strategy_result_t result;
+  result.strategy = "sql";
+  auto start = clock_type::now();
+  std::string point = "MakePoint(?, ?, 4326)";
+  std::string covers = "ST_Covers(geom, " + point + ") AND rowid IN (SELECT rowid FROM "
+    "SpatialIndex WHERE f_table_name = '" + lookup.table + "' AND search_frame = " + point + ")";
+  std::vector<std::string> sqls;
+  if (lookup.admin) {
+    sqls.push_back("SELECT rowid FROM admins WHERE admin_level=4 AND parent_admin IN "
+                   "(SELECT rowid FROM admins) AND " + covers + " LIMIT 1");
+    sqls.push_back("SELECT rowid FROM admins WHERE admin_level=2 AND " + covers + " LIMIT 1");
+  } else {
+    sqls.push_back("SELECT rowid FROM tz_world WHERE " + covers + " LIMIT 1");
+  }
+  std::vector<sqlite3_stmt*> stmts;
+  for (const auto& sql : sqls) {
+    sqlite3_stmt* stmt = 0;
+    if (sqlite3_prepare_v2(lookup.db_handle, sql.c_str(), sql.length(), &stmt, 0) != SQLITE_OK) {
+      LOG_ERROR("SQL error: " + sql);
+      LOG_ERROR(std::string(sqlite3_errmsg(lookup.db_handle)));
     }
+    stmts.push_back(stmt);
   }
-  if (stmt) {
-    sqlite3_finalize(stmt);
-    stmt = 0;
+  result.setup_secs = Secs(start);
+
+  for (const auto& sample : samples) {
+    start = clock_type::now();
+    uint32_t id = 0;
+    for (auto* stmt : stmts) {
+      if (!stmt)
+        continue;
+      sqlite3_reset(stmt);
+      sqlite3_bind_double(stmt, 1, sample.ll.lng());
+      sqlite3_bind_double(stmt, 2, sample.ll.lat());
+      sqlite3_bind_double(stmt, 3, sample.ll.lng());
+      sqlite3_bind_double(stmt, 4, sample.ll.lat());
+      if (sqlite3_step(stmt) == SQLITE_ROW) {
+        id = sqlite3_column_int(stmt, 0);
+        break;
+      }
+    }
+    result.nanos.push_back(Nanos(start));
+    result.ids.push_back(id);
   }
-  return polys;
+  for (auto* stmt : stmts) {
+    if (stmt)
+      sqlite3_finalize(stmt);
+  }
+  return result;
 }
 
-// Benchmark the admin DB access
-void Benchmark(const boost::property_tree::ptree& pt) {
-std::cout << "In Benchmark" << std::endl;
+// What the graph enhancer does: fetch the polygons intersecting each tile
+// then test the points of the tile with covered_by
+strategy_result_t TileStrategy(const lookup_t& lookup, const std::vector<sample_t>& samples,
+                               const TileHierarchy& tile_hierarchy) {
+  strategy_result_t result;
+  result.strategy = "tile";
+  const auto& tiles = tile_hierarchy.levels().rbegin()->second.tiles;
+  std::vector<std::pair<uint32_t, multi_polygon_type> > polys;
+  uint32_t tileid = std::numeric_limits<uint32_t>::max();
+  for (const auto& sample : samples) {
+    if (sample.tileid != tileid) {
+      tileid = sample.tileid;
+      auto start = clock_type::now();
+      if (lookup.admin) {
+        polys = ReadPolygons(lookup.db_handle,
+                             StateQuery(SearchFrame("admins", "state.", tiles.TileBounds(tileid))));
+        if (polys.empty())
+          polys = ReadPolygons(lookup.db_handle,
+                               CountryQuery(SearchFrame("admins", "", tiles.TileBounds(tileid))));
+      } else {
+        polys = ReadPolygons(lookup.db_handle,
+                             TimeZoneQuery(SearchFrame("tz_world", "", tiles.TileBounds(tileid))));
+      }
+      result.setup_secs += Secs(start);
+    }
 
-  uint32_t counts[128] = {};
+    auto start = clock_type::now();
+    uint32_t id = 0;
+    if (polys.size() == 1) {
+      id = polys.front().first;
+    } else {
+      point_type p(sample.ll.lng(), sample.ll.lat());
+      for (const auto& poly : polys) {
+        if (boost::geometry::covered_by(p, poly.second)) {
+          id = poly.first;
+          break;
+        }
+      }
+    }
+    result.nanos.push_back(Nanos(start));
+    result.ids.push_back(id);
+  }
+  return result;
+}
 
-  // Initialize the admin DB (if it exists)
-  boost::property_tree::ptree admin = pt.get_child("admin");
-  std::string dir = admin.get<std::string>("admin_dir");
-  std::string db_name = admin.get<std::string>("db_name");
-  std::string database = dir + "/" +  db_name;
-  sqlite3* db_handle = nullptr;
-  if (boost::filesystem::exists(database)) {
-    spatialite_init(0);
-    sqlite3_stmt* stmt = 0;
-    char* err_msg = nullptr;
-    std::string sql;
-    uint32_t ret = sqlite3_open_v2(database.c_str(), &db_handle,
-                        SQLITE_OPEN_READONLY, nullptr);
-    if (ret != SQLITE_OK) {
-      LOG_ERROR("cannot open " + database);
-      sqlite3_close(db_handle);
-      db_handle = nullptr;
-      return;
+// Load every polygon once into an in memory r-tree of their envelopes
+strategy_result_t RTreeStrategy(const lookup_t& lookup, const std::vector<sample_t>& samples) {
+  strategy_result_t result;
+  result.strategy = "rtree";
+  auto start = clock_type::now();
+
+  // States come before countries so they are preferred
+  auto polys = ReadPolygons(lookup.db_handle, lookup.admin ? StateQuery("") : TimeZoneQuery(""));
+  if (lookup.admin) {
+    auto countries = ReadPolygons(lookup.db_handle, CountryQuery(""));
+    std::move(countries.begin(), countries.end(), std::back_inserter(polys));
+  }
+  std::vector<std::pair<box_type, size_t> > boxes;
+  boxes.reserve(polys.size());
+  for (size_t i = 0; i < polys.size(); i++) {
+    boxes.emplace_back(boost::geometry::return_envelope<box_type>(polys[i].second), i);
+  }
+  rtree_type rtree(boxes.begin(), boxes.end());
+  result.setup_secs = Secs(start);
+
+  std::vector<std::pair<box_type, size_t> > candidates;
+  for (const auto& sample : samples) {
+    start = clock_type::now();
+    point_type p(sample.ll.lng(), sample.ll.lat());
+    candidates.clear();
+    rtree.query(boost::geometry::index::intersects(p), std::back_inserter(candidates));
+    std::sort(candidates.begin(), candidates.end(),
+              [](const std::pair<box_type, size_t>& a, const std::pair<box_type, size_t>& b) {
+                return a.second < b.second;
+              });
+    uint32_t id = 0;
+    // States sort first so countries are only tested if no state covers the point
+    for (const auto& candidate : candidates) {
+      if (boost::geometry::covered_by(p, polys[candidate.second].second)) {
+        id = polys[candidate.second].first;
+        break;
+      }
     }
+    result.nanos.push_back(Nanos(start));
+    result.ids.push_back(id);
+  }
+  return result;
+}
+
+uint32_t Percentile(std::vector<uint32_t> nanos, const float percentile) {
+  if (nanos.empty())
+    return 0;
+  auto nth = nanos.begin() + std::min(nanos.size() - 1,
+                                      static_cast<size_t>(nanos.size() * percentile));
+  std::nth_element(nanos.begin(), nth, nanos.end());
+  return *nth;
+}
 
-    // loading SpatiaLite as an extension
-    sqlite3_enable_load_extension(db_handle, 1);
-    sql = "SELECT load_extension('mod_spatialite')";
-    ret = sqlite3_exec(db_handle, sql.c_str(), nullptr, nullptr, &err_msg);
-    if (ret != SQLITE_OK) {
-      LOG_ERROR("load_extension() error: " + std::string(err_msg));
-      sqlite3_free(err_msg);
-      sqlite3_close(db_handle);
-      return;
+// Log throughput, latency and agreement with the first strategy
+void Report(const lookup_t& lookup, const std::vector<strategy_result_t>& results) {
+  for (const auto& result : results) {
+    double lookup_secs = 0.0;
+    size_t found = 0;
+    for (size_t i = 0; i < result.nanos.size(); i++) {
+      lookup_secs += result.nanos[i] * 1e-9;
+      found += result.ids[i] != 0;
     }
-    LOG_INFO("SpatiaLite loaded as an extension");
+    size_t count = result.ids.size();
+    std::string line = (boost::format("%1% %2%: setup %3$.3f s, %4$.0f lookups/s, "
+        "%5$.0f lookups/s with setup, p50 %6$.1f us, p99 %7$.1f us, found %8$.2f%%")
+        % lookup.name % result.strategy % result.setup_secs
+        % (lookup_secs > 0.0 ? count / lookup_secs : 0.0)
+        % (lookup_secs + result.setup_secs > 0.0 ? count / (lookup_secs + result.setup_secs) : 0.0)
+        % (Percentile(result.nanos, 0.5f) * 0.001f) % (Percentile(result.nanos, 0.99f) * 0.001f)
+        % (count ? 100.0 * found / count : 0.0)).str();
+    LOG_INFO(line);
   }
-  else {
-    LOG_ERROR("Admin db " + database + " not found.");
+  for (size_t s = 1; s < results.size(); s++) {
+    const auto& base = results.front();
+    const auto& other = results[s];
+    size_t agree = 0;
+    for (size_t i = 0; i < base.ids.size(); i++) {
+      agree += base.ids[i] == other.ids[i];
+    }
+    LOG_INFO((boost::format("%1% %2% agrees with %3% for %4$.2f%% of %5% samples")
+        % lookup.name % other.strategy % base.strategy
+        % (base.ids.empty() ? 100.0 : 100.0 * agree / base.ids.size()) % base.ids.size()).str());
+  }
+}
+
+}
+
+// Benchmark point to admin and point to time zone resolution
+void Benchmark(const boost::property_tree::ptree& pt) {
+  // Sample node locations from the tiles
+  GraphReader reader(pt);
+  std::vector<sample_t> samples = SampleNodes(reader);
+  if (samples.empty()) {
+    LOG_ERROR("No nodes found in the tiles");
     return;
   }
 
-  // Graphreader
-  GraphReader reader(pt.get_child("hierarchy"));
-  auto tile_hierarchy = reader.GetTileHierarchy();
-  auto local_level = tile_hierarchy.levels().rbegin()->second.level;
-  auto tiles = tile_hierarchy.levels().rbegin()->second.tiles;
+  std::vector<lookup_t> lookups;
+  auto admin = pt.get_optional<std::string>("admin");
+  if (admin) {
+    lookups.push_back({ "admin", OpenDb(*admin), "admins", true });
+  }
+  auto timezone = pt.get_optional<std::string>("timezone");
+  if (timezone) {
+    lookups.push_back({ "timezone", OpenDb(*timezone), "tz_world", false });
+  }
 
-  // Iterate through the tiles and perform enhancements
-  std::unordered_map<uint32_t,multi_polygon_type> polys;
-  std::unordered_map<uint32_t,bool> drive_on_right;
-  for (uint32_t id = 0; id < tiles.TileCount(); id++) {
-    // Get the admin polys if there is data for tiles that exist
-    GraphId tile_id(id, local_level, 0);
-    if (GraphReader::DoesTileExist(tile_hierarchy, tile_id)) {
-      polys = GetAdminInfo(db_handle, drive_on_right, tiles.TileBounds(id));
-      LOG_INFO("polys: " + std::to_string(polys.size()));
-      if (polys.size() < 128) {
-        counts[polys.size()]++;
-      }
+  for (const auto& lookup : lookups) {
+    if (!lookup.db_handle) {
+      continue;
     }
-  }
-  for (uint32_t i = 0; i < 128; i++) {
-    if (counts[i] > 0) {
-      LOG_INFO("Tiles with " + std::to_string(i) + " admin polys: " +
-               std::to_string(counts[i]));
+    std::vector<strategy_result_t> results;
+    for (const auto& strategy : strategies) {
+      LOG_INFO("Timing " + lookup.name + " lookups with " + strategy);
+      if (strategy == "sql") {
+        results.emplace_back(SqlStrategy(lookup, samples));
+      } else if (strategy == "tile") {
+        results.emplace_back(TileStrategy(lookup, samples, reader.GetTileHierarchy()));
+      } else if (strategy == "rtree") {
+        results.emplace_back(RTreeStrategy(lookup, samples));
+      } else {
+        LOG_WARN("Unknown strategy " + strategy);
+      }
     }
+    Report(lookup, results);
+    sqlite3_close(lookup.db_handle);
   }
 }
 
 bool ParseArguments(int argc, char *argv[]) {
-  std::vector<std::string> input_files;
+  std::string strategy_list;
   bpo::options_description options(
       "adminbenchmark " VERSION "\n"
       "\n"
       " Usage: adminbenchmark [options] \n"
       "\n"
-      "adminbenchmark is a program to time the admin queries "
+      "adminbenchmark is a program to time point to admin and point to time zone "
+      "lookups. Node locations sampled from the tiles are resolved with each "
+      "strategy: sql (a spatialite query per point), tile (polygons fetched per "
+      "tile and tested with covered_by, as the graph enhancer does) and rtree "
+      "(all polygons held in an in memory index). Throughput, p50/p99 latency "
+      "and agreement with the first strategy are reported."
       "\n"
       "\n");
 
@@ -225,7 +455,13 @@ bool ParseArguments(int argc, char *argv[]) {
               ("version,v", "Print the version of this software.")
               ("config,c",
                   boost::program_options::value<boost::filesystem::path>(&config_file_path)->required(),
-                  "Path to the json configuration file.");
+                  "Path to the json configuration file.")
+              ("samples,n", boost::program_options::value<size_t>(&sample_count),
+                  "Number of node locations to sample (default 10000).")
+              ("seed,s", boost::program_options::value<uint32_t>(&seed),
+                  "Seed for sampling node locations (default 0).")
+              ("strategies", boost::program_options::value<std::string>(&strategy_list),
+                  "Comma separated strategies to time (default sql,tile,rtree).");
 
   bpo::positional_options_description pos_options;
   bpo::variables_map vm;
@@ -250,6 +486,10 @@ bool ParseArguments(int argc, char *argv[]) {
     return true;
   }
 
+  if (!strategy_list.empty()) {
+    boost::algorithm::split(strategies, strategy_list, boost::algorithm::is_any_of(","));
+  }
+
   if (vm.count("config")) {
     if (boost::filesystem::is_regular_file(config_file_path))
       return true;
@@ -263,7 +503,7 @@ int main(int argc, char** argv) {
   if (!ParseArguments(argc, argv))
     return EXIT_FAILURE;
 
-  //Ccheck what type of input we are getting
+  //Check what type of input we are getting
   boost::property_tree::ptree pt;
   boost::property_tree::read_json(config_file_path.c_str(), pt);
 
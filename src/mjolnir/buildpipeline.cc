@@ -0,0 +1,400 @@
+#include "mjolnir/buildpipeline.h"
+#include "mjolnir/metrics.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <sys/resource.h>
+
+#include <valhalla/midgard/logging.h>
+
+namespace {
+
+// Measures below these are too small to compare between builds
+constexpr double kMinSeconds = 1.0;
+constexpr double kMinBytes = 1024.0 * 1024.0;
+
+// Compare a measure with the baseline, returns true if it regressed
+bool Regressed(const std::string& name, const double value, const double baseline,
+               const double min_value, const float threshold) {
+  if (baseline < min_value || value <= baseline * (1.0 + threshold)) {
+    return false;
+  }
+  LOG_WARN("Regression in " + name + ": " + std::to_string(value) + " against " +
+           std::to_string(baseline) + " (+" +
+           std::to_string(static_cast<int>((value / baseline - 1.0) * 100.0)) + "%)");
+  return true;
+}
+
+// Highest peak RSS before the last reset. Resetting the peak resets the
+// one getrusage reports too.
+std::mutex peak_lock;
+uint64_t peak_before_reset = 0;
+
+// Resources used between two points in time
+void SetUsage(const valhalla::mjolnir::ResourceUsage& start,
+              const valhalla::mjolnir::ResourceUsage& end,
+              valhalla::mjolnir::StageTiming& timing) {
+  timing.ran = true;
+  timing.seconds = end.wall_seconds - start.wall_seconds;
+  timing.cpu_seconds = end.cpu_seconds - start.cpu_seconds;
+  timing.peak_rss = end.peak_rss;
+  timing.bytes_read = end.bytes_read - start.bytes_read;
+  timing.bytes_written = end.bytes_written - start.bytes_written;
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+ResourceUsage ResourceUsage::Now() {
+  ResourceUsage usage{};
+  usage.wall_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  rusage self;
+  if (getrusage(RUSAGE_SELF, &self) == 0) {
+    usage.cpu_seconds = self.ru_utime.tv_sec + self.ru_stime.tv_sec +
+                        (self.ru_utime.tv_usec + self.ru_stime.tv_usec) * 1e-6;
+    usage.peak_rss = static_cast<uint64_t>(self.ru_maxrss) * 1024;
+  }
+
+  // Only available on linux, elsewhere the bytes stay 0 and the peak is
+  // that of the whole process
+  std::ifstream io("/proc/self/io");
+  std::string key;
+  uint64_t value;
+  while (io >> key >> value) {
+    if (key == "read_bytes:") {
+      usage.bytes_read = value;
+    } else if (key == "write_bytes:") {
+      usage.bytes_written = value;
+    }
+  }
+  std::ifstream status("/proc/self/status");
+  std::string line;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmHWM:") == 0) {
+      usage.peak_rss = std::stoull(line.substr(6)) * 1024;
+      break;
+    }
+  }
+  return usage;
+}
+
+bool ResourceUsage::ResetPeak() {
+  std::lock_guard<std::mutex> lock(peak_lock);
+  peak_before_reset = std::max(peak_before_reset, Now().peak_rss);
+  std::ofstream clear_refs("/proc/self/clear_refs");
+  clear_refs << "5";
+  clear_refs.close();
+  return !clear_refs.fail();
+}
+
+uint64_t ResourceUsage::ProcessPeak() {
+  std::lock_guard<std::mutex> lock(peak_lock);
+  return std::max(peak_before_reset, Now().peak_rss);
+}
+
+size_t CompareReport(const boost::property_tree::ptree& report,
+                     const boost::property_tree::ptree& baseline,
+                     const float threshold) {
+  const std::pair<std::string, double> measures[] = {
+    { "seconds", kMinSeconds }, { "cpu_seconds", kMinSeconds }, { "peak_rss", kMinBytes },
+    { "bytes_read", kMinBytes }, { "bytes_written", kMinBytes } };
+  size_t regressions = 0;
+  for (const auto& stage : report.get_child("stages")) {
+    auto name = stage.second.get<std::string>("name");
+    for (const auto& base : baseline.get_child("stages")) {
+      if (base.second.get<std::string>("name") != name) {
+        continue;
+      }
+      for (const auto& measure : measures) {
+        regressions += Regressed(name + " " + measure.first,
+                                 stage.second.get<double>(measure.first),
+                                 base.second.get<double>(measure.first, 0.0), measure.second,
+                                 threshold);
+      }
+    }
+  }
+  for (const auto& total : { "peak_rss", "tile_bytes" }) {
+    regressions += Regressed(total, report.get<double>(total, 0.0),
+                             baseline.get<double>(total, 0.0), kMinBytes, threshold);
+  }
+  return regressions;
+}
+
+TileFeed::TileFeed(const std::string& name)
+    : closed_(false), gauge_("pipeline." + name + "_depth") {
+}
+
+void TileFeed::Push(const baldr::GraphId& tile_id) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    tiles_.push_back(tile_id);
+  }
+  Metrics::Get().gauge(gauge_).Add(1);
+  ready_.notify_one();
+}
+
+void TileFeed::Close() {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    closed_ = true;
+  }
+  ready_.notify_all();
+}
+
+bool TileFeed::Pop(baldr::GraphId& tile_id) {
+  std::unique_lock<std::mutex> lock(lock_);
+  ready_.wait(lock, [this]() { return closed_ || !tiles_.empty(); });
+  if (tiles_.empty()) {
+    return false;
+  }
+  tile_id = tiles_.front();
+  tiles_.pop_front();
+  Metrics::Get().gauge(gauge_).Add(-1);
+  return true;
+}
+
+BuiltTiles::BuiltTiles(const baldr::TileHierarchy& hierarchy)
+    : hierarchy_(hierarchy), planned_(false), closed_(false),
+      ready_("ready_feed") {
+}
+
+void BuiltTiles::Plan(const std::set<baldr::GraphId>& tiles) {
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (const auto& tile_id : tiles) {
+      // A tile waits for itself and for each planned tile next to it
+      uint32_t& count = pending_[tile_id.Tile_Base()];
+      for (const auto& neighbor : Neighbors(tile_id)) {
+        if (tiles.find(neighbor) != tiles.end()) {
+          ++count;
+        }
+      }
+    }
+    planned_ = true;
+  }
+  written_.notify_all();
+}
+
+void BuiltTiles::Add(const baldr::GraphId& tile_id) {
+  auto base = tile_id.Tile_Base();
+  std::vector<baldr::GraphId> ready;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (closed_ || !built_.insert(base).second) {
+      return;
+    }
+    for (const auto& neighbor : Neighbors(base)) {
+      auto pending = pending_.find(neighbor);
+      if (pending != pending_.end() && pending->second > 0 &&
+          --pending->second == 0) {
+        ready.push_back(neighbor);
+      }
+    }
+  }
+  written_.notify_all();
+  for (const auto& ready_id : ready) {
+    ready_.Push(ready_id);
+  }
+}
+
+void BuiltTiles::Close() {
+  // Built tiles still waiting for a neighbor wait for nothing anymore
+  std::vector<baldr::GraphId> ready;
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    for (const auto& tile_id : built_) {
+      auto pending = pending_.find(tile_id);
+      if (pending != pending_.end() && pending->second > 0) {
+        pending->second = 0;
+        ready.push_back(tile_id);
+      }
+    }
+  }
+  written_.notify_all();
+  for (const auto& ready_id : ready) {
+    ready_.Push(ready_id);
+  }
+  ready_.Close();
+}
+
+bool BuiltTiles::Wait(const baldr::GraphId& tile_id) const {
+  auto base = tile_id.Tile_Base();
+  std::unique_lock<std::mutex> lock(lock_);
+  written_.wait(lock, [this, &base]() {
+    return closed_ || built_.find(base) != built_.end() ||
+           (planned_ && pending_.find(base) == pending_.end());
+  });
+  return built_.find(base) != built_.end();
+}
+
+TileFeed& BuiltTiles::ready() {
+  return ready_;
+}
+
+std::vector<baldr::GraphId> BuiltTiles::Neighbors(
+    const baldr::GraphId& tile_id) const {
+  // Tiles touched by the bounds of the tile grown by half a tile, which is
+  // the tile and the 8 around it
+  const auto& level = hierarchy_.levels().rbegin()->second;
+  auto bounds = level.tiles.TileBounds(tile_id.tileid());
+  float half = (bounds.maxx() - bounds.minx()) * 0.5f;
+  midgard::AABB2<midgard::PointLL> grown(bounds.minx() - half, bounds.miny() - half,
+                                         bounds.maxx() + half, bounds.maxy() + half);
+  std::vector<baldr::GraphId> neighbors;
+  for (auto id : level.tiles.TileList(grown)) {
+    neighbors.emplace_back(id, level.level, 0);
+  }
+  return neighbors;
+}
+
+BuildPipeline::BuildPipeline(const boost::property_tree::ptree& pt)
+    : all_(true) {
+  auto stages = pt.get_child_optional("mjolnir.stages");
+  if (stages) {
+    all_ = false;
+    for (const auto& stage : *stages) {
+      enabled_.insert(stage.second.get_value<std::string>());
+    }
+  }
+}
+
+void BuildPipeline::Add(const std::string& name, const std::function<void()>& run,
+                        const bool overlap) {
+  stages_.push_back({ name, run, overlap });
+  open_steps_.push_back({ "", ResourceUsage() });
+  steps_.emplace_back();
+}
+
+bool BuildPipeline::enabled(const std::string& name) const {
+  return all_ || enabled_.find(name) != enabled_.end();
+}
+
+StepCallback BuildPipeline::Steps(const std::string& name) {
+  size_t index = 0;
+  while (index < stages_.size() && stages_[index].name != name) {
+    index++;
+  }
+  if (index == stages_.size()) {
+    throw std::runtime_error("No stage " + name + " to time steps of");
+  }
+  return [this, index](const std::string& step) {
+    auto now = ResourceUsage::Now();
+    std::lock_guard<std::mutex> lock(steps_lock_);
+    EndStep(index, now);
+    open_steps_[index] = { step, now };
+  };
+}
+
+// Called with the steps locked
+void BuildPipeline::EndStep(const size_t index, const ResourceUsage& now) {
+  auto& open = open_steps_[index];
+  if (!open.name.empty()) {
+    steps_[index].push_back({ stages_[index].name + "/" + open.name });
+    SetUsage(open.start, now, steps_[index].back());
+    open.name.clear();
+  }
+}
+
+// Run a stage, keeping the resources it used and any exception it throws
+void BuildPipeline::RunStage(const size_t index, std::exception_ptr& error) {
+  const auto& stage = stages_[index];
+  LOG_INFO("Starting stage " + stage.name);
+  Gauge& running = Metrics::Get().gauge("pipeline.stages_running");
+  running.Add(1);
+  auto start = ResourceUsage::Now();
+  try {
+    stage.run();
+  }
+  catch (...) {
+    error = std::current_exception();
+  }
+  auto end = ResourceUsage::Now();
+  {
+    std::lock_guard<std::mutex> lock(steps_lock_);
+    EndStep(index, end);
+  }
+  SetUsage(start, end, timings_[index]);
+  running.Add(-1);
+  Metrics::Get().timer("pipeline.stage." + stage.name).Record(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(timings_[index].seconds)));
+  LOG_INFO("Finished stage " + stage.name + " in " + std::to_string(timings_[index].seconds) + " s");
+}
+
+std::vector<StageTiming> BuildPipeline::Run() {
+  for (const auto& name : enabled_) {
+    bool known = false;
+    for (const auto& stage : stages_) {
+      known = known || stage.name == name;
+    }
+    if (!known) {
+      LOG_WARN("Unknown stage " + name + " in mjolnir.stages");
+    }
+  }
+
+  timings_.clear();
+  for (const auto& stage : stages_) {
+    timings_.push_back({ stage.name });
+  }
+
+  // Each group is a stage and the stages overlapping it. The first enabled
+  // stage of a group runs on this thread, the others on their own. The
+  // peak RSS starts over with each group.
+  bool peak_reset = true;
+  for (size_t first = 0; first < stages_.size(); ) {
+    size_t last = first + 1;
+    while (last < stages_.size() && stages_[last].overlap) {
+      last++;
+    }
+    if (peak_reset && !ResourceUsage::ResetPeak()) {
+      LOG_WARN("Unable to reset the peak RSS, stages report that of the whole process");
+      peak_reset = false;
+    }
+    std::vector<std::exception_ptr> errors(last - first);
+    std::vector<std::shared_ptr<std::thread> > threads;
+    size_t here = last;
+    for (size_t i = first; i < last; i++) {
+      if (!enabled(stages_[i].name)) {
+        LOG_INFO("Skipping stage " + stages_[i].name);
+      } else if (here == last) {
+        here = i;
+      } else {
+        threads.emplace_back(new std::thread(&BuildPipeline::RunStage, this, i,
+                                             std::ref(errors[i - first])));
+      }
+    }
+    if (here != last) {
+      RunStage(here, errors[here - first]);
+    }
+    for (auto& thread : threads) {
+      thread->join();
+    }
+    for (const auto& error : errors) {
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+    first = last;
+  }
+
+  std::vector<StageTiming> timings;
+  for (size_t i = 0; i < stages_.size(); i++) {
+    timings.push_back(timings_[i]);
+    timings.insert(timings.end(), steps_[i].begin(), steps_[i].end());
+  }
+  return timings;
+}
+
+}
+}
@@ -0,0 +1,135 @@
+#include "mjolnir/buildsnapshot.h"
+
+#include <boost/filesystem/operations.hpp>
+
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/midgard/logging.h>
+
+using namespace valhalla::baldr;
+
+namespace {
+
+// Tiles and intermediate files are only ever replaced, never written in
+// place, once they are in a snapshot so links to them stay as they were
+void LinkOrCopy(const boost::filesystem::path& from, const boost::filesystem::path& to) {
+  boost::filesystem::create_directories(to.parent_path());
+  boost::system::error_code error;
+  boost::filesystem::create_hard_link(from, to, error);
+  if (error) {
+    boost::filesystem::copy_file(from, to);
+  }
+}
+
+// Copy or link every file under a dir into another dir
+void CopyTree(const boost::filesystem::path& from, const boost::filesystem::path& to,
+              const bool link) {
+  if (!boost::filesystem::exists(from)) {
+    return;
+  }
+  for (boost::filesystem::recursive_directory_iterator i(from), end; i != end; ++i) {
+    if (!boost::filesystem::is_regular_file(i->path())) {
+      continue;
+    }
+    boost::filesystem::path copy(to.string() + i->path().string().substr(from.string().size()));
+    if (link) {
+      LinkOrCopy(i->path(), copy);
+    } else {
+      boost::filesystem::create_directories(copy.parent_path());
+      boost::filesystem::copy_file(i->path(), copy);
+    }
+  }
+}
+
+// Put a dir in place of another. Between the two renames there is no dir.
+void Swap(const boost::filesystem::path& staging, const boost::filesystem::path& target) {
+  boost::filesystem::path previous(target.string() + ".previous");
+  boost::filesystem::remove_all(previous);
+  if (boost::filesystem::exists(target)) {
+    boost::filesystem::rename(target, previous);
+  }
+  boost::filesystem::rename(staging, target);
+  boost::filesystem::remove_all(previous);
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+BuildSnapshot::BuildSnapshot(const boost::property_tree::ptree& pt)
+    : dir_(pt.get<std::string>("snapshot_dir", "")),
+      hierarchy_(pt.get<std::string>("tile_dir")),
+      level_(hierarchy_.levels().rbegin()->first) {
+  // The staging dir is named after the snapshot dir
+  while (dir_.size() > 1 && dir_.back() == '/') {
+    dir_.pop_back();
+  }
+}
+
+bool BuildSnapshot::configured() const {
+  return !dir_.empty();
+}
+
+bool BuildSnapshot::exists(const std::vector<std::string>& files) const {
+  if (!configured() || !boost::filesystem::is_directory(dir_ + "/" + std::to_string(level_))) {
+    return false;
+  }
+  for (const auto& name : files) {
+    if (!boost::filesystem::exists(file(name))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+std::string BuildSnapshot::file(const std::string& name) const {
+  return dir_ + "/" + boost::filesystem::path(name).filename().string();
+}
+
+// Copied rather than linked, the later stages write to the tiles in place
+void BuildSnapshot::Restore() const {
+  auto level = "/" + std::to_string(level_);
+  boost::filesystem::path target(hierarchy_.tile_dir() + level);
+  boost::filesystem::path staging(target.string() + ".staging");
+  boost::filesystem::remove_all(staging);
+  boost::filesystem::create_directories(staging);
+  CopyTree(dir_ + level, staging, false);
+  Swap(staging, target);
+  LOG_INFO("Restored the local tiles of " + dir_);
+}
+
+void BuildSnapshot::Save(const std::vector<std::string>& files,
+                         const std::set<GraphId>* rebuilt) const {
+  for (const auto& name : files) {
+    if (!boost::filesystem::exists(name)) {
+      LOG_WARN("No " + name + " to keep, leaving the snapshot in " + dir_ + " as it was");
+      return;
+    }
+  }
+  auto level = "/" + std::to_string(level_);
+  boost::filesystem::path staging(dir_ + ".staging");
+  boost::filesystem::remove_all(staging);
+  boost::filesystem::create_directories(staging.string() + level);
+  if (rebuilt && boost::filesystem::is_directory(dir_ + level)) {
+    CopyTree(dir_ + level, staging.string() + level, true);
+    for (const auto& tile : *rebuilt) {
+      auto suffix = "/" + GraphTile::FileSuffix(tile, hierarchy_);
+      boost::filesystem::path copy(staging.string() + suffix);
+      boost::filesystem::remove(copy);
+      if (boost::filesystem::exists(hierarchy_.tile_dir() + suffix)) {
+        boost::filesystem::create_directories(copy.parent_path());
+        boost::filesystem::copy_file(hierarchy_.tile_dir() + suffix, copy);
+      }
+    }
+  } else {
+    CopyTree(hierarchy_.tile_dir() + level, staging.string() + level, false);
+  }
+  for (const auto& name : files) {
+    LinkOrCopy(name, staging / boost::filesystem::path(name).filename());
+  }
+  Swap(staging, dir_);
+  LOG_INFO("Saved the snapshot in " + dir_);
+}
+
+}
+}
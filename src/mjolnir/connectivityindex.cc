@@ -0,0 +1,335 @@
+#include "mjolnir/connectivityindex.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <valhalla/baldr/graphconstants.h>
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/logging.h>
+
+using namespace valhalla::baldr;
+
+namespace {
+
+constexpr uint32_t kIndexMagic = 0x58444943;  // CIDX
+constexpr uint32_t kIndexVersion = 2;
+
+// Magic, version, build id, level, tile count, node count and the component
+// count of each mode
+constexpr uint32_t kHeaderSize = 6 + valhalla::mjolnir::kConnectivityModeCount;
+
+// Access each mode needs on an edge to connect its nodes
+constexpr uint32_t kModeAccess[] = { kAutoAccess, kPedestrianAccess };
+
+// Count the nodes in each tile
+void CountNodes(const boost::property_tree::ptree& pt, const uint8_t level,
+                const std::vector<uint32_t>& tileids, std::atomic<size_t>& next,
+                std::vector<uint32_t>& counts) {
+  GraphReader reader(pt);
+  for (size_t i = next++; i < tileids.size(); i = next++) {
+    const GraphTile* tile = reader.GetGraphTile(GraphId(tileids[i], level, 0));
+    counts[tileids[i]] = tile->header()->nodecount();
+    if (reader.OverCommitted()) {
+      reader.Clear();
+    }
+  }
+}
+
+// Add the tiles to the connectivity
+void AddTiles(const boost::property_tree::ptree& pt, const uint8_t level,
+              const std::vector<uint32_t>& tileids, std::atomic<size_t>& next,
+              valhalla::mjolnir::ConnectivityBuilder& builder) {
+  GraphReader reader(pt);
+  for (size_t i = next++; i < tileids.size(); i = next++) {
+    builder.Add(reader.GetGraphTile(GraphId(tileids[i], level, 0)));
+    if (reader.OverCommitted()) {
+      reader.Clear();
+    }
+  }
+}
+
+template <class T>
+void Write(std::ofstream& file, const std::vector<T>& values) {
+  file.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+}
+
+template <class T>
+bool Read(std::ifstream& file, std::vector<T>& values, const size_t count) {
+  values.resize(count);
+  file.read(reinterpret_cast<char*>(values.data()), count * sizeof(T));
+  return static_cast<bool>(file);
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+ConnectivityIndex::ConnectivityIndex()
+    : build_id_(0), level_(0) {
+}
+
+std::string ConnectivityIndex::FileName(const boost::property_tree::ptree& pt) {
+  return pt.get<std::string>("tile_dir") + "/connectivity.bin";
+}
+
+void ConnectivityIndex::Build(const boost::property_tree::ptree& pt) {
+  const auto& mjolnir = pt.get_child("mjolnir");
+  TileHierarchy hierarchy(mjolnir.get<std::string>("tile_dir"));
+  auto level = hierarchy.levels().rbegin()->second.level;
+  const auto& tiles = hierarchy.levels().rbegin()->second.tiles;
+
+  std::vector<uint32_t> tileids;
+  for (uint32_t id = 0; id < tiles.TileCount(); id++) {
+    if (GraphReader::DoesTileExist(hierarchy, GraphId(id, level, 0))) {
+      tileids.push_back(id);
+    }
+  }
+  unsigned int thread_count = std::max(static_cast<unsigned int>(1),
+      pt.get<unsigned int>("mjolnir.concurrency", std::thread::hardware_concurrency()));
+  std::vector<std::shared_ptr<std::thread> > threads(thread_count);
+  LOG_INFO("Computing connectivity of " + std::to_string(tileids.size()) + " tiles");
+
+  // Count the nodes so that the nodes of all the tiles are numbered
+  // consecutively
+  std::vector<uint32_t> counts(tiles.TileCount(), 0);
+  std::atomic<size_t> next(0);
+  for (auto& thread : threads) {
+    thread.reset(new std::thread(CountNodes, std::cref(mjolnir), level, std::cref(tileids),
+                                 std::ref(next), std::ref(counts)));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
+
+  // Merge everything joined by an edge
+  ConnectivityBuilder builder(mjolnir, counts);
+  next = 0;
+  for (auto& thread : threads) {
+    thread.reset(new std::thread(AddTiles, std::cref(mjolnir), level, std::cref(tileids),
+                                 std::ref(next), std::ref(builder)));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
+  builder.Finish();
+}
+
+bool ConnectivityIndex::Load(const std::string& file_name, const TileHierarchy& hierarchy) {
+  *this = ConnectivityIndex();
+  std::ifstream file(file_name, std::ios::in | std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  uint32_t header[kHeaderSize];
+  file.read(reinterpret_cast<char*>(header), sizeof(header));
+  if (!file || header[0] != kIndexMagic || header[1] != kIndexVersion) {
+    LOG_WARN("Connectivity index " + file_name + " is not valid");
+    return false;
+  }
+  const auto& local = hierarchy.levels().rbegin()->second;
+  uint32_t tile_count = header[4];
+  if (header[3] != local.level || tile_count != local.tiles.TileCount()) {
+    LOG_WARN("Connectivity index " + file_name + " does not match the tiles");
+    return false;
+  }
+  bool read = Read(file, node_offsets_, tile_count + 1) && Read(file, tile_ids_, tile_count) &&
+              node_offsets_.back() == header[5];
+  for (uint32_t m = 0; read && m < kConnectivityModeCount; m++) {
+    read = Read(file, components_[m], node_offsets_.back()) &&
+           Read(file, sizes_[m], header[6 + m]) &&
+           Read(file, major_[m], header[6 + m]);
+  }
+  if (!read) {
+    LOG_WARN("Connectivity index " + file_name + " is truncated");
+    *this = ConnectivityIndex();
+    return false;
+  }
+  build_id_ = header[2];
+  level_ = header[3];
+  return true;
+}
+
+// Header (see kHeaderSize), then the arrays in the order they are declared
+void ConnectivityIndex::Save(const std::string& file_name) const {
+  std::ofstream file(file_name, std::ios::out | std::ios::binary | std::ios::trunc);
+  if (!file) {
+    throw std::runtime_error("Could not open " + file_name + " for writing");
+  }
+  uint32_t header[kHeaderSize] =
+      { kIndexMagic, kIndexVersion, build_id_, level_, static_cast<uint32_t>(tile_ids_.size()),
+        node_offsets_.back() };
+  for (uint32_t m = 0; m < kConnectivityModeCount; m++) {
+    header[6 + m] = sizes_[m].size();
+  }
+  file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  Write(file, node_offsets_);
+  Write(file, tile_ids_);
+  for (uint32_t m = 0; m < kConnectivityModeCount; m++) {
+    Write(file, components_[m]);
+    Write(file, sizes_[m]);
+    Write(file, major_[m]);
+  }
+}
+
+bool ConnectivityIndex::empty() const {
+  return tile_ids_.empty();
+}
+
+uint32_t ConnectivityIndex::build_id() const {
+  return build_id_;
+}
+
+bool ConnectivityIndex::matches(const GraphTile* tile) const {
+  if (tile == nullptr) {
+    return false;
+  }
+  auto id = tile->header()->graphid();
+  return id.level() == level_ && id.tileid() < tile_ids_.size() && tile_ids_[id.tileid()] != 0 &&
+         node_offsets_[id.tileid() + 1] - node_offsets_[id.tileid()] <= tile->header()->nodecount();
+}
+
+uint32_t ConnectivityIndex::tile_id(const uint32_t tileid) const {
+  return tileid < tile_ids_.size() ? tile_ids_[tileid] : 0;
+}
+
+uint32_t ConnectivityIndex::component(const baldr::GraphId& node,
+                                      const ConnectivityMode mode) const {
+  uint32_t tileid = node.tileid();
+  if (tileid >= tile_ids_.size() ||
+      node.id() >= node_offsets_[tileid + 1] - node_offsets_[tileid]) {
+    return 0;
+  }
+  return components_[static_cast<uint32_t>(mode)][node_offsets_[tileid] + node.id()];
+}
+
+uint32_t ConnectivityIndex::component_size(const uint32_t component,
+                                           const ConnectivityMode mode) const {
+  const auto& sizes = sizes_[static_cast<uint32_t>(mode)];
+  return component < sizes.size() ? sizes[component] : 0;
+}
+
+bool ConnectivityIndex::has_major_road(const uint32_t component,
+                                       const ConnectivityMode mode) const {
+  const auto& major = major_[static_cast<uint32_t>(mode)];
+  return component < major.size() && major[component] != 0;
+}
+
+uint32_t ConnectivityIndex::component_count(const ConnectivityMode mode) const {
+  const auto& sizes = sizes_[static_cast<uint32_t>(mode)];
+  return sizes.empty() ? 0 : sizes.size() - 1;
+}
+
+ConnectivityBuilder::ConnectivityBuilder(const boost::property_tree::ptree& pt,
+                                         const std::vector<uint32_t>& capacities)
+    : file_name_(ConnectivityIndex::FileName(pt)),
+      level_(TileHierarchy(pt.get<std::string>("tile_dir")).levels().rbegin()->second.level),
+      slots_(capacities.size() + 1, 0),
+      counts_(capacities.size(), 0),
+      added_(capacities.size(), 0),
+      tiles_(capacities.size()) {
+  for (size_t i = 0; i < capacities.size(); i++) {
+    slots_[i + 1] = slots_[i] + capacities[i];
+  }
+  for (uint32_t m = 0; m < kConnectivityModeCount; m++) {
+    nodes_[m].reset(new UnionFind(slots_.back()));
+    major_[m].assign(slots_.back(), 0);
+  }
+}
+
+// Only the major road flags of the tile's own nodes are set so threads
+// adding different tiles never write the same element
+void ConnectivityBuilder::Add(const GraphTile* tile) {
+  uint32_t tileid = tile->header()->graphid().tileid();
+  uint32_t count = tile->header()->nodecount();
+  if (tileid >= counts_.size() || count > slots_[tileid + 1] - slots_[tileid]) {
+    throw std::runtime_error("Tile " + std::to_string(tileid) +
+                             " has more nodes than the connectivity index expects");
+  }
+  counts_[tileid] = count;
+  added_[tileid] = 1;
+  for (uint32_t i = 0; i < count; i++) {
+    uint32_t a = slots_[tileid] + i;
+    const NodeInfo* node = tile->node(i);
+    const DirectedEdge* edge = tile->directededge(node->edge_index());
+    for (uint32_t j = 0; j < node->edge_count(); j++, edge++) {
+      GraphId end = edge->endnode();
+      if (end.level() != level_ || edge->IsTransitLine() || end.tileid() >= counts_.size() ||
+          end.id() >= slots_[end.tileid() + 1] - slots_[end.tileid()]) {
+        continue;
+      }
+      if (end.tileid() != tileid) {
+        tiles_.Union(tileid, end.tileid());
+      }
+      uint32_t b = slots_[end.tileid()] + end.id();
+      uint32_t access = edge->forwardaccess() | edge->reverseaccess();
+      for (uint32_t m = 0; m < kConnectivityModeCount; m++) {
+        if (access & kModeAccess[m]) {
+          nodes_[m]->Union(a, b);
+          if (edge->classification() < RoadClass::kTertiary) {
+            major_[m][a] = 1;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Label the tiles and number the components in order of their first node
+void ConnectivityBuilder::Finish() {
+  ConnectivityIndex index;
+  index.build_id_ = std::chrono::duration_cast<std::chrono::seconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  index.level_ = level_;
+  index.node_offsets_.resize(counts_.size() + 1);
+  uint32_t node_count = 0;
+  for (size_t i = 0; i < counts_.size(); i++) {
+    index.node_offsets_[i] = node_count;
+    node_count += counts_[i];
+  }
+  index.node_offsets_.back() = node_count;
+  index.tile_ids_.assign(counts_.size(), 0);
+  for (uint32_t id = 0; id < added_.size(); id++) {
+    if (added_[id]) {
+      index.tile_ids_[id] = tiles_.Find(id) + 1;
+    }
+  }
+  for (uint32_t m = 0; m < kConnectivityModeCount; m++) {
+    std::vector<uint32_t> labels(slots_.back(), 0);
+    auto& components = index.components_[m];
+    auto& sizes = index.sizes_[m];
+    auto& major = index.major_[m];
+    components.resize(node_count);
+    sizes.assign(1, 0);
+    major.assign(1, 0);
+    for (uint32_t t = 0; t < counts_.size(); t++) {
+      for (uint32_t i = 0; i < counts_[t]; i++) {
+        uint32_t root = nodes_[m]->Find(slots_[t] + i);
+        if (labels[root] == 0) {
+          labels[root] = sizes.size();
+          sizes.push_back(0);
+          major.push_back(0);
+        }
+        uint32_t label = labels[root];
+        components[index.node_offsets_[t] + i] = label;
+        sizes[label]++;
+        major[label] |= major_[m][slots_[t] + i];
+      }
+    }
+    nodes_[m].reset();
+    LOG_INFO("Found " + std::to_string(sizes.size() - 1) + " " +
+             (m == 0 ? "auto" : "pedestrian") + " components among " +
+             std::to_string(node_count) + " nodes");
+  }
+
+  index.Save(file_name_);
+}
+
+}
+}
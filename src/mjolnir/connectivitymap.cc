@@ -2,11 +2,24 @@
 #include <stdlib.h>
 #include <string>
 #include <vector>
-
-#include <valhalla/baldr/connectivity_map.h>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <fstream>
+#include <iomanip>
+#include <algorithm>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/logging.h>
+#include "mjolnir/unionfind.h"
+#include "mjolnir/connectivityindex.h"
 #include "config.h"
 
 using namespace valhalla::baldr;
+using namespace valhalla::mjolnir;
 
 #include <ostream>
 #include <boost/program_options.hpp>
@@ -14,18 +27,15 @@ using namespace valhalla::baldr;
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/optional.hpp>
+#include <boost/algorithm/string.hpp>
 
 namespace bpo = boost::program_options;
 using namespace valhalla::midgard;
 
 boost::filesystem::path config_file_path;
 std::vector<std::string> input_files;
-
-struct PPMObject {
-  std::string magic_num;
-  int32_t width, height, maxColVal;
-  char* m_image;
-};
+std::string outputs = "ppm,geojson";
+bool use_index = false;
 
 bool ParseArguments(int argc, char *argv[]) {
 
@@ -35,7 +45,11 @@ bool ParseArguments(int argc, char *argv[]) {
     " Usage: connectivitymap [options]\n"
     "\n"
     "connectivitymap is a program that creates a PPM image file representing "
-    "the connectivity between tiles."
+    "the connectivity between tiles. Tiles are connected if an edge joins "
+    "them. It can also write the connected tiles as GeoJSON and the "
+    "connectivity id of every tile as a compact binary file (connectivity.ids: "
+    "uint32 columns, uint32 rows, then a uint32 id per tile by row, 0 if the "
+    "tile does not exist)."
     "\n"
     "\n");
 
@@ -45,6 +59,10 @@ bool ParseArguments(int argc, char *argv[]) {
       ("config,c",
         boost::program_options::value<boost::filesystem::path>(&config_file_path)->required(),
         "Path to the json configuration file.")
+      ("outputs,o", boost::program_options::value<std::string>(&outputs),
+        "Comma separated outputs to write: ppm, geojson and/or ids (default ppm,geojson).")
+      ("index,i", boost::program_options::bool_switch(&use_index),
+        "Use the connectivity index saved when the graph was built instead of reading the tiles.")
       // positional arguments
       ("input_files", boost::program_options::value<std::vector<std::string> >(&input_files)->multitoken());
 
@@ -97,6 +115,45 @@ struct RGB {
   }
 };
 
+namespace {
+
+// Color of a connectivity id. Hashed rather than kept in a colormap so any
+// row can be colored on its own. No tile is white.
+RGB Color(const uint32_t id) {
+  if (id == 0) {
+    return RGB(255, 255, 255);
+  }
+  uint32_t hash = id * 2654435761u;
+  return RGB((hash >> 8) % 200, (hash >> 16) % 200, (hash >> 24) % 200);
+}
+
+// Merge each tile with the tiles its edges end in. Tiles are handed out to
+// the threads one at a time and each thread has its own reader.
+void UnionTiles(const boost::property_tree::ptree& pt, const uint8_t level,
+                std::atomic<uint32_t>& next, std::vector<uint8_t>& exists,
+                UnionFind& tiles) {
+  GraphReader reader(pt);
+  const auto& tile_hierarchy = reader.GetTileHierarchy();
+  for (uint32_t id = next++; id < tiles.size(); id = next++) {
+    GraphId tile_id(id, level, 0);
+    if (!GraphReader::DoesTileExist(tile_hierarchy, tile_id)) {
+      continue;
+    }
+    exists[id] = 1;
+    const GraphTile* tile = reader.GetGraphTile(tile_id);
+    for (uint32_t i = 0; i < tile->header()->directededgecount(); i++) {
+      GraphId endnode = tile->directededge(i)->endnode();
+      if (endnode.level() == level && endnode.tileid() != id) {
+        tiles.Union(id, endnode.tileid());
+      }
+    }
+    if (reader.OverCommitted()) {
+      reader.Clear();
+    }
+  }
+}
+
+}
 
 // NOTE: a PPM image can be converted to png using ImageMagick:
 //    convert connectivity.ppm connectivity.png
@@ -113,63 +170,127 @@ int main(int argc, char** argv) {
   boost::property_tree::ptree pt;
   boost::property_tree::read_json(config_file_path.c_str(), pt);
 
+  // Which outputs to write
+  std::vector<std::string> formats;
+  boost::algorithm::split(formats, outputs, boost::algorithm::is_any_of(","));
+  auto wanted = [&formats](const std::string& format) {
+    return std::find(formats.cbegin(), formats.cend(), format) != formats.cend();
+  };
+
   // Get something we can use to fetch tiles
   valhalla::baldr::TileHierarchy tile_hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
-  valhalla::baldr::connectivity_map_t connectivity_map(tile_hierarchy);
+  auto local_level = tile_hierarchy.levels().rbegin()->second.level;
+  auto tiles = tile_hierarchy.levels().rbegin()->second.tiles;
+  uint32_t width  = tiles.ncolumns();
+  uint32_t height = tiles.nrows();
 
-  // Make the vector representation of it
-  std::ofstream geojson_file("connectivity.geojson", std::ios::out);
-  if (!geojson_file) {
-    std::cout << "Unable to open output file: " << "connectivity.geojson" << std::endl;
+  // Label the connected tiles in parallel, or look the labels up
+  ConnectivityIndex index;
+  if (use_index && !index.Load(ConnectivityIndex::FileName(pt.get_child("mjolnir")), tile_hierarchy)) {
+    std::cout << "Unable to load the connectivity index" << std::endl;
     return EXIT_FAILURE;
   }
-  geojson_file << connectivity_map.to_geojson(tile_hierarchy.levels().rbegin()->first);
-  geojson_file.close();
-
-
-  // Make the ppm file for raster images
-  std::vector<size_t> connectivity_image = connectivity_map.to_image(tile_hierarchy.levels().rbegin()->first);
+  UnionFind connectivity(use_index ? 0 : width * height);
+  std::vector<uint8_t> exists(use_index ? 0 : width * height, 0);
+  if (!use_index) {
+    unsigned int thread_count = std::max(static_cast<unsigned int>(1),
+        pt.get<unsigned int>("mjolnir.concurrency", std::thread::hardware_concurrency()));
+    std::atomic<uint32_t> next(0);
+    std::vector<std::shared_ptr<std::thread> > threads(thread_count);
+    for (auto& thread : threads) {
+      thread.reset(new std::thread(UnionTiles, std::cref(pt.get_child("mjolnir")), local_level,
+                                   std::ref(next), std::ref(exists), std::ref(connectivity)));
+    }
+    for (auto& thread : threads) {
+      thread->join();
+    }
+  }
 
-  // Create output file
-  std::string fname = "connectivity.ppm";
-  std::ofstream outfile(fname, std::ios::binary | std::ios::out);
-  if (!outfile) {
-    std::cout << "Unable to open output file: " << fname << std::endl;
-    return EXIT_FAILURE;
+  // Open the outputs
+  std::ofstream ppm_file, geojson_file, ids_file;
+  if (wanted("ppm")) {
+    ppm_file.open("connectivity.ppm", std::ios::binary | std::ios::out);
+    if (!ppm_file) {
+      std::cout << "Unable to open output file: " << "connectivity.ppm" << std::endl;
+      return EXIT_FAILURE;
+    }
+    ppm_file << "P6" << std::endl;
+    ppm_file << std::to_string(width) << " " << std::to_string(height) << std::endl;
+    ppm_file << std::to_string(255) << std::endl;
+  }
+  if (wanted("geojson")) {
+    geojson_file.open("connectivity.geojson", std::ios::out);
+    if (!geojson_file) {
+      std::cout << "Unable to open output file: " << "connectivity.geojson" << std::endl;
+      return EXIT_FAILURE;
+    }
+    geojson_file << std::fixed << std::setprecision(6);
+    geojson_file << "{\"type\":\"FeatureCollection\",\"features\":[";
+  }
+  if (wanted("ids")) {
+    ids_file.open("connectivity.ids", std::ios::binary | std::ios::out);
+    if (!ids_file) {
+      std::cout << "Unable to open output file: " << "connectivity.ids" << std::endl;
+      return EXIT_FAILURE;
+    }
+    ids_file.write(reinterpret_cast<const char*>(&width), sizeof(width));
+    ids_file.write(reinterpret_cast<const char*>(&height), sizeof(height));
   }
 
-  auto local_level = tile_hierarchy.levels().rbegin()->second.level;
-  auto tiles = tile_hierarchy.levels().rbegin()->second.tiles;
+  // Stream the outputs a row at a time. The id of a connected set of tiles
+  // is one more than its smallest tile id.
+  std::vector<uint32_t> ids(width);
+  std::vector<RGB> ppm(width);
+  bool first_feature = true;
+  for (uint32_t row = 0; row < height; row++) {
+    for (uint32_t col = 0; col < width; col++) {
+      uint32_t tile = row * width + col;
+      if (use_index) {
+        ids[col] = index.tile_id(tile);
+      } else {
+        ids[col] = exists[tile] ? connectivity.Find(tile) + 1 : 0;
+      }
+    }
 
-  uint32_t width  = tiles.ncolumns();
-  uint32_t height = tiles.nrows();
+    if (ppm_file.is_open()) {
+      for (uint32_t col = 0; col < width; col++) {
+        ppm[col] = Color(ids[col]);
+      }
+      ppm_file.write(reinterpret_cast<const char*>(ppm.data()), width * 3);
+    }
+
+    // One rectangle per run of tiles with the same id
+    if (geojson_file.is_open()) {
+      for (uint32_t col = 0; col < width; ) {
+        uint32_t end = col + 1;
+        while (end < width && ids[end] == ids[col]) {
+          end++;
+        }
+        if (ids[col] != 0) {
+          auto min = tiles.TileBounds(row * width + col);
+          auto max = tiles.TileBounds(row * width + end - 1);
+          geojson_file << (first_feature ? "" : ",")
+                       << "{\"type\":\"Feature\",\"properties\":{\"id\":" << ids[col]
+                       << "},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[["
+                       << "[" << min.minx() << "," << min.miny() << "],"
+                       << "[" << max.maxx() << "," << min.miny() << "],"
+                       << "[" << max.maxx() << "," << min.maxy() << "],"
+                       << "[" << min.minx() << "," << min.maxy() << "],"
+                       << "[" << min.minx() << "," << min.miny() << "]]]}}";
+          first_feature = false;
+        }
+        col = end;
+      }
+    }
 
-  // Add background color: white
-  std::unordered_map<size_t, RGB> colormap;
-  RGB white(255, 255, 255);
-  colormap[0] = white;
-
-  // Create an array of RGB values
-  std::vector<RGB> ppm;
-  for (auto c : connectivity_image) {
-    auto color = colormap.find(c);
-    if (color == colormap.end()) {
-      // Add a random color to the colormap
-      RGB newcolor(rand() % 200, rand() % 200, rand() % 200);
-      ppm.push_back(newcolor);
-      colormap[c] = newcolor;
-    } else {
-      ppm.push_back(color->second);
+    if (ids_file.is_open()) {
+      ids_file.write(reinterpret_cast<const char*>(ids.data()), width * sizeof(uint32_t));
     }
   }
 
-  std::string tmp;
-  outfile << "P6" << std::endl; //  << “# foreground “ << std::endl;
-  outfile << std::to_string(width) << " " << std::to_string(height) << std::endl;
-  outfile << std::to_string(255) << std::endl;
-  outfile.write(reinterpret_cast<char*>(&ppm[0]), height*width*3);
-  outfile.close();
+  if (geojson_file.is_open()) {
+    geojson_file << "]}";
+  }
 
   return EXIT_SUCCESS;
 }
-
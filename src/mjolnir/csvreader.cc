@@ -0,0 +1,123 @@
+#include "mjolnir/csvreader.h"
+
+#include <stdexcept>
+#include <boost/algorithm/string.hpp>
+
+namespace {
+
+const std::string kEmpty;
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+// Open the file and read the column names
+CsvReader::CsvReader(const std::string& file_name)
+    : file_(file_name, std::ios::in | std::ios::binary),
+      count_(0) {
+  if (!file_) {
+    throw std::runtime_error("Couldn't open " + file_name);
+  }
+  if (ReadRecord(header_) && !header_.empty()) {
+    // Strip a UTF-8 byte order mark
+    if (header_.front().compare(0, 3, "\xEF\xBB\xBF") == 0) {
+      header_.front().erase(0, 3);
+    }
+    for (auto& name : header_) {
+      boost::algorithm::trim(name);
+    }
+  }
+}
+
+// Read records skipping any blank lines
+bool CsvReader::Next() {
+  while (ReadRecord(fields_)) {
+    if (fields_.size() > 1 || !fields_.front().empty()) {
+      count_++;
+      return true;
+    }
+  }
+  return false;
+}
+
+int CsvReader::column(const std::string& name) const {
+  for (size_t i = 0; i < header_.size(); i++) {
+    if (header_[i] == name) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+const std::string& CsvReader::field(const int index) const {
+  if (index < 0 || index >= static_cast<int>(fields_.size())) {
+    return kEmpty;
+  }
+  return fields_[index];
+}
+
+const std::string& CsvReader::field(const std::string& name) const {
+  return field(column(name));
+}
+
+size_t CsvReader::count() const {
+  return count_;
+}
+
+// Split a record into fields. A quoted field may span lines in which case
+// the following lines are read until the closing quote.
+bool CsvReader::ReadRecord(std::vector<std::string>& fields) {
+  if (!std::getline(file_, line_)) {
+    return false;
+  }
+
+  size_t field_count = 0;
+  bool quoted = false;
+  std::string* current = nullptr;
+  auto next_field = [&fields, &field_count, &current]() {
+    if (field_count == fields.size()) {
+      fields.emplace_back();
+    }
+    current = &fields[field_count++];
+    current->clear();
+  };
+  next_field();
+
+  while (true) {
+    for (size_t i = 0; i < line_.size(); i++) {
+      char c = line_[i];
+      if (quoted) {
+        if (c == '"') {
+          // Doubled quotes are a literal quote
+          if (i + 1 < line_.size() && line_[i + 1] == '"') {
+            current->push_back('"');
+            i++;
+          } else {
+            quoted = false;
+          }
+        } else {
+          current->push_back(c);
+        }
+      } else if (c == '"') {
+        quoted = true;
+      } else if (c == ',') {
+        next_field();
+      } else if (c != '\r') {
+        current->push_back(c);
+      }
+    }
+
+    // Keep going on the next line if we are within a quoted field
+    if (!quoted || !std::getline(file_, line_)) {
+      break;
+    }
+    current->push_back('\n');
+  }
+
+  fields.resize(field_count);
+  return true;
+}
+
+}
+}
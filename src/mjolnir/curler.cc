@@ -0,0 +1,245 @@
+#include "mjolnir/curler.h"
+
+#include <fstream>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <boost/format.hpp>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <valhalla/midgard/logging.h>
+
+using namespace boost::property_tree;
+
+namespace {
+
+// Retries back off up to 2^6 times the first delay
+constexpr size_t kMaxBackoff = 6;
+
+struct logged_error_t: public std::runtime_error {
+  logged_error_t(const std::string& msg):std::runtime_error(msg) {
+    LOG_ERROR(msg);
+  }
+};
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+ResponseCache::ResponseCache(const ptree& pt)
+    : api_key_(pt.get_optional<std::string>("api_key") ? "&api_key=" + pt.get<std::string>("api_key") : "") {
+  auto dir = pt.get_optional<std::string>("cache_dir");
+  if(dir) {
+    cache_dir_ = *dir;
+    boost::filesystem::create_directories(cache_dir_);
+  }
+}
+
+bool ResponseCache::get(const std::string& url, std::string& body) const {
+  if(cache_dir_.empty())
+    return false;
+  auto key = strip(url);
+  std::ifstream file(path(key).string(), std::ios::in | std::ios::binary);
+  std::string line;
+  if(!file || !std::getline(file, line) || line != key)
+    return false;
+  body.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+void ResponseCache::put(const std::string& url, const std::string& body) const {
+  if(cache_dir_.empty())
+    return;
+  auto key = strip(url);
+  auto file_name = path(key);
+  boost::filesystem::create_directories(file_name.parent_path());
+  auto temp_name = file_name.string() + '.' + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream file(temp_name, std::ios::out | std::ios::trunc | std::ios::binary);
+    file << key << '\n' << body;
+  }
+  boost::filesystem::rename(temp_name, file_name);
+}
+
+std::string ResponseCache::strip(std::string url) const {
+  auto pos = api_key_.empty() ? std::string::npos : url.find(api_key_);
+  if(pos != std::string::npos)
+    url.erase(pos, api_key_.size());
+  return url;
+}
+
+boost::filesystem::path ResponseCache::path(const std::string& key) const {
+  //64 bit fnv-1a
+  uint64_t hash = 14695981039346656037ULL;
+  for(const auto c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  auto hex = (boost::format("%016x") % hash).str();
+  return boost::filesystem::path(cache_dir_) / hex.substr(0, 2) / hex;
+}
+
+Curler::Curler(const ptree& pt, const ResponseCache& cache)
+    : multi_(curl_multi_init(), [](CURLM* m){curl_multi_cleanup(m);}), cache_(cache),
+      api_key_(pt.get_optional<std::string>("api_key") ? "&api_key=" + pt.get<std::string>("api_key") : ""),
+      max_tries_(std::max(static_cast<size_t>(1), pt.get<size_t>("max_tries", 10))),
+      generator_(std::chrono::system_clock::now().time_since_epoch().count()),
+      distribution_(static_cast<size_t>(300), static_cast<size_t>(700)) {
+  if(multi_.get() == nullptr)
+    throw logged_error_t("Failed to created CURL multi handle");
+  transfers_.resize(std::max(static_cast<size_t>(1), pt.get<size_t>("max_in_flight", 8)));
+  for(auto& transfer : transfers_) {
+    transfer.reset(new transfer_t());
+    transfer->connection = curl_easy_init();
+    if(transfer->connection == nullptr)
+      throw logged_error_t("Failed to created CURL connection");
+    auto* connection = transfer->connection;
+    assert_curl(curl_easy_setopt(connection, CURLOPT_ERRORBUFFER, transfer->error), "Failed to set error buffer");
+    assert_curl(curl_easy_setopt(connection, CURLOPT_FOLLOWLOCATION, 1L), "Failed to set redirect option ");
+    assert_curl(curl_easy_setopt(connection, CURLOPT_WRITEDATA, &transfer->result), "Failed to set write data ");
+    assert_curl(curl_easy_setopt(connection, CURLOPT_WRITEFUNCTION, write_callback), "Failed to set writer ");
+    assert_curl(curl_easy_setopt(connection, CURLOPT_PRIVATE, transfer.get()), "Failed to set private data ");
+    //content encoding header
+    char encoding[] = "gzip"; //TODO: allow "identity" and "deflate"
+    assert_curl(curl_easy_setopt(connection, CURLOPT_ACCEPT_ENCODING, encoding), "Failed to set gzip content header ");
+    idle_.push_back(transfer.get());
+  }
+}
+
+Curler::~Curler() {
+  for(auto& transfer : transfers_)
+    curl_easy_cleanup(transfer->connection);
+}
+
+ptree Curler::operator()(const std::string& url, const std::string& retry_if_no) {
+  ptree pt;
+  (*this)(std::vector<std::string>{url}, retry_if_no, [&pt](size_t, const ptree& response){ pt = response; }, false);
+  return pt;
+}
+
+size_t Curler::operator()(const std::vector<std::string>& urls, const std::string& retry_if_no,
+                          const handler_t& handler, bool follow_next) {
+  std::deque<request_t> pending;
+  for(size_t i = 0; i < urls.size(); ++i)
+    pending.push_back(request_t{i, urls[i], 0, clock_t::now()});
+  size_t active = 0, given_up = 0;
+  //dont stop until we have something useful or run out of tries
+  while(!pending.empty() || active) {
+    //hand out work to idle connections, answering from the cache when we can
+    auto now = clock_t::now();
+    bool cached = false;
+    for(size_t n = pending.size(); n > 0 && !idle_.empty(); --n) {
+      request_t request = std::move(pending.front());
+      pending.pop_front();
+      if(request.not_before > now) {
+        pending.push_back(std::move(request));
+        continue;
+      }
+      std::string body;
+      ptree pt;
+      if(cache_.get(request.url, body) && parse(body, retry_if_no, pt)) {
+        done(request, pt, handler, follow_next, pending);
+        cached = true;
+        continue;
+      }
+      auto* transfer = idle_.back();
+      idle_.pop_back();
+      transfer->request = std::move(request);
+      transfer->result.str("");
+      LOG_DEBUG(transfer->request.url);
+      assert_curl(curl_easy_setopt(transfer->connection, CURLOPT_URL, transfer->request.url.c_str()), "Failed to set URL ");
+      if(curl_multi_add_handle(multi_.get(), transfer->connection) != CURLM_OK)
+        throw logged_error_t("Failed to add CURL connection");
+      ++active;
+    }
+
+    //move the transfers along and pick up the ones that finished
+    int running = 0, left = 0;
+    curl_multi_perform(multi_.get(), &running);
+    while(CURLMsg* message = curl_multi_info_read(multi_.get(), &left)) {
+      if(message->msg != CURLMSG_DONE)
+        continue;
+      CURL* connection = message->easy_handle;
+      CURLcode code = message->data.result;
+      transfer_t* transfer = nullptr;
+      curl_easy_getinfo(connection, CURLINFO_PRIVATE, reinterpret_cast<char**>(&transfer));
+      curl_multi_remove_handle(multi_.get(), connection);
+      idle_.push_back(transfer);
+      --active;
+
+      long http_code = 0;
+      std::string log_extra = "Couldn't fetch url ";
+      if(code == CURLE_OK) {
+        curl_easy_getinfo(connection, CURLINFO_RESPONSE_CODE, &http_code);
+        log_extra = std::to_string(http_code) + "'d ";
+        //it should be 200 OK, file urls have no status
+        if(http_code == 200 || http_code == 0) {
+          ptree pt;
+          auto body = transfer->result.str();
+          if(parse(body, retry_if_no, pt)) {
+            cache_.put(transfer->request.url, body);
+            done(transfer->request, pt, handler, follow_next, pending);
+            continue;
+          }
+          log_extra = "Unusable response ";
+        }
+      }
+      //try again a bit later, backing off the more it fails
+      auto& request = transfer->request;
+      if(++request.tries >= max_tries_) {
+        LOG_ERROR(log_extra + "giving up on " + request.url + " after " + std::to_string(request.tries) + " tries");
+        ++given_up;
+        continue;
+      }
+      auto delay = distribution_(generator_) << std::min(request.tries - 1, kMaxBackoff);
+      request.not_before = clock_t::now() + std::chrono::milliseconds(delay);
+      //dont log rate limit stuff its too frequent
+      if(http_code != 429 || (request.tries % 10) == 0)
+        LOG_WARN(log_extra + "retrying " + request.url);
+      pending.push_back(std::move(request));
+    }
+
+    //wait for some traffic or for a retry to come due
+    if(active)
+      curl_multi_wait(multi_.get(), nullptr, 0, 100, nullptr);
+    else if(!pending.empty() && !cached)
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return given_up;
+}
+
+bool Curler::parse(const std::string& body, const std::string& retry_if_no, ptree& pt) {
+  try {
+    std::stringstream stream(body);
+    read_json(stream, pt);
+  }
+  catch (...) {
+    return false;
+  }
+  return retry_if_no.empty() || pt.get_child_optional(retry_if_no);
+}
+
+//the next page goes to the front so chains finish rather than all being half done
+void Curler::done(const request_t& request, const ptree& pt, const handler_t& handler,
+                  bool follow_next, std::deque<request_t>& pending) {
+  handler(request.chain, pt);
+  auto next = pt.get_optional<std::string>("meta.next");
+  if(follow_next && next)
+    pending.push_front(request_t{request.chain, *next + api_key_, 0, clock_t::now()});
+}
+
+void Curler::assert_curl(CURLcode code, const std::string& msg) {
+  if(code != CURLE_OK)
+    throw logged_error_t(msg + curl_easy_strerror(code));
+}
+
+size_t Curler::write_callback(char *in, size_t block_size, size_t blocks, std::stringstream *out) {
+  if(!out) return static_cast<size_t>(0);
+  out->write(in, block_size * blocks);
+  return block_size * blocks;
+}
+
+}
+}
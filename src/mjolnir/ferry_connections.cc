@@ -1,10 +1,122 @@
 #include "mjolnir/ferry_connections.h"
 
-#include <queue>
-#include <unordered_map>
-
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <limits>
+#include <memory>
+#include <thread>
+
+#include <valhalla/midgard/logging.h>
 #include <valhalla/midgard/util.h>
 
+namespace {
+
+constexpr uint32_t kEmptySlot = std::numeric_limits<uint32_t>::max();
+constexpr size_t kMinSearchSlots = 1024;
+
+// Best class of a node without driveable non-ferry, non-link edges
+constexpr uint8_t kNoClass = 0xFF;
+
+// Flags per graph node
+constexpr uint8_t kFerryEdge = 1;
+constexpr uint8_t kNonFerryEdge = 2;
+
+// Cost comparator for the adjacency heap
+class CompareCost {
+public:
+  bool operator()(const std::pair<float, uint32_t>& n1,
+                  const std::pair<float, uint32_t>& n2) {
+    return n1.first > n2.first;
+  }
+};
+
+size_t Slot(const uint32_t node, const size_t mask) {
+  return ((static_cast<uint64_t>(node) * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+}
+
+// Double the node status table and reinsert the nodes of this search
+void Grow(valhalla::mjolnir::FerrySearch& search) {
+  std::vector<std::pair<uint32_t, valhalla::mjolnir::NodeStatusInfo> > entries;
+  entries.reserve(search.used.size());
+  for (auto slot : search.used) {
+    entries.emplace_back(search.keys[slot], search.status[slot]);
+  }
+  size_t size = std::max(kMinSearchSlots, search.keys.size() * 2);
+  search.keys.assign(size, kEmptySlot);
+  search.status.resize(size);
+  search.used.clear();
+  for (const auto& entry : entries) {
+    search[entry.first] = entry.second;
+  }
+}
+
+// Move a file iterator to an index. Short moves forward are done by
+// advancing so reading in file order stays sequential.
+template <class T>
+void Seek(valhalla::midgard::sequence<T>& items,
+          typename valhalla::midgard::sequence<T>::iterator& itr, const size_t index) {
+  if (index >= itr.position()) {
+    itr += index - itr.position();
+  } else {
+    itr = items[index];
+  }
+}
+
+// What one thread found for its ferry terminals
+struct FerryResult {
+  std::vector<uint32_t> reclassify;   // Edges along the shortest paths
+  std::vector<uint32_t> start_edges;  // First edge from each terminal
+  uint32_t endpoint_count = 0;
+};
+
+// Form shortest paths from a terminal along each edge connected to the
+// ferry, track until the specified RC is reached
+void ConnectFerry(const uint32_t node, const valhalla::mjolnir::FerryGraph& graph,
+                  const uint32_t rc, valhalla::mjolnir::FerrySearch& search,
+                  FerryResult& result) {
+  for (auto e = graph.begin(node); e != graph.end(node); ++e) {
+    // Skip ferry edges and non-driveable edges
+    const auto edge = graph.edge(*e);
+    if (edge.ferry || (!edge.driveablereverse && !edge.driveableforward)) {
+      continue;
+    }
+
+    // Expand/reclassify from the end node of this edge.
+    uint32_t end_node = (edge.sourcenode == node) ? edge.targetnode : edge.sourcenode;
+
+    // Check if edge is oneway towards the ferry or outbound from the
+    // ferry. If edge is drivable both ways we need to expand it twice-
+    // once with a driveable path towards the ferry and once with a
+    // driveable path away from the ferry
+    if (edge.driveableforward == edge.driveablereverse) {
+      ShortestPath(node, end_node, graph, true, rc, search, result.reclassify);
+      ShortestPath(node, end_node, graph, false, rc, search, result.reclassify);
+    } else {
+      // Check if oneway inbound to the ferry
+      bool inbound = (edge.sourcenode == node) ?
+                      edge.driveablereverse : edge.driveableforward;
+      ShortestPath(node, end_node, graph, inbound, rc, search, result.reclassify);
+    }
+    result.endpoint_count++;
+
+    // The first/start edge is reclassified once all the searches are done
+    // so no search immediately determines it hit the specified classification
+    result.start_edges.push_back(*e);
+  }
+}
+
+void ConnectFerries(const valhalla::mjolnir::FerryGraph& graph,
+                    const std::vector<uint32_t>& terminals, const uint32_t rc,
+                    std::atomic<size_t>& next, FerryResult& result) {
+  valhalla::mjolnir::FerrySearch search;
+  for (size_t i = next++; i < terminals.size(); i = next++) {
+    ConnectFerry(terminals[i], graph, rc, search, result);
+  }
+}
+
+}
+
 namespace valhalla {
 namespace mjolnir {
 
@@ -26,51 +138,217 @@ uint32_t GetBestNonFerryClass(const std::map<Edge, size_t>& edges) {
   return bestrc;
 }
 
-// Cost comparator for priority_queue
-class CompareCost {
-public:
-  bool operator()(const std::pair<float, uint32_t>& n1,
-                  const std::pair<float, uint32_t>& n2) {
-    return n1.first > n2.first;
-  }
-};
+// Edges are written in way order so the ways and way nodes are read
+// sequentially along with them
+FerryGraph::FerryGraph(sequence<OSMWay>& ways, sequence<OSMWayNode>& way_nodes,
+                       sequence<Edge>& edges, const std::string& file_prefix)
+    : edges_file_(file_prefix + ".ferry_edges.bin"),
+      adjacency_file_(file_prefix + ".ferry_adjacency.bin"),
+      edges_(edges_file_, true),
+      adjacency_(adjacency_file_, true) {
+  auto way_itr = ways.begin();
+  auto way_node_itr = way_nodes.begin();
+  uint32_t way_index = kEmptySlot;
+  float speed = 0.0f;
+  for (auto edge_itr = edges.begin(); edge_itr != edges.end(); ++edge_itr) {
+    const Edge edge = *edge_itr;
+    if (!edge.attributes.driveable_ferry &&
+        !edge.attributes.driveableforward &&
+        !edge.attributes.driveablereverse) {
+      continue;
+    }
+    if (edge.wayindex_ != way_index) {
+      way_index = edge.wayindex_;
+      Seek(ways, way_itr, way_index);
+      speed = (*way_itr).speed();
+    }
 
-// Form the shortest path from the start node until a node that
-// touches the specified road classification.
-uint32_t ShortestPath(const uint32_t start_node_idx,
-                      const uint32_t node_idx,
-                      sequence<OSMWay>& ways,
-                      sequence<OSMWayNode>& way_nodes,
-                      sequence<Edge>& edges,
-                      sequence<Node>& nodes,
-                      const bool inbound, const uint32_t rc) {
-  // Method to get the shape for an edge - since LL is stored as a pair of
-  // floats we need to change into PointLL to get length of an edge
-  const auto EdgeShape = [&way_nodes](size_t idx, const size_t count) {
-    std::list<PointLL> shape;
-    for (size_t i = 0; i < count; ++i) {
-      auto node = (*way_nodes[idx++]).node;
-      shape.emplace_back(node.lng, node.lat);
+    // Length of the shape, consecutive edges of a way share a way node
+    Seek(way_nodes, way_node_itr, edge.llindex_);
+    float length = 0.0f;
+    auto ll = (*way_node_itr).node;
+    for (uint32_t i = 1; i < edge.attributes.llcount; i++) {
+      ++way_node_itr;
+      auto next_ll = (*way_node_itr).node;
+      length += PointLL(ll.lng, ll.lat).Distance(PointLL(next_ll.lng, next_ll.lat));
+      ll = next_ll;
     }
-    return shape;
+
+    FerryEdge ferry_edge;
+    ferry_edge.edge_index = edge_itr.position();
+    ferry_edge.sourcenode = edge.sourcenode_;
+    ferry_edge.targetnode = edge.targetnode_;
+    ferry_edge.seconds = (length * 3.6f) / speed;
+    ferry_edge.length = length;
+    ferry_edge.importance = edge.attributes.importance;
+    ferry_edge.driveableforward = edge.attributes.driveableforward;
+    ferry_edge.driveablereverse = edge.attributes.driveablereverse;
+    ferry_edge.ferry = edge.attributes.driveable_ferry;
+    ferry_edge.link = edge.attributes.link;
+    ferry_edge.spare = 0;
+    edges_.push_back(ferry_edge);
+    positions_.push_back(edge.sourcenode_);
+    positions_.push_back(edge.targetnode_);
+  }
+
+  // Number the nodes the edges use
+  std::sort(positions_.begin(), positions_.end());
+  positions_.erase(std::unique(positions_.begin(), positions_.end()), positions_.end());
+  positions_.shrink_to_fit();
+  const auto Index = [this](const uint32_t position) {
+    return static_cast<uint32_t>(std::lower_bound(positions_.begin(), positions_.end(),
+                                                  position) - positions_.begin());
   };
 
-  // Map to store the status and index of nodes that have been encountered.
-  // Any unreached nodes are not added to the map.
-  std::unordered_map<uint32_t, NodeStatusInfo> node_status;
-  std::vector<NodeLabel> node_labels;
+  // Renumber the nodes of the edges and count the edges per node. A loop
+  // is only listed once at its node.
+  offsets_.assign(positions_.size() + 1, 0);
+  best_class_.assign(positions_.size(), kNoClass);
+  ferry_.assign(positions_.size(), 0);
+  for (auto edge_itr = edges_.begin(); edge_itr != edges_.end(); ++edge_itr) {
+    FerryEdge edge = *edge_itr;
+    edge.sourcenode = Index(edge.sourcenode);
+    edge.targetnode = Index(edge.targetnode);
+    edge_itr = edge;
+    offsets_[edge.sourcenode + 1]++;
+    if (edge.targetnode != edge.sourcenode) {
+      offsets_[edge.targetnode + 1]++;
+    }
+  }
+  for (size_t i = 1; i < offsets_.size(); i++) {
+    offsets_[i] += offsets_[i - 1];
+  }
 
-  // Priority queue for the adjacency list
-  std::priority_queue<std::pair<float, uint32_t>,
-      std::vector<std::pair<float, uint32_t>>, CompareCost> adjset;
+  // Group the edges by node
+  for (uint32_t i = 0; i < offsets_.back(); i++) {
+    adjacency_.push_back(0);
+  }
+  std::vector<uint32_t> fill(offsets_.begin(), offsets_.end() - 1);
+  uint32_t e = 0;
+  for (auto edge_itr = edges_.begin(); edge_itr != edges_.end(); ++edge_itr, ++e) {
+    const FerryEdge edge = *edge_itr;
+    for (auto node : { edge.sourcenode, edge.targetnode }) {
+      auto element = adjacency_[fill[node]++];
+      element = e;
+      if (edge.ferry) {
+        ferry_[node] |= kFerryEdge;
+      } else if (edge.driveableforward || edge.driveablereverse) {
+        ferry_[node] |= kNonFerryEdge;
+        if (!edge.link && edge.importance < best_class_[node]) {
+          best_class_[node] = edge.importance;
+        }
+      }
+      if (edge.targetnode == edge.sourcenode) {
+        break;
+      }
+    }
+  }
+  adjacency_.flush();
+  edges_.flush();
+}
+
+FerryGraph::~FerryGraph() {
+  edges_.flush();
+  adjacency_.flush();
+  std::remove(edges_file_.c_str());
+  std::remove(adjacency_file_.c_str());
+}
+
+uint32_t FerryGraph::node_count() const {
+  return positions_.size();
+}
+
+sequence<uint32_t>::iterator FerryGraph::begin(const uint32_t node) const {
+  return adjacency_[offsets_[node]];
+}
+
+sequence<uint32_t>::iterator FerryGraph::end(const uint32_t node) const {
+  return adjacency_[offsets_[node + 1]];
+}
+
+FerryGraph::FerryEdge FerryGraph::edge(const uint32_t edge) const {
+  return *edges_[edge];
+}
+
+uint32_t FerryGraph::position(const uint32_t node) const {
+  return positions_[node];
+}
+
+uint32_t FerryGraph::best_class(const uint32_t node) const {
+  return best_class_[node] == kNoClass ?
+      kAbsurdRoadClass : best_class_[node];
+}
+
+bool FerryGraph::ferry_edge(const uint32_t node) const {
+  return ferry_[node] & kFerryEdge;
+}
+
+bool FerryGraph::non_ferry_edge(const uint32_t node) const {
+  return ferry_[node] & kNonFerryEdge;
+}
+
+// Reset only what the last search used
+void FerrySearch::clear() {
+  node_labels.clear();
+  adjset.clear();
+  for (auto slot : used) {
+    keys[slot] = kEmptySlot;
+  }
+  used.clear();
+}
+
+// Get the status of a node, adding it as unreached if it is not in the
+// table yet. The reference is only valid until the next node is added.
+NodeStatusInfo& FerrySearch::operator[](const uint32_t node) {
+  if ((used.size() + 1) * 2 > keys.size()) {
+    Grow(*this);
+  }
+  size_t mask = keys.size() - 1;
+  for (size_t slot = Slot(node, mask); ; slot = (slot + 1) & mask) {
+    if (keys[slot] == node) {
+      return status[slot];
+    }
+    if (keys[slot] == kEmptySlot) {
+      keys[slot] = node;
+      status[slot] = NodeStatusInfo();
+      used.push_back(slot);
+      return status[slot];
+    }
+  }
+}
+
+const NodeStatusInfo* FerrySearch::find(const uint32_t node) const {
+  if (keys.empty()) {
+    return nullptr;
+  }
+  size_t mask = keys.size() - 1;
+  for (size_t slot = Slot(node, mask); keys[slot] != kEmptySlot; slot = (slot + 1) & mask) {
+    if (keys[slot] == node) {
+      return &status[slot];
+    }
+  }
+  return nullptr;
+}
+
+// Form the shortest path from the start node until a node that
+// touches the specified road classification.
+void ShortestPath(const uint32_t start_node_idx,
+                  const uint32_t node_idx,
+                  const FerryGraph& graph,
+                  const bool inbound, const uint32_t rc,
+                  FerrySearch& search,
+                  std::vector<uint32_t>& reclassify) {
+  // Labels, adjacency heap and node status are reused from the last search
+  search.clear();
+  auto& node_labels = search.node_labels;
+  auto& adjset = search.adjset;
+  CompareCost compare;
 
   // Add node to list of node labels, set the node status and add
   // to the adjacency set
-  uint32_t nodelabel_index = 0;
   node_labels.emplace_back(0.0f, node_idx, node_idx);
-  node_status[node_idx] = { kTemporary, nodelabel_index };
-  adjset.push({0.0f, nodelabel_index});
-  nodelabel_index++;
+  search[node_idx] = { kTemporary, 0 };
+  adjset.emplace_back(0.0f, 0);
 
   // Expand edges until a node connected to specified road classification
   // is reached
@@ -79,112 +357,98 @@ uint32_t ShortestPath(const uint32_t start_node_idx,
   while (!adjset.empty()) {
     // Get the next node from the adjacency list/priority queue. Gets its
     // current cost and index
-    const auto& expand_node = adjset.top();
-    float current_cost = expand_node.first;
-    index = expand_node.second;
+    std::pop_heap(adjset.begin(), adjset.end(), compare);
+    float current_cost = adjset.back().first;
+    index = adjset.back().second;
+    adjset.pop_back();
     uint32_t node_index = node_labels[index].node_index;
-    adjset.pop();
 
     // Skip if already labeled - this can happen if an edge is already in
     // adj. list and a lower cost is found
-    if (node_status[node_index].set == kPermanent) {
+    NodeStatusInfo& node_status = search[node_index];
+    if (node_status.set == kPermanent) {
       continue;
     }
 
-    // Expand all edges from this node
-    auto expand_node_itr = nodes[node_index];
-    auto expanded = collect_node_edges(expand_node_itr, nodes, edges);
-
     // We are finished if node has RC <= rc and beyond first several edges.
     // Have seen cases where the immediate connections are high class roads
     // but then there are service roads (lanes) immediately after (like
     // Twawwassen Terminal near Vancouver,BC)
-    if (n > 400 && GetBestNonFerryClass(expanded.node_edges) <= rc) {
+    if (n > 400 && graph.best_class(node_index) <= rc) {
       break;
     }
     n++;
 
     // Label the node as done/permanent
-    node_status[node_index] = { kPermanent, index};
+    node_status = { kPermanent, index };
 
     // Expand edges. Skip ferry edges and non-driveable edges (based on
     // the inbound flag).
-    for (const auto& expandededge : expanded.node_edges) {
+    for (auto e = graph.begin(node_index); e != graph.end(node_index); ++e) {
       // Skip any ferry edge and any edge that includes the start node index
-      const auto& edge = expandededge.first;
-      if (edge.attributes.driveable_ferry ||
-          edge.sourcenode_ == start_node_idx ||
-          edge.targetnode_ == start_node_idx)
+      const auto edge = graph.edge(*e);
+      if (edge.ferry ||
+          edge.sourcenode == start_node_idx ||
+          edge.targetnode == start_node_idx)
         continue;
 
       // Skip non-driveable edges (based on inbound flag)
-      const OSMWay w = *ways[edge.wayindex_];
-      bool forward = (edge.sourcenode_ == node_index);
+      bool forward = (edge.sourcenode == node_index);
       if (forward) {
-        if (( inbound && !edge.attributes.driveablereverse) ||
-            (!inbound && !edge.attributes.driveableforward)) {
+        if (( inbound && !edge.driveablereverse) ||
+            (!inbound && !edge.driveableforward)) {
           continue;
         }
       } else {
-        if (( inbound && !edge.attributes.driveableforward) ||
-            (!inbound && !edge.attributes.driveablereverse)) {
+        if (( inbound && !edge.driveableforward) ||
+            (!inbound && !edge.driveablereverse)) {
           continue;
         }
       }
 
       // Get the end node. Skip if already permanently labeled or this
       // edge is a loop
-      uint32_t endnode = forward ? edge.targetnode_ : edge.sourcenode_;
-      if (node_status[endnode].set == kPermanent || endnode == node_index) {
+      uint32_t endnode = forward ? edge.targetnode : edge.sourcenode;
+      if (endnode == node_index) {
+        continue;
+      }
+      NodeStatusInfo& end_status = search[endnode];
+      if (end_status.set == kPermanent) {
         continue;
       }
-
-      // Get cost - need the length and speed of the edge
-      auto shape = EdgeShape(edge.llindex_, edge.attributes.llcount);
-      float cost = current_cost + (valhalla::midgard::length(shape) * 3.6f) / w.speed();
 
       // Check if already in adj set - skip if cost is higher than prior path
-      if (node_status[endnode].set == kTemporary) {
-        uint32_t endnode_idx = node_status[endnode].index;
-        if (node_labels[endnode_idx].cost < cost) {
-          continue;
-        }
+      float cost = current_cost + edge.seconds;
+      if (end_status.set == kTemporary &&
+          node_labels[end_status.index].cost < cost) {
+        continue;
       }
 
-      // Add to the node labels and adjacency set. Skip if this is a loop.
+      // Add to the node labels and adjacency set
+      end_status = { kTemporary, static_cast<uint32_t>(node_labels.size()) };
+      adjset.emplace_back(cost, node_labels.size());
+      std::push_heap(adjset.begin(), adjset.end(), compare);
       node_labels.emplace_back(cost, endnode, node_index);
-      node_status[endnode] = { kTemporary, nodelabel_index };
-      adjset.push({cost, nodelabel_index});
-      nodelabel_index++;
     }
   }
 
   // If only one label we have immediately found an edge with proper
   // classification - or we cannot expand due to driveability
   if (node_labels.size() == 1) {
-      LOG_DEBUG("Only 1 edge reclassified");
-    return 0;
+    LOG_DEBUG("Only 1 edge reclassified");
+    return;
   }
 
-  // Trace shortest path backwards and upgrade edge classifications
-  uint32_t count = 0;
+  // Trace shortest path backwards and collect the edges to upgrade
   while (true) {
     // Get the edge between this node and the predecessor
     uint32_t idx = node_labels[index].node_index;
     uint32_t pred_node = node_labels[index].pred_node_index;
-    auto expand_node_itr = nodes[idx];
-    auto bundle2 = collect_node_edges(expand_node_itr, nodes, edges);
-    for (auto& edge : bundle2.node_edges) {
-      if (edge.first.sourcenode_ == pred_node ||
-          edge.first.targetnode_ == pred_node) {
-        sequence<Edge>::iterator element = edges[edge.second];
-        auto update_edge = *element;
-        if (update_edge.attributes.importance > rc) {
-          update_edge.attributes.importance = rc;
-          update_edge.attributes.reclass_ferry = true;
-          element = update_edge;
-          count++;
-        }
+    for (auto e = graph.begin(idx); e != graph.end(idx); ++e) {
+      const auto edge = graph.edge(*e);
+      if ((edge.sourcenode == pred_node || edge.targetnode == pred_node) &&
+          edge.importance > rc) {
+        reclassify.push_back(*e);
       }
     }
 
@@ -192,42 +456,25 @@ uint32_t ShortestPath(const uint32_t start_node_idx,
     if (pred_node == node_idx) {
       break;
     }
-    index = node_status[pred_node].index;
+    index = search.find(pred_node)->index;
   }
-  return count;
 }
 
-// Check if the ferry included in this node bundle is short. Must be
+// Check if the ferry at this node is short. Must be
 // just one edge and length < 2 km
-bool ShortFerry(const uint32_t node_index, node_bundle& bundle,
-                sequence<Edge>& edges, sequence<Node>& nodes,
-                sequence<OSMWay>& ways,
-                sequence<OSMWayNode>& way_nodes) {
-  // Method to get the shape for an edge - since LL is stored as a pair of
-  // floats we need to change into PointLL to get length of an edge
-  const auto EdgeShape = [&way_nodes](size_t idx, const size_t count) {
-    std::list<PointLL> shape;
-    for (size_t i = 0; i < count; ++i) {
-      auto node = (*way_nodes[idx++]).node;
-      shape.emplace_back(node.lng, node.lat);
-    }
-    return shape;
-  };
-  uint32_t wayid = 0;
+bool ShortFerry(const uint32_t node_idx, const FerryGraph& graph) {
+  uint32_t edge_index = 0;
   bool short_edge = false;
-  for (const auto& edge : bundle.node_edges) {
+  for (auto e = graph.begin(node_idx); e != graph.end(node_idx); ++e) {
     // Check ferry edge. If the end node has a non-ferry edge check
     // the length of the edge
-    if (edge.first.attributes.driveable_ferry) {
-      uint32_t endnode = (edge.first.sourcenode_ == node_index) ?
-                          edge.first.targetnode_ : edge.first.sourcenode_;
-      auto end_node_itr = nodes[endnode];
-      auto bundle2 = collect_node_edges(end_node_itr, nodes, edges);
-      if (bundle2.node.attributes_.non_ferry_edge) {
-        auto shape = EdgeShape(edge.first.llindex_, edge.first.attributes.llcount);
-        if (midgard::length(shape) < 2000.0f) {
-          const OSMWay w = *ways[edge.first.wayindex_];
-          wayid = w.way_id();
+    const auto edge = graph.edge(*e);
+    if (edge.ferry) {
+      uint32_t endnode = (edge.sourcenode == node_idx) ?
+                          edge.targetnode : edge.sourcenode;
+      if (graph.non_ferry_edge(endnode)) {
+        if (edge.length < 2000.0f) {
+          edge_index = edge.edge_index;
           short_edge = true;
         }
       } else {
@@ -236,7 +483,7 @@ bool ShortFerry(const uint32_t node_index, node_bundle& bundle,
     }
   }
   if (short_edge) {
-    LOG_DEBUG("Skip short ferry: way_id = " + std::to_string(wayid));
+    LOG_DEBUG("Skip short ferry: edge index = " + std::to_string(edge_index));
   }
   return short_edge;
 }
@@ -245,82 +492,73 @@ bool ShortFerry(const uint32_t node_index, node_bundle& bundle,
 // specified road classification.
 void ReclassifyFerryConnections(const std::string& ways_file,
                                 const std::string& way_nodes_file,
-                                const std::string& nodes_file,
                                 const std::string& edges_file,
                                 const uint32_t rc,
-                                DataQuality& stats) {
+                                DataQuality& stats,
+                                const unsigned int thread_count) {
   LOG_INFO("Reclassifying ferry connection graph edges...");
 
   sequence<OSMWay> ways(ways_file, false);
   sequence<OSMWayNode> way_nodes(way_nodes_file, false);
   sequence<Edge> edges(edges_file, false);
-  sequence<Node> nodes(nodes_file, false);
+  FerryGraph graph(ways, way_nodes, edges, edges_file);
 
   // Need to expand from the end of the ferry until we meet a road with the
   // specified classification. Want to do simple shortest path (time based
   // only) and obey driveability.
 
-  // Iterate through nodes and find any that connect to both a ferry and a
-  // regular (non-ferry) edge. Skip short ferry edges (river crossing?)
+  // Find nodes that connect to both a ferry and a regular (non-ferry) edge.
+  // Skip short ferry edges (river crossing?)
+  std::vector<uint32_t> terminals;
+  for (uint32_t node = 0; node < graph.node_count(); node++) {
+    if (graph.ferry_edge(node) && graph.non_ferry_edge(node) &&
+        graph.best_class(node) > rc && !ShortFerry(node, graph)) {
+      terminals.push_back(node);
+    }
+  }
+
+  // Search from the terminals in parallel
+  std::vector<FerryResult> results(std::max(1u, thread_count));
+  std::vector<std::shared_ptr<std::thread> > threads(results.size());
+  std::atomic<size_t> next(0);
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].reset(new std::thread(ConnectFerries, std::cref(graph), std::cref(terminals),
+                                     rc, std::ref(next), std::ref(results[i])));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
+
+  // Upgrade the edges in file order. Edges along a path are marked as
+  // reclassified, an edge may be on several paths but is counted once.
   uint32_t ferry_endpoint_count = 0;
   uint32_t total_count = 0;
-  sequence<Node>::iterator node_itr = nodes.begin();
-  while (node_itr != nodes.end()) {
-    auto bundle = collect_node_edges(node_itr, nodes, edges);
-    if (bundle.node.attributes_.ferry_edge &&
-        bundle.node.attributes_.non_ferry_edge &&
-        GetBestNonFerryClass(bundle.node_edges) > rc &&
-        !ShortFerry(node_itr.position(), bundle, edges,
-                    nodes, ways, way_nodes)) {
-      // Form shortest path from node along each edge connected to the ferry,
-      // track until the specified RC is reached
-      bool oneway_reverse = false;
-      for (const auto& edge : bundle.node_edges) {
-        // Skip ferry edges and non-driveable edges
-        if (edge.first.attributes.driveable_ferry ||
-          (!edge.first.attributes.driveablereverse &&
-           !edge.first.attributes.driveableforward)) {
-          continue;
-        }
-
-        // Expand/reclassify from the end node of this edge.
-        uint32_t end_node_idx = (edge.first.sourcenode_ == node_itr.position()) ?
-                    edge.first.targetnode_ : edge.first.sourcenode_;
-
-        // Check if edge is oneway towards the ferry or outbound from the
-        // ferry. If edge is drivable both ways we need to expand it twice-
-        // once with a driveable path towards the ferry and once with a
-        // driveable path away from the ferry
-        if (edge.first.attributes.driveableforward ==
-            edge.first.attributes.driveablereverse) {
-          // Driveable in both directions - get an inbound path and an
-          // outbound path.
-          total_count += ShortestPath(node_itr.position(), end_node_idx, ways,
-                            way_nodes,edges, nodes, true, rc);
-          total_count += ShortestPath(node_itr.position(), end_node_idx, ways,
-                            way_nodes, edges, nodes, false, rc);
-        } else {
-          // Check if oneway inbound to the ferry
-          bool inbound = (edge.first.sourcenode_ == node_itr.position()) ?
-                          edge.first.attributes.driveablereverse :
-                          edge.first.attributes.driveableforward;
-          total_count += ShortestPath(node_itr.position(), end_node_idx, ways,
-                            way_nodes, edges, nodes, inbound, rc);
-        }
-        ferry_endpoint_count++;
-
-        // Reclassify the first/start edge. Do this AFTER finding shortest path so
-        // we do not immediately determine we hit the specified classification
-        sequence<Edge>::iterator element = edges[edge.second];
-        auto update_edge = *element;
-        update_edge.attributes.importance = rc;
-        element = update_edge;
-        total_count++;
-      }
+  std::vector<std::pair<uint32_t, bool> > updates;
+  for (const auto& result : results) {
+    ferry_endpoint_count += result.endpoint_count;
+    total_count += result.start_edges.size();
+    for (auto e : result.reclassify) {
+      updates.emplace_back(graph.edge(e).edge_index, true);
     }
-
-    // Go to the next node
-    node_itr += bundle.node_count;
+    for (auto e : result.start_edges) {
+      updates.emplace_back(graph.edge(e).edge_index, false);
+    }
+  }
+  std::sort(updates.begin(), updates.end());
+  for (size_t i = 0; i < updates.size(); ) {
+    uint32_t edge_index = updates[i].first;
+    bool path = false;
+    for (; i < updates.size() && updates[i].first == edge_index; i++) {
+      path = path || updates[i].second;
+    }
+    sequence<Edge>::iterator element = edges[edge_index];
+    auto update_edge = *element;
+    update_edge.attributes.importance = rc;
+    if (path) {
+      update_edge.attributes.reclass_ferry = true;
+      total_count++;
+    }
+    element = update_edge;
   }
   LOG_INFO("Finished ReclassifyFerryEdges: ferry_endpoint_count = " +
            std::to_string(ferry_endpoint_count) + ", " +
@@ -4,13 +4,16 @@
 #include "mjolnir/node_expander.h"
 #include "mjolnir/ferry_connections.h"
 #include "mjolnir/linkclassification.h"
+#include "mjolnir/metrics.h"
 
+#include <algorithm>
 #include <future>
 #include <utility>
 #include <thread>
 #include <set>
 #include <boost/format.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/filesystem/operations.hpp>
 
 #include <valhalla/midgard/logging.h>
 #include <valhalla/midgard/util.h>
@@ -23,6 +26,7 @@
 #include <valhalla/baldr/graphconstants.h>
 #include <valhalla/baldr/signinfo.h>
 #include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/graphtile.h>
 #include <valhalla/skadi/sample.h>
 #include <valhalla/skadi/util.h>
 
@@ -117,6 +121,7 @@ void ConstructEdges(const OSMData& osmdata, const std::string& ways_file,
           const std::string& edges_file, const float tilesize,
           const std::function<GraphId (const OSMNode&)>& graph_id_predicate) {
   LOG_INFO("Creating graph edges from ways...")
+  Counter& written = Metrics::Get().counter("build.bytes_written");
 
   //so we can read ways and nodes and write edges
   sequence<OSMWay> ways(ways_file, false);
@@ -150,6 +155,7 @@ void ConstructEdges(const OSMData& osmdata, const std::string& ways_file,
     way_node.node.attributes_.link_edge = way.link();
     way_node.node.attributes_.non_link_edge = !way.link();
     nodes.push_back({way_node.node, static_cast<uint32_t>(edges.size()), static_cast<uint32_t>(-1), graph_id_predicate(way_node.node)});
+    written.Add(sizeof(Node));
 
     // Iterate through the nodes of the way until we find an intersection
     while(current_way_node_index < way_nodes.size()) {
@@ -167,6 +173,7 @@ void ConstructEdges(const OSMData& osmdata, const std::string& ways_file,
         way_node.node.attributes_.non_link_edge = !way.link();
         nodes.push_back({way_node.node, static_cast<uint32_t>(-1), static_cast<uint32_t>(edges.size()), graph_id_predicate(way_node.node)});
         edges.push_back(edge);
+        written.Add(sizeof(Node) + sizeof(Edge));
 
         // Start a new edge if this is not the last node in the way
         if (current_way_node_index != last_way_node_index) {
@@ -339,8 +346,8 @@ void BuildTileSet(const std::string& ways_file, const std::string& way_nodes_fil
     const std::unique_ptr<const valhalla::skadi::sample>& sample,
     std::map<GraphId, size_t>::const_iterator tile_start,
     std::map<GraphId, size_t>::const_iterator tile_end,
-    const uint32_t tile_creation_date,
-    std::promise<DataQuality>& result) {
+    const uint32_t tile_creation_date, const BuildObserver& observer,
+    const std::set<GraphId>* rebuild, std::promise<DataQuality>& result) {
 
   sequence<OSMWay> ways(ways_file, false);
   sequence<OSMWayNode> way_nodes(way_nodes_file, false);
@@ -349,6 +356,8 @@ void BuildTileSet(const std::string& ways_file, const std::string& way_nodes_fil
 
   const auto& tl = hierarchy.levels().rbegin();
   Tiles<PointLL> tiling = tl->second.tiles;
+  Counter& tiles_built = Metrics::Get().counter("build.tiles_built");
+  Gauge& tiles_remaining = Metrics::Get().gauge("build.tiles_remaining");
 
   // Method to get the shape for an edge - since LL is stored as a pair of
   // floats we need to change into PointLL to get length of an edge
@@ -372,6 +381,9 @@ void BuildTileSet(const std::string& ways_file, const std::string& way_nodes_fil
   ////////////////////////////////////////////////////////////////////////////
   // Iterate over tiles
   for(; tile_start != tile_end; ++tile_start) {
+    if (rebuild && rebuild->find(tile_start->first.Tile_Base()) == rebuild->end()) {
+      continue;
+    }
     try {
       // What actually writes the tile
       GraphId tile_id = tile_start->first.Tile_Base();
@@ -633,6 +645,11 @@ void BuildTileSet(const std::string& ways_file, const std::string& way_nodes_fil
 
       // Write the actual tile to disk
       graphtile.StoreTileData();
+      tiles_built.Add();
+      tiles_remaining.Add(-1);
+      if (observer.tile_built) {
+        observer.tile_built(tile_id);
+      }
 
       // Made a tile
       LOG_DEBUG((boost::format("Wrote tile %1%: %2% bytes") % tile_start->first % graphtile.size()).str());
@@ -653,12 +670,19 @@ void BuildLocalTiles(const unsigned int thread_count, const OSMData& osmdata,
   const std::string& ways_file, const std::string& way_nodes_file,
   const std::string& nodes_file, const std::string& edges_file,
   const std::map<GraphId, size_t>& tiles, const TileHierarchy& tile_hierarchy, DataQuality& stats,
-  const std::unique_ptr<const valhalla::skadi::sample>& sample) {
+  const std::unique_ptr<const valhalla::skadi::sample>& sample, const BuildObserver& observer,
+  const std::set<GraphId>* rebuild) {
 
   auto tz = DateTime::get_tz_db().from_index(DateTime::get_tz_db().to_index("America/New_York"));
   uint32_t tile_creation_date = DateTime::days_from_pivot_date(DateTime::get_formatted_date(DateTime::iso_date_time(tz)));
 
-  LOG_INFO("Building " + std::to_string(tiles.size()) + " tiles with " + std::to_string(thread_count) + " threads...");
+  size_t tiles_to_build = tiles.size();
+  if (rebuild) {
+    tiles_to_build = std::count_if(rebuild->begin(), rebuild->end(),
+      [&tiles](const GraphId& tile) { return tiles.find(tile) != tiles.end(); });
+  }
+  LOG_INFO("Building " + std::to_string(tiles_to_build) + " tiles with " + std::to_string(thread_count) + " threads...");
+  Metrics::Get().gauge("build.tiles_remaining").Set(tiles_to_build);
 
   // A place to hold worker threads and their results, be they exceptions or otherwise
   std::vector<std::shared_ptr<std::thread> > threads(thread_count);
@@ -684,7 +708,7 @@ void BuildLocalTiles(const unsigned int thread_count, const OSMData& osmdata,
       new std::thread(BuildTileSet,  std::cref(ways_file), std::cref(way_nodes_file),
                       std::cref(nodes_file), std::cref(edges_file), std::cref(tile_hierarchy),
                       std::cref(osmdata), std::cref(sample), tile_start, tile_end, tile_creation_date,
-                      std::ref(results[i]))
+                      std::cref(observer), rebuild, std::ref(results[i]))
     );
   }
 
@@ -715,9 +739,35 @@ void BuildLocalTiles(const unsigned int thread_count, const OSMData& osmdata,
 namespace valhalla {
 namespace mjolnir {
 
+// An edge between two tiles marks the other tile if either is rebuilt
+void GraphBuilder::AddConnectedTiles(const std::string& nodes_file, const std::string& edges_file,
+                                     std::set<GraphId>& rebuild) {
+  sequence<Node> nodes(nodes_file, false);
+  sequence<Edge> edges(edges_file, false);
+  std::set<GraphId> connected;
+  for (auto itr = edges.begin(); itr != edges.end(); ++itr) {
+    const Edge edge = *itr;
+    GraphId source = (*nodes[edge.sourcenode_]).graph_id.Tile_Base();
+    GraphId target = (*nodes[edge.targetnode_]).graph_id.Tile_Base();
+    if (source == target) {
+      continue;
+    }
+    if (rebuild.find(source) != rebuild.end()) {
+      connected.insert(target);
+    } else if (rebuild.find(target) != rebuild.end()) {
+      connected.insert(source);
+    }
+  }
+  size_t changed = rebuild.size();
+  rebuild.insert(connected.begin(), connected.end());
+  LOG_INFO("Rebuilding " + std::to_string(rebuild.size()) + " tiles, " +
+           std::to_string(rebuild.size() - changed) + " more for their edges in " + edges_file);
+}
+
 // Build the graph from the input
 void GraphBuilder::Build(const boost::property_tree::ptree& pt, const OSMData& osmdata,
-    const std::string& ways_file, const std::string& way_nodes_file) {
+    const std::string& ways_file, const std::string& way_nodes_file,
+    const BuildObserver& observer, std::set<GraphId>* rebuild) {
   std::string nodes_file = "nodes.bin";
   std::string edges_file = "edges.bin";
   TileHierarchy tile_hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
@@ -725,8 +775,14 @@ void GraphBuilder::Build(const boost::property_tree::ptree& pt, const OSMData& o
                                   pt.get<unsigned int>("mjolnir.concurrency", std::thread::hardware_concurrency()));
   const auto& tl = tile_hierarchy.levels().rbegin();
   uint8_t level = tl->second.level;
+  auto step = [&observer](const std::string& name) {
+    if (observer.step) {
+      observer.step(name);
+    }
+  };
 
   // Make the edges and nodes in the graph
+  step("construct edges");
   ConstructEdges(osmdata, ways_file, way_nodes_file, nodes_file, edges_file, tl->second.tiles.TileSize(),
     [&tile_hierarchy, &level](const OSMNode& node) {
       return tile_hierarchy.GetGraphId({node.lng, node.lat}, level);
@@ -734,12 +790,26 @@ void GraphBuilder::Build(const boost::property_tree::ptree& pt, const OSMData& o
   );
 
   // Line up the nodes and then re-map the edges that the edges to them
+  step("sort graph");
   auto tiles = SortGraph(nodes_file, edges_file, tile_hierarchy, level);
 
+  // Tiles of a partial rebuild that no longer have any nodes go away
+  if (rebuild) {
+    step("find tiles to rebuild");
+    AddConnectedTiles(nodes_file, edges_file, *rebuild);
+    for (const auto& tile : *rebuild) {
+      if (tiles.find(tile) == tiles.end()) {
+        boost::filesystem::remove(tile_hierarchy.tile_dir() + '/' +
+                                  GraphTile::FileSuffix(tile, tile_hierarchy));
+      }
+    }
+  }
+
   // Reclassify links (ramps). Cannot do this when building tiles since the
   // edge list needs to be modified
   DataQuality stats;
-  ReclassifyLinks(ways_file, nodes_file, edges_file, stats);
+  step("reclassify links");
+  ReclassifyLinks(ways_file, edges_file, stats, threads);
 
   // Reclassify ferry connection edges - use the highway classification cutoff
   RoadClass rc = RoadClass::kPrimary;
@@ -748,8 +818,9 @@ void GraphBuilder::Build(const boost::property_tree::ptree& pt, const OSMData& o
       rc = level.second.importance;
     }
   }
-  ReclassifyFerryConnections(ways_file, way_nodes_file, nodes_file, edges_file,
-                             static_cast<uint32_t>(rc), stats);
+  step("reclassify ferries");
+  ReclassifyFerryConnections(ways_file, way_nodes_file, edges_file,
+                             static_cast<uint32_t>(rc), stats, threads);
 
   // Crack open some elevation data if its there
   boost::optional<std::string> elevation = pt.get_optional<std::string>("additional_data.elevation");
@@ -757,9 +828,22 @@ void GraphBuilder::Build(const boost::property_tree::ptree& pt, const OSMData& o
   if(elevation)
     sample.reset(new skadi::sample(*elevation));
 
+  // Tell the observer how many node records each tile has
+  if (observer.tiles_planned) {
+    sequence<Node> nodes(nodes_file, false);
+    std::map<GraphId, size_t> node_records;
+    for (auto tile = tiles.cbegin(); tile != tiles.cend(); ++tile) {
+      auto next = std::next(tile);
+      node_records.emplace(tile->first,
+                           (next == tiles.cend() ? nodes.size() : next->second) - tile->second);
+    }
+    observer.tiles_planned(node_records);
+  }
+
   // Build tiles at the local level. Form connected graph from nodes and edges.
+  step("build local tiles");
   BuildLocalTiles(threads, osmdata, ways_file, way_nodes_file, nodes_file,
-                  edges_file, tiles, tile_hierarchy, stats, sample);
+                  edges_file, tiles, tile_hierarchy, stats, sample, observer, rebuild);
 
   stats.LogStatistics();
 }
@@ -1,13 +1,19 @@
 #include "mjolnir/graphenhancer.h"
+#include "mjolnir/buildpipeline.h"
 #include "mjolnir/graphtilebuilder.h"
+#include "mjolnir/connectivityindex.h"
+#include "mjolnir/metrics.h"
+#include "mjolnir/profiledmutex.h"
 
 #include <memory>
+#include <functional>
 #include <future>
 #include <thread>
 #include <mutex>
 #include <vector>
 #include <list>
 #include <queue>
+#include <set>
 #include <unordered_set>
 #include <unordered_map>
 #include <cinttypes>
@@ -248,16 +254,38 @@ void UpdateLinkUse(const GraphTile* tile,
   directededge.set_use(Use::kTurnChannel);
 }
 
+/**
+ * Get a tile, once it is written when the tiles are still being built.
+ * @param  reader   Graph reader
+ * @param  lock     Mutex for locking while tiles are retrieved
+ * @param  built    Tiles built so far, null if all of them are
+ * @param  id       Tile or an id within it
+ * @return  Returns the tile, null if there is none.
+ */
+const GraphTile* GetTile(GraphReader& reader, ProfiledMutex& lock,
+                         const BuiltTiles* built, const GraphId& id) {
+  if (built) {
+    built->Wait(id);
+  }
+  lock.lock();
+  const GraphTile* tile = reader.GetGraphTile(id);
+  lock.unlock();
+  return tile;
+}
+
 /**
  * Tests if the directed edge is unreachable by driving. If a driveable
  * edge cannot reach higher class roads and a search cannot expand after
  * a set number of iterations the edge is considered unreachable.
  * @param  reader        Graph reader
  * @param  lock          Mutex for locking while tiles are retrieved
+ * @param  built         Tiles built so far, null if all of them are
  * @param  directededge  Directed edge to test.
  * @return  Returns true if the edge is found to be unreachable.
  */
-bool IsUnreachable(GraphReader& reader, std::mutex& lock,
+bool IsUnreachable(GraphReader& reader, ProfiledMutex& lock,
+                   const BuiltTiles* built,
+                   const ConnectivityIndex& connectivity,
                    DirectedEdge& directededge) {
   // Only check driveable edges. If already on a higher class road consider
   // the edge reachable
@@ -266,6 +294,21 @@ bool IsUnreachable(GraphReader& reader, std::mutex& lock,
     return false;
   }
 
+  // The driveable component of the end node holds every node the expansion
+  // below can reach. If it is smaller than the expansion and has no road
+  // above tertiary the expansion would run out of nodes, so the edge is
+  // unreachable. Otherwise one way roads can still trap the edge and only
+  // the expansion can tell.
+  uint32_t component = connectivity.component(directededge.endnode(), ConnectivityMode::kAuto);
+  if (component != 0 &&
+      !connectivity.has_major_road(component, ConnectivityMode::kAuto) &&
+      connectivity.component_size(component, ConnectivityMode::kAuto) < kUnreachableIterations) {
+    const GraphTile* endtile = GetTile(reader, lock, built, directededge.endnode());
+    if (connectivity.matches(endtile)) {
+      return true;
+    }
+  }
+
   // Add the end node to the expand list
   std::unordered_set<GraphId> visitedset;  // Set of visited nodes
   std::unordered_set<GraphId> expandset;   // Set of nodes to expand
@@ -286,9 +329,7 @@ bool IsUnreachable(GraphReader& reader, std::mutex& lock,
     const GraphId expandnode = *expandset.cbegin();
     expandset.erase(expandset.begin());
     visitedset.insert(expandnode);
-    lock.lock();
-    const GraphTile* tile = reader.GetGraphTile(expandnode);
-    lock.unlock();
+    const GraphTile* tile = GetTile(reader, lock, built, expandnode);
     const NodeInfo* nodeinfo = tile->node(expandnode);
     const DirectedEdge* diredge = tile->directededge(nodeinfo->edge_index());
     for (uint32_t i = 0; i < nodeinfo->edge_count(); i++, diredge++) {
@@ -310,8 +351,8 @@ bool IsUnreachable(GraphReader& reader, std::mutex& lock,
 
 // Test if this is a "not thru" edge. These are edges that enter a region that
 // has no exit other than the edge entering the region
-bool IsNotThruEdge(GraphReader& reader, std::mutex& lock,
-                   const GraphId& startnode,
+bool IsNotThruEdge(GraphReader& reader, ProfiledMutex& lock,
+                   const BuiltTiles* built, const GraphId& startnode,
                    DirectedEdge& directededge) {
   // Add the end node to the expand list
   std::unordered_set<GraphId> visitedset;  // Set of visited nodes
@@ -330,9 +371,7 @@ bool IsNotThruEdge(GraphReader& reader, std::mutex& lock,
     const GraphId expandnode = *expandset.cbegin();
     expandset.erase(expandset.begin());
     visitedset.insert(expandnode);
-    lock.lock();
-    const GraphTile* tile = reader.GetGraphTile(expandnode);
-    lock.unlock();
+    const GraphTile* tile = GetTile(reader, lock, built, expandnode);
     const NodeInfo* nodeinfo = tile->node(expandnode);
     const DirectedEdge* diredge = tile->directededge(nodeinfo->edge_index());
     for (uint32_t i = 0; i < nodeinfo->edge_count(); i++, diredge++) {
@@ -361,7 +400,8 @@ bool IsNotThruEdge(GraphReader& reader, std::mutex& lock,
 }
 
 // Test if the edge is internal to an intersection.
-bool IsIntersectionInternal(GraphReader& reader, std::mutex& lock,
+bool IsIntersectionInternal(GraphReader& reader, ProfiledMutex& lock,
+                            const BuiltTiles* built,
                             const GraphId& startnode,
                             NodeInfo& startnodeinfo,
                             DirectedEdge& directededge,
@@ -375,9 +415,7 @@ bool IsIntersectionInternal(GraphReader& reader, std::mutex& lock,
   // Must have inbound oneway at start node (exclude edges that are nearly
   // straight turn type onto the directed edge
   bool oneway_inbound = false;
-  lock.lock();
-  const GraphTile* tile = reader.GetGraphTile(startnode);
-  lock.unlock();
+  const GraphTile* tile = GetTile(reader, lock, built, startnode);
   uint32_t heading = startnodeinfo.heading(idx);
   const DirectedEdge* diredge = tile->directededge(startnodeinfo.edge_index());
   for (uint32_t i = 0; i < startnodeinfo.edge_count(); i++, diredge++) {
@@ -412,9 +450,7 @@ bool IsIntersectionInternal(GraphReader& reader, std::mutex& lock,
   // straight turn from directed edge
   bool oneway_outbound = false;
   if (tile->id() != directededge.endnode().Tile_Base()) {
-    lock.lock();
-    tile = reader.GetGraphTile(directededge.endnode());
-    lock.unlock();
+    tile = GetTile(reader, lock, built, directededge.endnode());
   }
   const NodeInfo* node = tile->node(directededge.endnode());
   diredge = tile->directededge(node->edge_index());
@@ -466,6 +502,7 @@ bool IsIntersectionInternal(GraphReader& reader, std::mutex& lock,
  * in costing methods to help avoid dense, urban areas.
  * @param  reader        Graph reader
  * @param  lock          Mutex for locking while tiles are retrieved
+ * @param  built         Tiles built so far, null if all of them are
  * @param  ll            Lat,lng position
  * @param  maxdensity    (OUT) max density found
  * @param  tiles         Tiling (for getting list of required tiles)
@@ -473,7 +510,8 @@ bool IsIntersectionInternal(GraphReader& reader, std::mutex& lock,
  * @return  Returns the relative road density (0-15) - higher values are
  *          more dense.
  */
-uint32_t GetDensity(GraphReader& reader, std::mutex& lock, const PointLL& ll,
+uint32_t GetDensity(GraphReader& reader, ProfiledMutex& lock,
+                    const BuiltTiles* built, const PointLL& ll,
                     enhancer_stats& stats, const Tiles<PointLL>& tiles,
                     uint8_t local_level) {
   // Radius is in km - turn into meters
@@ -495,9 +533,7 @@ uint32_t GetDensity(GraphReader& reader, std::mutex& lock, const PointLL& ll,
   for (auto t : tilelist) {
     // Check all the nodes within the tile. Skip if tile has no nodes (can be
     // an empty tile added for connectivity map logic).
-    lock.lock();
-    const GraphTile* newtile = reader.GetGraphTile(GraphId(t, local_level, 0));
-    lock.unlock();
+    const GraphTile* newtile = GetTile(reader, lock, built, GraphId(t, local_level, 0));
     if (!newtile || newtile->header()->nodecount() == 0)
       continue;
     const auto start_node = newtile->node(0);
@@ -547,8 +583,35 @@ uint32_t GetMultiPolyId(const std::unordered_map<uint32_t,multi_polygon_type>& p
   return index;
 }
 
+// Does the database have a table of polygons clipped to the tiles
+bool HasTileFragments(sqlite3 *db_handle, const std::string& table) {
+  if (!db_handle)
+    return false;
+  sqlite3_stmt *stmt = 0;
+  std::string sql = "SELECT name FROM sqlite_master WHERE type = 'table' AND name = '" + table + "'";
+  bool found = sqlite3_prepare_v2(db_handle, sql.c_str(), sql.length(), &stmt, 0) == SQLITE_OK &&
+               sqlite3_step(stmt) == SQLITE_ROW;
+  if (stmt)
+    sqlite3_finalize(stmt);
+  return found;
+}
+
+// Spatial index filter on the polygons intersecting a tile
+std::string TileFilter(const std::string& table, const std::string& prefix,
+                       const AABB2<PointLL>& aabb) {
+  std::string mbr = "BuildMBR(" + std::to_string(aabb.minx()) + ",";
+  mbr += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
+  mbr += std::to_string(aabb.maxy()) + ")";
+  std::string sql = "ST_Intersects(" + prefix + "geom, " + mbr + ") ";
+  sql += "and " + prefix + "rowid IN (SELECT rowid FROM SpatialIndex WHERE f_table_name = ";
+  sql += "'" + table + "' AND search_frame = " + mbr + ")";
+  return sql;
+}
+
 std::unordered_map<uint32_t,multi_polygon_type> GetTimeZones(sqlite3 *db_handle,
-                                                             const AABB2<PointLL>& aabb) {
+                                                             const AABB2<PointLL>& aabb,
+                                                             const int32_t tileid,
+                                                             const bool tile_fragments) {
   std::unordered_map<uint32_t,multi_polygon_type> polys;
   if (!db_handle)
     return polys;
@@ -558,17 +621,19 @@ std::unordered_map<uint32_t,multi_polygon_type> GetTimeZones(sqlite3 *db_handle,
   char *err_msg = nullptr;
   uint32_t result = 0;
 
-  std::string sql = "select TZID, st_astext(geom) from tz_world where ";
-  sql += "ST_Intersects(geom, BuildMBR(" + std::to_string(aabb.minx()) + ",";
-  sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-  sql += std::to_string(aabb.maxy()) + ")) ";
-  sql += "and rowid IN (SELECT rowid FROM SpatialIndex WHERE f_table_name = ";
-  sql += "'tz_world' AND search_frame = BuildMBR(" + std::to_string(aabb.minx()) + ",";
-  sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-  sql += std::to_string(aabb.maxy()) + "));";
+  // Use the polygons clipped to this tile if they were built
+  std::string sql;
+  if (tile_fragments) {
+    sql = "select tz_world.TZID, st_astext(t.geom), t.covers from tz_tiles t, tz_world where ";
+    sql += "t.tileid = " + std::to_string(tileid) + " and tz_world.rowid = t.id;";
+  } else {
+    sql = "select TZID, st_astext(geom), 0 from tz_world where ";
+    sql += TileFilter("tz_world", "", aabb) + ";";
+  }
 
   ret = sqlite3_prepare_v2(db_handle, sql.c_str(), sql.length(), &stmt, 0);
 
+  uint32_t covering = 0;
   if (ret == SQLITE_OK) {
     result = sqlite3_step(stmt);
 
@@ -584,11 +649,16 @@ std::unordered_map<uint32_t,multi_polygon_type> GetTimeZones(sqlite3 *db_handle,
       uint32_t idx = DateTime::get_tz_db().to_index(tz_id);
       if (idx == 0) {
         polys.clear();
+        covering = 0;
         break;
       }
 
+      // A time zone covering the whole tile has no geometry
       multi_polygon_type multi_poly;
-      boost::geometry::read_wkt(geom, multi_poly);
+      if (sqlite3_column_int(stmt, 2))
+        covering = idx;
+      else
+        boost::geometry::read_wkt(geom, multi_poly);
       polys.emplace(idx, multi_poly);
 
       result = sqlite3_step(stmt);
@@ -598,11 +668,19 @@ std::unordered_map<uint32_t,multi_polygon_type> GetTimeZones(sqlite3 *db_handle,
     sqlite3_finalize(stmt);
     stmt = 0;
   }
+
+  // Every node in the tile is in the covering time zone
+  if (covering) {
+    multi_polygon_type multi_poly = polys[covering];
+    polys.clear();
+    polys.emplace(covering, multi_poly);
+  }
   return polys;
 }
 
 std::unordered_map<uint32_t,multi_polygon_type> GetAdminInfo(sqlite3 *db_handle, std::unordered_map<uint32_t,bool>& drive_on_right,
-                                                             const AABB2<PointLL>& aabb, GraphTileBuilder& tilebuilder) {
+                                                             const AABB2<PointLL>& aabb, const int32_t tileid,
+                                                             const bool tile_fragments, GraphTileBuilder& tilebuilder) {
   std::unordered_map<uint32_t,multi_polygon_type> polys;
   if (!db_handle)
     return polys;
@@ -616,32 +694,37 @@ std::unordered_map<uint32_t,multi_polygon_type> GetAdminInfo(sqlite3 *db_handle,
   std::string geom;
   std::string country_name, state_name, country_iso, state_iso;
 
+  // Use the polygons clipped to this tile if they were built
+  std::string tile = "t.tileid = " + std::to_string(tileid) + " and ";
+
   std::string sql = "SELECT state.rowid, country.name, state.name, country.iso_code, ";
-  sql += "state.iso_code, state.drive_on_right, st_astext(state.geom) ";
-  sql += "from admins state, admins country where ";
-  sql += "ST_Intersects(state.geom, BuildMBR(" + std::to_string(aabb.minx()) + ",";
-  sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-  sql += std::to_string(aabb.maxy()) + ")) and ";
-  sql += "country.rowid = state.parent_admin and state.admin_level=4 ";
-  sql += "and state.rowid IN (SELECT rowid FROM SpatialIndex WHERE f_table_name = ";
-  sql += "'admins' AND search_frame = BuildMBR(" + std::to_string(aabb.minx()) + ",";
-  sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-  sql += std::to_string(aabb.maxy()) + "));";
+  if (tile_fragments) {
+    sql += "state.iso_code, state.drive_on_right, st_astext(t.geom), t.covers ";
+    sql += "from admin_tiles t, admins state, admins country where " + tile;
+    sql += "state.rowid = t.id and ";
+  } else {
+    sql += "state.iso_code, state.drive_on_right, st_astext(state.geom), 0 ";
+    sql += "from admins state, admins country where ";
+    sql += TileFilter("admins", "state.", aabb) + " and ";
+  }
+  sql += "country.rowid = state.parent_admin and state.admin_level=4;";
 
   ret = sqlite3_prepare_v2(db_handle, sql.c_str(), sql.length(), &stmt, 0);
 
+  uint32_t covering = 0;
   if (ret == SQLITE_OK) {
     result = sqlite3_step(stmt);
     if (result == SQLITE_DONE) { //state/prov not found, try to find country
 
-      sql = "SELECT rowid, name, "", iso_code, "", drive_on_right, st_astext(geom) from ";
-      sql += " admins where ST_Intersects(geom, BuildMBR(" + std::to_string(aabb.minx()) + ",";
-      sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-      sql += std::to_string(aabb.maxy()) + ")) and admin_level=2 ";
-      sql += "and rowid IN (SELECT rowid FROM SpatialIndex WHERE f_table_name = ";
-      sql += "'admins' AND search_frame = BuildMBR(" + std::to_string(aabb.minx()) + ",";
-      sql += std::to_string(aabb.miny()) + ", " + std::to_string(aabb.maxx()) + ",";
-      sql += std::to_string(aabb.maxy()) + "));";
+      sql = "SELECT a.rowid, a.name, '', a.iso_code, '', a.drive_on_right, ";
+      if (tile_fragments) {
+        sql += "st_astext(t.geom), t.covers from admin_tiles t, admins a where " + tile;
+        sql += "a.rowid = t.id and ";
+      } else {
+        sql += "st_astext(a.geom), 0 from admins a where ";
+        sql += TileFilter("admins", "a.", aabb) + " and ";
+      }
+      sql += "a.admin_level=2;";
 
       sqlite3_finalize(stmt);
       stmt = 0;
@@ -683,8 +766,12 @@ std::unordered_map<uint32_t,multi_polygon_type> GetAdminInfo(sqlite3 *db_handle,
 
       uint32_t index = tilebuilder.AddAdmin(country_name,state_name,
                                             country_iso,state_iso);
+      // An admin covering the whole tile has no geometry
       multi_polygon_type multi_poly;
-      boost::geometry::read_wkt(geom, multi_poly);
+      if (sqlite3_column_int(stmt, 7))
+        covering = index;
+      else
+        boost::geometry::read_wkt(geom, multi_poly);
       polys.emplace(index, multi_poly);
       drive_on_right.emplace(index, dor);
 
@@ -696,6 +783,12 @@ std::unordered_map<uint32_t,multi_polygon_type> GetAdminInfo(sqlite3 *db_handle,
     stmt = 0;
   }
 
+  // Every node in the tile is in the covering admin
+  if (covering) {
+    multi_polygon_type multi_poly = polys[covering];
+    polys.clear();
+    polys.emplace(covering, multi_poly);
+  }
   return polys;
 }
 
@@ -1048,12 +1141,16 @@ bool ConsistentNames(const std::string& country_code,
   return (!(street_names1->FindCommonBaseNames(*street_names2)->empty()));
 }
 
+// Gets the next tile to enhance, false once there are none left
+using next_tile_t = std::function<bool (GraphId&)>;
+
 // We make sure to lock on reading and writing because we dont want to race
 // since difference threads, use for the tilequeue as well
 void enhance(const boost::property_tree::ptree& pt,
              const boost::property_tree::ptree& hierarchy_properties,
-             std::queue<GraphId>& tilequeue, std::mutex& lock,
-             std::promise<enhancer_stats>& result) {
+             const ConnectivityIndex& connectivity,
+             const next_tile_t& next, const BuiltTiles* built,
+             ProfiledMutex& lock, std::promise<enhancer_stats>& result) {
 
   auto database = pt.get_optional<std::string>("admin");
   // Initialize the admin DB (if it exists)
@@ -1117,6 +1214,10 @@ void enhance(const boost::property_tree::ptree& pt,
   else
     LOG_WARN("Time zone db " + *database + " not found.  Not saving time zone information.");
 
+  // Use the polygons clipped to the tiles by pbfadminbuilder if present
+  bool admin_tiles = HasTileFragments(admin_db_handle, "admin_tiles");
+  bool tz_tiles = HasTileFragments(tz_db_handle, "tz_tiles");
+
   // Local Graphreader
   GraphReader reader(hierarchy_properties);
 
@@ -1125,18 +1226,13 @@ void enhance(const boost::property_tree::ptree& pt,
   const auto& tile_hierarchy = reader.GetTileHierarchy();
   const auto& local_level = tile_hierarchy.levels().rbegin()->second.level;
   const auto& tiles = tile_hierarchy.levels().rbegin()->second.tiles;
+  Counter& tiles_enhanced = Metrics::Get().counter("enhance.tiles_enhanced");
 
-  // Iterate through the tiles in the queue and perform enhancements
-  while (true) {
-    // Get the next tile Id from the queue and get writeable and readable
-    // tile. Lock while we access the tile queue and get the tile.
+  // Iterate through the tiles and perform enhancements
+  GraphId tile_id;
+  while (next(tile_id)) {
+    // Get writeable and readable tile. Lock while we get the tile.
     lock.lock();
-    if (tilequeue.empty()) {
-      lock.unlock();
-      break;
-    }
-    GraphId tile_id = tilequeue.front();
-    tilequeue.pop();
 
     // Get a readable tile.If the tile is empty, skip it. Empty tiles are
     // added where ways go through a tile but no end not is within the tile.
@@ -1169,7 +1265,7 @@ void enhance(const boost::property_tree::ptree& pt,
     std::unordered_map<uint32_t,bool> drive_on_right;
     if (admin_db_handle) {
       admin_polys = GetAdminInfo(admin_db_handle, drive_on_right, tiles.TileBounds(id),
-                           tilebuilder);
+                           id, admin_tiles, tilebuilder);
       if (admin_polys.size() == 1) {
         // TODO - check if tile bounding box is entirely inside the polygon...
         tile_within_one_admin = true;
@@ -1179,7 +1275,7 @@ void enhance(const boost::property_tree::ptree& pt,
     bool tile_within_one_tz = false;
     std::unordered_map<uint32_t,multi_polygon_type> tz_polys;
     if (tz_db_handle) {
-      tz_polys = GetTimeZones(tz_db_handle, tiles.TileBounds(id));
+      tz_polys = GetTimeZones(tz_db_handle, tiles.TileBounds(id), id, tz_tiles);
       if (tz_polys.size() == 1) {
         tile_within_one_tz = true;
       }
@@ -1206,9 +1302,7 @@ void enhance(const boost::property_tree::ptree& pt,
         if (tile->id() == directededge.endnode().Tile_Base()) {
           endnodetile = tile;
         } else {
-          lock.lock();
-          endnodetile = reader.GetGraphTile(directededge.endnode());
-          lock.unlock();
+          endnodetile = GetTile(reader, lock, built, directededge.endnode());
         }
 
         // If this edge is a link, update its use (potentially change short
@@ -1234,7 +1328,7 @@ void enhance(const boost::property_tree::ptree& pt,
       NodeInfo& nodeinfo = tilebuilder.node_builder(i);
 
       // Get relative road density and local density
-      uint32_t density = GetDensity(reader, lock, nodeinfo.latlng(),
+      uint32_t density = GetDensity(reader, lock, built, nodeinfo.latlng(),
                                     stats, tiles, local_level);
       nodeinfo.set_density(density);
 
@@ -1328,7 +1422,7 @@ void enhance(const boost::property_tree::ptree& pt,
           }
 
           // Set unreachable (driving) flag
-          if (IsUnreachable(reader, lock, directededge)) {
+          if (IsUnreachable(reader, lock, built, connectivity, directededge)) {
             directededge.set_unreachable(true);
             stats.unreachable++;
           }
@@ -1336,7 +1430,7 @@ void enhance(const boost::property_tree::ptree& pt,
           // Check for not_thru edge (only on low importance edges). Exclude
           // transit edges
           if (directededge.classification() > RoadClass::kTertiary) {
-            if (IsNotThruEdge(reader, lock, startnode, directededge)) {
+            if (IsNotThruEdge(reader, lock, built, startnode, directededge)) {
               directededge.set_not_thru(true);
               stats.not_thru++;
             }
@@ -1344,7 +1438,7 @@ void enhance(const boost::property_tree::ptree& pt,
 
           // Test if an internal intersection edge. Must do this after setting
           // opposing edge index
-          if (IsIntersectionInternal(reader, lock, startnode, nodeinfo,
+          if (IsIntersectionInternal(reader, lock, built, startnode, nodeinfo,
                                       directededge, j)) {
             directededge.set_internal(true);
             stats.internalcount++;
@@ -1395,6 +1489,7 @@ void enhance(const boost::property_tree::ptree& pt,
     // Write the new file
     lock.lock();
     tilebuilder.StoreTileData();
+    tiles_enhanced.Add();
     LOG_TRACE((boost::format("GraphEnhancer completed tile %1%") % tile_id).str());
 
     // Check if we need to clear the tile cache
@@ -1414,13 +1509,10 @@ void enhance(const boost::property_tree::ptree& pt,
   result.set_value(stats);
 }
 
-}
-
-namespace valhalla {
-namespace mjolnir {
-
-// Enhance the local level of the graph
-void GraphEnhancer::Enhance(const boost::property_tree::ptree& pt) {
+// Enhance the tiles next gives out, on as many threads as configured
+void Run(const boost::property_tree::ptree& pt,
+         const ConnectivityIndex& connectivity, const next_tile_t& next,
+         const BuiltTiles* built, ProfiledMutex& lock) {
   // A place to hold worker threads and their results, exceptions or otherwise
   std::vector<std::shared_ptr<std::thread> > threads(
     std::max(static_cast<unsigned int>(1),
@@ -1429,34 +1521,15 @@ void GraphEnhancer::Enhance(const boost::property_tree::ptree& pt) {
   // A place to hold the results of those threads, exceptions or otherwise
   std::list<std::promise<enhancer_stats> > results;
 
-  // Create a randomized queue of tiles to work from
-  std::deque<GraphId> tempqueue;
-  boost::property_tree::ptree hierarchy_properties = pt.get_child("mjolnir");
-  GraphReader reader(hierarchy_properties);
-  auto tile_hierarchy = reader.GetTileHierarchy();
-  auto local_level = tile_hierarchy.levels().rbegin()->second.level;
-  auto tiles = tile_hierarchy.levels().rbegin()->second.tiles;
-  for (uint32_t id = 0; id < tiles.TileCount(); id++) {
-    // If tile exists add it to the queue
-    GraphId tile_id(id, local_level, 0);
-    if (GraphReader::DoesTileExist(tile_hierarchy, tile_id)) {
-      tempqueue.push_back(tile_id);
-    }
-  }
-  std::random_shuffle(tempqueue.begin(), tempqueue.end());
-  std::queue<GraphId> tilequeue(tempqueue);
-
-  // An atomic object we can use to do the synchronization
-  std::mutex lock;
-
   // Start the threads
+  boost::property_tree::ptree hierarchy_properties = pt.get_child("mjolnir");
   LOG_INFO("Enhancing local graph...");
   for (auto& thread : threads) {
     results.emplace_back();
     thread.reset(new std::thread(enhance,
                  std::cref(pt.get_child("mjolnir")),
-                 std::ref(hierarchy_properties), std::ref(tilequeue),
-                 std::ref(lock), std::ref(results.back())));
+                 std::ref(hierarchy_properties), std::cref(connectivity), std::cref(next),
+                 built, std::ref(lock), std::ref(results.back())));
   }
 
   // Wait for them to finish up their work
@@ -1464,6 +1537,8 @@ void GraphEnhancer::Enhance(const boost::property_tree::ptree& pt) {
     thread->join();
   }
 
+  lock.Report("enhance");
+
   // Check all of the outcomes, to see about maximum density (km/km2)
   enhancer_stats stats{std::numeric_limits<float>::min(), 0};
   for (auto& result : results) {
@@ -1488,5 +1563,72 @@ void GraphEnhancer::Enhance(const boost::property_tree::ptree& pt) {
   }
 }
 
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+// Enhance the local level of the graph
+void GraphEnhancer::Enhance(const boost::property_tree::ptree& pt,
+                            const std::set<GraphId>* only) {
+  // Create a randomized queue of tiles to work from
+  std::deque<GraphId> tempqueue;
+  boost::property_tree::ptree hierarchy_properties = pt.get_child("mjolnir");
+  GraphReader reader(hierarchy_properties);
+  auto tile_hierarchy = reader.GetTileHierarchy();
+  auto local_level = tile_hierarchy.levels().rbegin()->second.level;
+  auto tiles = tile_hierarchy.levels().rbegin()->second.tiles;
+  for (uint32_t id = 0; id < tiles.TileCount(); id++) {
+    // If tile exists add it to the queue
+    GraphId tile_id(id, local_level, 0);
+    if ((!only || only->find(tile_id) != only->end()) &&
+        GraphReader::DoesTileExist(tile_hierarchy, tile_id)) {
+      tempqueue.push_back(tile_id);
+    }
+  }
+  std::random_shuffle(tempqueue.begin(), tempqueue.end());
+  std::queue<GraphId> tilequeue(tempqueue);
+
+  // Connectivity computed once after the graph was built
+  ConnectivityIndex connectivity;
+  if (!connectivity.Load(ConnectivityIndex::FileName(hierarchy_properties), tile_hierarchy)) {
+    LOG_WARN("No connectivity index. Unreachable edges will be found by expanding the graph.");
+  }
+
+  // An atomic object we can use to do the synchronization
+  ProfiledMutex lock("enhance", pt.get<bool>("mjolnir.profile_locks", false));
+
+  // Lock while we access the tile queue
+  Gauge& tiles_remaining = Metrics::Get().gauge("enhance.tiles_remaining");
+  next_tile_t next = [&tilequeue, &lock, &tiles_remaining](GraphId& tile_id) {
+    lock.lock();
+    bool found = !tilequeue.empty();
+    if (found) {
+      tile_id = tilequeue.front();
+      tilequeue.pop();
+      tiles_remaining.Set(tilequeue.size());
+    }
+    lock.unlock();
+    return found;
+  };
+  Run(pt, connectivity, next, nullptr, lock);
+}
+
+// Enhance the local tiles as they are built
+void GraphEnhancer::Enhance(const boost::property_tree::ptree& pt,
+                            BuiltTiles& built) {
+  // The connectivity index needs every tile, the searches expand the graph
+  // instead
+  ConnectivityIndex connectivity;
+  ProfiledMutex lock("enhance", pt.get<bool>("mjolnir.profile_locks", false));
+  next_tile_t next = [&built](GraphId& tile_id) {
+    return built.ready().Pop(tile_id);
+  };
+  Run(pt, connectivity, next, &built, lock);
+}
+
+}
+}
+
 }
 }
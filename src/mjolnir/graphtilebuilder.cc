@@ -203,8 +203,10 @@ void GraphTileBuilder::StoreTileData() {
     file.write(reinterpret_cast<const char*>(&directededges_builder_[0]),
                directededges_builder_.size() * sizeof(DirectedEdge));
 
-    // Sort and write the transit departures
-    std::sort(departure_builder_.begin(), departure_builder_.end());
+    // Sort and write the transit departures. The transit builder adds them
+    // in order so skip the sort when we can
+    if (!std::is_sorted(departure_builder_.begin(), departure_builder_.end()))
+      std::sort(departure_builder_.begin(), departure_builder_.end());
     file.write(reinterpret_cast<const char*>(&departure_builder_[0]),
                departure_builder_.size() * sizeof(TransitDeparture));
 
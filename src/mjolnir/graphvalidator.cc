@@ -2,6 +2,9 @@
 #include "mjolnir/graphvalidator.h"
 #include "mjolnir/graphtilebuilder.h"
 #include "mjolnir/statistics.h"
+#include "mjolnir/connectivityindex.h"
+#include "mjolnir/metrics.h"
+#include "mjolnir/profiledmutex.h"
 
 #include <valhalla/midgard/logging.h>
 
@@ -349,7 +352,7 @@ void AddStatistics(validator_stats& stats, DirectedEdge& directededge,
 }
 
 void validate(const boost::property_tree::ptree& pt,
-              std::deque<GraphId>& tilequeue, std::mutex& lock,
+              std::deque<GraphId>& tilequeue, ProfiledMutex& lock,
               std::promise<std::pair<validator_stats, tweeners_t>>& result) {
 
     // Our local class for gathering the stats
@@ -360,6 +363,9 @@ void validate(const boost::property_tree::ptree& pt,
     GraphReader graph_reader(pt.get_child("mjolnir"));
     // Get some things we need throughout
     const auto& hierarchy = graph_reader.GetTileHierarchy();
+    Counter& tiles_validated = Metrics::Get().counter("validate.tiles_validated");
+    Gauge& tiles_remaining = Metrics::Get().gauge("validate.tiles_remaining");
+    Gauge& queue_depth = Metrics::Get().gauge("validate.queue_depth");
 
     // Check for more tiles
     while (true) {
@@ -371,6 +377,7 @@ void validate(const boost::property_tree::ptree& pt,
       // Get the next tile Id
       GraphId tile_id = tilequeue.front();
       tilequeue.pop_front();
+      queue_depth.Set(tilequeue.size());
       lock.unlock();
 
       // Point tiles to the set we need for current level
@@ -553,6 +560,8 @@ void validate(const boost::property_tree::ptree& pt,
 
       // Add possible duplicates to return class
       stats.add_dup(dupcount, level);
+      tiles_validated.Add();
+      tiles_remaining.Add(-1);
     }
 
     // Fill promise with statistics
@@ -577,7 +586,7 @@ void validate(const boost::property_tree::ptree& pt,
   }
 
   //crack open tiles and bin edges that pass through them but dont end or begin in them
-  void bin_tweeners(const TileHierarchy& hierarchy, tweeners_t::iterator& start, const tweeners_t::iterator& end, std::mutex& lock) {
+  void bin_tweeners(const TileHierarchy& hierarchy, tweeners_t::iterator& start, const tweeners_t::iterator& end, ProfiledMutex& lock) {
     //go while we have tiles to update
     while(true) {
       lock.lock();
@@ -627,9 +636,11 @@ namespace mjolnir {
       }
     }
     std::random_shuffle(tilequeue.begin(), tilequeue.end());
+    Metrics::Get().gauge("validate.tiles_remaining").Set(tilequeue.size());
+    Metrics::Get().gauge("validate.queue_depth").Set(tilequeue.size());
 
     // An mutex we can use to do the synchronization
-    std::mutex lock;
+    ProfiledMutex lock("validate", pt.get<bool>("mjolnir.profile_locks", false));
 
     LOG_INFO("Validating signs and connectivity and binning edges");
 
@@ -650,6 +661,7 @@ namespace mjolnir {
     // Wait for threads to finish
     for (auto& thread : threads)
       thread->join();
+    lock.Report("validate");
     // Get the promise from the future
     validator_stats stats;
     tweeners_t tweeners;
@@ -670,6 +682,7 @@ namespace mjolnir {
       thread.reset(new std::thread(bin_tweeners, std::cref(hierarchy), std::ref(start), std::cref(end), std::ref(lock)));
     for (auto& thread : threads)
       thread->join();
+    lock.Report("bin tweeners");
     LOG_INFO("Finished");
 
     // Add up total dupcount_ and find densities
@@ -692,6 +705,23 @@ namespace mjolnir {
       LOG_DEBUG("Average density = " + std::to_string(average_density) +
                " max = " + std::to_string(max_density));
     }
+
+    // Report islands in the driveable graph using the connectivity computed
+    // after the graph was built rather than searching for them again
+    ConnectivityIndex connectivity;
+    if (connectivity.Load(ConnectivityIndex::FileName(pt.get_child("mjolnir")), hierarchy)) {
+      uint32_t largest = 0, islands = 0, total = 0;
+      for (uint32_t c = 1; c <= connectivity.component_count(ConnectivityMode::kAuto); c++) {
+        uint32_t size = connectivity.component_size(c, ConnectivityMode::kAuto);
+        largest = std::max(largest, size);
+        total += size;
+        if (size > 1 && !connectivity.has_major_road(c, ConnectivityMode::kAuto)) {
+          islands++;
+        }
+      }
+      LOG_INFO((boost::format("Driveable components: %1%, largest has %2% of %3% nodes, %4% islands without a major road")
+        % connectivity.component_count(ConnectivityMode::kAuto) % largest % total % islands).str());
+    }
     stats.build_db(pt);
   }
 }
@@ -0,0 +1,918 @@
+#include "mjolnir/gtfsbuilder.h"
+#include "mjolnir/csvreader.h"
+
+#include <fstream>
+#include <unordered_map>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
+#include <boost/filesystem/operations.hpp>
+#include <boost/algorithm/string.hpp>
+#include <boost/date_time/gregorian/gregorian.hpp>
+
+#include <valhalla/midgard/logging.h>
+#include <valhalla/midgard/constants.h>
+#include <valhalla/midgard/pointll.h>
+#include <valhalla/midgard/util.h>
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/baldr/datetime.h>
+
+#include "proto/transit.pb.h"
+
+using namespace valhalla::midgard;
+using namespace valhalla::baldr;
+using namespace valhalla::mjolnir;
+
+namespace {
+
+// Stop pairs per file before continuing in a .pbf.n file (same as the
+// transit fetcher)
+constexpr int kMaxStopPairs = 500000;
+
+struct Stop {
+  std::string onestop_id;
+  std::string name;
+  PointLL ll;
+  bool wheelchair_boarding;
+  uint32_t timezone;
+  GraphId graphid;
+};
+
+struct Agency {
+  std::string name;
+  std::string url;
+};
+
+struct Service {
+  bool days_of_week[7];
+  uint32_t start_date;
+  uint32_t end_date;
+  std::vector<uint32_t> added_dates;
+  std::vector<uint32_t> except_dates;
+};
+
+struct Trip {
+  std::string id;
+  std::string route_id;
+  std::string service_id;
+  std::string headsign;
+  std::string block_id;
+  std::string shape_id;
+  bool wheelchair_accessible;
+  bool bikes_allowed;
+};
+
+struct StopTime {
+  uint32_t sequence;
+  uint32_t stop;        // Index into the stops of the feed
+  int32_t arrival;      // Seconds from midnight, -1 if not a timepoint
+  int32_t departure;
+  std::string headsign;
+};
+
+struct Shape {
+  std::vector<PointLL> pts;
+  std::vector<float> distances;
+};
+
+// A feed and its stops. The stops are loaded first so they can be given
+// graph ids across all of the feeds before the schedules are read.
+struct Feed {
+  std::string dir;
+  std::string name;
+  std::string timezone;
+  std::vector<Stop> stops;
+  std::unordered_map<std::string, uint32_t> stop_index;
+};
+
+// Ids which have to be unique across all of the feeds
+struct unique_transit_t {
+  std::unordered_map<std::string, size_t> trips;
+  std::unordered_map<std::string, size_t> block_ids;
+  std::unordered_map<std::string, size_t> lines;
+};
+
+// Trips, blocks and lines of a feed. While the feeds are built in parallel
+// stop pairs refer to them by their index here (blocks by index + 1). Once
+// all feeds are built they are given ids across the feeds, in feed order.
+struct feed_ids_t {
+  std::vector<std::string> trips;
+  std::vector<std::string> blocks;
+  std::vector<std::string> lines;
+  std::vector<uint32_t> trip_ids;
+  std::vector<uint32_t> block_ids;
+  std::vector<uint32_t> line_ids;
+};
+
+// Routes, shapes and stop pairs of a feed keyed by the tile of the origin stop
+using feed_tiles_t = std::unordered_map<GraphId, Transit>;
+
+std::string feed_file(const Feed& feed, const std::string& name) {
+  return feed.dir + '/' + name;
+}
+
+// Seconds from midnight of a GTFS time. Hours go past 24 for trips that run
+// over midnight. Returns -1 for an empty or malformed time.
+int32_t ParseTime(const std::string& time) {
+  int32_t parts[3] = { 0, 0, 0 };
+  size_t part = 0;
+  bool digits = false;
+  for (const char c : time) {
+    if (c >= '0' && c <= '9') {
+      parts[part] = parts[part] * 10 + (c - '0');
+      digits = true;
+    } else if (c == ':') {
+      if (++part > 2) {
+        return -1;
+      }
+    } else if (c != ' ') {
+      return -1;
+    }
+  }
+  if (!digits || part != 2) {
+    return -1;
+  }
+  return parts[0] * 3600 + parts[1] * 60 + parts[2];
+}
+
+// Julian day of a GTFS date (YYYYMMDD). Returns 0 if malformed.
+uint32_t ParseDate(const std::string& date) {
+  try {
+    return boost::gregorian::from_undelimited_string(
+             boost::algorithm::trim_copy(date)).julian_day();
+  } catch (...) {
+    return 0;
+  }
+}
+
+// Map basic and extended GTFS route types to vehicle types
+bool GetVehicleType(const int route_type, Transit_VehicleType& type) {
+  switch (route_type) {
+    case 0:
+      type = Transit_VehicleType::Transit_VehicleType_kTram;
+      return true;
+    case 1:
+      type = Transit_VehicleType::Transit_VehicleType_kMetro;
+      return true;
+    case 2:
+    case 12:  // Monorail
+      type = Transit_VehicleType::Transit_VehicleType_kRail;
+      return true;
+    case 3:
+    case 11:  // Trolleybus
+      type = Transit_VehicleType::Transit_VehicleType_kBus;
+      return true;
+    case 4:
+      type = Transit_VehicleType::Transit_VehicleType_kFerry;
+      return true;
+    case 5:
+      type = Transit_VehicleType::Transit_VehicleType_kCableCar;
+      return true;
+    case 6:
+      type = Transit_VehicleType::Transit_VehicleType_kGondola;
+      return true;
+    case 7:
+      type = Transit_VehicleType::Transit_VehicleType_kFunicular;
+      return true;
+  }
+
+  // Extended route types are grouped by hundreds
+  switch (route_type / 100) {
+    case 1:   // Railway
+      type = Transit_VehicleType::Transit_VehicleType_kRail;
+      return true;
+    case 2:   // Coach
+    case 7:   // Bus
+    case 8:   // Trolleybus
+      type = Transit_VehicleType::Transit_VehicleType_kBus;
+      return true;
+    case 4:   // Urban railway
+      type = Transit_VehicleType::Transit_VehicleType_kMetro;
+      return true;
+    case 9:   // Tram
+      type = Transit_VehicleType::Transit_VehicleType_kTram;
+      return true;
+    case 10:  // Water transport
+    case 12:  // Ferry
+      type = Transit_VehicleType::Transit_VehicleType_kFerry;
+      return true;
+    case 13:  // Aerial lift
+      type = Transit_VehicleType::Transit_VehicleType_kGondola;
+      return true;
+    case 14:  // Funicular
+      type = Transit_VehicleType::Transit_VehicleType_kFunicular;
+      return true;
+  }
+  return false;
+}
+
+// Read the agency timezone and the stops of a feed. Stations and entrances
+// are not served by trips so only stops and platforms are kept.
+void LoadStops(Feed& feed) {
+  {
+    // Every agency in a feed must have the same timezone
+    CsvReader agencies(feed_file(feed, "agency.txt"));
+    if (agencies.Next()) {
+      feed.timezone = agencies.field("agency_timezone");
+    }
+  }
+
+  CsvReader reader(feed_file(feed, "stops.txt"));
+  int id = reader.column("stop_id");
+  int name = reader.column("stop_name");
+  int lat = reader.column("stop_lat");
+  int lon = reader.column("stop_lon");
+  int location_type = reader.column("location_type");
+  int wheelchair_boarding = reader.column("wheelchair_boarding");
+  int timezone = reader.column("stop_timezone");
+  while (reader.Next()) {
+    const auto& type = reader.field(location_type);
+    if (!type.empty() && type != "0") {
+      continue;
+    }
+    const auto& stop_id = reader.field(id);
+    if (stop_id.empty() || reader.field(lat).empty() || reader.field(lon).empty()) {
+      LOG_WARN("Skipping stop without an id or location in " + feed.name);
+      continue;
+    }
+
+    Stop stop;
+    stop.onestop_id = feed.name + ':' + stop_id;
+    stop.name = reader.field(name);
+    stop.ll = PointLL(std::atof(reader.field(lon).c_str()),
+                      std::atof(reader.field(lat).c_str()));
+    stop.wheelchair_boarding = reader.field(wheelchair_boarding) == "1";
+    const auto& tz = reader.field(timezone).empty() ? feed.timezone : reader.field(timezone);
+    stop.timezone = DateTime::get_tz_db().to_index(tz);
+    if (stop.timezone == 0) {
+      LOG_WARN("Timezone not found for stop " + stop.name);
+    }
+    feed.stop_index.emplace(stop_id, feed.stops.size());
+    feed.stops.emplace_back(std::move(stop));
+  }
+}
+
+std::unordered_map<std::string, Transit_Route> LoadRoutes(const Feed& feed) {
+  std::unordered_map<std::string, Agency> agencies;
+  std::string default_agency;
+  {
+    CsvReader reader(feed_file(feed, "agency.txt"));
+    int id = reader.column("agency_id");
+    int name = reader.column("agency_name");
+    int url = reader.column("agency_url");
+    while (reader.Next()) {
+      // agency_id is optional when there is only one agency
+      if (agencies.empty()) {
+        default_agency = reader.field(id);
+      }
+      agencies.emplace(reader.field(id), Agency{reader.field(name), reader.field(url)});
+    }
+  }
+
+  std::unordered_map<std::string, Transit_Route> routes;
+  CsvReader reader(feed_file(feed, "routes.txt"));
+  int id = reader.column("route_id");
+  int agency_id = reader.column("agency_id");
+  int short_name = reader.column("route_short_name");
+  int long_name = reader.column("route_long_name");
+  int desc = reader.column("route_desc");
+  int route_type = reader.column("route_type");
+  int color = reader.column("route_color");
+  int text_color = reader.column("route_text_color");
+  while (reader.Next()) {
+    const auto& route_id = reader.field(id);
+    Transit_VehicleType type;
+    if (!GetVehicleType(std::atoi(reader.field(route_type).c_str()), type)) {
+      LOG_ERROR("Skipping unsupported route_type: " + reader.field(route_type) +
+                " for route " + feed.name + ':' + route_id);
+      continue;
+    }
+
+    Transit_Route route;
+    route.set_onestop_id(feed.name + ':' + route_id);
+    route.set_vehicle_type(type);
+    auto agency = agencies.find(reader.field(agency_id).empty() ?
+                                default_agency : reader.field(agency_id));
+    if (agency != agencies.cend()) {
+      route.set_operated_by_onestop_id(feed.name + ':' + agency->first);
+      route.set_operated_by_name(agency->second.name);
+      route.set_operated_by_website(agency->second.url);
+    }
+    // The short name is what is shown on the vehicle, fall back to the long name
+    route.set_name(reader.field(short_name).empty() ?
+                   reader.field(long_name) : reader.field(short_name));
+    if (!reader.field(long_name).empty()) {
+      route.set_route_long_name(reader.field(long_name));
+    }
+    if (!reader.field(desc).empty()) {
+      route.set_route_desc(reader.field(desc));
+    }
+    std::string route_color = boost::algorithm::trim_copy(reader.field(color));
+    std::string route_text_color = boost::algorithm::trim_copy(reader.field(text_color));
+    route.set_route_color(strtol(route_color.empty() ? "FFFFFF" : route_color.c_str(), nullptr, 16));
+    route.set_route_text_color(strtol(route_text_color.empty() ? "000000" : route_text_color.c_str(), nullptr, 16));
+    routes.emplace(route_id, std::move(route));
+  }
+  return routes;
+}
+
+// Services from calendar.txt with the exceptions from calendar_dates.txt.
+// Either file may be missing.
+std::unordered_map<std::string, Service> LoadServices(const Feed& feed) {
+  std::unordered_map<std::string, Service> services;
+  if (boost::filesystem::exists(feed_file(feed, "calendar.txt"))) {
+    const char* days[] = { "monday", "tuesday", "wednesday", "thursday",
+                           "friday", "saturday", "sunday" };
+    CsvReader reader(feed_file(feed, "calendar.txt"));
+    int id = reader.column("service_id");
+    int start_date = reader.column("start_date");
+    int end_date = reader.column("end_date");
+    int day_columns[7];
+    for (size_t d = 0; d < 7; d++) {
+      day_columns[d] = reader.column(days[d]);
+    }
+    while (reader.Next()) {
+      Service service;
+      for (size_t d = 0; d < 7; d++) {
+        service.days_of_week[d] = reader.field(day_columns[d]) == "1";
+      }
+      service.start_date = ParseDate(reader.field(start_date));
+      service.end_date = ParseDate(reader.field(end_date));
+      if (service.start_date == 0 || service.end_date == 0) {
+        LOG_WARN("Skipping service " + reader.field(id) + " with invalid dates in " + feed.name);
+        continue;
+      }
+      services.emplace(reader.field(id), std::move(service));
+    }
+  }
+
+  if (boost::filesystem::exists(feed_file(feed, "calendar_dates.txt"))) {
+    CsvReader reader(feed_file(feed, "calendar_dates.txt"));
+    int id = reader.column("service_id");
+    int date = reader.column("date");
+    int exception_type = reader.column("exception_type");
+    while (reader.Next()) {
+      uint32_t day = ParseDate(reader.field(date));
+      if (day == 0) {
+        continue;
+      }
+
+      // Services defined only by their dates run on no regular days so the
+      // date range can simply grow to cover each added date
+      auto service = services.find(reader.field(id));
+      bool dates_only = service == services.end();
+      if (dates_only) {
+        Service s;
+        std::fill(s.days_of_week, s.days_of_week + 7, false);
+        s.start_date = s.end_date = day;
+        service = services.emplace(reader.field(id), std::move(s)).first;
+      } else if (std::none_of(service->second.days_of_week,
+                              service->second.days_of_week + 7,
+                              [](bool d) { return d; })) {
+        dates_only = true;
+      }
+
+      if (reader.field(exception_type) == "1") {
+        if (dates_only) {
+          service->second.start_date = std::min(service->second.start_date, day);
+          service->second.end_date = std::max(service->second.end_date, day);
+        }
+        service->second.added_dates.push_back(day);
+      } else if (reader.field(exception_type) == "2") {
+        service->second.except_dates.push_back(day);
+      }
+    }
+  }
+  return services;
+}
+
+// Shape points in sequence order with the distance along the shape of each
+std::unordered_map<std::string, Shape> LoadShapes(const Feed& feed) {
+  std::unordered_map<std::string, Shape> shapes;
+  if (!boost::filesystem::exists(feed_file(feed, "shapes.txt"))) {
+    return shapes;
+  }
+
+  std::unordered_map<std::string, std::vector<std::pair<uint32_t, PointLL> > > points;
+  CsvReader reader(feed_file(feed, "shapes.txt"));
+  int id = reader.column("shape_id");
+  int lat = reader.column("shape_pt_lat");
+  int lon = reader.column("shape_pt_lon");
+  int sequence = reader.column("shape_pt_sequence");
+  while (reader.Next()) {
+    points[reader.field(id)].emplace_back(
+        std::strtoul(reader.field(sequence).c_str(), nullptr, 10),
+        PointLL(std::atof(reader.field(lon).c_str()), std::atof(reader.field(lat).c_str())));
+  }
+
+  for (auto& p : points) {
+    std::sort(p.second.begin(), p.second.end(),
+              [](const std::pair<uint32_t, PointLL>& a, const std::pair<uint32_t, PointLL>& b) {
+                return a.first < b.first;
+              });
+    Shape& shape = shapes[p.first];
+    float distance = 0.0f;
+    for (const auto& pt : p.second) {
+      if (!shape.pts.empty()) {
+        distance += shape.pts.back().Distance(pt.second);
+      }
+      shape.pts.push_back(pt.second);
+      shape.distances.push_back(distance);
+    }
+  }
+  return shapes;
+}
+
+// Fill in the times at stops that are not timepoints by interpolating
+// between the surrounding timed stops. Returns false if the first or last
+// stop of the trip has no time.
+bool InterpolateTimes(std::vector<StopTime>& stop_times) {
+  for (auto& st : stop_times) {
+    if (st.arrival < 0) {
+      st.arrival = st.departure;
+    }
+    if (st.departure < 0) {
+      st.departure = st.arrival;
+    }
+  }
+  if (stop_times.front().departure < 0 || stop_times.back().arrival < 0) {
+    return false;
+  }
+
+  size_t previous = 0;
+  for (size_t i = 1; i < stop_times.size(); i++) {
+    if (stop_times[i].arrival < 0) {
+      continue;
+    }
+    int64_t elapsed = stop_times[i].arrival - stop_times[previous].departure;
+    for (size_t j = previous + 1; j < i; j++) {
+      stop_times[j].arrival = stop_times[j].departure = stop_times[previous].departure +
+          static_cast<int32_t>(elapsed * static_cast<int64_t>(j - previous) /
+                               static_cast<int64_t>(i - previous));
+    }
+    previous = i;
+  }
+  return true;
+}
+
+// Closest point on the segment a-b. Uses a local equirectangular projection
+// which is plenty for the distance between a stop and its shape.
+PointLL ClosestPoint(const PointLL& ll, const PointLL& a, const PointLL& b,
+                     const float lng_scale) {
+  float dx = (b.lng() - a.lng()) * lng_scale;
+  float dy = b.lat() - a.lat();
+  float length = dx * dx + dy * dy;
+  if (length == 0.0f) {
+    return a;
+  }
+  float t = (((ll.lng() - a.lng()) * lng_scale) * dx + (ll.lat() - a.lat()) * dy) / length;
+  t = std::min(1.0f, std::max(0.0f, t));
+  return PointLL(a.lng() + (b.lng() - a.lng()) * t, a.lat() + (b.lat() - a.lat()) * t);
+}
+
+// Distance along the shape of each stop of a trip in meters. Stops are
+// projected in order, each no earlier on the shape than the previous one,
+// so shapes which double back on themselves are handled.
+std::vector<float> StopDistances(const Shape& shape, const std::vector<Stop>& stops,
+                                 const std::vector<StopTime>& stop_times) {
+  std::vector<float> distances;
+  size_t segment = 0;
+  for (const auto& st : stop_times) {
+    const PointLL& ll = stops[st.stop].ll;
+    float lng_scale = std::cos(ll.lat() * kRadPerDeg);
+    float best = std::numeric_limits<float>::max();
+    size_t best_segment = segment;
+    PointLL best_point = shape.pts[segment];
+    for (size_t s = segment; s + 1 < shape.pts.size(); s++) {
+      PointLL x = ClosestPoint(ll, shape.pts[s], shape.pts[s + 1], lng_scale);
+      float dx = (x.lng() - ll.lng()) * lng_scale;
+      float dy = x.lat() - ll.lat();
+      float d = dx * dx + dy * dy;
+      if (d < best) {
+        best = d;
+        best_segment = s;
+        best_point = x;
+      }
+    }
+    distances.push_back(shape.distances[best_segment] +
+                        shape.pts[best_segment].Distance(best_point));
+    segment = best_segment;
+  }
+  return distances;
+}
+
+// Read the schedule of a feed and turn each trip into stop pairs. The stop
+// pairs along with the routes and shapes they use go into the tile of their
+// origin stop.
+feed_tiles_t BuildFeed(const Feed& feed, feed_ids_t& ids) {
+  auto routes = LoadRoutes(feed);
+  auto services = LoadServices(feed);
+  auto shapes = LoadShapes(feed);
+
+  std::vector<Trip> trips;
+  std::unordered_map<std::string, uint32_t> trip_index;
+  {
+    CsvReader reader(feed_file(feed, "trips.txt"));
+    int id = reader.column("trip_id");
+    int route_id = reader.column("route_id");
+    int service_id = reader.column("service_id");
+    int headsign = reader.column("trip_headsign");
+    int block_id = reader.column("block_id");
+    int shape_id = reader.column("shape_id");
+    int wheelchair_accessible = reader.column("wheelchair_accessible");
+    int bikes_allowed = reader.column("bikes_allowed");
+    while (reader.Next()) {
+      trip_index.emplace(reader.field(id), trips.size());
+      trips.emplace_back(Trip{reader.field(id), reader.field(route_id),
+                              reader.field(service_id), reader.field(headsign),
+                              reader.field(block_id), reader.field(shape_id),
+                              reader.field(wheelchair_accessible) == "1",
+                              reader.field(bikes_allowed) == "1"});
+    }
+  }
+
+  // Group the stop times by trip. This is by far the largest file so it is
+  // streamed and only the parsed values are kept.
+  std::vector<std::vector<StopTime> > trip_stop_times(trips.size());
+  size_t unknown = 0;
+  {
+    CsvReader reader(feed_file(feed, "stop_times.txt"));
+    int trip_id = reader.column("trip_id");
+    int stop_id = reader.column("stop_id");
+    int sequence = reader.column("stop_sequence");
+    int arrival = reader.column("arrival_time");
+    int departure = reader.column("departure_time");
+    int headsign = reader.column("stop_headsign");
+    while (reader.Next()) {
+      auto trip = trip_index.find(reader.field(trip_id));
+      auto stop = feed.stop_index.find(reader.field(stop_id));
+      if (trip == trip_index.cend() || stop == feed.stop_index.cend()) {
+        unknown++;
+        continue;
+      }
+      trip_stop_times[trip->second].emplace_back(StopTime{
+          static_cast<uint32_t>(std::strtoul(reader.field(sequence).c_str(), nullptr, 10)),
+          stop->second, ParseTime(reader.field(arrival)),
+          ParseTime(reader.field(departure)), reader.field(headsign)});
+    }
+  }
+  if (unknown) {
+    LOG_WARN(std::to_string(unknown) + " stop times with an unknown trip or stop in " + feed.name);
+  }
+
+  feed_tiles_t tiles;
+  std::unordered_map<GraphId, std::unordered_map<std::string, uint32_t> > tile_routes;
+  std::unordered_map<GraphId, std::unordered_map<std::string, uint32_t> > tile_shapes;
+  // Trips running the same stops along the same shape share their distances
+  std::unordered_map<std::string, std::vector<float> > pattern_distances;
+  std::unordered_map<std::string, uint32_t> block_index, line_index;
+  size_t skipped = 0, stop_pairs = 0;
+  for (size_t t = 0; t < trips.size(); t++) {
+    const Trip& trip = trips[t];
+    auto& stop_times = trip_stop_times[t];
+    auto route = routes.find(trip.route_id);
+    auto service = services.find(trip.service_id);
+    if (stop_times.size() < 2 || route == routes.cend() || service == services.cend()) {
+      skipped++;
+      continue;
+    }
+    std::sort(stop_times.begin(), stop_times.end(),
+              [](const StopTime& a, const StopTime& b) { return a.sequence < b.sequence; });
+    if (!InterpolateTimes(stop_times)) {
+      skipped++;
+      continue;
+    }
+
+    const std::vector<float>* distances = nullptr;
+    auto shape = shapes.find(trip.shape_id);
+    if (shape != shapes.cend() && shape->second.pts.size() > 1) {
+      std::string pattern = trip.shape_id;
+      for (const auto& st : stop_times) {
+        pattern += ',' + std::to_string(st.stop);
+      }
+      auto found = pattern_distances.find(pattern);
+      if (found == pattern_distances.end()) {
+        found = pattern_distances.emplace(pattern,
+                  StopDistances(shape->second, feed.stops, stop_times)).first;
+      }
+      distances = &found->second;
+    }
+
+    uint32_t trip_id = ids.trips.size(), block_id = 0;
+    ids.trips.push_back(feed.name + ':' + trip.id);
+    if (!trip.block_id.empty()) {
+      // ids.blocks.size()+1 because we can't have a block id of 0.
+      // 0 means block id is not set in the transit builder.
+      auto block = block_index.emplace(feed.name + ':' + trip.block_id, ids.blocks.size() + 1);
+      if (block.second) {
+        ids.blocks.push_back(block.first->first);
+      }
+      block_id = block.first->second;
+    }
+
+    for (size_t i = 0; i + 1 < stop_times.size(); i++) {
+      const Stop& origin = feed.stops[stop_times[i].stop];
+      const Stop& destination = feed.stops[stop_times[i + 1].stop];
+      if (!origin.graphid.Is_Valid() || !destination.graphid.Is_Valid()) {
+        continue;
+      }
+      GraphId tile_id(origin.graphid.tileid(), origin.graphid.level(), 0);
+      Transit& tile = tiles[tile_id];
+
+      // Routes are added to a tile the first time one of its trips leaves
+      // from a stop in the tile
+      auto route_index = tile_routes[tile_id].emplace(trip.route_id, tile.routes_size());
+      if (route_index.second) {
+        tile.add_routes()->CopyFrom(route->second);
+      }
+
+      auto* pair = tile.add_stop_pairs();
+      pair->set_origin_onestop_id(origin.onestop_id);
+      pair->set_origin_graphid(origin.graphid.value);
+      pair->set_destination_onestop_id(destination.onestop_id);
+      pair->set_destination_graphid(destination.graphid.value);
+      pair->set_route_index(route_index.first->second);
+
+      //uniq line id
+      auto line_id = origin.onestop_id < destination.onestop_id ?
+                      origin.onestop_id + destination.onestop_id + route->second.onestop_id():
+                      destination.onestop_id + origin.onestop_id + route->second.onestop_id();
+      auto line = line_index.emplace(line_id, ids.lines.size());
+      if (line.second) {
+        ids.lines.push_back(line_id);
+      }
+      pair->set_line_id(line.first->second);
+
+      pair->set_origin_departure_time(stop_times[i].departure);
+      pair->set_destination_arrival_time(stop_times[i + 1].arrival);
+      pair->set_service_start_date(service->second.start_date);
+      pair->set_service_end_date(service->second.end_date);
+      for (size_t d = 0; d < 7; d++) {
+        pair->add_service_days_of_week(service->second.days_of_week[d]);
+      }
+      for (const auto& d : service->second.except_dates) {
+        pair->add_service_except_dates(d);
+      }
+      for (const auto& d : service->second.added_dates) {
+        pair->add_service_added_dates(d);
+      }
+
+      pair->set_trip_id(trip_id);
+      if (block_id) {
+        pair->set_block_id(block_id);
+      }
+      const auto& headsign = stop_times[i].headsign.empty() ? trip.headsign : stop_times[i].headsign;
+      if (!headsign.empty()) {
+        pair->set_trip_headsign(headsign);
+      }
+      pair->set_wheelchair_accessible(trip.wheelchair_accessible);
+      pair->set_bikes_allowed(trip.bikes_allowed);
+
+      // Shape data. Stops that project to the same place on the shape are
+      // left as a straight line.
+      if (distances != nullptr && (*distances)[i] < (*distances)[i + 1]) {
+        // shapes_size()+1 because we can't have a shape id of 0.
+        // 0 means shape id is not set in the transit builder.
+        auto shape_id = tile_shapes[tile_id].emplace(trip.shape_id, tile.shapes_size() + 1);
+        if (shape_id.second) {
+          auto* s = tile.add_shapes();
+          s->set_shape_id(shape_id.first->second);
+          s->set_encoded_shape(encode(shape->second.pts));
+        }
+        pair->set_shape_id(shape_id.first->second);
+        pair->set_origin_dist_traveled((*distances)[i]);
+        pair->set_destination_dist_traveled((*distances)[i + 1]);
+      }
+      stop_pairs++;
+    }
+  }
+
+  LOG_INFO(feed.name + " had " + std::to_string(feed.stops.size()) + " stops " +
+           std::to_string(routes.size()) + " routes " + std::to_string(trips.size()) +
+           " trips (" + std::to_string(skipped) + " skipped) " +
+           std::to_string(stop_pairs) + " stop pairs");
+  return tiles;
+}
+
+void write_pbf(const Transit& tile, const boost::filesystem::path& transit_tile) {
+  if (!boost::filesystem::exists(transit_tile.parent_path()))
+    boost::filesystem::create_directories(transit_tile.parent_path());
+  std::fstream stream(transit_tile.string(), std::ios::out | std::ios::trunc | std::ios::binary);
+  if (!tile.SerializeToOstream(&stream))
+    LOG_ERROR("Couldn't write: " + transit_tile.string() + " it would have been " + std::to_string(tile.ByteSize()));
+  LOG_INFO(transit_tile.string() + " had " + std::to_string(tile.stops_size()) + " stops " +
+           std::to_string(tile.routes_size()) + " routes " + std::to_string(tile.shapes_size()) + " shapes " +
+           std::to_string(tile.stop_pairs_size()) + " stop pairs");
+}
+
+// Give the keys of a feed the next free ids, in key order so the ids are
+// the same however the feeds were split between threads
+void AssignIds(const std::vector<std::string>& keys, std::unordered_map<std::string, size_t>& unique,
+               const size_t first, std::vector<uint32_t>& ids) {
+  std::vector<size_t> order(keys.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(order.begin(), order.end(),
+            [&keys](const size_t a, const size_t b) { return keys[a] < keys[b]; });
+  ids.resize(keys.size());
+  for (auto k : order) {
+    ids[k] = unique.insert({keys[k], unique.size() + first}).first->second;
+  }
+}
+
+// Combine the stops of a tile with the routes, shapes and stop pairs from
+// each feed and write it out. The route and shape indices of each feed are
+// offset by those of the feeds before it and the trips, blocks and lines
+// are given their ids across the feeds.
+void WriteTile(const std::string& prefix, const std::vector<const Stop*>& stops,
+               std::vector<Transit>& parts, const std::vector<const feed_ids_t*>& part_ids) {
+  Transit tile;
+  for (const auto* s : stops) {
+    auto* stop = tile.add_stops();
+    stop->set_lon(s->ll.lng());
+    stop->set_lat(s->ll.lat());
+    stop->set_onestop_id(s->onestop_id);
+    stop->set_name(s->name);
+    stop->set_wheelchair_boarding(s->wheelchair_boarding);
+    stop->set_graphid(s->graphid.value);
+    stop->set_timezone(s->timezone);
+  }
+
+  std::vector<std::pair<uint32_t, uint32_t> > offsets;
+  for (const auto& part : parts) {
+    offsets.emplace_back(tile.routes_size(), tile.shapes_size());
+    tile.mutable_routes()->MergeFrom(part.routes());
+    tile.mutable_shapes()->MergeFrom(part.shapes());
+  }
+
+  //tiles are wrote out with .pbf or .pbf.n ext
+  uint32_t ext = 0;
+  std::string file_name = prefix;
+  for (size_t p = 0; p < parts.size(); p++) {
+    for (auto& pair : *parts[p].mutable_stop_pairs()) {
+      auto* sp = tile.add_stop_pairs();
+      sp->Swap(&pair);
+      sp->set_route_index(sp->route_index() + offsets[p].first);
+      if (sp->shape_id()) {
+        sp->set_shape_id(sp->shape_id() + offsets[p].second);
+      }
+      sp->set_trip_id(part_ids[p]->trip_ids[sp->trip_id()]);
+      if (sp->block_id()) {
+        sp->set_block_id(part_ids[p]->block_ids[sp->block_id() - 1]);
+      }
+      sp->set_line_id(part_ids[p]->line_ids[sp->line_id()]);
+      if (tile.stop_pairs_size() >= kMaxStopPairs) {
+        write_pbf(tile, file_name);
+        tile.Clear();
+        file_name = prefix + '.' + std::to_string(ext++);
+      }
+    }
+    parts[p].Clear();
+  }
+  if (file_name == prefix || tile.stop_pairs_size()) {
+    write_pbf(tile, file_name);
+  }
+}
+
+void load_feeds(std::vector<Feed>& feeds, std::atomic<size_t>& next) {
+  for (size_t f = next++; f < feeds.size(); f = next++) {
+    try {
+      LoadStops(feeds[f]);
+    } catch (const std::exception& e) {
+      LOG_ERROR("Skipping feed " + feeds[f].name + ": " + e.what());
+      feeds[f].stops.clear();
+      feeds[f].stop_index.clear();
+    }
+  }
+}
+
+void build_feeds(const std::vector<Feed>& feeds, std::vector<feed_ids_t>& feed_ids,
+                 std::vector<feed_tiles_t>& feed_tiles, std::atomic<size_t>& next) {
+  for (size_t f = next++; f < feeds.size(); f = next++) {
+    if (feeds[f].stops.empty()) {
+      continue;
+    }
+    try {
+      feed_tiles[f] = BuildFeed(feeds[f], feed_ids[f]);
+    } catch (const std::exception& e) {
+      LOG_ERROR("Skipping schedule of feed " + feeds[f].name + ": " + e.what());
+      feed_tiles[f].clear();
+      feed_ids[f] = feed_ids_t();
+    }
+  }
+}
+
+void write_tiles(const std::string& transit_dir, const TileHierarchy& hierarchy,
+                 const std::vector<std::pair<GraphId, std::vector<const Stop*> > >& tiles,
+                 std::vector<feed_tiles_t>& feed_tiles, const std::vector<feed_ids_t>& feed_ids,
+                 std::atomic<size_t>& next) {
+  for (size_t t = next++; t < tiles.size(); t = next++) {
+    const GraphId& tile_id = tiles[t].first;
+    std::vector<Transit> parts;
+    std::vector<const feed_ids_t*> part_ids;
+    for (size_t f = 0; f < feed_tiles.size(); f++) {
+      auto part = feed_tiles[f].find(tile_id);
+      if (part != feed_tiles[f].end()) {
+        parts.emplace_back();
+        parts.back().Swap(&part->second);
+        part_ids.push_back(&feed_ids[f]);
+      }
+    }
+    auto file_name = GraphTile::FileSuffix(tile_id, hierarchy);
+    file_name = file_name.substr(0, file_name.size() - 3) + "pbf";
+    WriteTile(transit_dir + '/' + file_name, tiles[t].second, parts, part_ids);
+  }
+}
+
+template <class F>
+void run(unsigned int thread_count, F work) {
+  std::vector<std::shared_ptr<std::thread> > threads(thread_count);
+  for (auto& thread : threads)
+    thread.reset(new std::thread(work));
+  for (auto& thread : threads)
+    thread->join();
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+void GTFSBuilder::Build(const boost::property_tree::ptree& pt,
+                        const std::vector<std::string>& feed_dirs) {
+  TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
+  std::string transit_dir = pt.get<std::string>("mjolnir.transit_dir");
+  unsigned int thread_count = std::max(static_cast<unsigned int>(1),
+                                       pt.get<unsigned int>("mjolnir.concurrency",
+                                                            std::thread::hardware_concurrency()));
+
+  // Feeds are named after their directory so ids stay unique across feeds
+  std::vector<Feed> feeds(feed_dirs.size());
+  for (size_t f = 0; f < feed_dirs.size(); f++) {
+    feeds[f].dir = feed_dirs[f];
+    auto name = boost::filesystem::path(feed_dirs[f]);
+    feeds[f].name = (name.filename() == "." ? name.parent_path() : name).filename().string();
+  }
+  LOG_INFO("Reading " + std::to_string(feeds.size()) + " GTFS feeds with " +
+           std::to_string(thread_count) + " threads...");
+
+  // Load the stops of every feed
+  std::atomic<size_t> next(0);
+  run(thread_count, [&feeds, &next]() { load_feeds(feeds, next); });
+
+  // Give each stop a graph id within its tile. This is done in feed order so
+  // the ids are the same every time.
+  const auto& tile_level = hierarchy.levels().rbegin()->second;
+  std::unordered_map<GraphId, size_t> tile_index;
+  std::vector<std::pair<GraphId, std::vector<const Stop*> > > tiles;
+  for (auto& feed : feeds) {
+    for (auto& stop : feed.stops) {
+      int32_t tileid = tile_level.tiles.TileId(stop.ll);
+      if (tileid < 0) {
+        LOG_WARN("Stop " + stop.onestop_id + " is outside of the tiles");
+        continue;
+      }
+      GraphId tile_id(tileid, hierarchy.levels().rbegin()->first, 0);
+      auto inserted = tile_index.emplace(tile_id, tiles.size());
+      if (inserted.second) {
+        tiles.emplace_back(tile_id, std::vector<const Stop*>());
+      }
+      auto& tile_stops = tiles[inserted.first->second].second;
+      stop.graphid = GraphId(tileid, tile_id.level(), tile_stops.size());
+      tile_stops.push_back(&stop);
+    }
+  }
+
+  // Turn the schedules into stop pairs
+  std::vector<feed_ids_t> feed_ids(feeds.size());
+  std::vector<feed_tiles_t> feed_tiles(feeds.size());
+  next = 0;
+  run(thread_count, [&feeds, &feed_ids, &feed_tiles, &next]() {
+    build_feeds(feeds, feed_ids, feed_tiles, next);
+  });
+
+  // Number the trips, blocks and lines across the feeds in feed order so the
+  // tiles are the same from one run to the next
+  unique_transit_t uniques;
+  for (auto& ids : feed_ids) {
+    AssignIds(ids.trips, uniques.trips, 0, ids.trip_ids);
+    AssignIds(ids.blocks, uniques.block_ids, 1, ids.block_ids);
+    AssignIds(ids.lines, uniques.lines, 0, ids.line_ids);
+  }
+
+  // Write out the tiles
+  LOG_INFO("Writing " + std::to_string(tiles.size()) + " transit tiles...");
+  next = 0;
+  run(thread_count, [&transit_dir, &hierarchy, &tiles, &feed_tiles, &feed_ids, &next]() {
+    write_tiles(transit_dir, hierarchy, tiles, feed_tiles, feed_ids, next);
+  });
+  LOG_INFO("Finished");
+}
+
+}
+}
@@ -1,11 +1,13 @@
 #include "mjolnir/hierarchybuilder.h"
 #include "valhalla/mjolnir/graphtilebuilder.h"
+#include "mjolnir/metrics.h"
 
 #include <sstream>
 #include <iostream>
 #include <string>
 #include <vector>
 #include <map>
+#include <algorithm>
 #include <utility>
 #include <boost/property_tree/ptree.hpp>
 
@@ -504,6 +506,12 @@ void FormTilesInNewLevel(
 
   info.graphreader_.Clear();
 
+  // Tiles are formed one at a time, the ones left are the whole backlog
+  Counter& tiles_built = Metrics::Get().counter("hierarchy.tiles_built");
+  Gauge& tiles_remaining = Metrics::Get().gauge("hierarchy.tiles_remaining");
+  tiles_remaining.Set(std::count_if(info.tilednodes_.begin(), info.tilednodes_.end(),
+    [](const std::vector<NewNode>& nodes) { return !nodes.empty(); }));
+
   for (const auto& newtile : info.tilednodes_) {
     // Skip if no nodes in the tile at the new level
     if (newtile.size() == 0) {
@@ -634,6 +642,8 @@ void FormTilesInNewLevel(
     tilebuilder.StoreTileData();
     LOG_DEBUG((boost::format("HierarchyBuilder created tile %1%: %2% bytes") %
          tile % tilebuilder.size()).str());
+    tiles_built.Add();
+    tiles_remaining.Add(-1);
 
     // Increment tileid
     tileid++;
@@ -1,12 +1,210 @@
-#include "mjolnir/ferry_connections.h"
+#include "mjolnir/linkclassification.h"
+#include "mjolnir/unionfind.h"
 
-#include <list>
-#include <set>
-#include <unordered_map>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 #include <valhalla/baldr/graphid.h>
+#include <valhalla/midgard/logging.h>
 
 using namespace valhalla::baldr;
+using namespace valhalla::mjolnir;
+
+namespace {
+
+// Best class of a node without driveable non-link edges
+constexpr uint8_t kNoClass = 0xFF;
+
+// Link nodes are handed to the threads in batches
+constexpr size_t kNodeBatch = 4096;
+
+struct LinkEdge {
+  uint32_t edge_index;    // Index in the edges file
+  uint32_t wayindex;
+  uint32_t sourcenode;    // Link node index of the source
+  uint32_t targetnode;    // Link node index of the target
+  uint32_t importance;
+};
+
+// What the reclassification needs to know about a node with a link edge
+struct LinkNode {
+  uint32_t link_count = 0;
+  uint32_t non_link_count = 0;
+  uint8_t best_class = kNoClass;    // Of driveable non-link edges
+  bool shortlink = false;
+
+  // Any non-link edge ends the links, driveable or not
+  bool non_link_edge() const {
+    return non_link_count > 0;
+  }
+
+  // Links continue through the node if it has no non-link edge.
+  // Also if the link count > 1 and a "short link" is present (could be an
+  // internal intersection link). Do not want to continue in cases where an
+  // exit ramp crosses onto an entrance back onto the same highway that was
+  // exited. But there are cases with internal intersection links that we
+  // do need to include. Also continue if only one non-link edge exists and
+  // more than 1 link exists (common case - service road off a ramp)
+  bool passable() const {
+    return !non_link_edge() ||
+           (link_count > 1 && (shortlink || non_link_count == 1));
+  }
+};
+
+// The link edges of the graph and the nodes they touch
+struct LinkGraph {
+  std::vector<LinkEdge> edges;
+  std::vector<uint32_t> positions;    // Node index (in the nodes file) per link node
+  std::vector<LinkNode> nodes;
+  std::vector<uint32_t> offsets;      // Link edges of each link node
+  std::vector<uint32_t> adjacency;
+
+  uint32_t Node(const uint32_t position) const {
+    auto itr = std::lower_bound(positions.begin(), positions.end(), position);
+    return (itr == positions.end() || *itr != position) ?
+        kNoNode : static_cast<uint32_t>(itr - positions.begin());
+  }
+
+  static constexpr uint32_t kNoNode = static_cast<uint32_t>(-1);
+};
+
+constexpr uint32_t LinkGraph::kNoNode;
+
+// Read the link edges and, with a second pass over the edges, the
+// non-link edges at their nodes. Both passes read the edges in file order.
+void LoadLinks(sequence<Edge>& edges, LinkGraph& graph) {
+  for (auto edge_itr = edges.begin(); edge_itr != edges.end(); ++edge_itr) {
+    const Edge edge = *edge_itr;
+    if (edge.attributes.link) {
+      graph.edges.push_back({ static_cast<uint32_t>(edge_itr.position()), edge.wayindex_,
+                              edge.sourcenode_, edge.targetnode_,
+                              edge.attributes.importance });
+      graph.positions.push_back(edge.sourcenode_);
+      graph.positions.push_back(edge.targetnode_);
+    }
+  }
+  std::sort(graph.positions.begin(), graph.positions.end());
+  graph.positions.erase(std::unique(graph.positions.begin(), graph.positions.end()),
+                        graph.positions.end());
+  graph.nodes.resize(graph.positions.size());
+
+  // Group the link edges by node. A loop is only counted once at its node.
+  graph.offsets.assign(graph.nodes.size() + 1, 0);
+  for (auto& edge : graph.edges) {
+    edge.sourcenode = graph.Node(edge.sourcenode);
+    edge.targetnode = graph.Node(edge.targetnode);
+    graph.offsets[edge.sourcenode + 1]++;
+    if (edge.targetnode != edge.sourcenode) {
+      graph.offsets[edge.targetnode + 1]++;
+    }
+  }
+  for (size_t i = 1; i < graph.offsets.size(); i++) {
+    graph.offsets[i] += graph.offsets[i - 1];
+  }
+  graph.adjacency.resize(graph.offsets.back());
+  std::vector<uint32_t> fill(graph.offsets.begin(), graph.offsets.end() - 1);
+  for (uint32_t e = 0; e < graph.edges.size(); e++) {
+    const auto& edge = graph.edges[e];
+    for (auto node : { edge.sourcenode, edge.targetnode }) {
+      graph.adjacency[fill[node]++] = e;
+      graph.nodes[node].link_count++;
+      if (edge.targetnode == edge.sourcenode) {
+        break;
+      }
+    }
+  }
+  for (auto edge_itr = edges.begin(); edge_itr != edges.end(); ++edge_itr) {
+    const Edge edge = *edge_itr;
+    for (auto position : { edge.sourcenode_, edge.targetnode_ }) {
+      uint32_t node = graph.Node(position);
+      if (node != LinkGraph::kNoNode) {
+        auto& link_node = graph.nodes[node];
+        link_node.shortlink |= edge.attributes.shortlink;
+        if (!edge.attributes.link) {
+          link_node.non_link_count++;
+
+          // Do not count non-driveable (e.g. emergency service roads) as a
+          // non-link edge
+          if ((edge.attributes.driveableforward || edge.attributes.driveablereverse) &&
+              edge.attributes.importance < link_node.best_class) {
+            link_node.best_class = edge.attributes.importance;
+          }
+        }
+      }
+      if (edge.targetnode_ == edge.sourcenode_) {
+        break;
+      }
+    }
+  }
+}
+
+// Join the link edges that meet at a node links continue through
+void UnionLinks(const LinkGraph& graph, std::atomic<size_t>& next,
+                UnionFind& links) {
+  for (size_t start = next.fetch_add(kNodeBatch); start < graph.nodes.size();
+       start = next.fetch_add(kNodeBatch)) {
+    size_t end = std::min(start + kNodeBatch, graph.nodes.size());
+    for (size_t node = start; node < end; node++) {
+      if (!graph.nodes[node].passable()) {
+        continue;
+      }
+      for (uint32_t i = graph.offsets[node] + 1; i < graph.offsets[node + 1]; i++) {
+        links.Union(graph.adjacency[graph.offsets[node]], graph.adjacency[i]);
+      }
+    }
+  }
+}
+
+// What one thread decided for its link components
+struct LinkResult {
+  std::vector<std::pair<uint32_t, uint32_t> > updates;   // Edge index, importance
+  std::vector<uint32_t> unconnected;                    // Way index
+};
+
+// Set each component of connected links to the second best road class of
+// the roads it connects to. This protects against downgrading links when
+// branches occur.
+void ClassifyLinks(const LinkGraph& graph, const std::vector<uint32_t>& component_offsets,
+                   const std::vector<uint32_t>& component_edges,
+                   std::atomic<size_t>& next, LinkResult& result) {
+  std::vector<std::pair<uint8_t, uint32_t> > ends;
+  for (size_t c = next++; c + 1 < component_offsets.size(); c = next++) {
+    // Get the classification of each node with a non-link edge. Nodes
+    // without a driveable one sort last.
+    ends.clear();
+    for (uint32_t i = component_offsets[c]; i < component_offsets[c + 1]; i++) {
+      const auto& edge = graph.edges[component_edges[i]];
+      for (auto node : { edge.sourcenode, edge.targetnode }) {
+        if (graph.nodes[node].non_link_edge()) {
+          ends.emplace_back(graph.nodes[node].best_class, node);
+        }
+      }
+    }
+    std::sort(ends.begin(), ends.end());
+    ends.erase(std::unique(ends.begin(), ends.end()), ends.end());
+
+    // Make sure this connects...
+    const auto& first = graph.edges[component_edges[component_offsets[c]]];
+    if (ends.size() < 2) {
+      result.unconnected.push_back(first.wayindex);
+      continue;
+    }
+    if (ends[1].first == kNoClass) {
+      continue;
+    }
+    uint32_t rc = ends[1].first;
+    for (uint32_t i = component_offsets[c]; i < component_offsets[c + 1]; i++) {
+      const auto& edge = graph.edges[component_edges[i]];
+      if (rc > edge.importance) {
+        result.updates.emplace_back(edge.edge_index, rc);
+      }
+    }
+  }
+}
+
+}
 
 namespace valhalla {
 namespace mjolnir {
@@ -30,123 +228,77 @@ uint32_t GetBestNonLinkClass(const std::map<Edge, size_t>& edges) {
 // the best classification, while to more effectively create shortcuts it is
 // better to "downgrade" link edges to the lower classification.
 void ReclassifyLinks(const std::string& ways_file,
-                     const std::string& nodes_file,
                      const std::string& edges_file,
-                     DataQuality& stats) {
-  LOG_INFO("Reclassifying link graph edges...")
-
-  uint32_t count = 0;
-  std::unordered_set<size_t> visitedset;  // Set of visited nodes
-  std::unordered_set<size_t> expandset;   // Set of nodes to expand
-  std::list<size_t> linkedgeindexes;     // Edge indexes to reclassify
-  std::multiset<uint32_t> endrc;           //
+                     DataQuality& stats,
+                     const unsigned int thread_count) {
+  LOG_INFO("Reclassifying link graph edges...");
+
   sequence<OSMWay> ways(ways_file, false);
   sequence<Edge> edges(edges_file, false);
-  sequence<Node> nodes(nodes_file, false);
-
-  //try to expand
-  auto expand = [&expandset, &endrc, &nodes, &edges, &visitedset] (const Edge& edge, const sequence<Node>::iterator& node_itr) {
-    auto end_node_itr = (edge.sourcenode_ == node_itr.position() ? nodes[edge.targetnode_] : node_itr);
-    auto end_node_bundle = collect_node_edges(end_node_itr, nodes, edges);
-
-    // Add the classification if there is a driveable non-link edge
-    if (end_node_bundle.node.attributes_.non_link_edge) {
-      endrc.insert(GetBestNonLinkClass(end_node_bundle.node_edges));
-
-      // Expand if the link count > 1 and a "short link" is present (could be
-      // an internal intersection link). Do not want to expand in cases where
-      // an exit ramp crosses onto an entrance back onto the same highway
-      // that was exited. But there are cases with internal intersection links
-      // that we do need to expand.
-      // Also expand if only one non-link edge exists and more than 1 link
-      // exists(common case - service road off a ramp)
-      if ( end_node_bundle.link_count > 1 &&
-          (end_node_bundle.node.attributes_.shortlink ||
-           end_node_bundle.non_link_count == 1)   &&
-          visitedset.find(end_node_itr.position()) == visitedset.end()) {
-       expandset.insert(end_node_itr.position());
-      }
-    } else if (visitedset.find(end_node_itr.position()) == visitedset.end()) {
-      expandset.insert(end_node_itr.position());
-    }
-  };
-
-  //for each node
-  sequence<Node>::iterator node_itr = nodes.begin();
-  while (node_itr != nodes.end()) {
-    // If the node has a both links and non links at it
-    auto bundle = collect_node_edges(node_itr, nodes, edges);
-    if (bundle.node.attributes_.link_edge &&
-        bundle.node.attributes_.non_link_edge) {
-      // Get the highest classification of non-link edges at this node
-      endrc = { GetBestNonLinkClass(bundle.node_edges) };
-
-      // Expand from all link edges
-      for (const auto& startedge : bundle.node_edges) {
-        // Get the edge information. Skip non-link edges and link edges
-        // already reclassified
-        if (!startedge.first.attributes.link ||
-             startedge.first.attributes.reclass_link) {
-          continue;
-        }
+  LinkGraph graph;
+  LoadLinks(edges, graph);
 
-        // Clear the visited set and start expanding at the end of this edge
-        visitedset = {};
-        expandset = {};
-        linkedgeindexes = { startedge.second };
-        expand(startedge.first, node_itr);
-
-        // Expand edges until all paths reach a node that has a non-link and
-        // only one link edge
-        while (!expandset.empty()) {
-          // Expand all edges from this node and pop from expand set
-          auto expand_node_itr = nodes[*expandset.begin()];
-          auto expanded = collect_node_edges(expand_node_itr, nodes, edges);
-          visitedset.insert(expand_node_itr.position());
-          expandset.erase(expandset.begin());
-          for (const auto& expandededge : expanded.node_edges) {
-            // Do not allow use of the start edge or any non-link edge
-            if (expandededge.second == startedge.second ||
-                !expandededge.first.attributes.link) {
-              continue;
-            }
-            // Expand from end node of this link edge
-            expand(expandededge.first, expand_node_itr);
-          }
-        }
+  // Find the components of connected links
+  std::vector<std::shared_ptr<std::thread> > threads(std::max(1u, thread_count));
+  UnionFind links(graph.edges.size());
+  std::atomic<size_t> next(0);
+  for (auto& thread : threads) {
+    thread.reset(new std::thread(UnionLinks, std::cref(graph), std::ref(next),
+                                 std::ref(links)));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
 
-        // Once expand list is empty - mark all link edges encountered
-        // with the specified classification / importance and break out
-        // of this loop (can still expand other ramp edges
-        // from the starting node
-        // Make sure this connects...
-        if (endrc.size() < 2) {
-          stats.AddIssue(kUnconnectedLinkEdge, GraphId(),
-                         (*ways[startedge.first.wayindex_]).way_id(), 0);
-        }
-        else {
-          // Set to the value of the 2nd best road class of all
-          // connections. This protects against downgrading links
-          // when branches occur.
-          uint32_t rc = *(++endrc.cbegin());
-          for (auto idx : linkedgeindexes) {
-            sequence<Edge>::iterator element = edges[idx];
-            auto edge = *element;
-            edge.attributes.reclass_link = true;
-            if (rc > edge.attributes.importance) {
-              edge.attributes.importance = rc;
-              element = edge;
-              count++;
-            }
-          }
-        }
-      }
+  // List the link edges of each component together
+  std::vector<uint32_t> component(graph.edges.size());
+  std::vector<uint32_t> component_offsets(1, 0);
+  for (uint32_t e = 0; e < graph.edges.size(); e++) {
+    uint32_t root = links.Find(e);
+    if (root == e) {
+      component[e] = component_offsets.size() - 1;
+      component_offsets.push_back(0);
     }
+    component_offsets[component[root] + 1]++;
+  }
+  for (size_t i = 1; i < component_offsets.size(); i++) {
+    component_offsets[i] += component_offsets[i - 1];
+  }
+  std::vector<uint32_t> component_edges(graph.edges.size());
+  std::vector<uint32_t> fill(component_offsets.begin(), component_offsets.end() - 1);
+  for (uint32_t e = 0; e < graph.edges.size(); e++) {
+    component_edges[fill[component[links.Find(e)]]++] = e;
+  }
 
-    //go to the next node
-    node_itr += bundle.node_count;
+  // Classify the components
+  std::vector<LinkResult> results(threads.size());
+  next = 0;
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].reset(new std::thread(ClassifyLinks, std::cref(graph),
+                                     std::cref(component_offsets), std::cref(component_edges),
+                                     std::ref(next), std::ref(results[i])));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
+
+  // Update the edges in file order
+  std::vector<std::pair<uint32_t, uint32_t> > updates;
+  for (const auto& result : results) {
+    updates.insert(updates.end(), result.updates.begin(), result.updates.end());
+    for (auto wayindex : result.unconnected) {
+      stats.AddIssue(kUnconnectedLinkEdge, GraphId(), (*ways[wayindex]).way_id(), 0);
+    }
+  }
+  std::sort(updates.begin(), updates.end());
+  for (const auto& update : updates) {
+    sequence<Edge>::iterator element = edges[update.first];
+    auto edge = *element;
+    edge.attributes.reclass_link = true;
+    edge.attributes.importance = update.second;
+    element = edge;
   }
-  LOG_INFO("Finished with " + std::to_string(count) + " reclassified.");
+  LOG_INFO("Finished with " + std::to_string(updates.size()) + " reclassified.");
 }
 
 }
@@ -0,0 +1,213 @@
+#include "mjolnir/metrics.h"
+
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <valhalla/midgard/logging.h>
+
+namespace {
+
+// Prometheus only allows letters, digits and underscores in names
+std::string PrometheusName(const std::string& name) {
+  std::string result = "mjolnir_";
+  for (auto c : name) {
+    result += (isalnum(c) || c == '_') ? c : '_';
+  }
+  return result;
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+Counter::Counter()
+    : value_(0) {
+}
+
+uint64_t Counter::value() const {
+  return value_.load(std::memory_order_relaxed);
+}
+
+Gauge::Gauge()
+    : value_(0) {
+}
+
+int64_t Gauge::value() const {
+  return value_.load(std::memory_order_relaxed);
+}
+
+Timer::Timer()
+    : count_(0), nanoseconds_(0), max_nanoseconds_(0) {
+}
+
+void Timer::Record(const std::chrono::steady_clock::duration& duration) {
+  uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+  count_.fetch_add(1, std::memory_order_relaxed);
+  nanoseconds_.fetch_add(nanoseconds, std::memory_order_relaxed);
+  uint64_t max = max_nanoseconds_.load(std::memory_order_relaxed);
+  while (nanoseconds > max &&
+         !max_nanoseconds_.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+  }
+}
+
+uint64_t Timer::count() const {
+  return count_.load(std::memory_order_relaxed);
+}
+
+double Timer::seconds() const {
+  return nanoseconds_.load(std::memory_order_relaxed) * 1e-9;
+}
+
+double Timer::max_seconds() const {
+  return max_nanoseconds_.load(std::memory_order_relaxed) * 1e-9;
+}
+
+Metrics::Metrics() {
+}
+
+Metrics& Metrics::Get() {
+  static Metrics metrics;
+  return metrics;
+}
+
+Counter& Metrics::counter(const std::string& name) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto& counter = counters_[name];
+  if (!counter) {
+    counter.reset(new Counter());
+  }
+  return *counter;
+}
+
+Gauge& Metrics::gauge(const std::string& name) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto& gauge = gauges_[name];
+  if (!gauge) {
+    gauge.reset(new Gauge());
+  }
+  return *gauge;
+}
+
+Timer& Metrics::timer(const std::string& name) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto& timer = timers_[name];
+  if (!timer) {
+    timer.reset(new Timer());
+  }
+  return *timer;
+}
+
+// Names are made by the code, not the data, so they need no escaping
+std::string Metrics::JsonLine() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::ostringstream json;
+  json << std::fixed << std::setprecision(6) << "{\"time\":" << std::chrono::duration<double>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  json << ",\"counters\":{";
+  for (auto counter = counters_.cbegin(); counter != counters_.cend(); ++counter) {
+    json << (counter == counters_.cbegin() ? "" : ",") << '"' << counter->first << "\":"
+         << counter->second->value();
+  }
+  json << "},\"gauges\":{";
+  for (auto gauge = gauges_.cbegin(); gauge != gauges_.cend(); ++gauge) {
+    json << (gauge == gauges_.cbegin() ? "" : ",") << '"' << gauge->first << "\":"
+         << gauge->second->value();
+  }
+  json << "},\"timers\":{";
+  for (auto timer = timers_.cbegin(); timer != timers_.cend(); ++timer) {
+    json << (timer == timers_.cbegin() ? "" : ",") << '"' << timer->first << "\":{\"count\":"
+         << timer->second->count() << ",\"seconds\":" << timer->second->seconds()
+         << ",\"max_seconds\":" << timer->second->max_seconds() << "}";
+  }
+  json << "}}";
+  return json.str();
+}
+
+// Timers are written as summaries without quantiles plus a gauge of the
+// longest duration
+std::string Metrics::Prometheus() const {
+  std::lock_guard<std::mutex> lock(lock_);
+  std::ostringstream text;
+  text << std::fixed << std::setprecision(6);
+  for (const auto& counter : counters_) {
+    auto name = PrometheusName(counter.first) + "_total";
+    text << "# TYPE " << name << " counter\n" << name << " " << counter.second->value() << "\n";
+  }
+  for (const auto& gauge : gauges_) {
+    auto name = PrometheusName(gauge.first);
+    text << "# TYPE " << name << " gauge\n" << name << " " << gauge.second->value() << "\n";
+  }
+  for (const auto& timer : timers_) {
+    auto name = PrometheusName(timer.first) + "_seconds";
+    text << "# TYPE " << name << " summary\n"
+         << name << "_count " << timer.second->count() << "\n"
+         << name << "_sum " << timer.second->seconds() << "\n"
+         << "# TYPE " << name << "_max gauge\n"
+         << name << "_max " << timer.second->max_seconds() << "\n";
+  }
+  return text.str();
+}
+
+MetricsExporter::MetricsExporter(const boost::property_tree::ptree& pt)
+    : file_name_(pt.get<std::string>("mjolnir.metrics.file", "")),
+      prometheus_(pt.get<std::string>("mjolnir.metrics.format", "json") == "prometheus"),
+      interval_(static_cast<int64_t>(pt.get<float>("mjolnir.metrics.interval", 10.0f) * 1000)),
+      stopped_(false) {
+  if (file_name_.empty()) {
+    return;
+  }
+  if (interval_.count() <= 0) {
+    LOG_WARN("Metrics interval must be at least a millisecond, not writing metrics");
+    return;
+  }
+  if (!prometheus_) {
+    // Start a new series of lines for this build
+    std::ofstream file(file_name_, std::ios::trunc);
+  }
+  LOG_INFO("Writing metrics to " + file_name_);
+  thread_.reset(new std::thread(&MetricsExporter::Run, this));
+}
+
+MetricsExporter::~MetricsExporter() {
+  if (!thread_) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(lock_);
+    stopped_ = true;
+  }
+  stop_.notify_one();
+  thread_->join();
+}
+
+void MetricsExporter::Run() {
+  std::unique_lock<std::mutex> lock(lock_);
+  while (!stop_.wait_for(lock, interval_, [this]() { return stopped_; })) {
+    Write();
+  }
+  Write();
+}
+
+// The prometheus file is replaced whole so it is never read half written
+void MetricsExporter::Write() const {
+  if (prometheus_) {
+    std::string temp_name = file_name_ + ".tmp";
+    {
+      std::ofstream file(temp_name, std::ios::trunc);
+      file << Metrics::Get().Prometheus();
+    }
+    if (std::rename(temp_name.c_str(), file_name_.c_str()) != 0) {
+      LOG_WARN("Could not write metrics to " + file_name_);
+    }
+  } else {
+    std::ofstream file(file_name_, std::ios::app);
+    file << Metrics::Get().JsonLine() << std::endl;
+  }
+}
+
+}
+}
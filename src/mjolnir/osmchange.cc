@@ -0,0 +1,244 @@
+#include "mjolnir/osmchange.h"
+#include "mjolnir/osmdata.h"
+#include "mjolnir/osmway.h"
+
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <expat.h>
+#include <boost/filesystem/operations.hpp>
+
+#include <valhalla/midgard/logging.h>
+#include <valhalla/midgard/sequence.h>
+
+using namespace valhalla::baldr;
+using namespace valhalla::midgard;
+
+namespace {
+
+// Size of the blocks the change file is read in
+constexpr size_t kReadSize = 64 * 1024;
+
+// State of the parse of a change file
+struct osc_parse_t {
+  std::unordered_set<uint64_t>& nodes;
+  std::unordered_set<uint64_t>& ways;
+  std::unordered_set<uint64_t>& relations;
+  std::vector<PointLL>& locations;
+  bool in_action;
+  bool deleting;
+  bool in_relation;
+  std::string error;
+};
+
+const char* Attribute(const char** attributes, const char* name) {
+  for (size_t i = 0; attributes[i]; i += 2) {
+    if (std::strcmp(attributes[i], name) == 0) {
+      return attributes[i + 1];
+    }
+  }
+  return nullptr;
+}
+
+// Created, modified and deleted elements are all changes. Only the new
+// location of a node is in the file, its old one is in the previous build.
+void Start(osc_parse_t& parse, const char* name, const char** attributes) {
+  if (std::strcmp(name, "create") == 0 || std::strcmp(name, "modify") == 0 ||
+      std::strcmp(name, "delete") == 0) {
+    parse.in_action = true;
+    parse.deleting = name[0] == 'd';
+    return;
+  }
+  if (!parse.in_action) {
+    return;
+  }
+  const char* id = Attribute(attributes, std::strcmp(name, "member") == 0 ? "ref" : "id");
+  if (std::strcmp(name, "node") == 0 || std::strcmp(name, "way") == 0 ||
+      std::strcmp(name, "relation") == 0 || std::strcmp(name, "member") == 0) {
+    if (!id) {
+      parse.error = std::string(name) + " without an id";
+      return;
+    }
+  }
+  if (std::strcmp(name, "node") == 0) {
+    parse.nodes.insert(std::stoull(id));
+    const char* lon = Attribute(attributes, "lon");
+    const char* lat = Attribute(attributes, "lat");
+    if (!parse.deleting && lon && lat) {
+      parse.locations.emplace_back(std::stof(lon), std::stof(lat));
+    }
+  } else if (std::strcmp(name, "way") == 0) {
+    parse.ways.insert(std::stoull(id));
+  } else if (std::strcmp(name, "relation") == 0) {
+    parse.relations.insert(std::stoull(id));
+    parse.in_relation = true;
+  } else if (std::strcmp(name, "member") == 0 && parse.in_relation) {
+    // Restrictions and routes change the ways and nodes they refer to
+    const char* type = Attribute(attributes, "type");
+    if (type && std::strcmp(type, "way") == 0) {
+      parse.ways.insert(std::stoull(id));
+    } else if (type && std::strcmp(type, "node") == 0) {
+      parse.nodes.insert(std::stoull(id));
+    }
+  }
+}
+
+// Exceptions must not pass through expat, they are kept until it returns
+void StartElement(void* data, const char* name, const char** attributes) {
+  auto& parse = *static_cast<osc_parse_t*>(data);
+  if (!parse.error.empty()) {
+    return;
+  }
+  try {
+    Start(parse, name, attributes);
+  }
+  catch (const std::exception& e) {
+    parse.error = std::string("invalid ") + name + ": " + e.what();
+  }
+}
+
+void EndElement(void* data, const char* name) {
+  auto& parse = *static_cast<osc_parse_t*>(data);
+  if (std::strcmp(name, "relation") == 0) {
+    parse.in_relation = false;
+  } else if (std::strcmp(name, "create") == 0 || std::strcmp(name, "modify") == 0 ||
+             std::strcmp(name, "delete") == 0) {
+    parse.in_action = false;
+  }
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+OSMChange::OSMChange() {
+}
+
+// The elements are only added once the whole file was read
+void OSMChange::Load(const std::string& file_name) {
+  std::ifstream file(file_name, std::ios::binary);
+  if (!file.is_open()) {
+    throw std::runtime_error("Unable to open: " + file_name);
+  }
+  std::unordered_set<uint64_t> nodes, ways, relations;
+  std::vector<PointLL> locations;
+  osc_parse_t parse{ nodes, ways, relations, locations, false, false, false, "" };
+  std::unique_ptr<XML_ParserStruct, void(*)(XML_Parser)> parser(XML_ParserCreate(nullptr),
+                                                                 XML_ParserFree);
+  XML_SetUserData(parser.get(), &parse);
+  XML_SetElementHandler(parser.get(), StartElement, EndElement);
+  std::vector<char> buffer(kReadSize);
+  bool done = false;
+  while (!done) {
+    file.read(buffer.data(), buffer.size());
+    done = file.gcount() < static_cast<std::streamsize>(buffer.size());
+    if (XML_Parse(parser.get(), buffer.data(), file.gcount(), done) == XML_STATUS_ERROR) {
+      throw std::runtime_error(file_name + " line " +
+                               std::to_string(XML_GetCurrentLineNumber(parser.get())) + ": " +
+                               XML_ErrorString(XML_GetErrorCode(parser.get())));
+    }
+    if (!parse.error.empty()) {
+      throw std::runtime_error(file_name + ": " + parse.error);
+    }
+  }
+
+  nodes_.insert(nodes.begin(), nodes.end());
+  ways_.insert(ways.begin(), ways.end());
+  relations_.insert(relations.begin(), relations.end());
+  locations_.insert(locations_.end(), locations.begin(), locations.end());
+  LOG_INFO("Change " + file_name + " touches " + std::to_string(nodes_.size()) + " nodes, " +
+           std::to_string(ways_.size()) + " ways and " + std::to_string(relations_.size()) +
+           " relations");
+}
+
+void OSMChange::AddRelationMembers(const std::string& relation_members_file) {
+  if (relations_.empty()) {
+    return;
+  }
+  if (!boost::filesystem::exists(relation_members_file)) {
+    LOG_WARN("No " + relation_members_file + " to find the members of changed relations in");
+    return;
+  }
+  size_t added = 0;
+  sequence<OSMRelationMember> members(relation_members_file, false);
+  for (auto itr = members.begin(); itr != members.end(); ++itr) {
+    const OSMRelationMember member = *itr;
+    if (relations_.find(member.relation_id) == relations_.end()) {
+      continue;
+    }
+    if (member.member_type == OSMType::kWay) {
+      added += ways_.insert(member.member_id).second;
+    } else if (member.member_type == OSMType::kNode) {
+      added += nodes_.insert(member.member_id).second;
+    }
+  }
+  LOG_INFO("Changed relations had " + std::to_string(added) + " more members in " +
+           relation_members_file);
+}
+
+std::set<GraphId> OSMChange::DirtyTiles(const TileHierarchy& hierarchy,
+    const std::vector<std::pair<std::string, std::string> >& intermediates) const {
+  const auto& local = hierarchy.levels().rbegin()->second;
+  std::set<GraphId> touched;
+  for (const auto& location : locations_) {
+    GraphId tile = hierarchy.GetGraphId(location, local.level);
+    if (tile.Is_Valid()) {
+      touched.insert(tile.Tile_Base());
+    }
+  }
+
+  // Way nodes are in order of their way so each way is only read once
+  for (const auto& files : intermediates) {
+    if (!boost::filesystem::exists(files.first) || !boost::filesystem::exists(files.second)) {
+      LOG_WARN("No " + files.first + " or " + files.second + " to find changed tiles in");
+      continue;
+    }
+    sequence<OSMWay> ways(files.first, false);
+    sequence<OSMWayNode> way_nodes(files.second, false);
+    size_t way_index = static_cast<size_t>(-1);
+    bool way_changed = false;
+    for (auto itr = way_nodes.begin(); itr != way_nodes.end(); ++itr) {
+      const OSMWayNode way_node = *itr;
+      if (way_node.way_index != way_index) {
+        way_index = way_node.way_index;
+        way_changed = ways_.find((*ways[way_index]).way_id()) != ways_.end();
+      }
+      if (way_changed || nodes_.find(way_node.node.osmid) != nodes_.end()) {
+        GraphId tile = hierarchy.GetGraphId({ way_node.node.lng, way_node.node.lat }, local.level);
+        if (tile.Is_Valid()) {
+          touched.insert(tile.Tile_Base());
+        }
+      }
+    }
+  }
+
+  // Add the neighbours, their edges can run into the touched tiles and the
+  // enhancer looks into the touched tiles from them. The tiles around the
+  // neighbours only see the touched tiles through the searches of the
+  // enhancer that expand the graph, which have to cross a whole tile to
+  // reach them.
+  int32_t columns = local.tiles.ncolumns();
+  int32_t rows = local.tiles.nrows();
+  std::set<GraphId> dirty;
+  for (const auto& tile : touched) {
+    int32_t row = tile.tileid() / columns;
+    int32_t col = tile.tileid() % columns;
+    for (int32_t r = std::max(row - 1, 0); r <= std::min(row + 1, rows - 1); r++) {
+      for (int32_t c = std::max(col - 1, 0); c <= std::min(col + 1, columns - 1); c++) {
+        dirty.emplace(local.tiles.TileId(c, r), local.level, 0);
+      }
+    }
+  }
+  LOG_INFO("Change touches " + std::to_string(touched.size()) + " local tiles, " +
+           std::to_string(dirty.size()) + " with their neighbours");
+  return dirty;
+}
+
+bool OSMChange::empty() const {
+  return nodes_.empty() && ways_.empty() && relations_.empty();
+}
+
+}
+}
@@ -0,0 +1,82 @@
+#include "mjolnir/osmdata.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace valhalla {
+namespace mjolnir {
+
+// Sort and remove duplicates, the rank of a node is its index
+void OSMShapeMap::set_nodes(std::vector<uint64_t>&& osmids) {
+  osmids_ = std::move(osmids);
+  std::sort(osmids_.begin(), osmids_.end());
+  osmids_.erase(std::unique(osmids_.begin(), osmids_.end()), osmids_.end());
+  osmids_.shrink_to_fit();
+  shapes_.assign(osmids_.size(), PointLL());
+  found_.assign(osmids_.size(), false);
+  count_ = 0;
+}
+
+bool OSMShapeMap::set(const uint64_t osmid, const PointLL& ll) {
+  auto itr = std::lower_bound(osmids_.cbegin(), osmids_.cend(), osmid);
+  if (itr == osmids_.cend() || *itr != osmid) {
+    return false;
+  }
+  size_t rank = itr - osmids_.cbegin();
+  if (!found_[rank]) {
+    found_[rank] = true;
+    ++count_;
+  }
+  shapes_[rank] = ll;
+  return true;
+}
+
+const PointLL& OSMShapeMap::at(const uint64_t osmid) const {
+  auto itr = std::lower_bound(osmids_.cbegin(), osmids_.cend(), osmid);
+  if (itr == osmids_.cend() || *itr != osmid || !found_[itr - osmids_.cbegin()]) {
+    throw std::out_of_range("No shape for node " + std::to_string(osmid));
+  }
+  return shapes_[itr - osmids_.cbegin()];
+}
+
+size_t OSMShapeMap::size() const {
+  return count_;
+}
+
+void OSMWayMap::emplace(const uint64_t osmid, const std::vector<uint64_t>& nodes) {
+  ways_.push_back({ osmid, nodes_.size(), static_cast<uint32_t>(nodes.size()) });
+  nodes_.insert(nodes_.end(), nodes.cbegin(), nodes.cend());
+}
+
+// Stable so that the first of any duplicate ways is the one kept
+void OSMWayMap::sort() {
+  std::stable_sort(ways_.begin(), ways_.end(),
+                   [](const way_t& a, const way_t& b) { return a.osmid < b.osmid; });
+  ways_.erase(std::unique(ways_.begin(), ways_.end(),
+                          [](const way_t& a, const way_t& b) { return a.osmid == b.osmid; }),
+              ways_.end());
+  ways_.shrink_to_fit();
+  nodes_.shrink_to_fit();
+}
+
+bool OSMWayMap::find(const uint64_t osmid, nodes_t& nodes) const {
+  auto itr = std::lower_bound(ways_.cbegin(), ways_.cend(), osmid,
+                              [](const way_t& w, const uint64_t id) { return w.osmid < id; });
+  if (itr == ways_.cend() || itr->osmid != osmid) {
+    return false;
+  }
+  nodes.first = nodes_.data() + itr->offset;
+  nodes.last = nodes.first + itr->count;
+  return true;
+}
+
+const std::vector<uint64_t>& OSMWayMap::node_ids() const {
+  return nodes_;
+}
+
+size_t OSMWayMap::size() const {
+  return ways_.size();
+}
+
+}
+}
@@ -1,5 +1,12 @@
 #include <string>
 #include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <algorithm>
+#include <cstdint>
 
 #include "mjolnir/pbfadminparser.h"
 #include "mjolnir/graphbuilder.h"
@@ -24,8 +31,14 @@
 #include <geos/io/WKTWriter.h>
 #include <geos/util/GEOSException.h>
 #include <geos/opLinemerge.h>
+#include <geos/geom/Envelope.h>
+#include <geos/geom/prep/PreparedGeometry.h>
+#include <geos/geom/prep/PreparedGeometryFactory.h>
+#include <geos/index/strtree/STRtree.h>
 
 using namespace geos::geom;
+using namespace geos::geom::prep;
+using namespace geos::index::strtree;
 using namespace geos::io;
 using namespace geos::util;
 using namespace geos::operation::linemerge;
@@ -40,6 +53,9 @@ using namespace valhalla::mjolnir;
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/optional.hpp>
 
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/aabb2.h>
+#include <valhalla/midgard/pointll.h>
 #include <valhalla/midgard/logging.h>
 
 namespace bpo = boost::program_options;
@@ -128,11 +144,9 @@ int polygondata_comparearea(const void* vp1, const void* vp2)
 }
 } // anonymous namespace
 
-std::vector<std::string> GetWkts(std::unique_ptr<Geometry>& mline) {
+std::vector<std::string> GetWkts(GeometryFactory& gf, std::unique_ptr<Geometry>& mline) {
   std::vector<std::string> wkts;
 
-  GeometryFactory gf;
-
   LineMerger merger;
   merger.add(mline.get());
   std::unique_ptr<std::vector<LineString *> > merged(merger.getMergedLineStrings());
@@ -162,34 +176,43 @@ std::vector<std::string> GetWkts(std::unique_ptr<Geometry>& mline) {
   if (totalpolys) {
     qsort(polys, totalpolys, sizeof(polygondata), polygondata_comparearea);
 
-    unsigned toplevelpolygons = 0;
-    int istoplevelafterall;
-
-    for (unsigned i=0 ;i < totalpolys; ++i) {
-      if (polys[i].iscontained != 0)
-        continue;
-
-      toplevelpolygons++;
-
-      for (unsigned j=i+1; j < totalpolys; ++j) {
-        // Does polygon[i] contain the smaller polygon[j]?
-        if (polys[j].containedbyid == 0 && polys[i].polygon->contains(polys[j].polygon)) {
-          // are we in a [i] contains [k] contains [j] situation
-          // which would actually make j top level
-          istoplevelafterall = 0;
-          for (unsigned k=i+1; k < j; ++k) {
-            if (polys[k].iscontained && polys[k].containedbyid == i &&
-                polys[k].polygon->contains(polys[j].polygon)) {
-              istoplevelafterall = 1;
-              break;
-            }
-          }
-          if (istoplevelafterall == 0) {
-            polys[j].iscontained = 1;
-            polys[j].containedbyid = i;
-          }
+    // Index the ring envelopes so each ring is only tested against the
+    // larger rings that could contain it
+    STRtree tree;
+    for (unsigned i=0 ;i < totalpolys; ++i)
+      tree.insert(polys[i].polygon->getEnvelopeInternal(), reinterpret_cast<void*>(static_cast<uintptr_t>(i)));
+
+    // Rings are prepared the first time they are tested as a container
+    std::vector<std::unique_ptr<const PreparedGeometry> > prepared(totalpolys);
+    std::vector<std::vector<unsigned> > holes(totalpolys);
+    std::vector<void*> candidates;
+    for (unsigned j=1; j < totalpolys; ++j) {
+      const Envelope* envelope = polys[j].polygon->getEnvelopeInternal();
+      candidates.clear();
+      tree.query(envelope, candidates);
+
+      // Count the larger rings containing this one and find the smallest
+      unsigned depth = 0;
+      unsigned parent = 0;
+      for (auto* candidate : candidates) {
+        unsigned i = static_cast<unsigned>(reinterpret_cast<uintptr_t>(candidate));
+        if (i >= j || !polys[i].polygon->getEnvelopeInternal()->contains(envelope))
+          continue;
+        if (!prepared[i])
+          prepared[i].reset(PreparedGeometryFactory::prepare(polys[i].polygon));
+        if (prepared[i]->contains(polys[j].polygon)) {
+          depth++;
+          parent = std::max(parent, i);
         }
       }
+
+      // Rings inside an odd number of rings are holes in the smallest one,
+      // rings inside a hole are islands and so top level again
+      if (depth % 2 == 1) {
+        polys[j].iscontained = 1;
+        polys[j].containedbyid = parent;
+        holes[parent].push_back(j);
+      }
     }
     // polys now is a list of polygons tagged with which ones are inside each other
 
@@ -202,11 +225,8 @@ std::vector<std::string> GetWkts(std::unique_ptr<Geometry>& mline) {
 
       // List of holes for this top level polygon
       std::unique_ptr<std::vector<Geometry*> > interior(new std::vector<Geometry*>);
-      for (unsigned j=i+1; j < totalpolys; ++j)
-      {
-        if (polys[j].iscontained == 1 && polys[j].containedbyid == i)
-          interior->push_back(polys[j].ring);
-      }
+      for (auto j : holes[i])
+        interior->push_back(polys[j].ring);
 
       Polygon* poly(gf.createPolygon(polys[i].ring, interior.release()));
       poly->normalize();
@@ -232,6 +252,219 @@ std::vector<std::string> GetWkts(std::unique_ptr<Geometry>& mline) {
   return wkts;
 }
 
+// Form a multi linestring from the member ways of an admin relation.
+// Returns nullptr if any of the ways are missing from the extract.
+std::unique_ptr<Geometry> GetLines(GeometryFactory& gf, const OSMData& osmdata,
+                                   const OSMAdmin& admin) {
+  std::unique_ptr<std::vector<Geometry*> > lines(new std::vector<Geometry*>);
+  for (const auto memberid : admin.ways()) {
+
+    OSMWayMap::nodes_t nodes;
+
+    // A relation may be included in an extract but it's members may not.
+    // Example:  PA extract can contain a NY relation.
+    if (!osmdata.way_map.find(memberid, nodes)) {
+      for (auto* line : *lines)
+        delete line;
+      return nullptr;
+    }
+
+    std::unique_ptr<CoordinateSequence> coords(gf.getCoordinateSequenceFactory()->create((size_t)0, (size_t)2));
+    for (const auto ref_id : nodes) {
+
+      const PointLL ll = osmdata.shape_map.at(ref_id);
+
+      Coordinate c;
+      c.x = ll.lng();
+      c.y = ll.lat();
+      coords->add(c, 0);
+
+    }
+
+    if (coords->getSize() > 1) {
+      lines->push_back(gf.createLineString(coords.release()));
+    }
+
+  } // member loop
+
+  return std::unique_ptr<Geometry>(gf.createMultiLineString(lines.release()));
+}
+
+// Polygons of each admin relation, filled in by the assembly threads and
+// consumed in relation order by the writer
+struct admin_polygons_t {
+  std::vector<std::vector<std::string> > wkts;
+  std::vector<uint8_t> ready;
+  std::mutex lock;
+  std::condition_variable assembled;
+
+  admin_polygons_t(const size_t count)
+    : wkts(count), ready(count, 0) {
+  }
+};
+
+// Assemble the polygons of admin relations until there are none left. Each
+// thread has its own geometry factory.
+void AssembleAdmins(const OSMData& osmdata, std::atomic<size_t>& next,
+                    admin_polygons_t& polygons) {
+  GeometryFactory gf;
+  for (size_t i = next++; i < osmdata.admins_.size(); i = next++) {
+    std::vector<std::string> wkts;
+    try {
+      auto mline = GetLines(gf, osmdata, osmdata.admins_[i]);
+      if (mline) {
+        wkts = GetWkts(gf, mline);
+      }
+    }
+    catch (std::exception& e)
+    {
+      LOG_ERROR("Standard exception processing relation: " + std::string(e.what()));
+    }
+    catch (...)
+    {
+      LOG_ERROR("Exception caught processing relations.");
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(polygons.lock);
+      polygons.wkts[i] = std::move(wkts);
+      polygons.ready[i] = 1;
+    }
+    polygons.assembled.notify_all();
+  }
+}
+
+/**
+ * Store the polygons of a table clipped to each local level tile they touch,
+ * so the enhancer only has to read tile sized fragments. The polygons are
+ * not simplified: neighbouring polygons would be simplified differently
+ * along their shared border, leaving gaps and overlaps there that change
+ * the admin and time zone found at the border. Tiles entirely covered by a
+ * polygon get a row with no geometry.
+ * @param  db_handle    Database holding the table.
+ * @param  hierarchy    Tile hierarchy to clip to.
+ * @param  table        Table of polygons, keyed by rowid.
+ * @param  filter       Where clause restricting the polygons to clip.
+ * @param  tile_table   Table to create with the fragments.
+ * @return Returns the number of fragments stored, 0 on error.
+ */
+uint32_t BuildTileFragments(sqlite3* db_handle, const valhalla::baldr::TileHierarchy& hierarchy,
+                            const std::string& table, const std::string& filter,
+                            const std::string& tile_table) {
+  char *err_msg = NULL;
+  std::string sql = "DROP TABLE IF EXISTS " + tile_table + "; CREATE TABLE " + tile_table + " (";
+  sql += "tileid INTEGER NOT NULL,";
+  sql += "id INTEGER NOT NULL,";
+  sql += "covers INTEGER NOT NULL); ";
+  sql += "SELECT AddGeometryColumn('" + tile_table + "', 'geom', 4326, 'MULTIPOLYGON', 2); ";
+  sql += "BEGIN";
+  uint32_t ret = sqlite3_exec(db_handle, sql.c_str(), NULL, NULL, &err_msg);
+  if (ret != SQLITE_OK) {
+    LOG_ERROR("Error: " + std::string(err_msg));
+    sqlite3_free(err_msg);
+    return 0;
+  }
+
+  sqlite3_stmt *select = NULL, *insert = NULL;
+  sql = "SELECT rowid, geom, MbrMinX(geom), MbrMinY(geom), ";
+  sql += "MbrMaxX(geom), MbrMaxY(geom) FROM " + table;
+  sql += filter.empty() ? "" : " WHERE " + filter;
+  if (sqlite3_prepare_v2(db_handle, sql.c_str(), sql.length(), &select, NULL) != SQLITE_OK) {
+    LOG_ERROR("SQL error: " + sql);
+    LOG_ERROR(std::string(sqlite3_errmsg(db_handle)));
+  }
+
+  // Fragments that are only lines or points where the polygon touches the
+  // tile edge are dropped
+  sql = "INSERT INTO " + tile_table + " (tileid, id, covers, geom) SELECT ?1, ?2, covers, geom FROM ";
+  sql += "(SELECT covers, CASE WHEN covers THEN NULL ELSE ";
+  sql += "CastToMulti(CollectionExtract(ST_Intersection(g, m), 3)) END AS geom FROM ";
+  sql += "(SELECT g, m, ST_Covers(g, m) AS covers FROM ";
+  sql += "(SELECT ?3 AS g, BuildMBR(?4, ?5, ?6, ?7, 4326) AS m) WHERE ST_Intersects(g, m))) ";
+  sql += "WHERE covers OR geom IS NOT NULL";
+  if (sqlite3_prepare_v2(db_handle, sql.c_str(), sql.length(), &insert, NULL) != SQLITE_OK) {
+    LOG_ERROR("SQL error: " + sql);
+    LOG_ERROR(std::string(sqlite3_errmsg(db_handle)));
+  }
+
+  uint32_t count = 0;
+  const auto& tiles = hierarchy.levels().rbegin()->second.tiles;
+  if (select && insert) {
+    while (sqlite3_step(select) == SQLITE_ROW) {
+      if (sqlite3_column_type(select, 1) != SQLITE_BLOB)
+        continue;
+      AABB2<PointLL> bbox(sqlite3_column_double(select, 2), sqlite3_column_double(select, 3),
+                          sqlite3_column_double(select, 4), sqlite3_column_double(select, 5));
+      for (auto tileid : tiles.TileList(bbox)) {
+        auto bounds = tiles.TileBounds(tileid);
+        sqlite3_reset(insert);
+        sqlite3_bind_int(insert, 1, tileid);
+        sqlite3_bind_int(insert, 2, sqlite3_column_int(select, 0));
+        sqlite3_bind_blob(insert, 3, sqlite3_column_blob(select, 1),
+                          sqlite3_column_bytes(select, 1), SQLITE_TRANSIENT);
+        sqlite3_bind_double(insert, 4, bounds.minx());
+        sqlite3_bind_double(insert, 5, bounds.miny());
+        sqlite3_bind_double(insert, 6, bounds.maxx());
+        sqlite3_bind_double(insert, 7, bounds.maxy());
+        ret = sqlite3_step(insert);
+        if (ret != SQLITE_DONE) {
+          LOG_ERROR("sqlite3_step() error: " + std::string(sqlite3_errmsg(db_handle)));
+          continue;
+        }
+        count += sqlite3_changes(db_handle);
+      }
+    }
+  }
+  sqlite3_finalize(select);
+  sqlite3_finalize(insert);
+
+  sql = "COMMIT; CREATE INDEX Idx_" + tile_table + "_tileid ON " + tile_table + " (tileid)";
+  ret = sqlite3_exec(db_handle, sql.c_str(), NULL, NULL, &err_msg);
+  if (ret != SQLITE_OK) {
+    LOG_ERROR("Error: " + std::string(err_msg));
+    sqlite3_free(err_msg);
+    return 0;
+  }
+  LOG_INFO("Stored " + std::to_string(count) + " tile fragments in " + tile_table);
+  return count;
+}
+
+/**
+ * Clip the time zone polygons to the tiles. The time zone database is built
+ * outside of mjolnir so the fragments are only added if it already exists.
+ */
+void BuildTimeZoneTiles(const boost::property_tree::ptree& pt,
+                        const valhalla::baldr::TileHierarchy& hierarchy) {
+  auto database = pt.get_optional<std::string>("timezone");
+  if (!database || !boost::filesystem::exists(*database)) {
+    LOG_WARN("Time zone db not found. Time zone tile fragments will not be created.");
+    return;
+  }
+
+  sqlite3 *db_handle;
+  char *err_msg = NULL;
+  uint32_t ret = sqlite3_open_v2((*database).c_str(), &db_handle, SQLITE_OPEN_READWRITE, NULL);
+  if (ret != SQLITE_OK) {
+    LOG_ERROR("cannot open " + (*database));
+    sqlite3_close(db_handle);
+    return;
+  }
+
+  // loading SpatiaLite as an extension
+  sqlite3_enable_load_extension(db_handle, 1);
+  std::string sql = "SELECT load_extension('mod_spatialite')";
+  ret = sqlite3_exec(db_handle, sql.c_str(), NULL, NULL, &err_msg);
+  if (ret != SQLITE_OK) {
+    LOG_ERROR("load_extension() error: " + std::string(err_msg));
+    sqlite3_free(err_msg);
+    sqlite3_close(db_handle);
+    return;
+  }
+
+  BuildTileFragments(db_handle, hierarchy, "tz_world", "", "tz_tiles");
+  sqlite3_close(db_handle);
+}
+
 /**
  * Build admins from protocol buffer input.
  */
@@ -327,107 +560,75 @@ void BuildAdminFromPBF(const boost::property_tree::ptree& pt,
     return;
   }
 
-  uint32_t count = 0;
-  uint64_t nodeid;
-  bool has_data;
-  GeometryFactory gf;
-
-  try {
-
-    for (const auto admin : osmdata.admins_) {
-
-      std::unique_ptr<Geometry> geom;
-      std::unique_ptr<std::vector<Geometry*> > lines(new std::vector<Geometry*>);
-      has_data = true;
-
-      for (const auto memberid : admin.ways()) {
-
-        auto itr = osmdata.way_map.find(memberid);
-
-        // A relation may be included in an extract but it's members may not.
-        // Example:  PA extract can contain a NY relation.
-        if (itr == osmdata.way_map.end()) {
-          has_data = false;
-          break;
-        }
-
-        std::unique_ptr<CoordinateSequence> coords(gf.getCoordinateSequenceFactory()->create((size_t)0, (size_t)2));
-        size_t j = 0;
-
-        for (const auto ref_id :itr->second) {
-
-          const PointLL ll = osmdata.shape_map.at(ref_id);
-
-          Coordinate c;
-          c.x = ll.lng();
-          c.y = ll.lat();
-          coords->add(c, 0);
-
-        }
-
-        if (coords->getSize() > 1) {
-          geom = std::unique_ptr<Geometry>(gf.createLineString(coords.release()));
-          lines->push_back(geom.release());
-        }
-
-      } // member loop
-
-      if (has_data) {
+  // Assemble the relations in parallel while this thread writes them out
+  unsigned int thread_count = std::max(static_cast<unsigned int>(1),
+      pt.get<unsigned int>("concurrency", std::thread::hardware_concurrency()));
+  LOG_INFO("Assembling " + std::to_string(osmdata.admins_.size()) + " admin relations with " +
+           std::to_string(thread_count) + " threads");
+  admin_polygons_t polygons(osmdata.admins_.size());
+  std::atomic<size_t> next(0);
+  std::vector<std::shared_ptr<std::thread> > threads(thread_count);
+  for (auto& thread : threads) {
+    thread.reset(new std::thread(AssembleAdmins, std::cref(osmdata), std::ref(next),
+                                 std::ref(polygons)));
+  }
 
-        std::unique_ptr<Geometry> mline (gf.createMultiLineString(lines.release()));
-        std::vector<std::string> wkts = GetWkts(mline);
-        std::string name;
+  // Insert in relation order so the table is the same as a serial run
+  uint32_t count = 0;
+  for (size_t i = 0; i < osmdata.admins_.size(); ++i) {
+    std::vector<std::string> wkts;
+    {
+      std::unique_lock<std::mutex> lock(polygons.lock);
+      polygons.assembled.wait(lock, [&polygons, i]() { return polygons.ready[i] != 0; });
+      wkts = std::move(polygons.wkts[i]);
+    }
 
-        for (const auto& wkt : wkts) {
+    const auto& admin = osmdata.admins_[i];
+    std::string name;
+    for (const auto& wkt : wkts) {
 
-          count++;
-          sqlite3_reset (stmt);
-          sqlite3_clear_bindings (stmt);
-          sqlite3_bind_int (stmt, 1, admin.admin_level());
+      count++;
+      sqlite3_reset (stmt);
+      sqlite3_clear_bindings (stmt);
+      sqlite3_bind_int (stmt, 1, admin.admin_level());
 
-          if (admin.iso_code_index()) {
-            name = osmdata.name_offset_map.name(admin.iso_code_index());
-            sqlite3_bind_text (stmt, 2, name.c_str(), name.length(), SQLITE_STATIC);
-          }
-          else
-            sqlite3_bind_null(stmt,2);
+      if (admin.iso_code_index()) {
+        name = osmdata.name_offset_map.name(admin.iso_code_index());
+        sqlite3_bind_text (stmt, 2, name.c_str(), name.length(), SQLITE_TRANSIENT);
+      }
+      else
+        sqlite3_bind_null(stmt,2);
 
-          sqlite3_bind_null(stmt,3);
+      sqlite3_bind_null(stmt,3);
 
-          name = osmdata.name_offset_map.name(admin.name_index());
-          sqlite3_bind_text (stmt, 4, name.c_str(), name.length(), SQLITE_STATIC);
+      name = osmdata.name_offset_map.name(admin.name_index());
+      sqlite3_bind_text (stmt, 4, name.c_str(), name.length(), SQLITE_TRANSIENT);
 
-          if (admin.name_en_index()) {
-            name = osmdata.name_offset_map.name(admin.name_en_index());
-            sqlite3_bind_text (stmt, 5, name.c_str(), name.length(), SQLITE_STATIC);
-          }
-          else
-            sqlite3_bind_null(stmt,5);
+      if (admin.name_en_index()) {
+        name = osmdata.name_offset_map.name(admin.name_en_index());
+        sqlite3_bind_text (stmt, 5, name.c_str(), name.length(), SQLITE_TRANSIENT);
+      }
+      else
+        sqlite3_bind_null(stmt,5);
+
+      sqlite3_bind_int (stmt, 6, admin.drive_on_right());
+      sqlite3_bind_text (stmt, 7, wkt.c_str(), wkt.length(), SQLITE_STATIC);
+      /* performing INSERT INTO */
+      ret = sqlite3_step (stmt);
+      if (ret == SQLITE_DONE || ret == SQLITE_ROW) {
+        continue;
+      }
+      LOG_ERROR("sqlite3_step() error: " + std::string(sqlite3_errmsg(db_handle)));
+      LOG_ERROR("sqlite3_step() Name: " + osmdata.name_offset_map.name(admin.name_index()));
+      LOG_ERROR("sqlite3_step() Name:en: " + osmdata.name_offset_map.name(admin.name_en_index()));
+      LOG_ERROR("sqlite3_step() Admin Level: " + std::to_string(admin.admin_level()));
+      LOG_ERROR("sqlite3_step() Drive on Right: " + std::to_string(admin.drive_on_right()));
 
-          sqlite3_bind_int (stmt, 6, admin.drive_on_right());
-          sqlite3_bind_text (stmt, 7, wkt.c_str(), wkt.length(), SQLITE_STATIC);
-          /* performing INSERT INTO */
-          ret = sqlite3_step (stmt);
-          if (ret == SQLITE_DONE || ret == SQLITE_ROW) {
-            continue;
-          }
-          LOG_ERROR("sqlite3_step() error: " + std::string(sqlite3_errmsg(db_handle)));
-          LOG_ERROR("sqlite3_step() Name: " + osmdata.name_offset_map.name(admin.name_index()));
-          LOG_ERROR("sqlite3_step() Name:en: " + osmdata.name_offset_map.name(admin.name_en_index()));
-          LOG_ERROR("sqlite3_step() Admin Level: " + std::to_string(admin.admin_level()));
-          LOG_ERROR("sqlite3_step() Drive on Right: " + std::to_string(admin.drive_on_right()));
+    }
+  }// admins
 
-        }
-      }// has data
-    }// admins
-  }
-  catch (std::exception& e)
-  {
-    LOG_ERROR("Standard exception processing relation: " + std::string(e.what()));
-  }
-  catch (...)
-  {
-    LOG_ERROR("Exception caught processing relations.");
+  for (auto& thread : threads) {
+    thread->join();
   }
 
   sqlite3_finalize (stmt);
@@ -498,6 +699,13 @@ void BuildAdminFromPBF(const boost::property_tree::ptree& pt,
   }
   LOG_INFO("Done updating Parent admin");
 
+  // Optionally clip the admins and time zones to the local level tiles
+  if (pt.get<bool>("admin_tiles", false)) {
+    valhalla::baldr::TileHierarchy hierarchy(pt.get<std::string>("tile_dir"));
+    BuildTileFragments(db_handle, hierarchy, "admins", "admin_level IN (2, 4)", "admin_tiles");
+    BuildTimeZoneTiles(pt, hierarchy);
+  }
+
   sqlite3_close (db_handle);
 }
 
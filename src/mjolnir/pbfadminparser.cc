@@ -4,10 +4,10 @@
 #include "mjolnir/osmpbfparser.h"
 #include "mjolnir/osmadmin.h"
 #include "mjolnir/luatagtransform.h"
-#include "mjolnir/idtable.h"
 #include "admin_lua_proc.h"
 
 #include <future>
+#include <algorithm>
 #include <utility>
 #include <thread>
 #include <boost/format.hpp>
@@ -21,8 +21,6 @@ using namespace valhalla::baldr;
 using namespace valhalla::mjolnir;
 
 namespace {
-// Will throw an error if this is exceeded. Then we can increase.
-constexpr uint64_t kMaxOSMNodeId = 4000000000;
 
 // Node equality
 const auto WayNodeEquals = [](const OSMWayNode& a, const OSMWayNode& b) {
@@ -36,19 +34,17 @@ struct admin_callback : public OSMPBF::Callback {
   virtual ~admin_callback() {}
   // Construct PBFAdminParser based on properties file and input PBF extract
   admin_callback(const boost::property_tree::ptree& pt, OSMData& osmdata)
-  : shape_(kMaxOSMNodeId), members_(kMaxOSMNodeId), osmdata_(osmdata), lua_(std::string(lua_admin_lua, lua_admin_lua + lua_admin_lua_len)) {
+  : osmdata_(osmdata), lua_(std::string(lua_admin_lua, lua_admin_lua + lua_admin_lua_len)) {
   }
 
   void node_callback(uint64_t osmid, double lng, double lat, const OSMPBF::Tags &tags) {
     // Check if it is in the list of nodes used by ways
-    if (!shape_.IsUsed(osmid)) {
+    if (!osmdata_.shape_map.set(osmid, PointLL(lng,lat))) {
       return;
     }
 
     ++osmdata_.osm_node_count;
 
-    osmdata_.shape_map.emplace(osmid, PointLL(lng,lat));
-
     if (osmdata_.shape_map.size() % 500000 == 0) {
       LOG_INFO("Processed " + std::to_string(osmdata_.shape_map.size()) + " nodes on ways");
     }
@@ -57,17 +53,12 @@ struct admin_callback : public OSMPBF::Callback {
   void way_callback(uint64_t osmid, const OSMPBF::Tags &tags, const std::vector<uint64_t> &nodes) {
 
     // Check if it is in the list of ways used by relations
-    if (!members_.IsUsed(osmid)) {
+    if (!std::binary_search(members_.cbegin(), members_.cend(), osmid)) {
       return;
     }
 
-    for (const auto node : nodes) {
-      ++osmdata_.node_count;
-      // Mark the nodes that we will care about when processing nodes
-      shape_.set(node);
-    }
-
-    osmdata_.way_map.emplace(osmid,std::list<uint64_t>(nodes.begin(), nodes.end()));
+    osmdata_.node_count += nodes.size();
+    osmdata_.way_map.emplace(osmid, nodes);
   }
 
   void relation_callback(const uint64_t osmid, const OSMPBF::Tags &tags, const std::vector<OSMPBF::Member> &members) {
@@ -97,7 +88,7 @@ struct admin_callback : public OSMPBF::Callback {
     for (const auto& member : members) {
 
       if (member.member_type == OSMPBF::Relation::MemberType::Relation_MemberType_WAY) {
-        members_.set(member.member_id);
+        members_.push_back(member.member_id);
         member_ids.push_back(member.member_id);
         ++osmdata_.osm_way_count;
       }
@@ -114,8 +105,24 @@ struct admin_callback : public OSMPBF::Callback {
   // Lua Tag Transformation class
   LuaTagTransform lua_;
 
-  // Mark the OSM Ids used by the ways and relations
-  IdTable shape_, members_;
+  // Sort the ways used by relations so they can be searched while parsing
+  // ways
+  void sort_members() {
+    std::sort(members_.begin(), members_.end());
+    members_.erase(std::unique(members_.begin(), members_.end()), members_.end());
+  }
+
+  // Sort the ways and mark the nodes that we will care about when
+  // processing nodes
+  void sort_ways() {
+    members_.clear();
+    members_.shrink_to_fit();
+    osmdata_.way_map.sort();
+    osmdata_.shape_map.set_nodes(std::vector<uint64_t>(osmdata_.way_map.node_ids()));
+  }
+
+  // The OSM Ids of the ways used by relations
+  std::vector<uint64_t> members_;
 
   // Pointer to all the OSM data (for use by callbacks)
   OSMData& osmdata_;
@@ -149,11 +156,13 @@ OSMData PBFAdminParser::Parse(const boost::property_tree::ptree& pt, const std::
   for (auto& file_handle : file_handles)
     OSMPBF::Parser::parse(file_handle, OSMPBF::Interest::RELATIONS, callback);
   LOG_INFO("Finished with " + std::to_string(osmdata.admins_.size()) + " admin polygons comprised of " + std::to_string(osmdata.osm_way_count) + " ways");
+  callback.sort_members();
 
   // Parse the ways.
   LOG_INFO("Parsing ways...");
   for (auto& file_handle : file_handles)
     OSMPBF::Parser::parse(file_handle, OSMPBF::Interest::WAYS, callback);
+  callback.sort_ways();
   LOG_INFO("Finished with " + std::to_string(osmdata.way_map.size()) + " ways comprised of " + std::to_string(osmdata.node_count) + " nodes");
 
   // Parse node in all the input files. Skip any that are not marked from
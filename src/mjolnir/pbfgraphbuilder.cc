@@ -1,12 +1,23 @@
+#include <atomic>
+#include <memory>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "mjolnir/buildpipeline.h"
+#include "mjolnir/buildsnapshot.h"
 #include "mjolnir/graphvalidator.h"
 #include "mjolnir/pbfgraphparser.h"
 #include "mjolnir/graphbuilder.h"
+#include "mjolnir/connectivityindex.h"
 #include "mjolnir/transitbuilder.h"
 #include "mjolnir/graphenhancer.h"
 #include "mjolnir/hierarchybuilder.h"
+#include "mjolnir/metrics.h"
+#include "mjolnir/osmchange.h"
+#include <valhalla/baldr/graphreader.h>
+#include <valhalla/baldr/graphtile.h>
 #include <valhalla/baldr/tilehierarchy.h>
 #include "config.h"
 
@@ -27,6 +38,10 @@ using namespace valhalla::mjolnir;
 namespace bpo = boost::program_options;
 
 boost::filesystem::path config_file_path;
+boost::filesystem::path report_file_path;
+boost::filesystem::path baseline_file_path;
+boost::filesystem::path changes_file_path;
+float regression_threshold = 0.1f;
 std::vector<std::string> input_files;
 
 bool ParseArguments(int argc, char *argv[]) {
@@ -49,6 +64,23 @@ bool ParseArguments(int argc, char *argv[]) {
       ("config,c",
         boost::program_options::value<boost::filesystem::path>(&config_file_path)->required(),
         "Path to the json configuration file.")
+      ("report,r",
+        boost::program_options::value<boost::filesystem::path>(&report_file_path),
+        "Write the time, cpu time, peak memory and bytes read and written by each "
+        "stage and step, and the size of the tiles, to this json file.")
+      ("baseline,b",
+        boost::program_options::value<boost::filesystem::path>(&baseline_file_path),
+        "Compare the build with a report from an earlier build and fail if it regressed.")
+      ("threshold,t",
+        boost::program_options::value<float>(&regression_threshold),
+        "Fraction a measure may grow over the baseline before it is a regression (default 0.1).")
+      ("changes,x",
+        boost::program_options::value<boost::filesystem::path>(&changes_file_path),
+        "OSM change file (.osc) the input files were updated with since the last build. "
+        "The input files are still parsed in full and the later stages still run on "
+        "every tile, only the local tiles the change touches are built and enhanced "
+        "again, starting from the snapshot in mjolnir.snapshot_dir. Falls back to a "
+        "full build if there is no snapshot.")
       // positional arguments
       ("input_files", boost::program_options::value<std::vector<std::string> >(&input_files)->multitoken());
 
@@ -87,6 +119,118 @@ bool ParseArguments(int argc, char *argv[]) {
   return false;
 }
 
+// Merge the connectivity of the tiles as the graph builder writes them. The
+// tiles are read right after they are written while they are still cached.
+// On failure the rest of the feed is drained so the index can be rebuilt
+// from the finished tiles.
+void ConnectTiles(const boost::property_tree::ptree& pt, TileFeed& feed,
+                  std::unique_ptr<ConnectivityBuilder>& connectivity,
+                  std::atomic<bool>& failed, BuiltTiles* built) {
+  valhalla::baldr::GraphReader reader(pt);
+  valhalla::baldr::GraphId tile_id;
+  Counter& tiles_added = Metrics::Get().counter("connectivity.tiles_added");
+  while (feed.Pop(tile_id)) {
+    if (!failed) {
+      try {
+        connectivity->Add(reader.GetGraphTile(tile_id));
+        tiles_added.Add();
+      }
+      catch (const std::exception& e) {
+        LOG_ERROR(std::string("Connectivity of tile failed: ") + e.what());
+        failed = true;
+      }
+      if (reader.OverCommitted()) {
+        reader.Clear();
+      }
+    }
+    // Done reading the tile, the enhancer may rewrite it now
+    if (built) {
+      built->Add(tile_id);
+    }
+  }
+}
+
+// Intermediate files of a build, kept with the snapshot for the next update
+const std::vector<std::string> kIntermediateFiles{
+  "ways.bin", "way_nodes.bin", "nodes.bin", "edges.bin", "relation_members.bin" };
+
+// An update needs the enhanced local level and the intermediate files of
+// the previous build. Transit is added to the local tiles by stop and is
+// not rebuilt by tile, so updates with transit are full builds.
+bool CanUpdate(const boost::property_tree::ptree& pt, const BuildPipeline& pipeline,
+               const BuildSnapshot& snapshot) {
+  if (!snapshot.configured()) {
+    LOG_WARN("No mjolnir.snapshot_dir to update from, building all tiles");
+    return false;
+  }
+  if (!snapshot.exists(kIntermediateFiles)) {
+    LOG_WARN("No complete snapshot to update from, building all tiles");
+    return false;
+  }
+  auto transit_dir = pt.get_optional<std::string>("mjolnir.transit_dir");
+  if (transit_dir && boost::filesystem::is_directory(*transit_dir)) {
+    LOG_WARN("Transit cannot be updated, building all tiles");
+    return false;
+  }
+  for (const auto& stage : { "parse", "build", "connectivity", "enhance" }) {
+    if (!pipeline.enabled(stage)) {
+      LOG_WARN(std::string("An update needs the ") + stage + " stage, building all tiles");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Transit is added to the local tiles before they are enhanced
+bool AddsTransit(const boost::property_tree::ptree& pt, const BuildPipeline& pipeline) {
+  auto transit_dir = pt.get_optional<std::string>("mjolnir.transit_dir");
+  return pipeline.enabled("transit") && transit_dir &&
+         boost::filesystem::is_directory(*transit_dir);
+}
+
+// Report of what each stage used, the peak RSS of the whole build and how
+// much was written to the tile dir
+boost::property_tree::ptree BuildReport(const std::vector<StageTiming>& timings,
+                                        const std::string& tile_dir) {
+  boost::property_tree::ptree report;
+  boost::property_tree::ptree inputs;
+  for (const auto& input_file : input_files) {
+    boost::property_tree::ptree input;
+    input.put("", input_file);
+    inputs.push_back(std::make_pair("", input));
+  }
+  report.add_child("input_files", inputs);
+
+  boost::property_tree::ptree stages;
+  for (const auto& timing : timings) {
+    if (!timing.ran) {
+      continue;
+    }
+    boost::property_tree::ptree stage;
+    stage.put("name", timing.name);
+    stage.put("seconds", timing.seconds);
+    stage.put("cpu_seconds", timing.cpu_seconds);
+    stage.put("peak_rss", timing.peak_rss);
+    stage.put("bytes_read", timing.bytes_read);
+    stage.put("bytes_written", timing.bytes_written);
+    stages.push_back(std::make_pair("", stage));
+  }
+  report.add_child("stages", stages);
+
+  uint64_t tile_bytes = 0;
+  size_t tile_files = 0;
+  for (boost::filesystem::recursive_directory_iterator i(tile_dir), end; i != end; ++i) {
+    if (boost::filesystem::is_regular_file(i->path())) {
+      tile_bytes += boost::filesystem::file_size(i->path());
+      tile_files++;
+    }
+  }
+  report.put("peak_rss", ResourceUsage::ProcessPeak());
+  report.put("tile_bytes", tile_bytes);
+  report.put("tile_files", tile_files);
+  return report;
+}
+
 int main(int argc, char** argv) {
 
   if (!ParseArguments(argc, argv))
@@ -103,41 +247,246 @@ int main(int argc, char** argv) {
     valhalla::midgard::logging::Configure(logging_config);
   }
 
-  //set up the directories and purge old tiles
+  // Write what the stages are doing while they run
+  MetricsExporter exporter(pt);
+
+  // Stages can be switched off to rerun later stages on existing tiles
+  BuildPipeline pipeline(pt);
+  if (pipeline.enabled("build") && !pipeline.enabled("parse")) {
+    LOG_ERROR("The build stage needs the parse stage");
+    return EXIT_FAILURE;
+  }
+
+  //set up the directories and purge old tiles if the graph is rebuilt
   auto tile_dir = pt.get<std::string>("mjolnir.tile_dir");
   valhalla::baldr::TileHierarchy hierarchy(tile_dir);
-  for(const auto& level : hierarchy.levels()) {
-    auto level_dir = tile_dir + "/" + std::to_string(level.first);
-    if(boost::filesystem::exists(level_dir) && !boost::filesystem::is_empty(level_dir)) {
-      LOG_WARN("Non-empty " + level_dir + " will be purged of tiles");
-      boost::filesystem::remove_all(level_dir);
+  BuildSnapshot snapshot(pt.get_child("mjolnir"));
+  if (pipeline.enabled("build")) {
+    for(const auto& level : hierarchy.levels()) {
+      auto level_dir = tile_dir + "/" + std::to_string(level.first);
+      if(boost::filesystem::exists(level_dir) && !boost::filesystem::is_empty(level_dir)) {
+        LOG_WARN("Non-empty " + level_dir + " will be purged of tiles");
+        boost::filesystem::remove_all(level_dir);
+      }
     }
+    // The connectivity of the old tiles goes with them, so the new tiles
+    // only have an index if the connectivity stage runs
+    boost::filesystem::remove(ConnectivityIndex::FileName(pt.get_child("mjolnir")));
   }
   boost::filesystem::create_directories(tile_dir);
 
-  // Read the OSM protocol buffer file. Callbacks for nodes, ways, and
-  // relations are defined within the PBFParser class
-  auto osm_data = PBFGraphParser::Parse(pt.get_child("mjolnir"), input_files, "ways.bin", "way_nodes.bin");
+  // An update starts from the enhanced local level of the previous build and
+  // only rebuilds the local tiles the change touches. The intermediate files
+  // of the previous build are kept with the snapshot to find where changed
+  // elements used to be. The change is not applied to them: the parser
+  // turns tags into way attributes with lua and collects names, restrictions
+  // and node attributes into the OSMData across the whole input, so the
+  // updated input is parsed again instead. The hierarchy builder forms the
+  // upper levels and the transitions in the local tiles from the whole local
+  // level and validate works on every level after it, so both still run on
+  // every tile.
+  OSMChange change;
+  std::set<valhalla::baldr::GraphId> rebuild;
+  bool update = !changes_file_path.empty() && CanUpdate(pt, pipeline, snapshot);
+  if (update) {
+    try {
+      change.Load(changes_file_path.string());
+      change.AddRelationMembers(snapshot.file("relation_members.bin"));
+    }
+    catch (const std::exception& e) {
+      LOG_ERROR("Unable to read " + changes_file_path.string() + ": " + e.what());
+      return EXIT_FAILURE;
+    }
+    snapshot.Restore();
+    LOG_INFO("Updating from " + changes_file_path.string() + ", the input is parsed in full "
+             "and the hierarchy and validate stages run on every tile");
+  }
 
-  // Build the graph using the OSMNodes and OSMWays from the parser
-  GraphBuilder::Build(pt, osm_data, "ways.bin", "way_nodes.bin");
+  // Read the OSM protocol buffer file. Callbacks for nodes, ways, and
+  // relations are defined within the PBFParser class. The intermediate
+  // files are removed first, the snapshot may link to the old ones.
+  OSMData osm_data{};
+  pipeline.Add("parse", [&pt, &osm_data, &pipeline]() {
+    for (const auto& file : kIntermediateFiles) {
+      boost::filesystem::remove(file);
+    }
+    osm_data = PBFGraphParser::Parse(pt.get_child("mjolnir"), input_files, "ways.bin", "way_nodes.bin",
+                                     pipeline.Steps("parse"), "relation_members.bin");
+  });
 
-  // Add transit
-  TransitBuilder::Build(pt);
+  // Build the graph using the OSMNodes and OSMWays from the parser. When
+  // both stages run, the connectivity of the graph is computed from the
+  // tiles as they are written. Without transit to add first, a tile is
+  // enhanced as soon as it and the tiles next to it are written (and read
+  // for the connectivity).
+  bool overlap = pipeline.enabled("build") && pipeline.enabled("connectivity") && !update;
+  bool overlap_enhance = pipeline.enabled("build") && pipeline.enabled("enhance") && !update &&
+                         !AddsTransit(pt, pipeline);
+  TileFeed built_tiles;
+  BuiltTiles enhance_tiles(hierarchy);
+  bool graph_built = false;
+  std::unique_ptr<ConnectivityBuilder> connectivity;
+  pipeline.Add("build", [&pt, &osm_data, &built_tiles, &enhance_tiles, &graph_built, &connectivity, &hierarchy,
+                         &pipeline, overlap, overlap_enhance, update, &change, &rebuild, &snapshot]() {
+    BuildObserver observer;
+    observer.step = pipeline.Steps("build");
+    if (overlap || overlap_enhance) {
+      observer.tiles_planned = [&pt, &connectivity, &enhance_tiles, &hierarchy, overlap, overlap_enhance](
+          const std::map<valhalla::baldr::GraphId, size_t>& node_records) {
+        if (overlap_enhance) {
+          std::set<valhalla::baldr::GraphId> planned;
+          for (const auto& tile : node_records) {
+            planned.insert(tile.first);
+          }
+          enhance_tiles.Plan(planned);
+        }
+        if (overlap) {
+          std::vector<uint32_t> capacities(hierarchy.levels().rbegin()->second.tiles.TileCount(), 0);
+          for (const auto& tile : node_records) {
+            capacities[tile.first.tileid()] = tile.second;
+          }
+          connectivity.reset(new ConnectivityBuilder(pt.get_child("mjolnir"), capacities));
+        }
+      };
+      observer.tile_built = [&built_tiles, &enhance_tiles, overlap](const valhalla::baldr::GraphId& tile_id) {
+        if (overlap) {
+          built_tiles.Push(tile_id);
+        } else {
+          enhance_tiles.Add(tile_id);
+        }
+      };
+    }
+    if (update) {
+      rebuild = change.DirtyTiles(hierarchy, {
+          { snapshot.file("ways.bin"), snapshot.file("way_nodes.bin") },
+          { "ways.bin", "way_nodes.bin" } });
+      GraphBuilder::AddConnectedTiles(snapshot.file("nodes.bin"), snapshot.file("edges.bin"),
+                                      rebuild);
+    }
+    try {
+      GraphBuilder::Build(pt, osm_data, "ways.bin", "way_nodes.bin", observer,
+                          update ? &rebuild : nullptr);
+    }
+    catch (...) {
+      built_tiles.Close();
+      if (!overlap) {
+        enhance_tiles.Close();
+      }
+      throw;
+    }
+    graph_built = true;
+    built_tiles.Close();
+    if (!overlap) {
+      enhance_tiles.Close();
+    }
+  });
 
   // Enhance the local level of the graph. This adds information to the local
   // level that is usable across all levels (density, administrative
   // information (and country based attribution), edge transition logic, etc.
-  GraphEnhancer::Enhance(pt);
+  // The enhanced local level is kept as the snapshot the next update starts
+  // from, the later stages add to its tiles. Transit rewrites the local
+  // tiles before the enhancer, so the enhancer only takes tiles from the
+  // build as they are written when there is no transit to add. Its searches
+  // then expand the graph, the connectivity of the whole level is not known
+  // yet, and wait for the tiles they reach.
+  bool connect_after_enhance = false;
+  auto enhance = [&pt, &snapshot, update, &rebuild, overlap_enhance, &enhance_tiles, &graph_built,
+                  &connect_after_enhance]() {
+    if (overlap_enhance) {
+      GraphEnhancer::Enhance(pt, enhance_tiles);
+      if (!graph_built) {
+        return;
+      }
+      if (connect_after_enhance) {
+        ConnectivityIndex::Build(pt);
+      }
+    } else {
+      GraphEnhancer::Enhance(pt, update ? &rebuild : nullptr);
+    }
+    if (snapshot.configured()) {
+      snapshot.Save(kIntermediateFiles, update ? &rebuild : nullptr);
+    }
+  };
+  if (overlap_enhance && !overlap) {
+    pipeline.Add("enhance", enhance, true);
+  }
+
+  // Compute the connectivity of the graph once so later passes can look it
+  // up instead of expanding the graph. If that fails while the enhancer
+  // rewrites the tiles, it is computed once the enhancer is done.
+  if (overlap) {
+    pipeline.Add("connectivity", [&pt, &built_tiles, &enhance_tiles, &graph_built, &connectivity,
+                                  overlap_enhance, &connect_after_enhance]() {
+      unsigned int thread_count = std::max(static_cast<unsigned int>(1),
+          pt.get<unsigned int>("mjolnir.concurrency", std::thread::hardware_concurrency()) / 4);
+      std::atomic<bool> failed(false);
+      std::vector<std::shared_ptr<std::thread> > threads(thread_count);
+      for (auto& thread : threads) {
+        thread.reset(new std::thread(ConnectTiles, std::cref(pt.get_child("mjolnir")),
+                                     std::ref(built_tiles), std::ref(connectivity),
+                                     std::ref(failed), overlap_enhance ? &enhance_tiles : nullptr));
+      }
+      for (auto& thread : threads) {
+        thread->join();
+      }
+      if (!graph_built) {
+        connectivity.reset();
+      } else if (failed && overlap_enhance) {
+        LOG_WARN("Computing connectivity from the enhanced tiles instead");
+        connectivity.reset();
+        connect_after_enhance = true;
+      } else if (failed) {
+        LOG_WARN("Computing connectivity from the finished tiles instead");
+        connectivity.reset();
+        ConnectivityIndex::Build(pt);
+      } else if (connectivity) {
+        connectivity->Finish();
+        connectivity.reset();
+      }
+      enhance_tiles.Close();
+    }, true);
+  } else {
+    pipeline.Add("connectivity", [&pt]() { ConnectivityIndex::Build(pt); });
+  }
+  if (overlap_enhance && overlap) {
+    pipeline.Add("enhance", enhance, true);
+  }
+
+  // Add transit
+  pipeline.Add("transit", [&pt]() { TransitBuilder::Build(pt); });
+
+  if (!overlap_enhance) {
+    pipeline.Add("enhance", enhance);
+  }
 
   // Builds additional hierarchies based on the config file. Connections
   // (directed edges) are formed between nodes at adjacent levels.
-  HierarchyBuilder::Build(pt);
+  pipeline.Add("hierarchy", [&pt]() { HierarchyBuilder::Build(pt); });
 
   // Validate the graph and add information that cannot be added until
   // full graph is formed.
-  GraphValidator::Validate(pt);
+  pipeline.Add("validate", [&pt]() { GraphValidator::Validate(pt); });
+
+  auto timings = pipeline.Run();
 
+  // Report what the build used and compare it with an earlier build
+  if (report_file_path.empty() && baseline_file_path.empty()) {
+    return EXIT_SUCCESS;
+  }
+  auto report = BuildReport(timings, tile_dir);
+  if (!report_file_path.empty()) {
+    boost::property_tree::write_json(report_file_path.string(), report);
+  }
+  if (!baseline_file_path.empty()) {
+    boost::property_tree::ptree baseline;
+    boost::property_tree::read_json(baseline_file_path.string(), baseline);
+    size_t regressions = CompareReport(report, baseline, regression_threshold);
+    if (regressions > 0) {
+      LOG_ERROR(std::to_string(regressions) + " regressions against " + baseline_file_path.string());
+      return EXIT_FAILURE;
+    }
+    LOG_INFO("No regressions against " + baseline_file_path.string());
+  }
   return EXIT_SUCCESS;
 }
-
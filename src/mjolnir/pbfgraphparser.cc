@@ -3,6 +3,7 @@
 #include "mjolnir/osmpbfparser.h"
 #include "mjolnir/luatagtransform.h"
 #include "mjolnir/idtable.h"
+#include "mjolnir/metrics.h"
 #include "graph_lua_proc.h"
 
 #include <future>
@@ -54,6 +55,9 @@ struct graph_callback : public OSMPBF::Callback {
   }
 
   void node_callback(uint64_t osmid, double lng, double lat, const OSMPBF::Tags &tags) {
+    static Counter& parsed = Metrics::Get().counter("parse.nodes");
+    parsed.Add();
+
     // Check if it is in the list of nodes used by ways
     if (!shape_.IsUsed(osmid)) {
       return;
@@ -185,6 +189,9 @@ struct graph_callback : public OSMPBF::Callback {
   }
 
   void way_callback(uint64_t osmid, const OSMPBF::Tags &tags, const std::vector<uint64_t> &nodes) {
+    static Counter& parsed = Metrics::Get().counter("parse.ways");
+    static Counter& written = Metrics::Get().counter("parse.bytes_written");
+    parsed.Add();
 
     // Do not add ways with < 2 nodes. Log error or add to a problem list
     // TODO - find out if we do need these, why they exist...
@@ -660,9 +667,13 @@ struct graph_callback : public OSMPBF::Callback {
 
     // Add the way to the list
     ways_->push_back(w);
+    written.Add(sizeof(OSMWay) + nodes.size() * sizeof(OSMWayNode));
   }
 
   void relation_callback(const uint64_t osmid, const OSMPBF::Tags &tags, const std::vector<OSMPBF::Member> &members) {
+    static Counter& parsed = Metrics::Get().counter("parse.relations");
+    parsed.Add();
+
     // Get tags
     Tags results = lua_.Transform(OSMType::kRelation, tags);
     if (results.size() == 0)
@@ -673,6 +684,17 @@ struct graph_callback : public OSMPBF::Callback {
       throw std::runtime_error("Detected unsorted input data");
     last_relation_ = osmid;
 
+    // Keep what the relation refers to so an update can find it again
+    if (relation_members_) {
+      for (const auto& member : members) {
+        if (member.member_type == OSMPBF::Relation::MemberType::Relation_MemberType_WAY) {
+          relation_members_->push_back({ osmid, member.member_id, OSMType::kWay });
+        } else if (member.member_type == OSMPBF::Relation::MemberType::Relation_MemberType_NODE) {
+          relation_members_->push_back({ osmid, member.member_id, OSMType::kNode });
+        }
+      }
+    }
+
     OSMRestriction restriction;
     uint64_t from_way_id = 0;
     bool isRestriction = false;
@@ -885,6 +907,8 @@ struct graph_callback : public OSMPBF::Callback {
   // Ways and nodes written to file, nodes are written in the order they appear in way (shape)
   std::unique_ptr<sequence<OSMWay> > ways_;
   std::unique_ptr<sequence<OSMWayNode> > way_nodes_;
+  // Members of the relations used, written while parsing relations if set
+  std::unique_ptr<sequence<OSMRelationMember> > relation_members_;
   // When updating the references with the node information we keep the last index we looked at
   // this lets us only have to iterate over the whole set once
   size_t current_way_node_index_;
@@ -901,7 +925,9 @@ namespace valhalla {
 namespace mjolnir {
 
 OSMData PBFGraphParser::Parse(const boost::property_tree::ptree& pt, const std::vector<std::string>& input_files,
-    const std::string& ways_file, const std::string& way_nodes_file) {
+    const std::string& ways_file, const std::string& way_nodes_file,
+    const std::function<void(const std::string&)>& step,
+    const std::string& relation_members_file) {
   //TODO: option 1: each one threads makes an osmdata and we splice them together at the end
   //option 2: synchronize around adding things to a single osmdata. will have to test to see
   //which is the least expensive (memory and speed). leaning towards option 2
@@ -925,6 +951,9 @@ OSMData PBFGraphParser::Parse(const boost::property_tree::ptree& pt, const std::
 
   // Parse the ways and find all node Ids needed (those that are part of a
   // way's node list. Iterate through each pbf input file.
+  if (step) {
+    step("ways");
+  }
   LOG_INFO("Parsing ways...")
   for (auto& file_handle : file_handles) {
     callback.current_way_node_index_ = callback.last_node_ = callback.last_way_ = callback.last_relation_ = 0;
@@ -935,16 +964,34 @@ OSMData PBFGraphParser::Parse(const boost::property_tree::ptree& pt, const std::
   LOG_INFO("Finished with " + std::to_string(osmdata.osm_way_count) + " routable ways containing " + std::to_string(osmdata.osm_way_node_count) + " nodes");
 
   // Parse relations.
+  if (step) {
+    step("relations");
+  }
   LOG_INFO("Parsing relations...")
+  if (!relation_members_file.empty()) {
+    callback.relation_members_.reset(new sequence<OSMRelationMember>(relation_members_file, true));
+  }
   for (auto& file_handle : file_handles) {
     callback.current_way_node_index_ = callback.last_node_ = callback.last_way_ = callback.last_relation_ = 0;
     OSMPBF::Parser::parse(file_handle, OSMPBF::Interest::RELATIONS, callback);
   }
+  if (callback.relation_members_) {
+    // Relations are only sorted within each input file
+    callback.relation_members_->sort(
+      [](const OSMRelationMember& a, const OSMRelationMember& b) {
+        return a.relation_id < b.relation_id;
+      }
+    );
+    callback.relation_members_.reset();
+  }
   LOG_INFO("Finished with " + std::to_string(osmdata.restrictions.size()) + " simple restrictions");
 
   //we need to sort the refs so that we can easily (sequentially) update them
   //during node processing, we use memory mapping here because otherwise we aren't
   //using much mem, the scoping makes sure to let it go when done sorting
+  if (step) {
+    step("sort by node");
+  }
   LOG_INFO("Sorting osm way node references by node id...");
   {
     sequence<OSMWayNode> way_nodes(way_nodes_file, false);
@@ -959,6 +1006,9 @@ OSMData PBFGraphParser::Parse(const boost::property_tree::ptree& pt, const std::
   // Parse node in all the input files. Skip any that are not marked from
   // being used in a way.
   // TODO: we know how many knows we expect, stop early once we have that many
+  if (step) {
+    step("nodes");
+  }
   LOG_INFO("Parsing nodes...");
   for (auto& file_handle : file_handles) {
     //each time we parse nodes we have to run through the way nodes file from the beginning because
@@ -975,6 +1025,9 @@ OSMData PBFGraphParser::Parse(const boost::property_tree::ptree& pt, const std::
 
   //we need to sort the refs so that we easily iterate over them for building edges
   //so we line them first by way index then by shape index of the node
+  if (step) {
+    step("sort by way");
+  }
   LOG_INFO("Sorting osm way node references by way index and node shape index...");
   {
     sequence<OSMWayNode> way_nodes(way_nodes_file, false);
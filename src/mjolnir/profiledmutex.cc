@@ -0,0 +1,129 @@
+#include "mjolnir/profiledmutex.h"
+
+#include <algorithm>
+#include <vector>
+#include <boost/format.hpp>
+
+#include <valhalla/midgard/logging.h>
+
+namespace {
+
+// Bucket of a wait, see kWaitBuckets
+size_t WaitBucket(const std::chrono::steady_clock::duration& wait) {
+  uint64_t microseconds = std::chrono::duration_cast<std::chrono::microseconds>(wait).count();
+  size_t bucket = 0;
+  while (microseconds > 0 && bucket + 1 < valhalla::mjolnir::ProfiledMutex::kWaitBuckets) {
+    microseconds >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+// Upper bound of the wait in microseconds below which a fraction of the
+// waits fall
+uint64_t WaitPercentile(const uint64_t* waits, const uint64_t count, const double fraction) {
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < valhalla::mjolnir::ProfiledMutex::kWaitBuckets; bucket++) {
+    seen += waits[bucket];
+    if (seen >= count * fraction) {
+      return static_cast<uint64_t>(1) << bucket;
+    }
+  }
+  return static_cast<uint64_t>(1) << (valhalla::mjolnir::ProfiledMutex::kWaitBuckets - 1);
+}
+
+double Seconds(const std::chrono::steady_clock::duration& duration) {
+  return std::chrono::duration<double>(duration).count();
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+constexpr size_t ProfiledMutex::kWaitBuckets;
+
+ProfiledMutex::ProfiledMutex(const std::string& name, const bool enabled)
+    : name_(name), enabled_(enabled), holder_(nullptr), wait_timer_(nullptr),
+      hold_timer_(nullptr) {
+  if (enabled_) {
+    wait_timer_ = &Metrics::Get().timer("lock." + name_ + ".wait");
+    hold_timer_ = &Metrics::Get().timer("lock." + name_ + ".hold");
+  }
+}
+
+// An uncontended lock is taken by try_lock and only costs the clock reads
+void ProfiledMutex::Acquire(const char* file, const int line) {
+  auto start = std::chrono::steady_clock::now();
+  bool contended = !mutex_.try_lock();
+  if (contended) {
+    mutex_.lock();
+  }
+  held_since_ = std::chrono::steady_clock::now();
+  auto wait = held_since_ - start;
+
+  holder_ = &sites_[std::make_pair(file, line)];
+  holder_->acquisitions++;
+  holder_->contended += contended;
+  holder_->wait += wait;
+  holder_->max_wait = std::max(holder_->max_wait, wait);
+  holder_->waits[WaitBucket(wait)]++;
+  wait_timer_->Record(wait);
+}
+
+void ProfiledMutex::Release() {
+  auto hold = std::chrono::steady_clock::now() - held_since_;
+  holder_->hold += hold;
+  hold_timer_->Record(hold);
+}
+
+void ProfiledMutex::Report(const std::string& pass) {
+  if (!enabled_) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // The same site can show up under more than one pointer to its file name
+  std::map<std::pair<std::string, int>, Site> sites;
+  Site total;
+  for (const auto& entry : sites_) {
+    std::string file = entry.first.first;
+    auto& site = sites[std::make_pair(file.substr(file.find_last_of('/') + 1), entry.first.second)];
+    for (auto* sum : { &site, &total }) {
+      sum->acquisitions += entry.second.acquisitions;
+      sum->contended += entry.second.contended;
+      sum->wait += entry.second.wait;
+      sum->max_wait = std::max(sum->max_wait, entry.second.max_wait);
+      sum->hold += entry.second.hold;
+      for (size_t bucket = 0; bucket < kWaitBuckets; bucket++) {
+        sum->waits[bucket] += entry.second.waits[bucket];
+      }
+    }
+  }
+  sites_.clear();
+
+  LOG_INFO((boost::format("Lock %1% during %2%: %3% acquisitions, %4% contended, "
+                          "%5$.3f s waiting, %6$.3f s held")
+      % name_ % pass % total.acquisitions % total.contended % Seconds(total.wait)
+      % Seconds(total.hold)).str());
+  std::vector<std::pair<std::string, const Site*> > busiest;
+  for (const auto& site : sites) {
+    busiest.emplace_back(site.first.first + ":" + std::to_string(site.first.second), &site.second);
+  }
+  std::sort(busiest.begin(), busiest.end(),
+    [](const std::pair<std::string, const Site*>& a, const std::pair<std::string, const Site*>& b) {
+      return a.second->wait > b.second->wait;
+    });
+  for (const auto& site : busiest) {
+    const Site& s = *site.second;
+    LOG_INFO((boost::format("  %1%: %2% acquisitions, %3% contended, wait %4$.3f s "
+                            "(p50 < %5% us, p99 < %6% us, max %7$.3f ms), held %8$.3f s")
+        % site.first % s.acquisitions % s.contended % Seconds(s.wait)
+        % WaitPercentile(s.waits, s.acquisitions, 0.5)
+        % WaitPercentile(s.waits, s.acquisitions, 0.99)
+        % (Seconds(s.max_wait) * 1000.0) % Seconds(s.hold)).str());
+  }
+}
+
+}
+}
@@ -8,6 +8,14 @@
 #include <future>
 #include <random>
 #include <queue>
+#include <mutex>
+#include <atomic>
+#include <map>
+#include <deque>
+#include <functional>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
 
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
@@ -15,8 +23,6 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/algorithm/string.hpp>
 #include <curl/curl.h>
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
-#include <google/protobuf/io/coded_stream.h>
 
 #include <valhalla/midgard/logging.h>
 #include <valhalla/baldr/graphid.h>
@@ -26,88 +32,14 @@
 #include <valhalla/midgard/util.h>
 
 #include "proto/transit.pb.h"
+#include "mjolnir/transitpbf.h"
+#include "mjolnir/curler.h"
 
 using namespace boost::property_tree;
 using namespace valhalla::midgard;
 using namespace valhalla::baldr;
 using namespace valhalla::mjolnir;
 
-struct logged_error_t: public std::runtime_error {
-  logged_error_t(const std::string& msg):std::runtime_error(msg) {
-    LOG_ERROR(msg);
-  }
-};
-
-struct curler_t {
-  curler_t():connection(curl_easy_init(), [](CURL* c){curl_easy_cleanup(c);}),
-    generator(std::chrono::system_clock::now().time_since_epoch().count()),
-    distribution(static_cast<size_t>(300), static_cast<size_t>(700)) {
-    if(connection.get() == nullptr)
-      throw logged_error_t("Failed to created CURL connection");
-    assert_curl(curl_easy_setopt(connection.get(), CURLOPT_ERRORBUFFER, error), "Failed to set error buffer");
-    assert_curl(curl_easy_setopt(connection.get(), CURLOPT_FOLLOWLOCATION, 1L), "Failed to set redirect option ");
-    assert_curl(curl_easy_setopt(connection.get(), CURLOPT_WRITEDATA, &result), "Failed to set write data ");
-    assert_curl(curl_easy_setopt(connection.get(), CURLOPT_WRITEFUNCTION, write_callback), "Failed to set writer ");
-  }
-  //for now we only need to handle json
-  //with templates we could return a string or whatever
-  ptree operator()(const std::string& url, const std::string& retry_if_no = "", bool gzip = true, boost::optional<size_t> timeout = boost::none) {
-    //content encoding header
-    if(gzip) {
-      char encoding[] = "gzip"; //TODO: allow "identity" and "deflate"
-      assert_curl(curl_easy_setopt(connection.get(), CURLOPT_ACCEPT_ENCODING, encoding), "Failed to set gzip content header ");
-    }
-    //set the url
-    assert_curl(curl_easy_setopt(connection.get(), CURLOPT_URL, url.c_str()), "Failed to set URL ");
-    //dont stop until we have something useful!
-    ptree pt;
-    size_t tries = 0;
-    while(++tries) {
-      result.str("");
-      long http_code = 0;
-      std::string log_extra = "Couldn't fetch url ";
-      //can we fetch this url
-      LOG_DEBUG(url);
-      if(curl_easy_perform(connection.get()) == CURLE_OK) {
-        curl_easy_getinfo(connection.get(), CURLINFO_RESPONSE_CODE, &http_code);
-        log_extra = std::to_string(http_code) + "'d ";
-        //it should be 200 OK
-        if(http_code == 200) {
-          bool threw = false;
-          try { read_json(result, pt); } catch (...) { threw = true; }
-          //has to parse and have required info
-          if(!threw && (retry_if_no.empty() || pt.get_child_optional(retry_if_no)))
-            break;
-          log_extra = "Unusable response ";
-        }
-      }
-      std::this_thread::sleep_for(std::chrono::milliseconds(timeout ? *timeout : distribution(generator)));
-      //dont log rate limit stuff its too frequent
-      if(http_code != 429 || (tries % 10) == 0)
-        LOG_WARN(log_extra + "retrying " + url);
-    };
-    return pt;
-  }
-  std::string last() const {
-    return result.str();
-  }
-protected:
-  void assert_curl(CURLcode code, const std::string& msg){
-    if(code != CURLE_OK)
-      throw logged_error_t(msg + error);
-  };
-  static size_t write_callback(char *in, size_t block_size, size_t blocks, std::stringstream *out) {
-    if(!out) return static_cast<size_t>(0);
-    out->write(in, block_size * blocks);
-    return block_size * blocks;
-  }
-  std::shared_ptr<CURL> connection;
-  char error[CURL_ERROR_SIZE];
-  std::stringstream result;
-  std::default_random_engine generator;
-  std::uniform_int_distribution<size_t> distribution;
-};
-
 std::string url(const std::string& path, const ptree& pt) {
   auto url = pt.get<std::string>("base_url") + path;
   auto key = pt.get_optional<std::string>("api_key");
@@ -124,8 +56,12 @@ std::priority_queue<weighted_tile_t> which_tiles(const ptree& pt) {
   TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
   std::set<GraphId> tiles;
   const auto& tile_level = hierarchy.levels().rbegin()->second;
-  curler_t curler;
+  ResponseCache cache(pt);
+  Curler curler(pt, cache);
   auto feeds = curler(url("/api/v1/feeds.geojson?", pt), "features");
+  //without the feeds we dont know where to look for transit at all
+  if(!feeds.get_child_optional("features"))
+    throw std::runtime_error("Couldn't fetch the transit feeds from " + pt.get<std::string>("base_url"));
   for(const auto& feature : feeds.get_child("features")) {
     //should be a polygon
     auto type = feature.second.get_optional<std::string>("geometry.type");
@@ -158,32 +94,35 @@ std::priority_queue<weighted_tile_t> which_tiles(const ptree& pt) {
   //we want slowest to build tiles first, routes query is slowest so we weight by that
   //stop pairs is most numerous so that might want to be factored in as well
   std::priority_queue<weighted_tile_t> prioritized;
-  auto now = time(nullptr);
-  auto* utc = gmtime(&now); utc->tm_year += 1900; ++utc->tm_mon;
-  for(const auto& tile : tiles) {
+  std::vector<GraphId> counted(tiles.cbegin(), tiles.cend());
+  std::vector<std::string> requests;
+  for(const auto& tile : counted) {
     auto bbox = tile_level.tiles.TileBounds(tile.tileid());
     auto min_y = std::max(bbox.miny(), bbox.minpt().MidPoint({bbox.maxx(), bbox.miny()}).second);
     auto max_y = std::min(bbox.maxy(), PointLL(bbox.minx(), bbox.maxy()).MidPoint(bbox.maxpt()).second);
     bbox = AABB2<PointLL>(bbox.minx(), min_y, bbox.maxx(), max_y);
     //stop count
-    auto request = url((boost::format("/api/v1/stops?total=true&per_page=0&bbox=%1%,%2%,%3%,%4%")
-      % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt);
-    auto stops_total = curler(request, "meta.total").get<size_t>("meta.total");
-    /*
-    //route count
-    request = url((boost::format("/api/v1/routes?total=true&per_page=0&bbox=%1%,%2%,%3%,%4%")
-      % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt);
-    auto routes_total = curler(request, "meta.total").get<size_t>("meta.total");
-    //pair count
-    request = url((boost::format("/api/v1/schedule_stop_pairs?total=true&per_page=0&bbox=%1%,%2%,%3%,%4%&service_from_date=%5%-%6%-%7%")
-      % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy() % utc->tm_year % utc->tm_mon % utc->tm_mday).str(), pt);
-    auto pairs_total = curler(request, "meta.total").get<size_t>("meta.total");
-    */
+    requests.push_back(url((boost::format("/api/v1/stops?total=true&per_page=0&bbox=%1%,%2%,%3%,%4%")
+      % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt));
+  }
+  //count them all at once
+  std::vector<bool> answered(counted.size(), false);
+  auto given_up = curler(requests, "meta.total", [&](size_t i, const ptree& response) {
+    answered[i] = true;
+    auto stops_total = response.get<size_t>("meta.total");
     //we have anything we want it
-    if(stops_total > 0/* || routes_total > 0|| pairs_total > 0*/) {
-      prioritized.push(weighted_tile_t{tile, stops_total + 10/* + routes_total * 1000 + pairs_total*/}); //TODO: factor in stop pairs as well
-      LOG_INFO(GraphTile::FileSuffix(tile, hierarchy) + " should have " + std::to_string(stops_total) +  " stops "/* +
-          std::to_string(routes_total) +  " routes and " + std::to_string(pairs_total) +  " stop_pairs"*/);
+    if(stops_total > 0) {
+      prioritized.push(weighted_tile_t{counted[i], stops_total + 10}); //TODO: factor in routes and stop pairs as well
+      LOG_INFO(GraphTile::FileSuffix(counted[i], hierarchy) + " should have " + std::to_string(stops_total) +  " stops");
+    }
+  }, false);
+  //a tile we couldnt count may still have stops, fetching it will tell
+  if(given_up) {
+    for(size_t i = 0; i < counted.size(); ++i) {
+      if(!answered[i]) {
+        LOG_WARN("Couldn't count the stops of " + GraphTile::FileSuffix(counted[i], hierarchy) + ", fetching it anyway");
+        prioritized.push(weighted_tile_t{counted[i], 10});
+      }
     }
   }
   LOG_INFO("Finished with " + std::to_string(prioritized.size()) + " transit tiles in " +
@@ -300,6 +239,10 @@ struct unique_transit_t {
   std::unordered_map<std::string, size_t> block_ids;
   std::unordered_set<std::string> missing_routes;
   std::unordered_map<std::string, size_t> lines;
+  //every stop we fetched, lets us stitch without opening other tiles
+  std::unordered_map<std::string, uint64_t> stops;
+  //tiles with requests that were given up on, they are not stored
+  std::vector<GraphId> failed;
 };
 
 bool get_stop_pairs(Transit& tile, unique_transit_t& uniques, const std::unordered_map<std::string, size_t>& shapes,
@@ -465,11 +408,19 @@ void write_pbf(const Transit& tile, const boost::filesystem::path& transit_tile)
   }
 }
 
+//transit tiles are named like the graph tiles but with a pbf extension
+std::string transit_name(const ptree& pt, const TileHierarchy& hierarchy, const GraphId& id) {
+  auto file_name = GraphTile::FileSuffix(id, hierarchy);
+  file_name = file_name.substr(0, file_name.size() - 3) + "pbf";
+  return pt.get<std::string>("mjolnir.transit_dir") + '/' + file_name;
+}
+
 void fetch_tiles(const ptree& pt, std::priority_queue<weighted_tile_t>& queue, unique_transit_t& uniques, std::promise<std::list<GraphId> >& promise) {
   TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
   const auto& tiles = hierarchy.levels().rbegin()->second.tiles;
   std::list<GraphId> dangling;
-  curler_t curler;
+  ResponseCache cache(pt);
+  Curler curler(pt, cache);
   auto now = time(nullptr);
   auto* utc = gmtime(&now); utc->tm_year += 1900; ++utc->tm_mon; //TODO: use timezone code?
 
@@ -489,46 +440,52 @@ void fetch_tiles(const ptree& pt, std::priority_queue<weighted_tile_t>& queue, u
     auto min_y = filter.miny() - std::abs(filter.miny() - filter.minpt().MidPoint({filter.maxx(), filter.miny()}).second);
     auto max_y = filter.maxy() + std::abs(filter.maxy() - filter.maxpt().MidPoint({filter.minx(), filter.maxy()}).second);
     AABB2<PointLL> bbox(filter.minx(), min_y, filter.maxx(), max_y);
-    ptree response;
-    auto api_key = pt.get_optional<std::string>("api_key") ? "&api_key=" + pt.get<std::string>("api_key") : "";
     auto import_level = pt.get_optional<std::string>("import_level") ? "&import_level=" +
         pt.get<std::string>("import_level") : "";
 
     Transit tile;
-    auto file_name = GraphTile::FileSuffix(current, hierarchy);
-    file_name = file_name.substr(0, file_name.size() - 3) + "pbf";
-    boost::filesystem::path transit_tile = pt.get<std::string>("mjolnir.transit_dir") + '/' + file_name;
+    boost::filesystem::path transit_tile = transit_name(pt, hierarchy, current);
 
     //tiles are wrote out with .pbf or .pbf.n ext
     uint32_t ext = 0;
     std::string prefix = transit_tile.string();
     LOG_INFO("Fetching " + transit_tile.string());
 
+    //a partial tile would look just like a complete one so none of it is kept
+    auto fail = [&]() {
+      LOG_ERROR(prefix + " was not stored, requests for it were given up on");
+      boost::filesystem::remove(prefix);
+      for(uint32_t i = 0; boost::filesystem::exists(prefix + '.' + std::to_string(i)); ++i)
+        boost::filesystem::remove(prefix + '.' + std::to_string(i));
+      uniques.lock.lock();
+      uniques.failed.push_back(current);
+      uniques.lock.unlock();
+    };
+
     //pull out all the STOPS (you see what we did there?)
     std::unordered_map<std::string, uint64_t> stops;
-    boost::optional<std::string> request = url((boost::format("/api/v1/stops?total=false&per_page=%1%&bbox=%2%,%3%,%4%,%5%")
-      % pt.get<std::string>("per_page") % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt);
-    do {
-      //grab some stuff
-      response = curler(*request, "stops");
+    std::vector<std::string> requests{url((boost::format("/api/v1/stops?total=false&per_page=%1%&bbox=%2%,%3%,%4%,%5%")
+      % pt.get<std::string>("per_page") % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt)};
+    //any page we dont get would leave the tile quietly incomplete
+    size_t given_up = curler(requests, "stops", [&](size_t, const ptree& response) {
       //copy stops in, keeping map of stopid to graphid
       get_stops(tile, stops, current, response, filter);
-      //please sir may i have some more?
-      request = response.get_optional<std::string>("meta.next");
-    } while(request && (request = *request + api_key));
+    });
     //um yeah.. we need these
+    if(given_up) {
+      fail();
+      continue;
+    }
     if(stops.size() == 0) {
       LOG_WARN(transit_tile.string() + " had no stops and will not be stored");
       continue;
     }
 
     //pull out all operator WEBSITES
-    request = url((boost::format("/api/v1/operators?total=false&per_page=%1%&bbox=%2%,%3%,%4%,%5%")
-      % pt.get<std::string>("per_page") % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt);
+    requests = {url((boost::format("/api/v1/operators?total=false&per_page=%1%&bbox=%2%,%3%,%4%,%5%")
+      % pt.get<std::string>("per_page") % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt)};
     std::unordered_map<std::string, std::string> websites;
-    do {
-      //grab some stuff
-      response = curler(*request, "operators");
+    given_up += curler(requests, "operators", [&](size_t, const ptree& response) {
       //save the websites to a map
       for(const auto& operators_pt : response.get_child("operators")) {
         std::string onestop_id = operators_pt.second.get<std::string>("onestop_id", "");
@@ -536,62 +493,53 @@ void fetch_tiles(const ptree& pt, std::priority_queue<weighted_tile_t>& queue, u
         if(!onestop_id.empty() && onestop_id != "null" && !website.empty() && website != "null")
           websites.emplace(onestop_id, website);
       }
-      //please sir may i have some more?
-      request = response.get_optional<std::string>("meta.next");
-    } while(request && (request = *request + api_key));
+    });
 
     //pull out all ROUTES
-    request = url((boost::format("/api/v1/routes?total=false&per_page=%1%&bbox=%2%,%3%,%4%,%5%")
-      % pt.get<std::string>("per_page") % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt);
+    requests = {url((boost::format("/api/v1/routes?total=false&per_page=%1%&bbox=%2%,%3%,%4%,%5%")
+      % pt.get<std::string>("per_page") % bbox.minx() % bbox.miny() % bbox.maxx() % bbox.maxy()).str(), pt)};
     std::unordered_map<std::string, size_t> routes;
-    do {
-      //grab some stuff
-      uniques.lock.lock();
-      response = curler(*request, "routes");
-      uniques.lock.unlock();
+    given_up += curler(requests, "routes", [&](size_t, const ptree& response) {
       //copy routes in, keeping track of routeid to route index
       get_routes(tile, routes, websites, response);
-      //please sir may i have some more?
-      request = response.get_optional<std::string>("meta.next");
-    } while(request && (request = *request + api_key));
+    });
 
-    //pull out all the route_stop_patterns or shapes
+    //pull out all the route_stop_patterns or shapes, all routes at once
     std::unordered_map<std::string, size_t> shapes;
+    requests.clear();
     for(const auto& route : routes) {
-      request = url((boost::format("/api/v1/route_stop_patterns?total=false&per_page=%1%&traversed_by=%2%")
-              % pt.get<std::string>("per_page") % route.first).str(), pt);
-      do {
-        //grab some stuff
-        response = curler(*request, "route_stop_patterns");
-        //copy shapes in.
-        get_stop_patterns(tile, shapes, response);
-        //please sir may i have some more?
-        request = response.get_optional<std::string>("meta.next");
-      } while(request && (request = *request + api_key));
+      requests.push_back(url((boost::format("/api/v1/route_stop_patterns?total=false&per_page=%1%&traversed_by=%2%")
+              % pt.get<std::string>("per_page") % route.first).str(), pt));
     }
+    given_up += curler(requests, "route_stop_patterns", [&](size_t, const ptree& response) {
+      //copy shapes in.
+      get_stop_patterns(tile, shapes, response);
+    });
 
-    //pull out all SCHEDULE_STOP_PAIRS
+    //pull out all SCHEDULE_STOP_PAIRS, all stops at once
     bool dangles = false;
+    requests.clear();
     for(const auto& stop : stops) {
-      request = url((boost::format("/api/v1/schedule_stop_pairs?total=false&per_page=%1%&origin_onestop_id=%2%&service_from_date=%3%-%4%-%5%")
-        % pt.get<std::string>("per_page") % stop.first % utc->tm_year % utc->tm_mon % utc->tm_mday).str(), pt);
-      request = *request + import_level;
-      do {
-        //grab some stuff
-        response = curler(*request, "schedule_stop_pairs");
-        //copy pairs in, noting if any dont have stops
-        dangles = get_stop_pairs(tile, uniques, shapes, response, stops, routes) || dangles;
-        //if stop pairs is large save to a path with an incremented extension
-        if (tile.stop_pairs_size() >= 500000) {
-          LOG_INFO("Writing " + transit_tile.string());
-          write_pbf(tile, transit_tile.string());
-          //reset everything
-          tile.Clear();
-          transit_tile = prefix + '.' + std::to_string(ext++);
-        }
-        //please sir may i have some more?
-        request = response.get_optional<std::string>("meta.next");
-      } while(request && (request = *request + api_key));
+      requests.push_back(url((boost::format("/api/v1/schedule_stop_pairs?total=false&per_page=%1%&origin_onestop_id=%2%&service_from_date=%3%-%4%-%5%")
+        % pt.get<std::string>("per_page") % stop.first % utc->tm_year % utc->tm_mon % utc->tm_mday).str(), pt) + import_level);
+    }
+    given_up += curler(requests, "schedule_stop_pairs", [&](size_t, const ptree& response) {
+      //copy pairs in, noting if any dont have stops
+      dangles = get_stop_pairs(tile, uniques, shapes, response, stops, routes) || dangles;
+      //if stop pairs is large save to a path with an incremented extension
+      if (tile.stop_pairs_size() >= 500000) {
+        LOG_INFO("Writing " + transit_tile.string());
+        write_pbf(tile, transit_tile.string());
+        //reset everything
+        tile.Clear();
+        transit_tile = prefix + '.' + std::to_string(ext++);
+      }
+    });
+
+    //throw away what was written of the tile
+    if(given_up) {
+      fail();
+      continue;
     }
 
     //remember who dangles
@@ -601,18 +549,24 @@ void fetch_tiles(const ptree& pt, std::priority_queue<weighted_tile_t>& queue, u
     //save the last tile
     if (tile.stop_pairs_size())
       write_pbf(tile, transit_tile.string());
+
+    //the stops of stored tiles can be stitched to
+    if (ext > 0 || tile.stop_pairs_size()) {
+      uniques.lock.lock();
+      uniques.stops.insert(stops.cbegin(), stops.cend());
+      uniques.lock.unlock();
+    }
   }
 
   //give back the work for later
   promise.set_value(dangling);
 }
 
-std::list<GraphId> fetch(const ptree& pt, std::priority_queue<weighted_tile_t>& tiles,
+std::list<GraphId> fetch(const ptree& pt, std::priority_queue<weighted_tile_t>& tiles, unique_transit_t& uniques,
     unsigned int thread_count = std::max(static_cast<unsigned int>(1), std::thread::hardware_concurrency())) {
   LOG_INFO("Fetching " + std::to_string(tiles.size()) + " transit tiles with " + std::to_string(thread_count) + " threads...");
 
   //schedule some work
-  unique_transit_t uniques;
   std::vector<std::shared_ptr<std::thread> > threads(thread_count);
   std::vector<std::promise<std::list<GraphId> > > promises(threads.size());
   for (size_t i = 0; i < threads.size(); ++i)
@@ -635,153 +589,127 @@ std::list<GraphId> fetch(const ptree& pt, std::priority_queue<weighted_tile_t>&
   return dangling;
 }
 
-GraphId id(const boost::property_tree::ptree& pt, const std::string& transit_tile) {
-  auto tile_dir = pt.get<std::string>("mjolnir.tile_dir");
-  auto transit_dir = pt.get<std::string>("mjolnir.transit_dir");
-  auto graph_tile = tile_dir + transit_tile.substr(transit_dir.size());
-  boost::algorithm::trim_if(graph_tile, boost::is_any_of(".pbf"));
-  graph_tile += ".gph";
-  TileHierarchy hierarchy(tile_dir);
-  return GraphTile::GetTileId(graph_tile, hierarchy);
+//the index lives next to the tiles, one stop per line: graphid then onestop_id
+std::string index_name(const ptree& pt) {
+  return pt.get<std::string>("mjolnir.transit_dir") + "/onestop_ids.txt";
 }
 
-Transit read_pbf(const std::string& file_name, std::mutex& lock) {
-  lock.lock();
-  std::fstream file(file_name, std::ios::in | std::ios::binary);
-  if(!file) {
-    throw std::runtime_error("Couldn't load " + file_name);
-    lock.unlock();
+//written off to the side and moved into place so a rerun never reads half of it
+void write_index(const ptree& pt, const std::unordered_map<std::string, uint64_t>& stops) {
+  auto file_name = index_name(pt);
+  auto temp_name = file_name + ".tmp";
+  std::map<uint64_t, std::string> sorted;
+  for(const auto& stop : stops)
+    sorted.emplace(stop.second, stop.first);
+  {
+    std::ofstream stream(temp_name, std::ios::out | std::ios::trunc);
+    for(const auto& stop : sorted)
+      stream << stop.first << '\t' << stop.second << '\n';
+    if(!stream) {
+      LOG_ERROR("Couldn't write: " + file_name);
+      boost::filesystem::remove(temp_name);
+      return;
+    }
   }
-  std::string buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-  lock.unlock();
-  google::protobuf::io::ArrayInputStream as(static_cast<const void*>(buffer.c_str()), buffer.size());
-  google::protobuf::io::CodedInputStream cs(static_cast<google::protobuf::io::ZeroCopyInputStream*>(&as));
-  auto limit = std::max(static_cast<size_t>(1), buffer.size() * 2);
-  cs.SetTotalBytesLimit(limit, limit);
-  Transit transit;
-  if(!transit.ParseFromCodedStream(&cs))
-    throw std::runtime_error("Couldn't load " + file_name);
-  return transit;
+  boost::filesystem::rename(temp_name, file_name);
+  LOG_INFO("Wrote " + std::to_string(sorted.size()) + " stops to " + file_name);
 }
 
-struct dist_sort_t {
-  PointLL center;
-  Tiles<PointLL> grid;
-  dist_sort_t(const GraphId& center, const Tiles<PointLL>& grid):grid(grid) {
-    this->center = grid.TileBounds(center.tileid()).Center();
+//the stops of a previous fetch, for stitching without fetching again
+std::unordered_map<std::string, uint64_t> read_index(const ptree& pt) {
+  auto file_name = index_name(pt);
+  std::ifstream stream(file_name);
+  if(!stream)
+    throw std::runtime_error("Couldn't read the stop index " + file_name);
+  std::unordered_map<std::string, uint64_t> stops;
+  std::string line;
+  while(std::getline(stream, line)) {
+    auto tab = line.find('\t');
+    if(tab == std::string::npos || tab == 0 || tab + 1 == line.size())
+      throw std::runtime_error("Malformed line in the stop index " + file_name + ": " + line);
+    stops.emplace(line.substr(tab + 1), std::stoull(line.substr(0, tab)));
   }
-  bool operator()(const GraphId& a, const GraphId& b) const {
-    auto a_dist = center.Distance(grid.TileBounds(a.tileid()).Center());
-    auto b_dist = center.Distance(grid.TileBounds(b.tileid()).Center());
-    if(a_dist == b_dist)
-      return a.tileid() < b.tileid();
-    return a_dist < b_dist;
-  }
-};
-
-void stitch_tiles(const ptree& pt, const std::unordered_set<GraphId>& all_tiles, std::list<GraphId>& tiles, std::mutex& lock) {
-  TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
-  auto grid = hierarchy.levels().rbegin()->second.tiles;
-  auto tile_name = [&hierarchy, &pt](const GraphId& id){
-    auto file_name = GraphTile::FileSuffix(id, hierarchy);
-    file_name = file_name.substr(0, file_name.size() - 3) + "pbf";
-    return pt.get<std::string>("mjolnir.transit_dir") + '/' + file_name;
-  };
+  LOG_INFO("Read " + std::to_string(stops.size()) + " stops from " + file_name);
+  return stops;
+}
 
-  //for each tile
-  while(true) {
-    GraphId current;
-    lock.lock();
-    if(tiles.empty()) {
-      lock.unlock();
-      break;
-    }
-    current = tiles.front();
-    tiles.pop_front();
-    lock.unlock();
+//every tile that was stored, any of them may dangle
+std::vector<std::string> stored_tiles(const ptree& pt) {
+  std::vector<std::string> tiles;
+  boost::filesystem::path transit_dir(pt.get<std::string>("mjolnir.transit_dir"));
+  if(!boost::filesystem::is_directory(transit_dir))
+    return tiles;
+  for(boost::filesystem::recursive_directory_iterator i(transit_dir), end; i != end; ++i) {
+    if(boost::filesystem::is_regular_file(i->path()) && i->path().extension() == ".pbf")
+      tiles.push_back(i->path().string());
+  }
+  std::sort(tiles.begin(), tiles.end());
+  return tiles;
+}
 
-    auto prefix = tile_name(current);
+void stitch_tiles(const std::unordered_map<std::string, uint64_t>& stops,
+    const std::vector<std::string>& tiles, std::atomic<size_t>& next) {
+  //for each tile, each thread only ever touches its own files
+  for(size_t t = next++; t < tiles.size(); t = next++) {
+    const auto& prefix = tiles[t];
     auto file_name = prefix;
     int ext = 0;
 
     do {
-
-      //open tile make a hash of missing stop to invalid graphid
-      auto tile = read_pbf(file_name, lock);
-      std::unordered_map<std::string, GraphId> needed;
-      for(const auto& stop_pair : tile.stop_pairs()) {
-        if(!stop_pair.has_origin_graphid())
-          needed.emplace(stop_pair.origin_onestop_id(), GraphId{});
-        if(!stop_pair.has_destination_graphid())
-          needed.emplace(stop_pair.destination_onestop_id(), GraphId{});
-      }
-
-      //do while we have more to find and arent sick of searching
-      std::set<GraphId, dist_sort_t> unchecked(all_tiles.cbegin(), all_tiles.cend(), dist_sort_t(current, grid));
-      size_t found = 0;
-      while(found < needed.size() && unchecked.size()) {
-        //crack it open to see if it has what we want
-        auto neighbor_id = *unchecked.cbegin();
-        unchecked.erase(unchecked.begin());
-        if(neighbor_id != current) {
-          auto neighbor_file_name = tile_name(neighbor_id);
-          auto neighbor = read_pbf(neighbor_file_name, lock);
-          for(const auto& stop : neighbor.stops()) {
-            auto stop_itr = needed.find(stop.onestop_id());
-            if(stop_itr != needed.cend()) {
-              stop_itr->second.value = stop.graphid();
-              ++found;
-            }
-          }
-        }
-      }
+      //the mapping is let go before we write over the file
+      Transit tile = TransitPbf(file_name).Read();
 
       //get the ids fixed up and write pbf to file
+      size_t found = 0, needed = 0;
       std::unordered_set<std::string> not_found;
+      auto lookup = [&](const std::string& onestop_id) -> uint64_t {
+        ++needed;
+        auto stop = stops.find(onestop_id);
+        if(stop != stops.cend()) {
+          ++found;
+          return stop->second;
+        }
+        if(not_found.insert(onestop_id).second)
+          LOG_ERROR("Stop not found: " + onestop_id);
+        return GraphId().value;
+      };
       for(auto& stop_pair : *tile.mutable_stop_pairs()) {
         if(!stop_pair.has_origin_graphid()) {
-          auto found = needed.find(stop_pair.origin_onestop_id())->second;
-          if(found.Is_Valid())
-            stop_pair.set_origin_graphid(found);
-          else if(not_found.find(stop_pair.origin_onestop_id()) == not_found.cend()) {
-            LOG_ERROR("Stop not found: " + stop_pair.origin_onestop_id());
-            not_found.emplace(stop_pair.origin_onestop_id());
-          }
+          auto graphid = lookup(stop_pair.origin_onestop_id());
+          if(GraphId(graphid).Is_Valid())
+            stop_pair.set_origin_graphid(graphid);
           //else{ TODO: we could delete this stop pair }
         }
         if(!stop_pair.has_destination_graphid()) {
-          auto found = needed.find(stop_pair.destination_onestop_id())->second;
-          if(found.Is_Valid())
-            stop_pair.set_destination_graphid(found);
-          else if(not_found.find(stop_pair.destination_onestop_id()) == not_found.cend()) {
-            LOG_ERROR("Stop not found: " + stop_pair.destination_onestop_id());
-            not_found.emplace(stop_pair.destination_onestop_id());
-          }
+          auto graphid = lookup(stop_pair.destination_onestop_id());
+          if(GraphId(graphid).Is_Valid())
+            stop_pair.set_destination_graphid(graphid);
           //else{ TODO: we could delete this stop pair }
         }
       }
-      lock.lock();
-      std::fstream stream(file_name, std::ios::out | std::ios::trunc | std::ios::binary);
-      tile.SerializeToOstream(&stream);
-      lock.unlock();
-      LOG_INFO(file_name + " stitched " + std::to_string(found) + " of " + std::to_string(needed.size()) + " stops");
+      //nothing to do if it had no dangling stop pairs
+      if(needed) {
+        std::fstream stream(file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+        tile.SerializeToOstream(&stream);
+        LOG_INFO(file_name + " stitched " + std::to_string(found) + " of " + std::to_string(needed) + " stop references");
+      }
 
       file_name = prefix + "." + std::to_string(ext++);
     }while(boost::filesystem::exists(file_name));
   }
 }
 
-void stitch(const ptree& pt, const std::unordered_set<GraphId>& all_tiles, std::list<GraphId>& dangling_tiles,
+void stitch(const std::unordered_map<std::string, uint64_t>& stops, const std::vector<std::string>& tiles,
     unsigned int thread_count = std::max(static_cast<unsigned int>(1), std::thread::hardware_concurrency())) {
-  LOG_INFO("Stitching " + std::to_string(dangling_tiles.size()) + " transit tiles with " + std::to_string(thread_count) + " threads...");
+  LOG_INFO("Stitching " + std::to_string(tiles.size()) + " transit tiles with " + std::to_string(thread_count) + " threads...");
 
   //figure out where the work should go
+  std::atomic<size_t> next(0);
   std::vector<std::shared_ptr<std::thread> > threads(thread_count);
-  std::mutex lock;
 
   //make let them rip
   for (size_t i = 0; i < threads.size(); ++i)
-    threads[i].reset(new std::thread(stitch_tiles, std::cref(pt), std::cref(all_tiles), std::ref(dangling_tiles), std::ref(lock)));
+    threads[i].reset(new std::thread(stitch_tiles, std::cref(stops), std::cref(tiles), std::ref(next)));
 
   //wait for them to finish
   for (auto& thread : threads)
@@ -791,8 +719,9 @@ void stitch(const ptree& pt, const std::unordered_set<GraphId>& all_tiles, std::
 }
 
 int main(int argc, char** argv) {
-  if(argc < 2) {
-    std::cerr << "Usage: " << std::string(argv[0]) << " valhalla_config transit_land_url per_page [target_directory] [transit_land_api_key]" << std::endl;
+  if(argc < 3) {
+    std::cerr << "Usage: " << std::string(argv[0]) << " valhalla_config transit_land_url per_page [target_directory] [transit_land_api_key] [import_level] [cache_directory] [max_in_flight] [max_tries]" << std::endl;
+    std::cerr << "       " << std::string(argv[0]) << " valhalla_config --stitch-only [target_directory]" << std::endl;
     std::cerr << "Sample: " << std::string(argv[0]) << " conf/valhalla.json http://transit.land/ 1000 ./transit_tiles transitland-YOUR_KEY_SUFFIX" << std::endl;
     return 1;
   }
@@ -800,34 +729,65 @@ int main(int argc, char** argv) {
   //args and config file loading
   ptree pt;
   boost::property_tree::read_json(std::string(argv[1]), pt);
+
+  //stitch the tiles of a previous fetch again with the stop index it left
+  if(std::string(argv[2]) == "--stitch-only") {
+    if(argc > 3) { pt.get_child("mjolnir").erase("transit_dir"); pt.add("mjolnir.transit_dir", std::string(argv[3])); }
+    try {
+      auto stops = read_index(pt);
+      stitch(stops, stored_tiles(pt));
+    }
+    catch(const std::exception& e) {
+      LOG_ERROR(e.what());
+      return 1;
+    }
+    return 0;
+  }
+
   pt.erase("base_url"); pt.add("base_url", std::string(argv[2]));
   pt.erase("per_page"); pt.add("per_page", argc > 3 ? std::string(argv[3]) : std::to_string(1000));
   if(argc > 4) { pt.get_child("mjolnir").erase("transit_dir"); pt.add("mjolnir.transit_dir", std::string(argv[4])); }
   if(argc > 5) { pt.erase("api_key"); pt.add("api_key", std::string(argv[5])); }
   if(argc > 6) { pt.erase("import_level"); pt.add("import_level", std::string(argv[6])); }
+  if(argc > 7) { pt.erase("cache_dir"); pt.add("cache_dir", std::string(argv[7])); }
+  if(argc > 8) { pt.erase("max_in_flight"); pt.add("max_in_flight", std::string(argv[8])); }
+  if(argc > 9) { pt.erase("max_tries"); pt.add("max_tries", std::string(argv[9])); }
 
   //yes we want to curl
   curl_global_init(CURL_GLOBAL_DEFAULT);
 
   //go get information about what transit tiles we should be fetching
-  auto transit_tiles = which_tiles(pt);
+  std::priority_queue<weighted_tile_t> transit_tiles;
+  try {
+    transit_tiles = which_tiles(pt);
+  }
+  catch(const std::exception& e) {
+    LOG_ERROR(e.what());
+    curl_global_cleanup();
+    return 1;
+  }
   //spawn threads to download all the tiles returning a list of
   //tiles that ended up having dangling stop pairs
-  auto dangling_tiles = fetch(pt, transit_tiles);
+  unique_transit_t uniques;
+  auto dangling_tiles = fetch(pt, transit_tiles, uniques);
   curl_global_cleanup();
 
-  //figure out which transit tiles even exist
-  TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
-  boost::filesystem::recursive_directory_iterator transit_file_itr(pt.get<std::string>("mjolnir.transit_dir") + '/' +
-                                                                   std::to_string(hierarchy.levels().rbegin()->first));
-  boost::filesystem::recursive_directory_iterator end_file_itr;
-  std::unordered_set<GraphId> all_tiles;
-  for(; transit_file_itr != end_file_itr; ++transit_file_itr)
-    if(boost::filesystem::is_regular(transit_file_itr->path()) && transit_file_itr->path().extension() == ".pbf")
-      all_tiles.emplace(id(pt, transit_file_itr->path().string()));
-
-  //spawn threads to connect dangling stop pairs to adjacent tiles' stops
-  stitch(pt, all_tiles, dangling_tiles);
+  //keep the stop index around next to the tiles for stitching again later
+  write_index(pt, uniques.stops);
 
+  //spawn threads to connect dangling stop pairs to other tiles' stops
+  TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
+  std::vector<std::string> dangling_names;
+  for(const auto& tile : dangling_tiles)
+    dangling_names.push_back(transit_name(pt, hierarchy, tile));
+  stitch(uniques.stops, dangling_names);
+
+  //the rest is usable but the transit graph is missing these tiles
+  if(!uniques.failed.empty()) {
+    for(const auto& tile : uniques.failed)
+      LOG_ERROR("Missing transit tile " + GraphTile::FileSuffix(tile, hierarchy));
+    LOG_ERROR(std::to_string(uniques.failed.size()) + " transit tiles could not be fetched");
+    return 1;
+  }
   return 0;
 }
@@ -0,0 +1,82 @@
+#include "mjolnir/gtfsbuilder.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <boost/filesystem/operations.hpp>
+#include <boost/program_options.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/json_parser.hpp>
+
+#include <valhalla/midgard/logging.h>
+#include <valhalla/midgard/util.h>
+
+using namespace valhalla::mjolnir;
+
+namespace bpo = boost::program_options;
+
+int main(int argc, char *argv[]) {
+  bpo::options_description options("transit_gtfs_builder\n"
+  "\nUsage: transit_gtfs_builder [options] <gtfs_feed_directory> ...\n"
+  "transit_gtfs_builder builds transit tiles from local GTFS feeds. Each feed "
+  "is a directory holding the extracted text files of the feed. The tiles are "
+  "written to mjolnir.transit_dir ready for the graph builder."
+  "\n");
+
+  std::string config, transit_dir;
+  std::vector<std::string> feeds;
+  options.add_options()
+      ("help,h", "Print this help message.")
+      ("conf,c", bpo::value<std::string>(&config), "Valhalla configuration file")
+      ("transit_dir,t", bpo::value<std::string>(&transit_dir), "Output directory, overrides mjolnir.transit_dir")
+      ("feeds", bpo::value<std::vector<std::string> >(&feeds)->multitoken());
+
+  bpo::positional_options_description pos_options;
+  pos_options.add("feeds", -1);
+  bpo::variables_map vm;
+  try {
+    bpo::store(bpo::command_line_parser(argc, argv).options(options).positional(pos_options).run(), vm);
+    bpo::notify(vm);
+  } catch (std::exception &e) {
+    std::cerr << "Unable to parse command line options because: " << e.what();
+    return EXIT_FAILURE;
+  }
+
+  if (vm.count("help")) {
+    std::cout << options << "\n";
+    return EXIT_SUCCESS;
+  }
+
+  if (vm.count("conf") == 0 || feeds.empty()) {
+    std::cerr << "A configuration file and at least one GTFS feed directory are required\n\n";
+    std::cerr << options << "\n";
+    return EXIT_FAILURE;
+  }
+
+  for (const auto& feed : feeds) {
+    if (!boost::filesystem::is_directory(feed)) {
+      std::cerr << feed << " is not a directory. Extract the feed first.\n";
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Read config
+  boost::property_tree::ptree pt;
+  boost::property_tree::read_json(config.c_str(), pt);
+  if (!transit_dir.empty()) {
+    pt.get_child("mjolnir").erase("transit_dir");
+    pt.add("mjolnir.transit_dir", transit_dir);
+  }
+
+  // Configure logging
+  boost::optional<boost::property_tree::ptree&> logging_subtree = pt.get_child_optional("mjolnir.logging");
+  if (logging_subtree) {
+    auto logging_config = valhalla::midgard::ToMap<const boost::property_tree::ptree&,
+        std::unordered_map<std::string, std::string> >(logging_subtree.get());
+    valhalla::midgard::logging::Configure(logging_config);
+  }
+
+  GTFSBuilder::Build(pt, feeds);
+  return EXIT_SUCCESS;
+}
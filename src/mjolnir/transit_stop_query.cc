@@ -1,9 +1,16 @@
 //#include "mjolnir/transitbuilder.h"
 //#include "mjolnir/graphtilebuilder.h"
 #include "proto/transit.pb.h"
+#include "mjolnir/transitpbf.h"
+#include "mjolnir/transitindex.h"
 
 #include <unordered_map>
 #include <map>
+#include <memory>
+#include <limits>
+#include <chrono>
+#include <sstream>
+#include <iomanip>
 #include <fstream>
 #include <iostream>
 #include <boost/filesystem/operations.hpp>
@@ -15,9 +22,6 @@
 #include <boost/optional.hpp>
 #include <boost/format.hpp>
 
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
-#include <google/protobuf/io/coded_stream.h>
-
 #include <valhalla/baldr/datetime.h>
 #include <valhalla/baldr/graphreader.h>
 #include <valhalla/midgard/util.h>
@@ -30,211 +34,124 @@ using namespace valhalla::mjolnir;
 
 namespace bpo = boost::program_options;
 
-// Get PBF transit data given a GraphId / tile
-Transit read_pbf(const GraphId& id, const TileHierarchy& hierarchy,
-                 const std::string& transit_dir) {
+// Get the PBF transit file name given a GraphId / tile
+std::string pbf_file(const GraphId& id, const TileHierarchy& hierarchy,
+                     const std::string& transit_dir) {
   std::string fname = GraphTile::FileSuffix(id, hierarchy);
   fname = fname.substr(0, fname.size() - 3) + "pbf";
-  std::string file_name = transit_dir + '/' + fname;
-  std::fstream file(file_name, std::ios::in | std::ios::binary);
-  if(!file) {
-    throw std::runtime_error("Couldn't load " + file_name);
-  }
-  std::string buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-  google::protobuf::io::ArrayInputStream as(static_cast<const void*>(buffer.c_str()), buffer.size());
-  google::protobuf::io::CodedInputStream cs(static_cast<google::protobuf::io::ZeroCopyInputStream*>(&as));
-  cs.SetTotalBytesLimit(buffer.size() * 2, buffer.size() * 2);
-  Transit transit;
-  if(!transit.ParseFromCodedStream(&cs))
-    throw std::runtime_error("Couldn't load " + file_name);
-  return transit;
+  return transit_dir + '/' + fname;
 }
 
-// Log all scheduled departures from a stop
-void LogDepartures(const Transit& transit, const GraphId& stopid) {
-  // Check if there are no schedule stop pairs in this tile
-  if (transit.stop_pairs_size() == 0) {
-    LOG_ERROR("No stop pairs in the PBF tile");
-    return;
-  }
-
-  // Iterate through the stop pairs in this tile and form Valhalla departure
-  // records
-  uint32_t tileid;
-  LOG_INFO("Departures:");
-  for (uint32_t i = 0; i < transit.stop_pairs_size(); i++) {
-    const Transit_StopPair& sp = transit.stop_pairs(i);
-
-    // Skip stop pair if either stop graph Id is invalid
-    GraphId orig_graphid = GraphId(sp.origin_graphid());
-    if (!orig_graphid.Is_Valid() ||
-        !GraphId(sp.destination_graphid()).Is_Valid()) {
-      continue;
-    }
-
-    if (orig_graphid == stopid) {
+// Format seconds from midnight as HH:MM:SS
+std::string FormatTime(const uint32_t total_seconds) {
+  std::stringstream ss;
+  ss << std::setfill('0') << std::setw(2) << total_seconds / 3600;
+  ss << ":";
+  ss << std::setfill('0') << std::setw(2) << (total_seconds / 60) % 60;
+  ss << ":";
+  ss << std::setfill('0') << std::setw(2) << total_seconds % 60;
+  return ss.str();
+}
 
-      int total_seconds = sp.origin_departure_time();
-      int seconds = total_seconds % 60;
-      int minutes = (total_seconds / 60) % 60;
-      int hours = total_seconds / 3600;
+// Transit tiles and their schedule indexes, loaded once and kept around so a
+// batch of queries only pays for each tile a single time
+struct transit_cache_t {
+  const TileHierarchy& hierarchy;
+  std::string transit_dir;
+  std::unordered_map<GraphId, Transit> tiles;
+  std::unordered_map<GraphId, std::unique_ptr<TransitIndex> > indexes;
 
-      std::stringstream ss;
-      ss << std::setfill('0') << std::setw(2) << hours;
-      ss << ":";
-      ss << std::setfill('0') << std::setw(2) << minutes;
-      ss << ":";
-      ss << std::setfill('0') << std::setw(2) << seconds;
+  transit_cache_t(const TileHierarchy& hierarchy, const std::string& transit_dir)
+    : hierarchy(hierarchy), transit_dir(transit_dir) {
+  }
 
-      LOG_INFO("LineID: " + std::to_string(sp.line_id()) +
-               " Route: " + std::to_string(sp.route_index()) +
-               " Trip: " + std::to_string(sp.trip_id()) +
-               " Dep Time: " + ss.str());
+  const Transit& tile(const GraphId& id) {
+    GraphId base = id.Tile_Base();
+    auto found = tiles.find(base);
+    if (found == tiles.end()) {
+      found = tiles.emplace(base, TransitPbf(pbf_file(base, hierarchy, transit_dir)).ReadWithoutStopPairs()).first;
     }
+    return found->second;
   }
-}
-
-void GetNextDeparture(const TileHierarchy hierarchy,
-                      const std::string transit_dir,
-                      GraphId& orig_graphid, const GraphId& destid,
-                      const uint32_t tripid,std::string& origin_time) {
-
-  if (orig_graphid.Is_Valid()) {
-
-    Transit transit = read_pbf(orig_graphid, hierarchy, transit_dir);
-
-    for (uint32_t i = 0; i < transit.stop_pairs_size(); i++) {
-
-      const Transit_StopPair& sp = transit.stop_pairs(i);
-      if (sp.trip_id() == tripid && orig_graphid == GraphId(sp.origin_graphid())) {
-
-         int total_seconds = sp.origin_departure_time();
-         int seconds = total_seconds % 60;
-         int minutes = (total_seconds / 60) % 60;
-         int hours = total_seconds / 3600;
-
-         std::stringstream ss;
-         ss << std::setfill('0') << std::setw(2) << hours;
-         ss << ":";
-         ss << std::setfill('0') << std::setw(2) << minutes;
-         ss << ":";
-         ss << std::setfill('0') << std::setw(2) << seconds;
-
-         if (origin_time == ss.str()) {
-
-           total_seconds = sp.destination_arrival_time();
-           seconds = total_seconds % 60;
-           minutes = (total_seconds / 60) % 60;
-           hours = total_seconds / 3600;
 
-           ss.str("");
-           ss << std::setfill('0') << std::setw(2) << hours;
-           ss << ":";
-           ss << std::setfill('0') << std::setw(2) << minutes;
-           ss << ":";
-           ss << std::setfill('0') << std::setw(2) << seconds;
-
-           LOG_INFO("Trip:\t" + sp.trip_headsign() +
-                    "\tDep Time:\t" + origin_time +
-                    "\tArr Time:\t" + ss.str() +
-                    "\tOrigin ----> Dest\t" + sp.origin_onestop_id() +
-                    " ----> " + sp.destination_onestop_id());
-
-           origin_time = ss.str();
-           orig_graphid = GraphId(sp.destination_graphid());
-
-           if (destid == orig_graphid) {//we are done.
-             orig_graphid = GraphId();
-             origin_time = "";
-           }
-
-           if (orig_graphid.Is_Valid())
-             return;
-         }
-      }
+  // The index is built on first use and saved next to the tile
+  const TransitIndex& index(const GraphId& id) {
+    GraphId base = id.Tile_Base();
+    auto found = indexes.find(base);
+    if (found == indexes.end()) {
+      found = indexes.emplace(base, std::unique_ptr<TransitIndex>(
+          new TransitIndex(pbf_file(base, hierarchy, transit_dir)))).first;
     }
+    return *found->second;
   }
-  orig_graphid = GraphId();
-  origin_time = "";
-}
-
-void LogSchedule(const TileHierarchy hierarchy, const std::string transit_dir,
-                 const GraphId& originid, const GraphId& destid,
-                 const uint32_t tripid, const std::string time) {
-
-  Transit transit = read_pbf(originid, hierarchy, transit_dir);
-
-  // Check if there are no schedule stop pairs in this tile
-  if (transit.stop_pairs_size() == 0) {
+};
+
+// Departure filters, times are seconds from midnight and the date is a
+// julian day (0 for any day)
+struct query_filter_t {
+  uint32_t date = 0;
+  uint32_t begin = 0;
+  uint32_t end = std::numeric_limits<uint32_t>::max();
+  int route = -1;
+};
+
+// Log the scheduled departures from a stop
+void LogDepartures(const TransitIndex& index, const GraphId& stopid,
+                   const query_filter_t& filter) {
+  LOG_INFO("Departures:");
+  if (index.size() == 0) {
     LOG_ERROR("No stop pairs in the PBF tile");
     return;
   }
-  // Iterate through the stop pairs in this tile and form Valhalla departure
-  // records
-  uint32_t tileid;
-  GraphId orig_graphid;
-  std::string origin_time;
-  LOG_INFO("Schedule:");
-  for (uint32_t i = 0; i < transit.stop_pairs_size(); i++) {
-    const Transit_StopPair& sp = transit.stop_pairs(i);
-
-    // Skip stop pair if either stop graph Id is invalid
-    orig_graphid = GraphId(sp.origin_graphid());
-    if (!orig_graphid.Is_Valid() ||
-        !GraphId(sp.destination_graphid()).Is_Valid()) {
+  for (const auto* departure : index.Departures(stopid.id(), filter.begin, filter.end, filter.date)) {
+    if (filter.route != -1 && departure->route_index != filter.route) {
       continue;
     }
+    LOG_INFO("LineID: " + std::to_string(departure->line_id) +
+             " Route: " + std::to_string(departure->route_index) +
+             " Trip: " + std::to_string(departure->trip_id) +
+             " Dep Time: " + FormatTime(departure->departure_time));
+  }
+}
 
-    //do we have the correct stop?
-    if (orig_graphid == originid) {
-
-      //do we have the correct trip?
-      if (sp.trip_id() == tripid) {
-
-        int total_seconds = sp.origin_departure_time();
-        int seconds = total_seconds % 60;
-        int minutes = (total_seconds / 60) % 60;
-        int hours = total_seconds / 3600;
-
-        std::stringstream ss;
-        ss << std::setfill('0') << std::setw(2) << hours;
-        ss << ":";
-        ss << std::setfill('0') << std::setw(2) << minutes;
-        ss << ":";
-        ss << std::setfill('0') << std::setw(2) << seconds;
-
-        //do we have the correct time?
-        if (time == ss.str()) {
-          // now lets save the destination time and id...this is our new origin
-          total_seconds = sp.destination_arrival_time();
-          seconds = total_seconds % 60;
-          minutes = (total_seconds / 60) % 60;
-          hours = total_seconds / 3600;
-
-          ss.str("");
-          ss << std::setfill('0') << std::setw(2) << hours;
-          ss << ":";
-          ss << std::setfill('0') << std::setw(2) << minutes;
-          ss << ":";
-          ss << std::setfill('0') << std::setw(2) << seconds;
-          origin_time = ss.str();
-          orig_graphid = GraphId(sp.destination_graphid());
-
-          LOG_INFO("Trip:\t" + sp.trip_headsign() +
-                   "\tDep Time:\t" + time +
-                   "\tArr Time:\t" + origin_time +
-                   "\tOrigin ----> Dest\t" + sp.origin_onestop_id() +
-                   " ----> " + sp.destination_onestop_id());
-
-          break;
-        }
+// Follow a trip from stop to stop, the next leg is the trip's first
+// departure at or after the arrival time
+void LogSchedule(transit_cache_t& cache, GraphId originid, const GraphId& destid,
+                 const uint32_t tripid, uint32_t time, const uint32_t date) {
+  LOG_INFO("Schedule:");
+  Transit_StopPair sp;
+  bool first = true;
+  while (originid.Is_Valid()) {
+    const auto& index = cache.index(originid);
+    const ScheduleEntry* leg = nullptr;
+    for (const auto* departure : index.Departures(originid.id(), time,
+             first ? time + 1 : std::numeric_limits<uint32_t>::max(), date)) {
+      if (departure->trip_id == tripid) {
+        leg = departure;
+        break;
       }
     }
-  }
-
-  while (orig_graphid.Is_Valid() && !origin_time.empty())
-    GetNextDeparture(hierarchy, transit_dir, orig_graphid, destid, tripid, origin_time);
+    if (leg == nullptr) {
+      if (first) {
+        LOG_ERROR("No departure of trip " + std::to_string(tripid) + " at " + FormatTime(time));
+      }
+      return;
+    }
 
+    index.StopPair(*leg, sp);
+    LOG_INFO("Trip:\t" + sp.trip_headsign() +
+             "\tDep Time:\t" + FormatTime(leg->departure_time) +
+             "\tArr Time:\t" + FormatTime(leg->arrival_time) +
+             "\tOrigin ----> Dest\t" + sp.origin_onestop_id() +
+             " ----> " + sp.destination_onestop_id());
+
+    originid = GraphId(leg->destination_graphid);
+    time = leg->arrival_time;
+    first = false;
+    if (originid == destid) { //we are done.
+      return;
+    }
+  }
 }
 
 // Log the list of routes within the tile
@@ -247,7 +164,7 @@ void LogRoutes(const Transit& transit) {
   }
 }
 
-GraphId GetGraphId(Transit& transit, const std::string& onestop_id) {
+GraphId GetGraphId(const Transit& transit, const std::string& onestop_id) {
   for (uint32_t i = 0; i < transit.stops_size(); i++) {
     const Transit_Stop& stop = transit.stops(i);
     if (stop.onestop_id() == onestop_id) {
@@ -258,16 +175,54 @@ GraphId GetGraphId(Transit& transit, const std::string& onestop_id) {
   return GraphId();
 }
 
+// Answer a single query, departures from a stop or the schedule of a trip
+void Query(transit_cache_t& cache, const std::string& origin, const PointLL& stopll,
+           const std::string& dest, const int tripid, const std::string& time,
+           const query_filter_t& filter) {
+  // Get the tile
+  auto local_level = cache.hierarchy.levels().rbegin()->second.level;
+  const auto& tiles = cache.hierarchy.levels().rbegin()->second.tiles;
+  GraphId tile(tiles.TileId(stopll), local_level, 0);
+  const Transit& transit = cache.tile(tile);
+
+  // Get the graph Id of the stop
+  GraphId originid = GetGraphId(transit, origin);
+  if (!originid.Is_Valid()) {
+    LOG_ERROR("Stop " + origin + " not found");
+    return;
+  }
+
+  if (tripid == 0 || time.empty()) {
+    // Log departures from this stop
+    LogDepartures(cache.index(tile), originid, filter);
+
+    // Log routes in this tile
+    LogRoutes(transit);
+  }
+  else {
+    GraphId destid = GraphId();
+    if (!dest.empty()) {
+      // Get the graph Id of the stop
+      destid = GetGraphId(transit, dest);
+    }
+    LogSchedule(cache, originid, destid, tripid, DateTime::seconds_from_midnight(time), filter.date);
+  }
+}
+
 // Main method for testing a single path
 int main(int argc, char *argv[]) {
   bpo::options_description options("transit_stop_query\n"
   "\nUsage: transit_stop_query [options]\n"
-  "transit_stop_query is a simple command line test tool to log transit stop info."
+  "transit_stop_query is a simple command line test tool to log transit stop info. "
+  "Each transit tile gets a schedule index (.pbf.idx) the first time it is queried "
+  "so later queries don't have to scan the stop pairs. A batch file holds one query "
+  "per line: onestop_id lat lng [tripid time]"
   "\n");
 
-  std::string config, origin, dest, time;
+  std::string config, origin, dest, time, date, begin, end, batch;
   float lat,lng;
   int tripid = 0;
+  int route = -1;
   options.add_options()
       ("help,h", "Print this help message.")
       ("version,v", "Print the version of this software.")
@@ -277,6 +232,11 @@ int main(int argc, char *argv[]) {
       ("dest,d", boost::program_options::value<std::string>(&dest))
       ("tripid,i", boost::program_options::value<int>(&tripid))
       ("time,t", boost::program_options::value<std::string>(&time))
+      ("date", boost::program_options::value<std::string>(&date), "Only service running on this date (YYYY-MM-DD)")
+      ("begin", boost::program_options::value<std::string>(&begin), "Only departures at or after this time (HH:MM:SS)")
+      ("end", boost::program_options::value<std::string>(&end), "Only departures before this time (HH:MM:SS)")
+      ("route,r", boost::program_options::value<int>(&route), "Only departures on this route index")
+      ("batch,b", boost::program_options::value<std::string>(&batch), "File of queries to run")
       ("conf,c", bpo::value<std::string>(&config), "Valhalla configuration file");
 
   bpo::variables_map vm;
@@ -293,7 +253,9 @@ int main(int argc, char *argv[]) {
     return true;
   }
 
-  for (auto arg : std::vector<std::string> { "origin", "lat", "lng", "conf" }) {
+  auto required = vm.count("batch") ? std::vector<std::string> { "conf" } :
+                  std::vector<std::string> { "origin", "lat", "lng", "conf" };
+  for (auto arg : required) {
     if (vm.count(arg) == 0) {
       std::cerr << "The <" << arg
           << "> argument was not provided, but is mandatory\n\n";
@@ -316,34 +278,53 @@ int main(int argc, char *argv[]) {
     return 0;
   }
 
-  // Get the tile
-  PointLL stopll(lng, lat);
-  TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
-  auto local_level = hierarchy.levels().rbegin()->second.level;
-  auto tiles = hierarchy.levels().rbegin()->second.tiles;
-  uint32_t tileid = tiles.TileId(stopll);
-
-  // Read transit tile
-  GraphId tile(tileid, local_level, 0);
-  Transit transit = read_pbf(tile, hierarchy, *transit_dir);
-
-  // Get the graph Id of the stop
-  GraphId originid = GetGraphId(transit, origin);
+  query_filter_t filter;
+  if (!date.empty()) {
+    filter.date = DateTime::get_formatted_date(date).julian_day();
+  }
+  if (!begin.empty()) {
+    filter.begin = DateTime::seconds_from_midnight(begin);
+  }
+  if (!end.empty()) {
+    filter.end = DateTime::seconds_from_midnight(end);
+  }
+  filter.route = route;
 
-  if (tripid == 0 || time.empty()) {
-    // Log departures from this stop
-    LogDepartures(transit, originid);
+  TileHierarchy hierarchy(pt.get<std::string>("mjolnir.tile_dir"));
+  transit_cache_t cache(hierarchy, *transit_dir);
+  if (batch.empty()) {
+    Query(cache, origin, PointLL(lng, lat), dest, tripid, time, filter);
+    return 0;
+  }
 
-    // Log routes in this tile
-    LogRoutes(transit);
+  // Run each query in the batch, tiles and indexes are shared between them
+  std::ifstream file(batch);
+  if (!file.is_open()) {
+    std::cerr << "Couldn't open " << batch << "\n";
+    return EXIT_FAILURE;
   }
-  else {
-    GraphId destid = GraphId();
-    if (!dest.empty()) {
-      // Get the graph Id of the stop
-      destid = GetGraphId(transit, dest);
+  std::string line;
+  size_t count = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (std::getline(file, line)) {
+    std::stringstream ss(line);
+    std::string stop, trip_time;
+    float stop_lat, stop_lng;
+    int trip = 0;
+    if (line.empty() || line[0] == '#' || !(ss >> stop >> stop_lat >> stop_lng)) {
+      continue;
+    }
+    ss >> trip >> trip_time;
+    try {
+      LOG_INFO("Query: " + line);
+      Query(cache, stop, PointLL(stop_lng, stop_lat), "", trip, trip_time, filter);
+      ++count;
+    } catch (const std::exception& e) {
+      LOG_ERROR(line + ": " + e.what());
     }
-    LogSchedule(hierarchy, *transit_dir, originid, destid, tripid, time);
   }
-
+  auto msecs = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start).count();
+  LOG_INFO("Answered " + std::to_string(count) + " queries in " + std::to_string(msecs) + " ms");
+  return 0;
 }
@@ -1,13 +1,23 @@
 #include "mjolnir/transitbuilder.h"
 #include "mjolnir/graphtilebuilder.h"
+#include "mjolnir/transitpbf.h"
+#include "mjolnir/connectivityindex.h"
+#include "mjolnir/metrics.h"
+#include "mjolnir/profiledmutex.h"
 #include "proto/transit.pb.h"
 
 #include <list>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <future>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <vector>
 #include <queue>
+#include <tuple>
 #include <unordered_map>
 #include <sqlite3.h>
 #include <spatialite.h>
@@ -16,8 +26,6 @@
 #include <boost/filesystem/operations.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/foreach.hpp>
-#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
-#include <google/protobuf/io/coded_stream.h>
 
 #include <valhalla/baldr/datetime.h>
 #include <valhalla/baldr/graphtile.h>
@@ -61,13 +69,23 @@ struct TransitLine {
   float    dest_dist_traveled;
 };
 
-// Shape
+// Shape along with the distance along it to each of its points, computed
+// once per tile and shared by every transit edge that is cut from it
 struct Shape {
-  uint32_t begins;
-  uint32_t ends;
   std::vector<PointLL> shape;
+  std::vector<float> distances;
 };
 
+// Edge info already added for a cut of a shape. Keyed by the shape, the
+// distances along it and the end nodes so routes and trips cut the same way
+// between the same nodes share geometry. Edge info is stored per node pair
+// and its direction depends on their order so neither can be left out.
+struct ShapeCut {
+  uint32_t edge_info_offset;
+  bool forward;
+};
+using ShapeCutKey = std::tuple<const Shape*, float, float, GraphId, GraphId>;
+
 struct StopEdges {
   GraphId origin_pbf_graphid;        // GraphId (from pbf) of the origin stop
   std::vector<GraphId> intrastation; // List of intra-station connections
@@ -108,173 +126,193 @@ struct builder_stats {
   }
 };
 
-// Get scheduled departures for a stop
-std::unordered_multimap<GraphId, Departure> ProcessStopPairs(
+// Get scheduled departures for the stops in a tile. The transit files are the
+// tile's pbf followed by any continuation files (.pbf.0, .pbf.1, ...) it was
+// split into
+std::vector<Departure> ProcessStopPairs(
     GraphTileBuilder& tilebuilder,
     const TileHierarchy& hierarchy,
     const Transit& transit,
     std::unordered_map<GraphId, bool>& stop_access,
-    const std::string& file,
+    const std::vector<std::string>& files,
     const GraphId& tile_id) {
   // Check if there are no schedule stop pairs in this tile
-  std::unordered_multimap<GraphId, Departure> departures;
+  std::vector<Departure> departures;
   uint32_t tile_date = tilebuilder.header()->date_created();
 
-  std::size_t slash_found = file.find_last_of("/\\");
-  std::string directory = file.substr(0,slash_found);
-
-  boost::filesystem::recursive_directory_iterator transit_file_itr(directory);
-  boost::filesystem::recursive_directory_iterator end_file_itr;
-
-  //for each tile.
-  for(; transit_file_itr != end_file_itr; ++transit_file_itr) {
-    if(boost::filesystem::is_regular(transit_file_itr->path())) {
-      std::string fname = transit_file_itr->path().string();
-      std::string ext = transit_file_itr->path().extension().string();
-      std::string file_name = fname.substr(0, fname.size() - ext.size());
-
-      // make sure we are looking at a pbf file
-      if ((ext == ".pbf" && fname == file) ||
-          (file_name.substr(file_name.size()-4) == ".pbf" && file_name == file)) {
-
-        Transit spp; {
-
-          // already loaded
-          if (ext == ".pbf")
-            spp = transit;
-          else {
-            std::fstream input(fname, std::ios::in | std::ios::binary);
-            if (!input) {
-              LOG_ERROR("Error opening file:  " + fname);
-              departures.clear();
-              return departures;
-            }
-            std::string buffer((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
-            google::protobuf::io::ArrayInputStream as(static_cast<const void*>(buffer.c_str()), buffer.size());
-            google::protobuf::io::CodedInputStream cs(static_cast<google::protobuf::io::ZeroCopyInputStream*>(&as));
-            cs.SetTotalBytesLimit(buffer.size() * 2, buffer.size() * 2);
-            if (!spp.ParseFromCodedStream(&cs)) {
-              LOG_ERROR("Failed to parse file: " + fname);
-              return departures;
+  //for each file belonging to this tile
+  for (const auto& fname : files) {
+    // Stream the stop pairs straight out of the mapped file, one at a time
+    Transit_StopPair sp;
+    try {
+      TransitPbf pbf(fname);
+      StopPairReader reader(pbf);
+      while (reader.Next(sp)) {
+        // We do not know in this step if the end node is in a valid (non-empty)
+        // Valhalla tile. So just add the stop pair and we will address this later
+
+        // Use transit PBF graph Ids internally until adding to the graph tiles
+        // TODO - wheelchair accessible, shape information
+        Departure dep;
+        dep.orig_pbf_graphid = GraphId(sp.origin_graphid());
+        dep.dest_pbf_graphid = GraphId(sp.destination_graphid());
+        dep.route = sp.route_index();
+        dep.trip = sp.trip_id();
+
+        // if we have shape data then set everything else shapeid = 0;
+        if (sp.has_shape_id() && sp.has_destination_dist_traveled() && sp.has_origin_dist_traveled()) {
+          dep.shapeid = sp.shape_id();
+          dep.orig_dist_traveled = sp.origin_dist_traveled();
+          dep.dest_dist_traveled = sp.destination_dist_traveled();
+        } else dep.shapeid = 0;
+
+        dep.blockid = sp.has_block_id() ? sp.block_id() : 0;
+        dep.dep_time = sp.origin_departure_time();
+        dep.elapsed_time = sp.destination_arrival_time() - dep.dep_time;
+
+        // Set bikes_allowed on the stops
+        // TODO - should this be |= ???
+        bool bikes_allowed = sp.bikes_allowed();
+        stop_access[dep.orig_pbf_graphid] = bikes_allowed;
+        stop_access[dep.dest_pbf_graphid] = bikes_allowed;
+
+        // Compute days of week mask
+        uint8_t dow_mask = kDOWNone;
+        for (uint32_t x = 0; x < sp.service_days_of_week_size(); x++) {
+          bool dow = sp.service_days_of_week(x);
+          if (dow) {
+            switch (x) {
+              case 0:
+                dow_mask |= kMonday;
+                break;
+              case 1:
+                dow_mask |= kTuesday;
+                break;
+              case 2:
+                dow_mask |= kWednesday;
+                break;
+              case 3:
+                dow_mask |= kThursday;
+                break;
+              case 4:
+                dow_mask |= kFriday;
+                break;
+              case 5:
+                dow_mask |= kSaturday;
+                break;
+              case 6:
+                dow_mask |= kSunday;
+                break;
             }
           }
         }
-
-        if (spp.stop_pairs_size() == 0) {
-          if (transit.stops_size() > 0) {
-            LOG_ERROR("Tile " + fname +
-                      " has 0 schedule stop pairs but has " +
-                      std::to_string(transit.stops_size()) + " stops");
-          }
-          departures.clear();
-          return departures;
+        dep.dow = dow_mask;
+
+        // Compute the valid days
+        // set the bits based on the dow.
+        boost::gregorian::date start_date(boost::gregorian::gregorian_calendar::from_julian_day_number(sp.service_start_date()));
+        boost::gregorian::date end_date(boost::gregorian::gregorian_calendar::from_julian_day_number(sp.service_end_date()));
+        dep.days = DateTime::get_service_days(start_date, end_date, tile_date, dow_mask);
+
+        // if this is a service addition for one day, delete the dow_mask.
+        if (sp.service_start_date() == sp.service_end_date())
+          dep.dow = kDOWNone;
+
+        // if dep.days == 0 then feed either starts after the end_date or tile_header_date > end_date
+        if (dep.days == 0 && !sp.service_added_dates_size()) {
+          LOG_DEBUG("Feed rejected!  Start date: " + to_iso_extended_string(start_date) + " End date: " + to_iso_extended_string(end_date));
+          continue;
         }
 
-        // Iterate through the stop pairs in this tile and form Valhalla departure
-        // records
-        for (const auto& sp : spp.stop_pairs()) {
-          // We do not know in this step if the end node is in a valid (non-empty)
-          // Valhalla tile. So just add the stop pair and we will address this later
-
-          // Use transit PBF graph Ids internally until adding to the graph tiles
-          // TODO - wheelchair accessible, shape information
-          Departure dep;
-          dep.orig_pbf_graphid = GraphId(sp.origin_graphid());
-          dep.dest_pbf_graphid = GraphId(sp.destination_graphid());
-          dep.route = sp.route_index();
-          dep.trip = sp.trip_id();
-
-          // if we have shape data then set everything else shapeid = 0;
-          if (sp.has_shape_id() && sp.has_destination_dist_traveled() && sp.has_origin_dist_traveled()) {
-            dep.shapeid = sp.shape_id();
-            dep.orig_dist_traveled = sp.origin_dist_traveled();
-            dep.dest_dist_traveled = sp.destination_dist_traveled();
-          } else dep.shapeid = 0;
-
-          dep.blockid = sp.has_block_id() ? sp.block_id() : 0;
-          dep.dep_time = sp.origin_departure_time();
-          dep.elapsed_time = sp.destination_arrival_time() - dep.dep_time;
-
-          // Set bikes_allowed on the stops
-          // TODO - should this be |= ???
-          bool bikes_allowed = sp.bikes_allowed();
-          stop_access[dep.orig_pbf_graphid] = bikes_allowed;
-          stop_access[dep.dest_pbf_graphid] = bikes_allowed;
-
-          // Compute days of week mask
-          uint8_t dow_mask = kDOWNone;
-          for (uint32_t x = 0; x < sp.service_days_of_week_size(); x++) {
-            bool dow = sp.service_days_of_week(x);
-            if (dow) {
-              switch (x) {
-                case 0:
-                  dow_mask |= kMonday;
-                  break;
-                case 1:
-                  dow_mask |= kTuesday;
-                  break;
-                case 2:
-                  dow_mask |= kWednesday;
-                  break;
-                case 3:
-                  dow_mask |= kThursday;
-                  break;
-                case 4:
-                  dow_mask |= kFriday;
-                  break;
-                case 5:
-                  dow_mask |= kSaturday;
-                  break;
-                case 6:
-                  dow_mask |= kSunday;
-                  break;
-              }
-            }
-          }
-          dep.dow = dow_mask;
-
-          // Compute the valid days
-          // set the bits based on the dow.
-          boost::gregorian::date start_date(boost::gregorian::gregorian_calendar::from_julian_day_number(sp.service_start_date()));
-          boost::gregorian::date end_date(boost::gregorian::gregorian_calendar::from_julian_day_number(sp.service_end_date()));
-          dep.days = DateTime::get_service_days(start_date, end_date, tile_date, dow_mask);
-
-          // if this is a service addition for one day, delete the dow_mask.
-          if (sp.service_start_date() == sp.service_end_date())
-            dep.dow = kDOWNone;
+        dep.headsign_offset = tilebuilder.AddName(sp.trip_headsign());
+        dep.end_day = (DateTime::days_from_pivot_date(end_date) - tile_date);
 
-          // if dep.days == 0 then feed either starts after the end_date or tile_header_date > end_date
-          if (dep.days == 0 && !sp.service_added_dates_size()) {
-            LOG_DEBUG("Feed rejected!  Start date: " + to_iso_extended_string(start_date) + " End date: " + to_iso_extended_string(end_date));
-            continue;
-          }
-
-          dep.headsign_offset = tilebuilder.AddName(sp.trip_headsign());
-          dep.end_day = (DateTime::days_from_pivot_date(end_date) - tile_date);
+        //if subtractions are between start and end date then turn off bit.
+        for (const auto& x : sp.service_except_dates()) {
+          boost::gregorian::date d(boost::gregorian::gregorian_calendar::from_julian_day_number(x));
+          dep.days = DateTime::remove_service_day(dep.days, start_date, end_date, d);
+        }
 
-          //if subtractions are between start and end date then turn off bit.
-          for (const auto& x : sp.service_except_dates()) {
-            boost::gregorian::date d(boost::gregorian::gregorian_calendar::from_julian_day_number(x));
-            dep.days = DateTime::remove_service_day(dep.days, start_date, end_date, d);
-          }
+        //if additions are between start and end date then turn on bit.
+        for (const auto& x : sp.service_added_dates()) {
+          boost::gregorian::date d(boost::gregorian::gregorian_calendar::from_julian_day_number(x));
+          dep.days = DateTime::add_service_day(dep.days, start_date, end_date, d);
+        }
 
-          //if additions are between start and end date then turn on bit.
-          for (const auto& x : sp.service_added_dates()) {
-            boost::gregorian::date d(boost::gregorian::gregorian_calendar::from_julian_day_number(x));
-            dep.days = DateTime::add_service_day(dep.days, start_date, end_date, d);
-          }
+        // Add to the departures list
+        departures.emplace_back(std::move(dep));
+      }
 
-          // Add to the departures list
-          departures.emplace(dep.orig_pbf_graphid, std::move(dep));
+      if (reader.count() == 0) {
+        if (transit.stops_size() > 0) {
+          LOG_ERROR("Tile " + fname +
+                    " has 0 schedule stop pairs but has " +
+                    std::to_string(transit.stops_size()) + " stops");
         }
+        departures.clear();
+        return departures;
       }
     }
+    catch (const std::exception& e) {
+      LOG_ERROR(e.what());
+      departures.clear();
+      return departures;
+    }
   }
   LOG_INFO("Tile " + std::to_string(tile_id.tileid()) + ": added " +
            std::to_string(departures.size()) + " departures");
   return departures;
 }
 
+// Sort departures by origin stop, departure time and trip. Stop indexes are
+// dense within the tile so they are bucketed with a counting sort, each
+// (small) bucket is then sorted by time and trip. Departures from stops that
+// are not in this tile are dropped. Returns the offset of the first departure
+// of each stop, with a final entry holding the total number of departures.
+std::vector<size_t> SortDepartures(std::vector<Departure>& departures,
+                                   const GraphId& tile_id,
+                                   const uint32_t stop_count) {
+  // Count departures per origin stop
+  std::vector<size_t> offsets(stop_count + 1, 0);
+  size_t dropped = 0;
+  for (const auto& dep : departures) {
+    if (dep.orig_pbf_graphid.Tile_Base() == tile_id &&
+        dep.orig_pbf_graphid.id() < stop_count) {
+      offsets[dep.orig_pbf_graphid.id() + 1]++;
+    } else {
+      dropped++;
+    }
+  }
+  if (dropped > 0) {
+    LOG_WARN("Tile " + std::to_string(tile_id.tileid()) + ": dropped " +
+             std::to_string(dropped) + " departures from stops outside the tile");
+  }
+  for (uint32_t i = 0; i < stop_count; i++) {
+    offsets[i + 1] += offsets[i];
+  }
+
+  // Scatter into the per stop buckets
+  std::vector<Departure> sorted(offsets.back());
+  std::vector<size_t> next(offsets.cbegin(), offsets.cend() - 1);
+  for (auto& dep : departures) {
+    if (dep.orig_pbf_graphid.Tile_Base() == tile_id &&
+        dep.orig_pbf_graphid.id() < stop_count) {
+      sorted[next[dep.orig_pbf_graphid.id()]++] = std::move(dep);
+    }
+  }
+
+  // Order each stop's departures by time and then trip
+  for (uint32_t i = 0; i < stop_count; i++) {
+    std::sort(sorted.begin() + offsets[i], sorted.begin() + offsets[i + 1],
+              [](const Departure& a, const Departure& b) {
+                return a.dep_time == b.dep_time ? a.trip < b.trip :
+                                                  a.dep_time < b.dep_time;
+              });
+  }
+  departures.swap(sorted);
+  return offsets;
+}
+
 // Add routes to the tile. Return a vector of route types.
 std::vector<uint32_t> AddRoutes(const Transit& transit,
                    GraphTileBuilder& tilebuilder) {
@@ -330,79 +368,55 @@ Use GetTransitUse(const uint32_t rt) {
   }
 }
 
-std::list<PointLL> GetShape(const PointLL& stop_ll, const PointLL& endstop_ll, uint32_t shapeid,
+// Cut the part of the trip shape between the origin and destination stops.
+// The cumulative distances let both ends be found by binary search.
+std::list<PointLL> GetShape(const PointLL& stop_ll, const PointLL& endstop_ll,
                             const float orig_dist_traveled, const float dest_dist_traveled,
-                            const std::vector<PointLL>& trip_shape, const std::vector<float>& distances) {
+                            const Shape* trip_shape) {
+
+  // Keep both ends on the shape. Distances given in the wrong order cut the
+  // same part of the shape, just walked the other way.
+  float orig = 0.0f, dest = 0.0f;
+  if (trip_shape != nullptr && trip_shape->shape.size() > 1) {
+    float length = trip_shape->distances.back();
+    orig = std::min(std::max(orig_dist_traveled, 0.0f), length);
+    dest = std::min(std::max(dest_dist_traveled, 0.0f), length);
+  }
+  bool reverse = orig > dest;
+  if (reverse) {
+    std::swap(orig, dest);
+  }
 
   std::list<PointLL> shape;
-  if (shapeid != 0 && trip_shape.size() && stop_ll != endstop_ll &&
-      orig_dist_traveled < dest_dist_traveled) {
-
-    float distance = 0.0f, d_from_p0_to_x = 0.0f;
-
-    // point x - we are trying to find it on the line segment between p0 and p1
-    PointLL x;
-    bool found = false;
-
-    // find out where orig_dist_traveled should be in the list.
-    auto lower_bound = std::lower_bound(distances.cbegin(), distances.cend(), orig_dist_traveled);
-    // find out where dest_dist_traveled should be in the list.
-    auto upper_bound = std::upper_bound(distances.cbegin(), distances.cend(), dest_dist_traveled);
-    float prev_distance = *(lower_bound);
-
-    // lower_bound returns an iterator pointing to the first element which does not compare less than the dist_traveled;
-    // therefore, we need to back up one if it does not equal the lower_bound value.  For example, we could be starting
-    // at the beginning of the points list
-    if (orig_dist_traveled != (*lower_bound))
-      prev_distance = *(--lower_bound);
-
-    // loop through the points.
-    for (auto itr = lower_bound; itr != upper_bound; ++itr) {
-
-      /*    |
-       *    |
-       *    p0
-       *    | }--d_from_p0_to_x (distance from p0 to x)
-       *    x -- point we are trying to find on the segment (orig_dist_traveled or dest_dist_traveled on this segment)
-       *    |
-       *    |
-       *    |
-       *    |
-       *    p1
-       *    |
-       *    |
-       */
-
-      // index into our vector of points
-      uint32_t index = (itr - distances.cbegin());
-      PointLL p0 = trip_shape[index];
-      PointLL p1 = trip_shape[index + 1];
-
-      // this is our distance that is beyond x.
-      distance = *(itr+1);
-
-      // find point x using the orig_dist_traveled - this is our first point added to shape
-      if (itr == lower_bound) {
-        // distance from p0 to x using the orig_dist_traveled
-        d_from_p0_to_x = (orig_dist_traveled - prev_distance) / (distance - prev_distance);
-        x = p0 + (p1 - p0) * d_from_p0_to_x;
-        shape.push_back(x);
-      }
-
-      // find point x using the dest_dist_traveled - this is our last point added to the shape
-      if ((itr+1) == upper_bound) {
-        // distance from p0 to x using the dest_dist_traveled
-        d_from_p0_to_x = (dest_dist_traveled - prev_distance) / (distance - prev_distance);
-        x = p0 + (p1 - p0) * d_from_p0_to_x;
-        shape.push_back(x);
-        // we are done p1 is too far away
-        break;
-      }
-
-      // add all the midpoints.
-      shape.push_back(p1);
-
-      prev_distance = distance;
+  if (orig < dest && stop_ll != endstop_ll) {
+    const auto& points = trip_shape->shape;
+    const auto& distances = trip_shape->distances;
+
+    // Index of the segment holding a distance. A distance that falls on a
+    // point starts the next segment but ends the previous one.
+    auto segment = [&distances](const float d, const bool start) {
+      auto itr = start ? std::upper_bound(distances.cbegin(), distances.cend(), d) :
+                         std::lower_bound(distances.cbegin(), distances.cend(), d);
+      size_t index = itr - distances.cbegin();
+      return std::min(index == 0 ? 0 : index - 1, distances.size() - 2);
+    };
+
+    // Point at a distance within a segment
+    auto interpolate = [&points, &distances](const size_t index, const float d) {
+      float length = distances[index + 1] - distances[index];
+      float t = length > 0.0f ? (d - distances[index]) / length : 0.0f;
+      return points[index] + (points[index + 1] - points[index]) * t;
+    };
+
+    size_t first = segment(orig, true);
+    size_t last = segment(dest, false);
+    shape.push_back(interpolate(first, orig));
+    for (size_t index = first + 1; index <= last; ++index) {
+      shape.push_back(points[index]);
+    }
+    shape.push_back(interpolate(last, dest));
+    if (reverse) {
+      shape.reverse();
     }
   // else no shape exists.
   } else {
@@ -425,35 +439,24 @@ GraphId GetGraphId(const GraphId& nodeid,
   }
 }
 
-// Get PBF transit data given a GraphId / tile
+// Get PBF transit data (without the stop pairs) given a GraphId / tile
 Transit read_pbf(const GraphId& id, const TileHierarchy& hierarchy,
                  const std::string& transit_dir) {
   std::string fname = GraphTile::FileSuffix(id, hierarchy);
   fname = fname.substr(0, fname.size() - 3) + "pbf";
-  std::string file_name = transit_dir + '/' + fname;
-  std::fstream file(file_name, std::ios::in | std::ios::binary);
-  if(!file) {
-    throw std::runtime_error("Couldn't load " + file_name);
-  }
-  std::string buffer((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-  google::protobuf::io::ArrayInputStream as(static_cast<const void*>(buffer.c_str()), buffer.size());
-  google::protobuf::io::CodedInputStream cs(static_cast<google::protobuf::io::ZeroCopyInputStream*>(&as));
-  cs.SetTotalBytesLimit(buffer.size() * 2, buffer.size() * 2);
-  Transit transit;
-  if(!transit.ParseFromCodedStream(&cs))
-    throw std::runtime_error("Couldn't load " + file_name);
-  return transit;
+  TransitPbf pbf(transit_dir + '/' + fname);
+  return pbf.ReadWithoutStopPairs();
 }
 
 void AddToGraph(GraphTileBuilder& tilebuilder,
                 const TileHierarchy& hierarchy,
                 const std::string& transit_dir,
+                const Transit& transit,
                 const std::unordered_map<GraphId, size_t>& tile_node_counts,
                 const std::map<GraphId, StopEdges>& stop_edge_map,
                 const std::unordered_map<GraphId, bool>& stop_access,
                 const std::vector<OSMConnectionEdge>& connection_edges,
-                const std::unordered_map<uint32_t, Shape> shape_data,
-                const std::vector<float> distances,
+                const std::unordered_map<uint32_t, const Shape*>& shape_data,
                 const std::vector<uint32_t>& route_types) {
   auto t1 = std::chrono::high_resolution_clock::now();
 
@@ -478,9 +481,7 @@ void AddToGraph(GraphTileBuilder& tilebuilder,
       tilebuilder.accessrestriction(0).edgeindex() : currentedges.size() + 1;;
   uint32_t rescount = tilebuilder.header()->access_restriction_count();
 
-  // Get Transit PBF data for this tile
   GraphId tileid = tilebuilder.header()->graphid().Tile_Base();
-  Transit transit = read_pbf(tileid, hierarchy, transit_dir);
 
   // Iterate through the nodes - add back any stored edges and insert any
   // connections from a node to a transit stop. Update each nodes edge index.
@@ -577,6 +578,7 @@ void AddToGraph(GraphTileBuilder& tilebuilder,
   // Iterate through the stops and their edges
   uint32_t nadded = 0;
   uint32_t transitedges = 0;
+  std::map<ShapeCutKey, ShapeCut> shape_cuts;
   for (const auto& stop_edges : stop_edge_map) {
     // Get the stop information
     GraphId stopid = stop_edges.second.origin_pbf_graphid;
@@ -742,24 +744,33 @@ void AddToGraph(GraphTileBuilder& tilebuilder,
       bool added = false;
       std::vector<std::string> names;
 
-      std::vector<PointLL> points;
-      std::vector<float> distance;
-      // get the indexes and vector of points for this shape id
+      // get the shape for this shape id
+      const Shape* trip_shape = nullptr;
       const auto& found = shape_data.find(transitedge.shapeid);
       if (transitedge.shapeid != 0 && found != shape_data.cend()) {
-        const auto& shape_d = found->second;
-        points = shape_d.shape;
-        // copy only the distances that we care about.
-        std::copy((distances.cbegin()+shape_d.begins),
-                  (distances.cbegin()+shape_d.ends),back_inserter(distance));
+        trip_shape = found->second;
       }
       else if (transitedge.shapeid != 0)
         LOG_WARN("Shape Id not found: " + std::to_string(transitedge.shapeid));
 
-      auto shape = GetShape(stopll, endll, transitedge.shapeid, transitedge.orig_dist_traveled,
-                            transitedge.dest_dist_traveled, points, distance);
-      uint32_t edge_info_offset = tilebuilder.AddEdgeInfo(transitedge.routeid,
-           origin_node, endnode, 0, shape, names, added);
+      // Reuse the edge info of an identical cut of the same shape
+      uint32_t edge_info_offset;
+      bool cut_shape = trip_shape != nullptr && stopll != endll;
+      ShapeCutKey key{trip_shape, transitedge.orig_dist_traveled, transitedge.dest_dist_traveled,
+                      origin_node, endnode};
+      auto cut = cut_shape ? shape_cuts.find(key) : shape_cuts.end();
+      if (cut != shape_cuts.end()) {
+        edge_info_offset = cut->second.edge_info_offset;
+        added = cut->second.forward;
+      } else {
+        auto shape = GetShape(stopll, endll, transitedge.orig_dist_traveled,
+                              transitedge.dest_dist_traveled, trip_shape);
+        edge_info_offset = tilebuilder.AddEdgeInfo(transitedge.routeid,
+             origin_node, endnode, 0, shape, names, added);
+        if (cut_shape) {
+          shape_cuts.emplace(key, ShapeCut{edge_info_offset, added});
+        }
+      }
 
       directededge.set_edgeinfo_offset(edge_info_offset);
       directededge.set_forward(added);
@@ -798,11 +809,158 @@ void AddToGraph(GraphTileBuilder& tilebuilder,
           + std::to_string(msecs) + " ms");
 }
 
+// Directed edge within a tile: (node index, directed edge index)
+using EdgeRef = std::pair<uint32_t, uint32_t>;
+
+// Number of grid cells along each side of the tile used to index edge shapes
+constexpr int32_t kConnectionGridSize = 32;
+
+// Index of the OSM edges within a tile. Built once per tile and shared by all
+// of the stops in the tile so finding the edges to connect a stop to does not
+// require scanning (and decoding the edge info of) the entire tile.
+class OSMEdgeIndex {
+ public:
+  OSMEdgeIndex(const GraphTile* tile, const TileHierarchy& hierarchy)
+      : tile_(tile),
+        bounds_(tile->BoundingBox(hierarchy)),
+        cell_width_(bounds_.Width() / kConnectionGridSize),
+        cell_height_(bounds_.Height() / kConnectionGridSize),
+        grid_built_(false) {
+    // Map each way Id to the directed edges along it
+    for (uint32_t i = 0; i < tile->header()->nodecount(); i++) {
+      const NodeInfo* node = tile->node(i);
+      for (uint32_t j = 0, n = node->edge_count(); j < n; j++) {
+        uint32_t idx = node->edge_index() + j;
+        auto edgeinfo = tile->edgeinfo(tile->directededge(idx)->edgeinfo_offset());
+        way_edges_[edgeinfo->wayid()].emplace_back(i, idx);
+      }
+    }
+  }
+
+  // Get the directed edges along a way. Returns nullptr if the way has no
+  // edges in this tile.
+  const std::vector<EdgeRef>* edges(const uint64_t wayid) const {
+    auto found = way_edges_.find(wayid);
+    return found == way_edges_.cend() ? nullptr : &found->second;
+  }
+
+  // Get the pedestrian accessible, non-ferry edges whose shape passes through
+  // the grid cells nearest to the location. The grid is only built the first
+  // time it is needed since most stops come with a usable way Id.
+  std::vector<EdgeRef> nearby(const PointLL& ll) {
+    if (!grid_built_) {
+      BuildGrid();
+    }
+
+    // Search rings of cells around the location. Once something is found
+    // search one more ring since a closer edge could lie in a neighbor cell
+    int32_t col = Col(ll.lng());
+    int32_t row = Row(ll.lat());
+    std::vector<EdgeRef> found;
+    int32_t last_ring = kConnectionGridSize;
+    for (int32_t ring = 0; ring <= last_ring; ring++) {
+      for (int32_t r = row - ring; r <= row + ring; r++) {
+        for (int32_t c = col - ring; c <= col + ring; c++) {
+          // Only the cells on the outside of this ring
+          if (r < 0 || c < 0 || r >= kConnectionGridSize || c >= kConnectionGridSize ||
+              (std::abs(r - row) != ring && std::abs(c - col) != ring)) {
+            continue;
+          }
+          const auto& cell = grid_[r * kConnectionGridSize + c];
+          found.insert(found.end(), cell.cbegin(), cell.cend());
+        }
+      }
+      if (!found.empty() && last_ring == kConnectionGridSize) {
+        last_ring = ring + 1;
+      }
+    }
+    std::sort(found.begin(), found.end());
+    found.erase(std::unique(found.begin(), found.end()), found.end());
+    return found;
+  }
+
+ private:
+  int32_t Col(const float lng) const {
+    int32_t c = static_cast<int32_t>((lng - bounds_.minx()) / cell_width_);
+    return std::min(std::max(c, 0), kConnectionGridSize - 1);
+  }
+
+  int32_t Row(const float lat) const {
+    int32_t r = static_cast<int32_t>((lat - bounds_.miny()) / cell_height_);
+    return std::min(std::max(r, 0), kConnectionGridSize - 1);
+  }
+
+  // Add each segment of the edge shapes to the cells its bounding box covers
+  void BuildGrid() {
+    grid_.resize(kConnectionGridSize * kConnectionGridSize);
+    for (uint32_t i = 0; i < tile_->header()->nodecount(); i++) {
+      const NodeInfo* node = tile_->node(i);
+      for (uint32_t j = 0, n = node->edge_count(); j < n; j++) {
+        uint32_t idx = node->edge_index() + j;
+        const DirectedEdge* directededge = tile_->directededge(idx);
+        if (!(directededge->forwardaccess() & kPedestrianAccess) ||
+            directededge->use() == Use::kFerry ||
+            directededge->use() == Use::kRailFerry) {
+          continue;
+        }
+        auto shape = tile_->edgeinfo(directededge->edgeinfo_offset())->shape();
+        for (size_t s = 0; s + 1 < shape.size(); s++) {
+          int32_t c0 = Col(shape[s].lng()), c1 = Col(shape[s + 1].lng());
+          int32_t r0 = Row(shape[s].lat()), r1 = Row(shape[s + 1].lat());
+          for (int32_t r = std::min(r0, r1); r <= std::max(r0, r1); r++) {
+            for (int32_t c = std::min(c0, c1); c <= std::max(c0, c1); c++) {
+              auto& cell = grid_[r * kConnectionGridSize + c];
+              if (cell.empty() || cell.back() != EdgeRef(i, idx)) {
+                cell.emplace_back(i, idx);
+              }
+            }
+          }
+        }
+      }
+    }
+    grid_built_ = true;
+  }
+
+  const GraphTile* tile_;
+  AABB2<PointLL> bounds_;
+  float cell_width_;
+  float cell_height_;
+  std::unordered_map<uint64_t, std::vector<EdgeRef> > way_edges_;
+  bool grid_built_;
+  std::vector<std::vector<EdgeRef> > grid_;
+};
+
+// Minimum number of nodes reachable on foot for an edge not to be
+// considered an island when a stop is connected to the nearest edges
+constexpr uint32_t kMinConnectedNodes = 20;
+
+// Drop the edges starting on small pedestrian islands (a platform or a plaza
+// drawn without connections) unless that would drop all of them
+void PreferConnected(std::vector<EdgeRef>& edges, const GraphTile* tile,
+                     const ConnectivityIndex& connectivity) {
+  if (connectivity.empty()) {
+    return;
+  }
+  GraphId base = tile->header()->graphid();
+  auto connected = [&base, &connectivity](const EdgeRef& edge) {
+    uint32_t component = connectivity.component(GraphId(base.tileid(), base.level(), edge.first),
+                                                 ConnectivityMode::kPedestrian);
+    return component == 0 || connectivity.component_size(component,
+               ConnectivityMode::kPedestrian) >= kMinConnectedNodes;
+  };
+  auto end = std::stable_partition(edges.begin(), edges.end(), connected);
+  if (end != edges.begin()) {
+    edges.erase(end, edges.end());
+  }
+}
+
 // Add connection edges from the transit stop to an OSM edge
 void AddOSMConnection(const Transit_Stop& stop, const GraphTile* tile,
                       const TileHierarchy& tilehierarchy,
                       GraphReader& reader,
-                      std::mutex& lock,
+                      ProfiledMutex& lock,
+                      OSMEdgeIndex& edge_index,
+                      const ConnectivityIndex& connectivity,
                       std::vector<OSMConnectionEdge>& connection_edges) {
   PointLL stop_ll = {stop.lon(), stop.lat() };
   uint64_t wayid = stop.osm_way_id();
@@ -812,79 +970,99 @@ void AddOSMConnection(const Transit_Stop& stop, const GraphTile* tile,
   GraphId startnode, endnode;
   std::vector<PointLL> closest_shape;
   std::tuple<PointLL,float,int> closest;
-  for (uint32_t i = 0; i < tile->header()->nodecount(); i++) {
+
+  // Get the edges along the stop's way. If the way is not in this tile fall
+  // back to the pedestrian edges nearest to the stop
+  std::vector<EdgeRef> nearby;
+  const std::vector<EdgeRef>* edges = edge_index.edges(wayid);
+  if (edges == nullptr) {
+    nearby = edge_index.nearby(stop_ll);
+    PreferConnected(nearby, tile, connectivity);
+    edges = &nearby;
+    if (!nearby.empty()) {
+      LOG_DEBUG("Way Id " + std::to_string(wayid) + " not found for stop: " +
+                stop.name() + ", using the nearest edges instead");
+    }
+  }
+
+  bool restarted = false;
+  size_t k = 0;
+  while (k < edges->size()) {
+    uint32_t i = (*edges)[k].first;
     const NodeInfo* node = tile->node(i);
-    for (uint32_t j = 0, n = node->edge_count(); j < n; j++) {
-      const DirectedEdge* directededge = tile->directededge(node->edge_index() + j);
-      auto edgeinfo = tile->edgeinfo(directededge->edgeinfo_offset());
-
-      if (edgeinfo->wayid() == wayid) {
-
-        // this is a temp hack until we have some time to have loki return multiple, ranked results.
-        // if the assigned wayid is a ferry, try to find a pedestrian edge instead.
-        // use the distance to the nodes to determine who is closer and where to look for pedestrian edges
-        if (directededge->use() == Use::kFerry || directededge->use() == Use::kRailFerry) {
-          float start_distance = node->latlng().Distance(stop_ll);
-
-          const DirectedEdge* opp_de = tile->directededge(node->edge_index() + directededge->opp_index());
-          GraphId end_node = opp_de->endnode();
-          float end_distance = 0.0f;
-
-          const GraphTile* endnode_tile = tile;
-          if ( directededge->endnode().Tile_Base() != end_node.Tile_Base()) {
-              // Get the end node tile
-              lock.lock();
-              endnode_tile = reader.GetGraphTile(end_node);
-              lock.unlock();
-          }
+    const DirectedEdge* directededge = tile->directededge((*edges)[k].second);
+    k++;
+    auto edgeinfo = tile->edgeinfo(directededge->edgeinfo_offset());
+
+    // this is a temp hack until we have some time to have loki return multiple, ranked results.
+    // if the assigned wayid is a ferry, try to find a pedestrian edge instead.
+    // use the distance to the nodes to determine who is closer and where to look for pedestrian edges
+    if (!restarted && (directededge->use() == Use::kFerry || directededge->use() == Use::kRailFerry)) {
+      float start_distance = node->latlng().Distance(stop_ll);
+
+      const DirectedEdge* opp_de = tile->directededge(node->edge_index() + directededge->opp_index());
+      GraphId end_node = opp_de->endnode();
+      float end_distance = 0.0f;
+
+      const GraphTile* endnode_tile = tile;
+      if ( directededge->endnode().Tile_Base() != end_node.Tile_Base()) {
+          // Get the end node tile
+          lock.lock();
+          endnode_tile = reader.GetGraphTile(end_node);
+          lock.unlock();
+      }
 
-          const NodeInfo* closest_node = endnode_tile->node(end_node.id());
-          end_distance = closest_node->latlng().Distance(stop_ll);
-          if (start_distance <= end_distance)
-            closest_node = node;
-
-          // loop until we hopefully find an edge with pedestrian access.
-          for (uint32_t x = 0, count = closest_node->edge_count(); x < count; x++) {
-            const DirectedEdge* de = endnode_tile->directededge(closest_node->edge_index() + x);
-            auto edge_info = endnode_tile->edgeinfo(de->edgeinfo_offset());
-
-            if (edge_info->wayid() != wayid && (de->forwardaccess() & kPedestrianAccess) &&
-                de->use() != Use::kFerry && de->use() != Use::kRailFerry) {
-              // update the wayid
-              wayid = edge_info->wayid();
-              break;
-            }
-          }
-          if (wayid != edgeinfo->wayid()) {
-            //restart the search process with the updated wayid.
-            i = 0;
-            mindist = 10000000.0f;
-            edgelength = 0;
-            startnode = GraphId{}, endnode = GraphId{};
-            closest_shape.clear();
-            break;
-          }
+      const NodeInfo* closest_node = endnode_tile->node(end_node.id());
+      end_distance = closest_node->latlng().Distance(stop_ll);
+      if (start_distance <= end_distance)
+        closest_node = node;
+
+      // loop until we hopefully find an edge with pedestrian access.
+      for (uint32_t x = 0, count = closest_node->edge_count(); x < count; x++) {
+        const DirectedEdge* de = endnode_tile->directededge(closest_node->edge_index() + x);
+        auto edge_info = endnode_tile->edgeinfo(de->edgeinfo_offset());
+
+        if (edge_info->wayid() != wayid && (de->forwardaccess() & kPedestrianAccess) &&
+            de->use() != Use::kFerry && de->use() != Use::kRailFerry) {
+          // update the wayid
+          wayid = edge_info->wayid();
+          break;
         }
-
-        // Get shape and find closest point
-        auto this_shape = edgeinfo->shape();
-        auto this_closest = stop_ll.ClosestPoint(this_shape);
-
-        if (std::get<1>(this_closest) < mindist) {
-          startnode.Set(tile->header()->graphid().tileid(),
-                        tile->header()->graphid().level(), i);
-          endnode = directededge->endnode();
-          mindist = std::get<1>(this_closest);
-          closest = this_closest;
-          closest_shape = this_shape;
-          edgelength = directededge->length();
-
-          // Reverse the shape if directed edge is not the forward direction
-          // along the shape
-          if (!directededge->forward()) {
-            std::reverse(closest_shape.begin(), closest_shape.end());
-          }
+      }
+      if (wayid != edgeinfo->wayid()) {
+        //restart the search process with the edges of the updated wayid.
+        static const std::vector<EdgeRef> kNoEdges;
+        edges = edge_index.edges(wayid);
+        if (edges == nullptr) {
+          edges = &kNoEdges;
         }
+        restarted = true;
+        mindist = 10000000.0f;
+        edgelength = 0;
+        startnode = GraphId{}, endnode = GraphId{};
+        closest_shape.clear();
+        k = 0;
+        continue;
+      }
+    }
+
+    // Get shape and find closest point
+    auto this_shape = edgeinfo->shape();
+    auto this_closest = stop_ll.ClosestPoint(this_shape);
+
+    if (std::get<1>(this_closest) < mindist) {
+      startnode.Set(tile->header()->graphid().tileid(),
+                    tile->header()->graphid().level(), i);
+      endnode = directededge->endnode();
+      mindist = std::get<1>(this_closest);
+      closest = this_closest;
+      closest_shape = this_shape;
+      edgelength = directededge->length();
+
+      // Reverse the shape if directed edge is not the forward direction
+      // along the shape
+      if (!directededge->forward()) {
+        std::reverse(closest_shape.begin(), closest_shape.end());
       }
     }
   }
@@ -955,59 +1133,59 @@ void AddOSMConnection(const Transit_Stop& stop, const GraphTile* tile,
   }
 }
 
-// We make sure to lock on reading and writing since tiles are now being
-// written. Also lock on queue access since shared by different threads.
+// Each tile is handled by exactly one thread so reading it needs no lock. We
+// only lock when reading a tile that belongs to some other thread and when
+// writing tiles, which other threads may be reading across tile boundaries.
+// The queue is shared, each thread atomically takes the next tile from it.
 void build(const std::string& transit_dir,
-           const boost::property_tree::ptree& pt, std::mutex& lock,
+           const boost::property_tree::ptree& pt, ProfiledMutex& lock,
            const std::unordered_map<GraphId, size_t>& tiles,
-           std::unordered_map<GraphId, size_t>::const_iterator tile_start,
-           std::unordered_map<GraphId, size_t>::const_iterator tile_end,
+           const std::unordered_map<GraphId, std::vector<std::string> >& transit_tiles,
+           const std::vector<GraphId>& queue,
+           std::atomic<size_t>& next_tile,
+           const ConnectivityIndex& connectivity,
            std::promise<builder_stats>& results) {
   // Local Graphreader. Get tile information so we can find bounding boxes
   GraphReader reader(pt);
   const TileHierarchy& hierarchy = reader.GetTileHierarchy();
+  Counter& tiles_built = Metrics::Get().counter("transit.tiles_built");
+  Gauge& tiles_remaining = Metrics::Get().gauge("transit.tiles_remaining");
+  Gauge& queue_depth = Metrics::Get().gauge("transit.queue_depth");
 
   // Iterate through the tiles in the queue and find any that include stops
-  for(; tile_start != tile_end; ++tile_start) {
+  for (size_t t = next_tile++; t < queue.size(); t = next_tile++) {
     // Get the next tile Id from the queue and get a tile builder
+    queue_depth.Add(-1);
     if(reader.OverCommitted())
       reader.Clear();
-    GraphId tile_id = tile_start->first.Tile_Base();
-
-    // Get transit pbf tile
-    std::string file_name = GraphTile::FileSuffix(GraphId(tile_id.tileid(), tile_id.level(),0), hierarchy);
-    boost::algorithm::trim_if(file_name, boost::is_any_of(".gph"));
-    file_name += ".pbf";
-    const std::string file = transit_dir + file_name;
-
-    // Make sure it exists
-    if (!boost::filesystem::exists(file)) {
-      LOG_ERROR("File not found.  " + file);
-      return;
+    GraphId tile_id = queue[t].Tile_Base();
+
+    // Get transit pbf tile and any continuation files from the index
+    auto transit_files = transit_tiles.find(tile_id);
+    if (transit_files == transit_tiles.cend()) {
+      LOG_ERROR("No transit files for tile " + std::to_string(tile_id.tileid()));
+      tiles_remaining.Add(-1);
+      continue;
     }
+    const std::string& file = transit_files->second.front();
 
-    Transit transit; {
-      std::fstream input(file, std::ios::in | std::ios::binary);
-      if (!input) {
-        LOG_ERROR("Error opening file:  " + file);
-        return;
-      }
-      std::string buffer((std::istreambuf_iterator<char>(input)), std::istreambuf_iterator<char>());
-      google::protobuf::io::ArrayInputStream as(static_cast<const void*>(buffer.c_str()), buffer.size());
-      google::protobuf::io::CodedInputStream cs(static_cast<google::protobuf::io::ZeroCopyInputStream*>(&as));
-      cs.SetTotalBytesLimit(buffer.size() * 2, buffer.size() * 2);
-      if (!transit.ParseFromCodedStream(&cs)) {
-        LOG_ERROR("Failed to parse file: " + file);
-        return;
-      }
+    // Stops, routes and shapes. Stop pairs are streamed later on
+    Transit transit;
+    try {
+      TransitPbf pbf(file);
+      transit = pbf.ReadWithoutStopPairs();
+    }
+    catch (const std::exception& e) {
+      LOG_ERROR(e.what());
+      tiles_remaining.Add(-1);
+      continue;
     }
 
     // Get Valhalla tile - get a read only instance for reference and
-    // a writeable instance (deserialize it so we can add to it)
-    lock.lock();
+    // a writeable instance (deserialize it so we can add to it). No other
+    // thread writes this tile so there is no need to lock
     const GraphTile* tile = reader.GetGraphTile(tile_id);
     GraphTileBuilder tilebuilder(hierarchy, tile_id, true);
-    lock.unlock();
 
     // Iterate through stops and form connections to OSM network. Each
     // stop connects to 1 or 2 OSM nodes along the closest OSM way.
@@ -1018,12 +1196,14 @@ void build(const std::string& transit_dir,
     // TODO - what if we split the edge and insert a node?
     std::vector<OSMConnectionEdge> connection_edges;
     std::unordered_multimap<GraphId, GraphId> children;
+    OSMEdgeIndex edge_index(tile, hierarchy);
     for (uint32_t i = 0; i < transit.stops_size(); i++) {
       const Transit_Stop& stop = transit.stops(i);
 
       // Form connections to the stop
       // TODO - deal with hierarchy (only connect egress locations)
-      AddOSMConnection(stop, tile, hierarchy, reader, lock, connection_edges);
+      AddOSMConnection(stop, tile, hierarchy, reader, lock, edge_index,
+                       connectivity, connection_edges);
 
       // Store stop information in TransitStops
       tilebuilder.AddTransitStop( { tilebuilder.AddName(stop.onestop_id()),
@@ -1035,32 +1215,31 @@ void build(const std::string& transit_dir,
       }       **/
     }
 
-    //Get all the shapes for this tile and calculate the distances
-    std::unordered_map<uint32_t, Shape> shapes;
-    std::vector<float> distances;
+    // Get all the shapes for this tile and calculate the distances along
+    // each of them once. Shapes with the same encoding are only kept once.
+    std::list<Shape> unique_shapes;
+    std::unordered_map<std::string, const Shape*> encoded_shapes;
+    std::unordered_map<uint32_t, const Shape*> shapes;
     for (uint32_t i = 0; i < transit.shapes_size(); i++) {
       const Transit_Shape& shape = transit.shapes(i);
-      const std::vector<PointLL> trip_shape = decode<std::vector<PointLL> >(shape.encoded_shape());
-
-      float distance = 0.0f;
-      Shape shape_data;
-      //first is always 0.0f.
-      distances.push_back(distance);
-      shape_data.begins = distances.size()-1;
-
-      // loop through the points getting the distances.
-      for (size_t index = 0; index < trip_shape.size() - 1; ++index) {
-        PointLL p0 = trip_shape[index];
-        PointLL p1 = trip_shape[index + 1];
-        distance += p0.Distance(p1);
-        distances.push_back(distance);
+      auto encoded = encoded_shapes.find(shape.encoded_shape());
+      if (encoded == encoded_shapes.end()) {
+        unique_shapes.emplace_back();
+        Shape& shape_data = unique_shapes.back();
+        shape_data.shape = decode<std::vector<PointLL> >(shape.encoded_shape());
+
+        //first is always 0.0f.
+        float distance = 0.0f;
+        shape_data.distances.reserve(shape_data.shape.size());
+        shape_data.distances.push_back(distance);
+        for (size_t index = 1; index < shape_data.shape.size(); ++index) {
+          distance += shape_data.shape[index - 1].Distance(shape_data.shape[index]);
+          shape_data.distances.push_back(distance);
+        }
+        encoded = encoded_shapes.emplace(shape.encoded_shape(), &shape_data).first;
       }
-      //must be distances.size for the end index as we use std::copy later on and want
-      //to include the last element in the vector we wish to copy.
-      shape_data.ends = distances.size();
-      shape_data.shape = trip_shape;
-      //shape id --> begin and end indexes in the distance vector and vector of points.
-      shapes[shape.shape_id()] = shape_data;
+      //shape id --> points and distances along them
+      shapes[shape.shape_id()] = encoded->second;
     }
 
     // Sort the connection edges
@@ -1068,7 +1247,7 @@ void build(const std::string& transit_dir,
 
     LOG_INFO("Tile " + std::to_string(tile_id.tileid()) + ": added " +
              std::to_string(transit.stops_size()) + " stops and " +
-             std::to_string(transit.shapes_size()) + " shapes and " +
+             std::to_string(unique_shapes.size()) + " unique shapes and " +
              std::to_string(connection_edges.size()) + " connection edges");
 
     // Get all scheduled departures from the stops within this tile.
@@ -1078,12 +1257,15 @@ void build(const std::string& transit_dir,
 
     // Create a map of stop key to index in the stop vector
 
-    // Process schedule stop pairs (departures)
+    // Process schedule stop pairs (departures) and sort them so each stop's
+    // departures form a contiguous range ordered by departure time
     std::unordered_map<GraphId, bool> stop_access;
-    std::unordered_multimap<GraphId, Departure> departures =
+    std::vector<Departure> departures =
                 ProcessStopPairs(tilebuilder, hierarchy,
                                  transit, stop_access,
-                                 file, tile_id);
+                                 transit_files->second, tile_id);
+    std::vector<size_t> stop_departures = SortDepartures(departures, tile_id,
+                                                         transit.stops_size());
 
     // Form departures and egress/station/platform hierarchy
     for (uint32_t i = 0; i < transit.stops_size(); i++) {
@@ -1104,9 +1286,9 @@ void build(const std::string& transit_dir,
 
       // Find unique transit graph edges.
       std::map<std::pair<uint32_t, GraphId>, uint32_t> unique_transit_edges;
-      auto range = departures.equal_range(stop_pbf_graphid);
-      for(auto key = range.first; key != range.second; ++key) {
-        Departure dep = key->second;
+      transit_departures.clear();
+      for (size_t d = stop_departures[i]; d < stop_departures[i + 1]; d++) {
+        const Departure& dep = departures[d];
 
         // Identify unique route and arrival stop pairs - associate to a
         // unique line Id stored in the directed edge.
@@ -1132,7 +1314,18 @@ void build(const std::string& transit_dir,
                      " dep time = " + std::to_string(td.departure_time()) +
                      " arr time = " + std::to_string(dep.arr_time));*/
 
-        tilebuilder.AddTransitDeparture(std::move(td));
+        transit_departures.emplace_back(std::move(td));
+      }
+
+      // Departures are already in time order and this stop's line Ids are
+      // contiguous, so a stable sort by line Id yields the (line Id, time)
+      // order the tile is stored in without sorting the whole tile again
+      std::stable_sort(transit_departures.begin(), transit_departures.end(),
+                       [](const TransitDeparture& a, const TransitDeparture& b) {
+                         return a.lineid() < b.lineid();
+                       });
+      for (const auto& td : transit_departures) {
+        tilebuilder.AddTransitDeparture(td);
       }
 
       // TODO Get any transfers from this stop (no transfers currently
@@ -1150,13 +1343,15 @@ void build(const std::string& transit_dir,
              ": added " + std::to_string(route_types.size()) + " routes");
 
     // Add nodes, directededges, and edgeinfo
-    AddToGraph(tilebuilder, hierarchy, transit_dir, tiles, stop_edge_map,
-               stop_access, connection_edges, shapes, distances, route_types);
+    AddToGraph(tilebuilder, hierarchy, transit_dir, transit, tiles, stop_edge_map,
+               stop_access, connection_edges, shapes, route_types);
 
     // Write the new file
     lock.lock();
     tilebuilder.StoreTileData();
     lock.unlock();
+    tiles_built.Add();
+    tiles_remaining.Add(-1);
   }
 
   // Send back the statistics
@@ -1190,28 +1385,49 @@ void TransitBuilder::Build(const boost::property_tree::ptree& pt) {
     LOG_INFO("Transit directory not found. Transit will not be added.");
     return;
   }
-  // Also bail if nothing inside
+  // Also bail if nothing inside. Scan the directory once and index each tile's
+  // pbf along with any continuation files (.pbf.0, .pbf.1, ...) it was split
+  // into so the workers never have to go back to the file system to find them
   transit_dir->push_back('/');
-  std::map<GraphId, std::string> transit_tiles;
+  std::unordered_map<GraphId, std::vector<std::string> > transit_tiles;
+  std::unordered_map<GraphId, std::map<uint32_t, std::string> > continuations;
   GraphReader reader(pt.get_child("mjolnir"));
   const auto& hierarchy = reader.GetTileHierarchy();
   auto local_level = hierarchy.levels().rbegin()->first;
   if(boost::filesystem::is_directory(*transit_dir + std::to_string(local_level) + "/")) {
     boost::filesystem::recursive_directory_iterator transit_file_itr(*transit_dir + std::to_string(local_level) + "/"), end_file_itr;
     for(; transit_file_itr != end_file_itr; ++transit_file_itr) {
-      if(boost::filesystem::is_regular(transit_file_itr->path()) && transit_file_itr->path().extension() == ".pbf") {
-        auto graph_id = TransitToTile(pt, transit_file_itr->path().string());
+      if(!boost::filesystem::is_regular(transit_file_itr->path()))
+        continue;
+      std::string fname = transit_file_itr->path().string();
+      std::string ext = transit_file_itr->path().extension().string();
+      if(ext == ".pbf") {
+        auto graph_id = TransitToTile(pt, fname);
         //TODO: this precludes a transit only network, which kind of sucks but
         //right now we are assuming that we have to connect stops to the OSM
         //road network so if that assumption goes away this can too
         if(GraphReader::DoesTileExist(hierarchy, graph_id)) {
           const GraphTile* tile = reader.GetGraphTile(graph_id);
           tiles.emplace(graph_id, tile->header()->nodecount());
-          transit_tiles.emplace(graph_id, transit_file_itr->path().string());
+          transit_tiles.emplace(graph_id, std::vector<std::string>{fname});
         }
       }
+      else if(ext.size() > 1 && std::all_of(ext.cbegin() + 1, ext.cend(), ::isdigit)) {
+        std::string base = fname.substr(0, fname.size() - ext.size());
+        if(boost::filesystem::path(base).extension() == ".pbf")
+          continuations[TransitToTile(pt, base)].emplace(std::stoul(ext.substr(1)), fname);
+      }
     }
   }
+
+  // Continuation files follow the tile's pbf in the order they were written
+  for(auto& transit_tile : transit_tiles) {
+    auto parts = continuations.find(transit_tile.first);
+    if(parts == continuations.cend())
+      continue;
+    for(const auto& part : parts->second)
+      transit_tile.second.push_back(part.second);
+  }
   if (!transit_tiles.size()) {
     LOG_INFO("No transit tiles found. Transit will not be added.");
     return;
@@ -1232,30 +1448,47 @@ void TransitBuilder::Build(const boost::property_tree::ptree& pt) {
        std::thread::hardware_concurrency())));
 
   // An atomic object we can use to do the synchronization
-  std::mutex lock;
+  ProfiledMutex lock("transit", pt.get<bool>("mjolnir.profile_locks", false));
 
   // A place to hold the results of those threads (exceptions, stats)
   std::list<std::promise<builder_stats> > results;
 
-  // Start the threads, divvy up the work
+  // Transit tiles vary wildly in how much work they are so queue them up by
+  // the size of their pbf files, largest first. Threads pull from the front
+  // of the queue so the big ones don't end up being done last
+  std::vector<std::pair<size_t, GraphId> > weighted;
+  for (const auto& transit_tile : transit_tiles) {
+    size_t size = 0;
+    for (const auto& file : transit_tile.second)
+      size += boost::filesystem::file_size(file);
+    weighted.emplace_back(size, transit_tile.first);
+  }
+  std::sort(weighted.begin(), weighted.end(),
+    [](const std::pair<size_t, GraphId>& a, const std::pair<size_t, GraphId>& b) {
+      return a.first == b.first ? a.second < b.second : a.first > b.first;
+    });
+  std::vector<GraphId> queue;
+  for (const auto& w : weighted)
+    queue.push_back(w.second);
+  std::atomic<size_t> next_tile(0);
+  Metrics::Get().gauge("transit.tiles_remaining").Set(queue.size());
+  Metrics::Get().gauge("transit.queue_depth").Set(queue.size());
+
+  // Connectivity computed after the graph was built, used to avoid
+  // connecting stops to islands
+  ConnectivityIndex connectivity;
+  connectivity.Load(ConnectivityIndex::FileName(pt.get_child("mjolnir")),
+                    TileHierarchy(pt.get<std::string>("mjolnir.tile_dir")));
+
+  // Start the threads
   LOG_INFO("Adding " + std::to_string(transit_tiles.size()) + " transit tiles to the local graph...");
-  size_t floor = tiles.size() / threads.size();
-  size_t at_ceiling = tiles.size() - (threads.size() * floor);
-  std::unordered_map<GraphId, size_t>::const_iterator tile_start, tile_end = tiles.begin();
-
-  // Atomically pass around stats info
   for (size_t i = 0; i < threads.size(); ++i) {
-    // Figure out how many this thread will work on (either ceiling or floor)
-    size_t tile_count = (i < at_ceiling ? floor + 1 : floor);
-    // Where the range begins
-    tile_start = tile_end;
-    // Where the range ends
-    std::advance(tile_end, tile_count);
     // Make the thread
     results.emplace_back();
     threads[i].reset(
       new std::thread(build, *transit_dir, std::cref(pt.get_child("mjolnir")),
-                      std::ref(lock), std::cref(tiles), tile_start, tile_end,
+                      std::ref(lock), std::cref(tiles), std::cref(transit_tiles),
+                      std::cref(queue), std::ref(next_tile), std::cref(connectivity),
                       std::ref(results.back())));
   }
 
@@ -1263,6 +1496,7 @@ void TransitBuilder::Build(const boost::property_tree::ptree& pt) {
   for (auto& thread : threads) {
     thread->join();
   }
+  lock.Report("transit");
 
   // Check all of the outcomes, to see about maximum density (km/km2)
   builder_stats stats{};
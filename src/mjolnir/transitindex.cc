@@ -0,0 +1,316 @@
+#include "mjolnir/transitindex.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <limits>
+#include <thread>
+#include <functional>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <valhalla/baldr/graphid.h>
+
+using namespace valhalla::baldr;
+
+namespace {
+
+constexpr char kMagic[8] = { 'T', 'R', 'N', 'S', 'I', 'D', 'X', '2' };
+
+struct header_t {
+  char magic[8];
+  uint32_t file_count;
+  uint32_t stop_count;
+  uint64_t entry_count;
+};
+
+// Size and modification time of each file so stale indexes are noticed
+struct file_info_t {
+  uint64_t size;
+  int64_t mtime;
+};
+
+bool Stat(const std::string& file, file_info_t& info) {
+  struct stat s;
+  if (stat(file.c_str(), &s) == -1) {
+    return false;
+  }
+  info.size = static_cast<uint64_t>(s.st_size);
+  info.mtime = static_cast<int64_t>(s.st_mtime);
+  return true;
+}
+
+std::vector<file_info_t> Info(const std::vector<std::string>& files) {
+  std::vector<file_info_t> info(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (!Stat(files[i], info[i])) {
+      throw std::runtime_error("Couldn't load " + files[i]);
+    }
+  }
+  return info;
+}
+
+bool HasDate(const google::protobuf::RepeatedField<uint32_t>& dates,
+             const uint32_t date) {
+  return std::find(dates.begin(), dates.end(), date) != dates.end();
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+TransitIndex::TransitIndex(const std::string& pbf_file)
+    : pbf_file_(pbf_file) {
+  std::string index_file = pbf_file + ".idx";
+  if (!Load(index_file)) {
+    Build(pbf_file, index_file);
+    if (!Load(index_file)) {
+      throw std::runtime_error("Couldn't load " + index_file);
+    }
+  }
+}
+
+uint32_t TransitIndex::stop_count() const {
+  return offsets_.empty() ? 0 : offsets_.size() - 1;
+}
+
+size_t TransitIndex::size() const {
+  return entries_.size();
+}
+
+// Binary search to the start of the window then walk the stop's departures
+std::vector<const ScheduleEntry*> TransitIndex::Departures(const uint32_t stop_id,
+                                                           const uint32_t begin,
+                                                           const uint32_t end,
+                                                           const uint32_t date) const {
+  std::vector<const ScheduleEntry*> departures;
+  if (stop_id >= stop_count()) {
+    return departures;
+  }
+  auto first = entries_.begin() + offsets_[stop_id];
+  auto last = entries_.begin() + offsets_[stop_id + 1];
+  auto itr = std::lower_bound(first, last, begin,
+      [](const ScheduleEntry& e, const uint32_t time) { return e.departure_time < time; });
+  for (; itr != last && itr->departure_time < end; ++itr) {
+    if (date == 0 || RunsOn(*itr, date)) {
+      departures.push_back(&*itr);
+    }
+  }
+  return departures;
+}
+
+// Only departures with added or removed dates need the stop pair decoded
+bool TransitIndex::RunsOn(const ScheduleEntry& entry, const uint32_t date) const {
+  Transit_StopPair pair;
+  if (entry.has_added_dates) {
+    StopPair(entry, pair);
+    if (HasDate(pair.service_added_dates(), date)) {
+      return true;
+    }
+  }
+  if (date < entry.service_start_date || date > entry.service_end_date) {
+    return false;
+  }
+
+  // Julian day 0 was a Monday
+  if ((entry.days_of_week & (1 << (date % 7))) == 0) {
+    return false;
+  }
+  if (entry.has_except_dates) {
+    if (!entry.has_added_dates) {
+      StopPair(entry, pair);
+    }
+    return !HasDate(pair.service_except_dates(), date);
+  }
+  return true;
+}
+
+void TransitIndex::StopPair(const ScheduleEntry& entry, Transit_StopPair& pair) const {
+  if (files_.empty()) {
+    files_.resize(Files(pbf_file_).size());
+  }
+  if (entry.file >= files_.size()) {
+    throw std::runtime_error("Schedule index of " + pbf_file_ + " is out of date");
+  }
+  auto& pbf = files_[entry.file];
+  if (!pbf) {
+    pbf.reset(new TransitPbf(entry.file == 0 ? pbf_file_ :
+                             pbf_file_ + "." + std::to_string(entry.file - 1), false));
+  }
+  pbf->ReadStopPair(entry.offset, pair);
+}
+
+// Stream the stop pairs of each file once and bucket them by origin stop
+void TransitIndex::Build(const std::string& pbf_file, const std::string& index_file) {
+  auto files = Files(pbf_file);
+  if (files.empty()) {
+    throw std::runtime_error("Couldn't load " + pbf_file);
+  }
+  if (files.size() > static_cast<size_t>(std::numeric_limits<uint16_t>::max()) + 1) {
+    throw std::runtime_error("Too many continuation files to index " + pbf_file);
+  }
+  auto info = Info(files);
+
+  // Stops only live in the first file
+  uint32_t stop_count;
+  GraphId tile;
+  {
+    TransitPbf pbf(pbf_file);
+    Transit transit = pbf.ReadWithoutStopPairs();
+    stop_count = transit.stops_size();
+    if (stop_count > 0) {
+      tile = GraphId(transit.stops(0).graphid()).Tile_Base();
+    }
+  }
+
+  std::vector<ScheduleEntry> entries;
+  std::vector<uint32_t> origins;
+  Transit_StopPair sp;
+  for (size_t f = 0; f < files.size(); ++f) {
+    TransitPbf pbf(files[f]);
+    StopPairReader reader(pbf);
+    while (reader.Next(sp)) {
+      GraphId origin(sp.origin_graphid());
+      if (!origin.Is_Valid() || !GraphId(sp.destination_graphid()).Is_Valid() ||
+          origin.tileid() != tile.tileid() || origin.level() != tile.level() ||
+          origin.id() >= stop_count) {
+        continue;
+      }
+      ScheduleEntry e;
+      std::memset(&e, 0, sizeof(e));
+      e.destination_graphid = sp.destination_graphid();
+      e.offset = reader.offset();
+      e.departure_time = sp.origin_departure_time();
+      e.arrival_time = sp.destination_arrival_time();
+      e.trip_id = sp.trip_id();
+      e.line_id = sp.line_id();
+      e.service_start_date = sp.service_start_date();
+      e.service_end_date = sp.service_end_date();
+      e.route_index = sp.route_index();
+      for (int d = 0; d < sp.service_days_of_week_size() && d < 7; ++d) {
+        if (sp.service_days_of_week(d)) {
+          e.days_of_week |= (1 << d);
+        }
+      }
+      e.file = f;
+      e.has_except_dates = sp.service_except_dates_size() > 0;
+      e.has_added_dates = sp.service_added_dates_size() > 0;
+      entries.push_back(e);
+      origins.push_back(origin.id());
+    }
+  }
+
+  // Counting sort by origin stop, then order each stop by departure time
+  std::vector<uint32_t> offsets(stop_count + 1, 0);
+  for (auto origin : origins) {
+    offsets[origin + 1]++;
+  }
+  for (uint32_t i = 0; i < stop_count; ++i) {
+    offsets[i + 1] += offsets[i];
+  }
+  std::vector<ScheduleEntry> sorted(entries.size());
+  std::vector<uint32_t> next(offsets.begin(), offsets.end() - 1);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    sorted[next[origins[i]]++] = entries[i];
+  }
+  for (uint32_t i = 0; i < stop_count; ++i) {
+    std::sort(sorted.begin() + offsets[i], sorted.begin() + offsets[i + 1],
+              [](const ScheduleEntry& a, const ScheduleEntry& b) {
+                return a.departure_time < b.departure_time ||
+                      (a.departure_time == b.departure_time && a.trip_id < b.trip_id);
+              });
+  }
+
+  // Write to a temporary file and move it into place so readers never see
+  // a partial index. Its name is unique to the process and thread so two
+  // builders of the same index don't write over each other.
+  header_t header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.file_count = files.size();
+  header.stop_count = stop_count;
+  header.entry_count = sorted.size();
+  std::string tmp_file = index_file + ".tmp." + std::to_string(getpid()) + "." +
+      std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+  {
+    std::ofstream file(tmp_file, std::ios::out | std::ios::binary | std::ios::trunc);
+    if (!file.is_open()) {
+      throw std::runtime_error("Couldn't write " + index_file);
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(info.data()), info.size() * sizeof(file_info_t));
+    file.write(reinterpret_cast<const char*>(offsets.data()), offsets.size() * sizeof(uint32_t));
+    file.write(reinterpret_cast<const char*>(sorted.data()), sorted.size() * sizeof(ScheduleEntry));
+    if (!file) {
+      throw std::runtime_error("Couldn't write " + index_file);
+    }
+  }
+  if (std::rename(tmp_file.c_str(), index_file.c_str()) != 0) {
+    std::remove(tmp_file.c_str());
+    throw std::runtime_error("Couldn't write " + index_file);
+  }
+}
+
+// Any difference in the files the index was built from means a rebuild
+bool TransitIndex::Load(const std::string& index_file) {
+  std::ifstream file(index_file, std::ios::in | std::ios::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+  header_t header;
+  if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    return false;
+  }
+
+  auto files = Files(pbf_file_);
+  if (header.file_count != files.size()) {
+    return false;
+  }
+  std::vector<file_info_t> saved(header.file_count);
+  if (!file.read(reinterpret_cast<char*>(saved.data()), saved.size() * sizeof(file_info_t))) {
+    return false;
+  }
+  for (size_t i = 0; i < files.size(); ++i) {
+    file_info_t current;
+    if (!Stat(files[i], current) || current.size != saved[i].size ||
+        current.mtime != saved[i].mtime) {
+      return false;
+    }
+  }
+
+  offsets_.resize(header.stop_count + 1);
+  entries_.resize(header.entry_count);
+  if (!file.read(reinterpret_cast<char*>(offsets_.data()), offsets_.size() * sizeof(uint32_t)) ||
+      !file.read(reinterpret_cast<char*>(entries_.data()), entries_.size() * sizeof(ScheduleEntry)) ||
+      offsets_.back() != header.entry_count) {
+    offsets_.clear();
+    entries_.clear();
+    return false;
+  }
+  files_.clear();
+  return true;
+}
+
+// The tile followed by its .pbf.0, .pbf.1, ... continuations
+std::vector<std::string> TransitIndex::Files(const std::string& pbf_file) {
+  std::vector<std::string> files;
+  struct stat s;
+  if (stat(pbf_file.c_str(), &s) == -1) {
+    return files;
+  }
+  files.push_back(pbf_file);
+  for (size_t i = 0; ; ++i) {
+    std::string file = pbf_file + "." + std::to_string(i);
+    if (stat(file.c_str(), &s) == -1) {
+      break;
+    }
+    files.push_back(file);
+  }
+  return files;
+}
+
+}
+}
@@ -0,0 +1,194 @@
+#include "mjolnir/transitpbf.h"
+
+#include <stdexcept>
+#include <limits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <google/protobuf/wire_format_lite.h>
+
+#include <valhalla/midgard/logging.h>
+
+using namespace google::protobuf::io;
+using google::protobuf::internal::WireFormatLite;
+
+namespace {
+
+// Let protobuf read the whole mapping, it defaults to a much smaller limit
+void SetLimit(CodedInputStream& cs, const size_t size) {
+  int limit = static_cast<int>(std::min(std::max(static_cast<size_t>(1), size * 2),
+                      static_cast<size_t>(std::numeric_limits<int>::max())));
+  cs.SetTotalBytesLimit(limit, limit);
+}
+
+// Parse a single length delimited message from the stream
+bool ReadMessage(CodedInputStream& cs, google::protobuf::MessageLite* message) {
+  uint32_t length;
+  if (!cs.ReadVarint32(&length)) {
+    return false;
+  }
+  auto limit = cs.PushLimit(length);
+  bool parsed = message->MergePartialFromCodedStream(&cs) &&
+                cs.ConsumedEntireMessage();
+  cs.PopLimit(limit);
+  return parsed;
+}
+
+bool IsMessage(const uint32_t tag) {
+  return WireFormatLite::GetTagWireType(tag) ==
+         WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+}
+
+}
+
+namespace valhalla {
+namespace mjolnir {
+
+// Map the file read only
+TransitPbf::TransitPbf(const std::string& file_name, const bool sequential)
+    : file_name_(file_name),
+      data_(nullptr),
+      size_(0) {
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    throw std::runtime_error("Couldn't load " + file_name);
+  }
+  struct stat s;
+  if (fstat(fd, &s) == -1) {
+    close(fd);
+    throw std::runtime_error("Couldn't load " + file_name);
+  }
+  size_ = s.st_size;
+  // Protobuf streams count bytes in an int, a bigger tile would be read
+  // short or at the wrong offsets. The writers split tiles well before this.
+  if (size_ > static_cast<size_t>(std::numeric_limits<int>::max())) {
+    close(fd);
+    LOG_ERROR(file_name + " is " + std::to_string(size_) + " bytes, transit pbfs are limited to " +
+              std::to_string(std::numeric_limits<int>::max()));
+    throw std::runtime_error("Couldn't load " + file_name + ", it is too large");
+  }
+  if (size_ > 0) {
+    void* ptr = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Couldn't map " + file_name);
+    }
+    // Read ahead only pays off when we read front to back
+    madvise(ptr, size_, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+    data_ = static_cast<const char*>(ptr);
+  }
+  close(fd);
+}
+
+TransitPbf::~TransitPbf() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+const std::string& TransitPbf::file_name() const {
+  return file_name_;
+}
+
+size_t TransitPbf::size() const {
+  return size_;
+}
+
+// Parse the whole tile straight from the mapping
+Transit TransitPbf::Read() const {
+  ArrayInputStream as(static_cast<const void*>(data_), size_);
+  CodedInputStream cs(static_cast<ZeroCopyInputStream*>(&as));
+  SetLimit(cs, size_);
+  Transit transit;
+  if (!transit.ParseFromCodedStream(&cs)) {
+    throw std::runtime_error("Couldn't load " + file_name_);
+  }
+  return transit;
+}
+
+// Parse everything except the stop pairs which are skipped over in place
+Transit TransitPbf::ReadWithoutStopPairs() const {
+  ArrayInputStream as(static_cast<const void*>(data_), size_);
+  CodedInputStream cs(static_cast<ZeroCopyInputStream*>(&as));
+  SetLimit(cs, size_);
+  Transit transit;
+  uint32_t tag;
+  while ((tag = cs.ReadTag()) != 0) {
+    bool parsed = true;
+    switch (WireFormatLite::GetTagFieldNumber(tag)) {
+      case Transit::kStopsFieldNumber:
+        parsed = IsMessage(tag) && ReadMessage(cs, transit.add_stops());
+        break;
+      case Transit::kRoutesFieldNumber:
+        parsed = IsMessage(tag) && ReadMessage(cs, transit.add_routes());
+        break;
+      case Transit::kShapesFieldNumber:
+        parsed = IsMessage(tag) && ReadMessage(cs, transit.add_shapes());
+        break;
+      default:
+        parsed = WireFormatLite::SkipField(&cs, tag);
+        break;
+    }
+    if (!parsed) {
+      throw std::runtime_error("Couldn't load " + file_name_);
+    }
+  }
+  return transit;
+}
+
+// Jump straight to the length prefix of a stop pair
+void TransitPbf::ReadStopPair(const size_t offset, Transit_StopPair& pair) const {
+  if (offset >= size_) {
+    throw std::runtime_error("Stop pair offset past the end of " + file_name_);
+  }
+  ArrayInputStream as(static_cast<const void*>(data_ + offset), size_ - offset);
+  CodedInputStream cs(static_cast<ZeroCopyInputStream*>(&as));
+  SetLimit(cs, size_ - offset);
+  pair.Clear();
+  if (!ReadMessage(cs, &pair)) {
+    throw std::runtime_error("Couldn't load stop pair from " + file_name_);
+  }
+}
+
+StopPairReader::StopPairReader(const TransitPbf& pbf)
+    : pbf_(pbf),
+      array_(static_cast<const void*>(pbf.data_), pbf.size_),
+      coded_(static_cast<ZeroCopyInputStream*>(&array_)),
+      count_(0),
+      offset_(0) {
+  SetLimit(coded_, pbf.size_);
+}
+
+// Skip ahead to the next stop pair and decode just that one
+bool StopPairReader::Next(Transit_StopPair& pair) {
+  uint32_t tag;
+  while ((tag = coded_.ReadTag()) != 0) {
+    if (WireFormatLite::GetTagFieldNumber(tag) == Transit::kStopPairsFieldNumber &&
+        IsMessage(tag)) {
+      pair.Clear();
+      offset_ = coded_.CurrentPosition();
+      if (!ReadMessage(coded_, &pair)) {
+        throw std::runtime_error("Couldn't load stop pair from " + pbf_.file_name());
+      }
+      count_++;
+      return true;
+    }
+    if (!WireFormatLite::SkipField(&coded_, tag)) {
+      throw std::runtime_error("Couldn't load " + pbf_.file_name());
+    }
+  }
+  return false;
+}
+
+size_t StopPairReader::count() const {
+  return count_;
+}
+
+size_t StopPairReader::offset() const {
+  return offset_;
+}
+
+}
+}
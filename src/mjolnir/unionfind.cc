@@ -0,0 +1,55 @@
+#include "mjolnir/unionfind.h"
+
+#include <utility>
+
+namespace valhalla {
+namespace mjolnir {
+
+UnionFind::UnionFind(const uint32_t size)
+    : parents_(size) {
+  for (uint32_t i = 0; i < size; i++) {
+    parents_[i].store(i, std::memory_order_relaxed);
+  }
+}
+
+// Path halving. A parent only ever changes to one of its ancestors so a
+// lost race just leaves the path a little longer.
+uint32_t UnionFind::Find(uint32_t index) {
+  while (true) {
+    uint32_t parent = parents_[index].load();
+    if (parent == index) {
+      return index;
+    }
+    uint32_t grandparent = parents_[parent].load();
+    if (grandparent != parent) {
+      parents_[index].compare_exchange_weak(parent, grandparent);
+    }
+    index = grandparent;
+  }
+}
+
+// Link the larger root under the smaller one. If the larger root got a
+// parent in the meantime start over from the new roots.
+bool UnionFind::Union(uint32_t a, uint32_t b) {
+  while (true) {
+    a = Find(a);
+    b = Find(b);
+    if (a == b) {
+      return false;
+    }
+    if (a < b) {
+      std::swap(a, b);
+    }
+    uint32_t root = a;
+    if (parents_[a].compare_exchange_strong(root, b)) {
+      return true;
+    }
+  }
+}
+
+uint32_t UnionFind::size() const {
+  return parents_.size();
+}
+
+}
+}
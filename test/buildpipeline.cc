@@ -0,0 +1,331 @@
+#include "test.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/pointll.h>
+#include "mjolnir/buildpipeline.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+using valhalla::midgard::PointLL;
+
+namespace {
+
+void TestFeedOrder() {
+  TileFeed feed;
+  for (uint32_t id = 0; id < 3; id++) {
+    feed.Push(GraphId(id, 2, 0));
+  }
+  feed.Close();
+  GraphId tile_id;
+  for (uint32_t id = 0; id < 3; id++) {
+    if (!feed.Pop(tile_id) || tile_id != GraphId(id, 2, 0))
+      throw runtime_error("Tiles should come out in the order they went in");
+  }
+  if (feed.Pop(tile_id) || feed.Pop(tile_id))
+    throw runtime_error("A closed feed should be empty once every tile was taken");
+}
+
+void TestFeedEmpty() {
+  TileFeed feed;
+  feed.Close();
+  GraphId tile_id;
+  if (feed.Pop(tile_id))
+    throw runtime_error("A feed closed without tiles should have none");
+}
+
+// Consumers wait for tiles and all finish once the feed is closed
+void TestFeedThreads() {
+  TileFeed feed;
+  std::atomic<uint32_t> popped(0);
+  std::vector<std::shared_ptr<std::thread> > threads(4);
+  for (auto& thread : threads) {
+    thread.reset(new std::thread([&feed, &popped]() {
+      GraphId tile_id;
+      while (feed.Pop(tile_id)) {
+        popped++;
+      }
+    }));
+  }
+  for (uint32_t id = 0; id < 1000; id++) {
+    feed.Push(GraphId(id, 2, 0));
+  }
+  feed.Close();
+  for (auto& thread : threads) {
+    thread->join();
+  }
+  if (popped != 1000)
+    throw runtime_error("Every tile should be taken exactly once");
+}
+
+// Local tile holding a point
+GraphId LocalTile(const TileHierarchy& hierarchy, const float lng, const float lat) {
+  return hierarchy.GetGraphId(PointLL(lng, lat), hierarchy.levels().rbegin()->first);
+}
+
+// Tiles are ready once they and the planned tiles next to them are built
+void TestBuiltReady() {
+  TileHierarchy hierarchy("test/tiles");
+  // A row of three tiles and one far away from them
+  auto a = LocalTile(hierarchy, 10.1f, 20.1f);
+  auto b = LocalTile(hierarchy, 10.35f, 20.1f);
+  auto c = LocalTile(hierarchy, 10.6f, 20.1f);
+  auto far = LocalTile(hierarchy, 50.1f, 20.1f);
+  BuiltTiles built(hierarchy);
+  built.Plan({ a, b, c, far });
+  built.Add(far);
+  built.Add(a);
+  built.Add(c);
+  built.Add(a);
+  built.Add(b);
+  built.Close();
+
+  GraphId tile_id;
+  if (!built.ready().Pop(tile_id) || tile_id != far)
+    throw runtime_error("A tile without planned neighbors should be ready once built");
+  std::set<GraphId> ready;
+  while (built.ready().Pop(tile_id)) {
+    if (!ready.insert(tile_id).second)
+      throw runtime_error("A tile should be ready only once");
+  }
+  if (ready != std::set<GraphId>{ a, b, c })
+    throw runtime_error("The row should be ready once its middle tile is built");
+}
+
+// A tile is not ready while a neighbor is still to be built, unless the
+// build is over
+void TestBuiltPending() {
+  TileHierarchy hierarchy("test/tiles");
+  auto a = LocalTile(hierarchy, 10.1f, 20.1f);
+  auto b = LocalTile(hierarchy, 10.1f, 20.35f);
+  auto far = LocalTile(hierarchy, 50.1f, 20.1f);
+  BuiltTiles built(hierarchy);
+  built.Plan({ a, b, far });
+  built.Add(a);
+  built.Add(far);
+  built.Close();
+  GraphId tile_id;
+  if (!built.ready().Pop(tile_id) || tile_id != far)
+    throw runtime_error("A tile with a neighbor not built should not be ready");
+  if (!built.ready().Pop(tile_id) || tile_id != a || built.ready().Pop(tile_id))
+    throw runtime_error("Built tiles should be ready once the build is over");
+}
+
+void TestBuiltWait() {
+  TileHierarchy hierarchy("test/tiles");
+  auto a = LocalTile(hierarchy, 10.1f, 20.1f);
+  auto b = LocalTile(hierarchy, 30.1f, 20.1f);
+  auto unplanned = LocalTile(hierarchy, 50.1f, 20.1f);
+  BuiltTiles built(hierarchy);
+
+  // Waits before the plan last until the tile is built
+  bool waited = false;
+  std::thread waiter([&built, &a, &waited]() {
+    waited = built.Wait(GraphId(a.tileid(), a.level(), 5));
+  });
+  built.Plan({ a, b });
+  if (built.Wait(unplanned))
+    throw runtime_error("A tile that is not planned should not be waited for");
+  built.Add(a);
+  waiter.join();
+  if (!waited || !built.Wait(a))
+    throw runtime_error("Waiting for a built tile should succeed");
+
+  built.Close();
+  if (built.Wait(b))
+    throw runtime_error("A tile not built by the time of closing never is");
+}
+
+void TestStages() {
+  boost::property_tree::ptree pt;
+  boost::property_tree::ptree stages, stage;
+  for (const auto& name : { "first", "second", "fourth" }) {
+    stage.put("", name);
+    stages.push_back(std::make_pair("", stage));
+  }
+  pt.add_child("mjolnir.stages", stages);
+
+  BuildPipeline pipeline(pt);
+  std::vector<std::string> ran;
+  std::mutex lock;
+  auto record = [&ran, &lock](const std::string& name) {
+    std::lock_guard<std::mutex> guard(lock);
+    ran.push_back(name);
+  };
+  pipeline.Add("first", [&record]() { record("first"); });
+  pipeline.Add("second", [&record, &pipeline]() {
+    auto step = pipeline.Steps("second");
+    step("one");
+    step("two");
+    record("second");
+  });
+  pipeline.Add("third", [&record]() { record("third"); });
+  pipeline.Add("fourth", [&record]() { record("fourth"); });
+  if (!pipeline.enabled("first") || pipeline.enabled("third"))
+    throw runtime_error("Only the listed stages should be enabled");
+
+  auto timings = pipeline.Run();
+  if (ran != std::vector<std::string>{ "first", "second", "fourth" })
+    throw runtime_error("Enabled stages should run in the order they were added");
+  std::vector<std::string> names;
+  for (const auto& timing : timings) {
+    names.push_back(timing.name);
+  }
+  if (names != std::vector<std::string>{ "first", "second", "second/one", "second/two", "third", "fourth" } ||
+      !timings[0].ran || !timings[3].ran || timings[4].ran)
+    throw runtime_error("Each stage should be timed followed by its steps");
+}
+
+// The overlapping stage runs alongside the one before it, here each waits
+// for a tile from the other, and the next stage waits for both
+void TestOverlap() {
+  boost::property_tree::ptree pt;
+  BuildPipeline pipeline(pt);
+  TileFeed to_second, to_first;
+  std::atomic<bool> both_done(false);
+  std::atomic<int> finished(0);
+  pipeline.Add("first", [&]() {
+    to_second.Push(GraphId(1, 2, 0));
+    to_second.Close();
+    GraphId tile_id;
+    if (!to_first.Pop(tile_id))
+      throw runtime_error("No tile from the second stage");
+    finished++;
+  });
+  pipeline.Add("second", [&]() {
+    GraphId tile_id;
+    while (to_second.Pop(tile_id)) {
+      to_first.Push(tile_id);
+    }
+    to_first.Close();
+    finished++;
+  }, true);
+  pipeline.Add("third", [&]() { both_done = finished == 2; });
+  pipeline.Run();
+  if (!both_done)
+    throw runtime_error("The next stage should wait for both overlapping stages");
+}
+
+// A failing stage is rethrown once the stage alongside it is done, later
+// stages do not run
+void TestFailure() {
+  boost::property_tree::ptree pt;
+  BuildPipeline pipeline(pt);
+  TileFeed feed;
+  bool consumer_done = false, later = false;
+  pipeline.Add("produce", [&feed]() {
+    feed.Close();
+    throw runtime_error("failed");
+  });
+  pipeline.Add("consume", [&feed, &consumer_done]() {
+    GraphId tile_id;
+    while (feed.Pop(tile_id));
+    consumer_done = true;
+  }, true);
+  pipeline.Add("later", [&later]() { later = true; });
+  try {
+    pipeline.Run();
+  }
+  catch (const std::runtime_error& e) {
+    if (std::string(e.what()) != "failed" || !consumer_done || later)
+      throw runtime_error("Only the stages before the failure should have run");
+    return;
+  }
+  throw runtime_error("The failure of a stage should be rethrown");
+}
+
+// A report of the stages with the given seconds and bytes written
+boost::property_tree::ptree Report(const std::vector<std::pair<std::string, double> >& stages,
+                                   const double bytes_written, const double tile_bytes) {
+  boost::property_tree::ptree report, stage_list;
+  for (const auto& stage : stages) {
+    boost::property_tree::ptree entry;
+    entry.put("name", stage.first);
+    entry.put("seconds", stage.second);
+    entry.put("cpu_seconds", stage.second);
+    entry.put("peak_rss", 0);
+    entry.put("bytes_read", 0);
+    entry.put("bytes_written", bytes_written);
+    stage_list.push_back(std::make_pair("", entry));
+  }
+  report.add_child("stages", stage_list);
+  report.put("peak_rss", 1e9);
+  report.put("tile_bytes", tile_bytes);
+  return report;
+}
+
+void TestCompareReport() {
+  auto baseline = Report({ { "parse", 10.0 }, { "build", 0.5 }, { "old", 10.0 } }, 1e8, 1e8);
+  if (CompareReport(baseline, baseline, 0.1f) != 0)
+    throw runtime_error("A report should not regress against itself");
+
+  // Within the threshold, too small in the baseline to compare, faster, or
+  // stages only in one of the reports
+  auto report = Report({ { "parse", 10.9 }, { "build", 5.0 }, { "new", 100.0 } }, 0.5e8, 1.05e8);
+  if (CompareReport(report, baseline, 0.1f) != 0)
+    throw runtime_error("Only measures that grew past the threshold should regress");
+
+  // Seconds and cpu seconds of parse, the tile bytes and the peak of the
+  // whole build
+  report = Report({ { "parse", 12.0 }, { "build", 0.5 } }, 1e8, 2e8);
+  report.put("peak_rss", 2e9);
+  if (CompareReport(report, baseline, 0.1f) != 4 || CompareReport(report, baseline, 0.5f) != 2)
+    throw runtime_error("Each measure past the threshold should be a regression");
+
+  // Baselines from before the peak of the whole build was reported
+  baseline.erase("peak_rss");
+  if (CompareReport(report, baseline, 0.5f) != 1)
+    throw runtime_error("Measures missing from the baseline should be skipped");
+}
+
+// Bytes are those that reach the disk and the peak starts over when reset
+void TestUsage() {
+  auto start = ResourceUsage::Now();
+  if (start.peak_rss == 0 || ResourceUsage::ProcessPeak() == 0)
+    throw runtime_error("The peak RSS should be known");
+  {
+    std::vector<char> memory(64 * 1024 * 1024, 1);
+    if (ResourceUsage::Now().peak_rss < start.peak_rss + memory.size() / 2)
+      throw runtime_error("The peak RSS should grow with the memory used");
+  }
+  if (ResourceUsage::ResetPeak() &&
+      ResourceUsage::Now().peak_rss >= ResourceUsage::ProcessPeak())
+    throw runtime_error("A reset peak should be below that of the whole process");
+}
+
+void TestEmpty() {
+  boost::property_tree::ptree pt;
+  BuildPipeline pipeline(pt);
+  if (!pipeline.Run().empty())
+    throw runtime_error("A pipeline without stages should time nothing");
+}
+
+}
+
+int main() {
+  test::suite suite("buildpipeline");
+
+  suite.test(TEST_CASE(TestFeedOrder));
+  suite.test(TEST_CASE(TestFeedEmpty));
+  suite.test(TEST_CASE(TestFeedThreads));
+  suite.test(TEST_CASE(TestBuiltReady));
+  suite.test(TEST_CASE(TestBuiltPending));
+  suite.test(TEST_CASE(TestBuiltWait));
+  suite.test(TEST_CASE(TestStages));
+  suite.test(TEST_CASE(TestOverlap));
+  suite.test(TEST_CASE(TestFailure));
+  suite.test(TEST_CASE(TestEmpty));
+  suite.test(TEST_CASE(TestCompareReport));
+  suite.test(TEST_CASE(TestUsage));
+
+  return suite.tear_down();
+}
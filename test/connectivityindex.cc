@@ -0,0 +1,154 @@
+#include "test.h"
+
+#include <cstdint>
+#include <fstream>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <valhalla/baldr/graphconstants.h>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/pointll.h>
+#include "mjolnir/connectivityindex.h"
+#include "mjolnir/graphtilebuilder.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+using namespace valhalla::midgard;
+
+namespace {
+
+const std::string kTileDir = "test/connectivity_tiles";
+
+// A node per element, edges given as (from, to, class, forward, reverse)
+struct edge_t {
+  uint32_t from;
+  uint32_t to;
+  RoadClass road_class;
+  uint32_t forward;
+  uint32_t reverse;
+};
+
+// Major road 0-1, residential 1-2 and a one way trap 1->3 with 3-4 behind
+// it. 5-6 is an island of residential roads and 7-8 a footway.
+GraphId WriteTile(const TileHierarchy& hierarchy) {
+  const auto& level = hierarchy.levels().rbegin()->second;
+  PointLL ll(5.1101f, 52.0894f);
+  GraphId tile_id(level.tiles.TileId(ll), level.level, 0);
+  const uint32_t kBoth = kAutoAccess | kPedestrianAccess;
+  const std::vector<edge_t> edges{
+    { 0, 1, RoadClass::kPrimary, kBoth, kBoth },
+    { 1, 2, RoadClass::kResidential, kBoth, kBoth },
+    { 1, 3, RoadClass::kResidential, kBoth, kPedestrianAccess },
+    { 3, 4, RoadClass::kResidential, kBoth, kBoth },
+    { 5, 6, RoadClass::kResidential, kBoth, kBoth },
+    { 7, 8, RoadClass::kServiceOther, kPedestrianAccess, kPedestrianAccess } };
+
+  GraphTileBuilder tile(hierarchy, tile_id, false);
+  for (uint32_t node = 0; node < 9; node++) {
+    uint32_t edge_index = tile.directededges().size();
+    for (const auto& edge : edges) {
+      if (edge.from != node && edge.to != node) {
+        continue;
+      }
+      bool forward = edge.from == node;
+      DirectedEdge directededge;
+      directededge.set_endnode(GraphId(tile_id.tileid(), tile_id.level(), forward ? edge.to : edge.from));
+      directededge.set_classification(edge.road_class);
+      directededge.set_forwardaccess(forward ? edge.forward : edge.reverse);
+      directededge.set_reverseaccess(forward ? edge.reverse : edge.forward);
+      tile.directededges().emplace_back(std::move(directededge));
+    }
+    tile.nodes().emplace_back(PointLL(ll.lng() + node * 0.001f, ll.lat()), RoadClass::kResidential,
+                              kBoth, NodeType::kStreetIntersection, false);
+    tile.nodes().back().set_edge_index(edge_index);
+    tile.nodes().back().set_edge_count(tile.directededges().size() - edge_index);
+  }
+  tile.StoreTileData();
+  return tile_id;
+}
+
+boost::property_tree::ptree Config() {
+  boost::property_tree::ptree pt;
+  pt.put("tile_dir", kTileDir);
+  return pt;
+}
+
+void TestComponents() {
+  boost::filesystem::remove_all(kTileDir);
+  auto pt = Config();
+  TileHierarchy hierarchy(kTileDir);
+  auto tile_id = WriteTile(hierarchy);
+  GraphTile tile(hierarchy, tile_id);
+
+  std::vector<uint32_t> capacities(hierarchy.levels().rbegin()->second.tiles.TileCount(), 0);
+  capacities[tile_id.tileid()] = tile.header()->nodecount();
+  ConnectivityBuilder builder(pt, capacities);
+  builder.Add(&tile);
+  builder.Finish();
+
+  ConnectivityIndex index;
+  if (!index.Load(ConnectivityIndex::FileName(pt), hierarchy) || !index.matches(&tile) ||
+      index.build_id() == 0)
+    throw runtime_error("The saved index should load and match its tile");
+  if (index.tile_id(tile_id.tileid()) != tile_id.tileid() + 1)
+    throw runtime_error("The tile should be labelled one more than its id");
+
+  auto node = [&tile_id](const uint32_t id) {
+    return GraphId(tile_id.tileid(), tile_id.level(), id);
+  };
+  const auto kAuto = ConnectivityMode::kAuto;
+  uint32_t mainland = index.component(node(0), kAuto);
+  uint32_t island = index.component(node(5), kAuto);
+  if (mainland != 1 || island != 2 || index.component_count(kAuto) != 4)
+    throw runtime_error("Components should be numbered in order of their first node");
+
+  // The trap behind the one way is in the component of the major road, only
+  // expanding the directed graph can tell it is unreachable
+  if (index.component(node(3), kAuto) != mainland || index.component(node(4), kAuto) != mainland ||
+      index.component_size(mainland, kAuto) != 5 || !index.has_major_road(mainland, kAuto))
+    throw runtime_error("Direction should be ignored when connecting nodes");
+  if (index.component(node(6), kAuto) != island || index.component_size(island, kAuto) != 2 ||
+      index.has_major_road(island, kAuto))
+    throw runtime_error("The island should be a component of its own without a major road");
+
+  // The footway only connects pedestrians
+  if (index.component(node(7), kAuto) == index.component(node(8), kAuto) ||
+      index.component_size(index.component(node(7), kAuto), kAuto) != 1 ||
+      index.component(node(7), ConnectivityMode::kPedestrian) !=
+      index.component(node(8), ConnectivityMode::kPedestrian))
+    throw runtime_error("Edges should only connect the modes that can use them");
+  if (index.component(node(9), kAuto) != 0 || index.component_size(99, kAuto) != 0)
+    throw runtime_error("Unknown nodes and components should be 0");
+}
+
+void TestRejected() {
+  auto pt = Config();
+  TileHierarchy hierarchy(kTileDir);
+  auto file_name = ConnectivityIndex::FileName(pt);
+  auto size = boost::filesystem::file_size(file_name);
+  boost::filesystem::resize_file(file_name, size - 1);
+  ConnectivityIndex index;
+  if (index.Load(file_name, hierarchy) || !index.empty())
+    throw runtime_error("A truncated index should not load");
+
+  {
+    std::ofstream file(file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+    file << "not an index";
+  }
+  if (index.Load(file_name, hierarchy) || !index.empty() || index.matches(nullptr))
+    throw runtime_error("An invalid index should not load");
+  boost::filesystem::remove_all(kTileDir);
+}
+
+}
+
+int main() {
+  test::suite suite("connectivityindex");
+
+  suite.test(TEST_CASE(TestComponents));
+  suite.test(TEST_CASE(TestRejected));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,90 @@
+#include "test.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "mjolnir/curler.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+
+namespace {
+
+const std::string kDir = "test/curler";
+
+// Responses are served from files so no server is needed
+std::string FileUrl(const std::string& name) {
+  return "file://" + boost::filesystem::absolute(kDir + '/' + name).string();
+}
+
+void WriteFile(const std::string& name, const std::string& body) {
+  boost::filesystem::create_directories(kDir);
+  std::ofstream file(kDir + '/' + name, std::ios::out | std::ios::trunc);
+  file << body;
+}
+
+boost::property_tree::ptree Config() {
+  boost::property_tree::ptree pt;
+  pt.put("max_in_flight", 2);
+  pt.put("max_tries", 2);
+  return pt;
+}
+
+void TestPaging() {
+  WriteFile("first.json", "{\"stops\": [1, 2], \"meta\": {\"next\": \"" + FileUrl("second.json") + "\"}}");
+  WriteFile("second.json", "{\"stops\": [3]}");
+  WriteFile("other.json", "{\"stops\": []}");
+  auto pt = Config();
+  ResponseCache cache(pt);
+  Curler curler(pt, cache);
+  std::vector<size_t> pages(2, 0);
+  auto given_up = curler({ FileUrl("first.json"), FileUrl("other.json") }, "stops",
+    [&pages](size_t chain, const boost::property_tree::ptree&) { pages[chain]++; });
+  if (given_up != 0 || pages[0] != 2 || pages[1] != 1)
+    throw runtime_error("Every page of each chain should be handed over");
+
+  auto response = curler(FileUrl("second.json"));
+  if (response.get_child("stops").size() != 1)
+    throw runtime_error("A single url should be fetched without paging");
+}
+
+void TestGiveUp() {
+  WriteFile("unusable.json", "{\"routes\": []}");
+  auto pt = Config();
+  ResponseCache cache(pt);
+  Curler curler(pt, cache);
+  size_t handled = 0;
+  auto given_up = curler({ FileUrl("missing.json"), FileUrl("unusable.json") }, "stops",
+    [&handled](size_t, const boost::property_tree::ptree&) { handled++; });
+  if (given_up != 2 || handled != 0)
+    throw runtime_error("Failing urls should be given up on after max_tries");
+}
+
+void TestCache() {
+  WriteFile("cached.json", "{\"stops\": [1]}");
+  auto pt = Config();
+  pt.put("cache_dir", kDir + "/cache");
+  ResponseCache cache(pt);
+  Curler curler(pt, cache);
+  curler(FileUrl("cached.json"), "stops");
+  boost::filesystem::remove(kDir + "/cached.json");
+  auto response = curler(FileUrl("cached.json"), "stops");
+  if (response.get_child("stops").size() != 1)
+    throw runtime_error("A cached response should be used once the url is gone");
+  boost::filesystem::remove_all(kDir);
+}
+
+}
+
+int main() {
+  test::suite suite("curler");
+
+  suite.test(TEST_CASE(TestPaging));
+  suite.test(TEST_CASE(TestGiveUp));
+  suite.test(TEST_CASE(TestCache));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,133 @@
+#include "test.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <valhalla/baldr/graphconstants.h>
+#include <valhalla/midgard/sequence.h>
+#include "mjolnir/dataquality.h"
+#include "mjolnir/ferry_connections.h"
+#include "mjolnir/node_expander.h"
+#include "mjolnir/osmdata.h"
+#include "mjolnir/osmway.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+using namespace valhalla::midgard;
+
+namespace {
+
+const std::string kWaysFile = "test_ferry_ways.bin";
+const std::string kWayNodesFile = "test_ferry_way_nodes.bin";
+const std::string kEdgesFile = "test_ferry_edges.bin";
+
+// Longitude of each node, all on the same latitude
+const std::vector<float> kNodeLngs{ 4.0f, 4.1f, 4.15f, 4.2f, 4.25f, 4.3f, 3.95f,
+                                    5.0f, 5.01f, 5.05f, 4.95f };
+
+struct way_t {
+  uint32_t source;
+  uint32_t target;
+  RoadClass road_class;
+  bool ferry;
+};
+
+// A long ferry 0-1 lands on a service road 1-2-3 that leads to the
+// primary road 3-4-5, the other end 0 is on the primary road 0-6. The
+// short ferry 7-8 crosses between service roads 8-9 and 7-10.
+const std::vector<way_t> kWays{
+  { 0, 1, RoadClass::kServiceOther, true },
+  { 0, 6, RoadClass::kPrimary, false },
+  { 1, 2, RoadClass::kServiceOther, false },
+  { 2, 3, RoadClass::kServiceOther, false },
+  { 3, 4, RoadClass::kPrimary, false },
+  { 4, 5, RoadClass::kPrimary, false },
+  { 7, 8, RoadClass::kServiceOther, true },
+  { 8, 9, RoadClass::kServiceOther, false },
+  { 7, 10, RoadClass::kServiceOther, false } };
+
+// An edge per way, each with the two way nodes at its ends
+void WriteGraph() {
+  sequence<OSMWay> ways(kWaysFile, true);
+  sequence<OSMWayNode> way_nodes(kWayNodesFile, true);
+  sequence<Edge> edges(kEdgesFile, true);
+  for (uint32_t i = 0; i < kWays.size(); i++) {
+    const auto& w = kWays[i];
+    OSMWay way{i + 1};
+    way.set_speed(50.0f);
+    ways.push_back(way);
+    for (auto node : { w.source, w.target }) {
+      OSMWayNode way_node{};
+      way_node.node.osmid = node;
+      way_node.node.lng = kNodeLngs[node];
+      way_node.node.lat = 52.0f;
+      way_node.way_index = i;
+      way_nodes.push_back(way_node);
+    }
+    Edge edge{i, i * 2};
+    edge.attributes = {};
+    edge.attributes.llcount = 2;
+    edge.attributes.importance = static_cast<uint32_t>(w.road_class);
+    edge.attributes.driveableforward = true;
+    edge.attributes.driveablereverse = true;
+    edge.attributes.driveable_ferry = w.ferry;
+    edge.sourcenode_ = w.source;
+    edge.targetnode_ = w.target;
+    edges.push_back(edge);
+  }
+}
+
+void Reclassify(const unsigned int threads) {
+  WriteGraph();
+  DataQuality stats;
+  ReclassifyFerryConnections(kWaysFile, kWayNodesFile, kEdgesFile,
+                             static_cast<uint32_t>(RoadClass::kPrimary), stats, threads);
+
+  // The same edges the search over the edge and node files upgraded: the
+  // edge from the terminal without the reclass flag and the rest of the
+  // path to the primary road with it
+  sequence<Edge> edges(kEdgesFile, false);
+  std::vector<uint32_t> importance;
+  std::vector<bool> reclassified;
+  for (auto itr = edges.begin(); itr != edges.end(); ++itr) {
+    Edge edge = *itr;
+    importance.push_back(edge.attributes.importance);
+    reclassified.push_back(edge.attributes.reclass_ferry);
+  }
+  const uint32_t primary = static_cast<uint32_t>(RoadClass::kPrimary);
+  const uint32_t service = static_cast<uint32_t>(RoadClass::kServiceOther);
+  const std::vector<uint32_t> expected_importance{ service, primary, primary, primary, primary,
+                                                   primary, service, service, service };
+  const std::vector<bool> expected_reclassified{ false, false, false, true, false,
+                                                 false, false, false, false };
+  if (importance != expected_importance || reclassified != expected_reclassified)
+    throw runtime_error("Ferry connections were not reclassified as before");
+
+  if (boost::filesystem::exists(kEdgesFile + ".ferry_edges.bin") ||
+      boost::filesystem::exists(kEdgesFile + ".ferry_adjacency.bin"))
+    throw runtime_error("The files of the ferry graph should be removed");
+  std::remove(kWaysFile.c_str());
+  std::remove(kWayNodesFile.c_str());
+  std::remove(kEdgesFile.c_str());
+}
+
+void TestReclassify() {
+  Reclassify(1);
+}
+
+void TestReclassifyThreads() {
+  Reclassify(3);
+}
+
+}
+
+int main() {
+  test::suite suite("ferryconnections");
+
+  suite.test(TEST_CASE(TestReclassify));
+  suite.test(TEST_CASE(TestReclassifyThreads));
+
+  return suite.tear_down();
+}
@@ -1,30 +1,225 @@
 #include "test.h"
 
+#include "mjolnir/buildsnapshot.h"
 #include "mjolnir/graphbuilder.h"
+#include "mjolnir/graphenhancer.h"
+#include "mjolnir/osmchange.h"
+#include "mjolnir/pbfgraphparser.h"
 
+#include <fstream>
+#include <iomanip>
+#include <iterator>
+#include <map>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <algorithm>
 #include <memory>
+#include <boost/filesystem/operations.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/optional.hpp>
 
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/pointll.h>
+#include <valhalla/midgard/sequence.h>
+
 using namespace std;
 using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+using namespace valhalla::midgard;
 
 namespace {
 
+const std::string kTileDir = "test/graphbuilder_tiles";
+const std::string kSnapshotDir = "test/graphbuilder_snapshot";
+const std::string kChangeFile = "test/graphbuilder.osc";
+const std::string kWaysFile = "test_graphbuilder_ways.bin";
+const std::string kWayNodesFile = "test_graphbuilder_way_nodes.bin";
+const std::string kRelationMembersFile = "test_graphbuilder_relation_members.bin";
+
+// The builder writes its nodes and edges to the working dir
+const std::vector<std::string> kFiles{
+  kWaysFile, kWayNodesFile, "nodes.bin", "edges.bin", kRelationMembersFile };
+
+boost::property_tree::ptree Config() {
+  boost::property_tree::ptree pt;
+  pt.put("mjolnir.tile_dir", kTileDir);
+  pt.put("mjolnir.snapshot_dir", kSnapshotDir);
+  pt.put("mjolnir.concurrency", 2);
+  pt.put("concurrency", 2);
+  // No admins or time zones, the enhancer only warns about them
+  pt.put("mjolnir.admin", "test/graphbuilder_admin.sqlite");
+  pt.put("mjolnir.timezone", "test/graphbuilder_tz.sqlite");
+  return pt;
+}
+
+// Files are removed before they are written, the snapshot links to them
+OSMData Parse(const boost::property_tree::ptree& pt) {
+  for (const auto& file : kFiles) {
+    boost::filesystem::remove(file);
+  }
+  return PBFGraphParser::Parse(pt.get_child("mjolnir"), {"test/data/liechtenstein-latest.osm.pbf"},
+                               kWaysFile, kWayNodesFile, nullptr, kRelationMembersFile);
+}
+
+// An edit of the extract: the speed and lanes of a way and the location of
+// one of its nodes
+struct Edit {
+  uint64_t way_id;
+  uint64_t node_id;
+  PointLL location;
+};
+
+// Edit the way in the middle of the parsed ways and the node in the middle
+// of that way
+Edit PickEdit() {
+  Edit edit;
+  sequence<OSMWay> ways(kWaysFile, false);
+  size_t way_index = ways.size() / 2;
+  edit.way_id = (*ways[way_index]).way_id();
+  std::vector<OSMNode> nodes;
+  sequence<OSMWayNode> way_nodes(kWayNodesFile, false);
+  for (auto itr = way_nodes.begin(); itr != way_nodes.end(); ++itr) {
+    const OSMWayNode way_node = *itr;
+    if (way_node.way_index == way_index) {
+      nodes.push_back(way_node.node);
+    }
+  }
+  if (nodes.empty())
+    throw std::runtime_error("The way to edit should have nodes");
+  const auto& node = nodes[nodes.size() / 2];
+  edit.node_id = node.osmid;
+  edit.location = PointLL(node.lng + 0.0005f, node.lat + 0.0005f);
+  return edit;
+}
+
+// Make the edit in the parser output, as if the edited extract was parsed
+void Apply(const Edit& edit) {
+  sequence<OSMWay> ways(kWaysFile, false);
+  for (size_t i = 0; i < ways.size(); i++) {
+    OSMWay way = *ways[i];
+    if (way.way_id() == edit.way_id) {
+      way.set_speed(way.speed() + 10.0f);
+      way.set_lanes(way.lanes() > 1 ? 1 : 2);
+      auto element = ways[i];
+      element = way;
+    }
+  }
+  sequence<OSMWayNode> way_nodes(kWayNodesFile, false);
+  for (size_t i = 0; i < way_nodes.size(); i++) {
+    OSMWayNode way_node = *way_nodes[i];
+    if (way_node.node.osmid == edit.node_id) {
+      way_node.node.set_latlng({ edit.location.lng(), edit.location.lat() });
+      auto element = way_nodes[i];
+      element = way_node;
+    }
+  }
+}
+
+// The change file of the edit
+void WriteChange(const Edit& edit) {
+  std::ofstream osc(kChangeFile, std::ios::trunc);
+  osc << std::setprecision(7) << std::fixed
+      << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<osmChange version=\"0.6\">\n<modify>\n"
+      << "<node id=\"" << edit.node_id << "\" version=\"2\" lat=\"" << edit.location.lat()
+      << "\" lon=\"" << edit.location.lng() << "\"/>\n"
+      << "<way id=\"" << edit.way_id << "\" version=\"2\"/>\n"
+      << "</modify>\n</osmChange>\n";
+}
+
+// Contents of every tile of the local level, by file name
+std::map<std::string, std::string> ReadLevel(const std::string& dir) {
+  TileHierarchy hierarchy(kTileDir);
+  boost::filesystem::path level(dir + "/" + std::to_string(hierarchy.levels().rbegin()->first));
+  std::map<std::string, std::string> tiles;
+  for (boost::filesystem::recursive_directory_iterator i(level), end; i != end; ++i) {
+    if (boost::filesystem::is_regular_file(i->path())) {
+      std::ifstream file(i->path().string(), std::ios::binary);
+      tiles[i->path().string().substr(level.string().size())] =
+          std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+  }
+  return tiles;
+}
+
+}
+
+// Updating the tiles of a build for an edit of the extract rebuilds and
+// enhances the tiles around it, which are then the same as those of a full
+// build of the edited extract. The tiles that are not rebuilt keep what the
+// enhancer found in the tiles around them, so they have to be the same too.
+void TestRebuild() {
+  auto pt = Config();
+  boost::filesystem::remove_all(kTileDir);
+  boost::filesystem::remove_all(kSnapshotDir);
+  TileHierarchy hierarchy(kTileDir);
+  BuildSnapshot snapshot(pt.get_child("mjolnir"));
+  {
+    auto osmdata = Parse(pt);
+    GraphBuilder::Build(pt, osmdata, kWaysFile, kWayNodesFile);
+    GraphEnhancer::Enhance(pt);
+    snapshot.Save(kFiles);
+  }
+
+  // Full build of the edited extract
+  Edit edit;
+  std::map<std::string, std::string> full;
+  {
+    boost::filesystem::remove_all(kTileDir);
+    auto osmdata = Parse(pt);
+    edit = PickEdit();
+    Apply(edit);
+    GraphBuilder::Build(pt, osmdata, kWaysFile, kWayNodesFile);
+    GraphEnhancer::Enhance(pt);
+    full = ReadLevel(kTileDir);
+  }
+
+  // Update of the first build with the change of the edit
+  WriteChange(edit);
+  OSMChange change;
+  change.Load(kChangeFile);
+  change.AddRelationMembers(snapshot.file(kRelationMembersFile));
+
+  boost::filesystem::remove_all(kTileDir);
+  snapshot.Restore();
+  auto osmdata = Parse(pt);
+  Apply(edit);
+  auto rebuild = change.DirtyTiles(hierarchy, {
+      { snapshot.file(kWaysFile), snapshot.file(kWayNodesFile) }, { kWaysFile, kWayNodesFile } });
+  if (rebuild.empty())
+    throw std::runtime_error("The tiles of the edited way should be rebuilt");
+  GraphBuilder::AddConnectedTiles(snapshot.file("nodes.bin"), snapshot.file("edges.bin"), rebuild);
+  GraphBuilder::Build(pt, osmdata, kWaysFile, kWayNodesFile, BuildObserver(), &rebuild);
+  GraphEnhancer::Enhance(pt, &rebuild);
+
+  auto updated = ReadLevel(kTileDir);
+  if (updated.size() != full.size())
+    throw std::runtime_error("The update should have as many tiles as the full build");
+  for (const auto& tile : full) {
+    auto found = updated.find(tile.first);
+    if (found == updated.end() || found->second != tile.second)
+      throw std::runtime_error("Tile " + tile.first + " differs from the full build");
+  }
+
+  // The edit has to show in the tiles, else the update was not tested
+  auto before = ReadLevel(kSnapshotDir);
+  if (before == full)
+    throw std::runtime_error("The edit should change the tiles");
 
+  boost::filesystem::remove(kChangeFile);
+  for (const auto& file : kFiles) {
+    boost::filesystem::remove(file);
+  }
+  boost::filesystem::remove_all(kTileDir);
+  boost::filesystem::remove_all(kSnapshotDir);
 }
 
 int main() {
   test::suite suite("graphbuilder");
 
-  // Test setting and getting on random sizes of bit tables
-  //suite.test(TEST_CASE(some_test));
-  //TODO: sweet jesus add more tests of this class!
+  suite.test(TEST_CASE(TestRebuild));
 
   return suite.tear_down();
 }
@@ -0,0 +1,173 @@
+#include "test.h"
+
+#include "mjolnir/csvreader.h"
+#include "mjolnir/gtfsbuilder.h"
+#include "mjolnir/transitpbf.h"
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/pointll.h>
+
+using namespace std;
+using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+using namespace valhalla::midgard;
+
+namespace {
+
+const std::string kTransitDir = "test/gtfs_transit";
+
+void TestCsvReader() {
+  {
+    std::fstream file("test/sample.csv", std::ios::out | std::ios::trunc | std::ios::binary);
+    file << "\xEF\xBB\xBF" << "id, name ,note\r\n"
+         << "1,\"a, b\",\"say \"\"hi\"\"\"\r\n"
+         << "\r\n"
+         << "2,\"two\nlines\"\r\n";
+  }
+  CsvReader reader("test/sample.csv");
+  int id = reader.column("id");
+  int name = reader.column("name");
+  int note = reader.column("note");
+  if (id != 0 || name != 1 || note != 2 || reader.column("missing") != -1)
+    throw runtime_error("Header was not parsed");
+  if (!reader.Next() || reader.field(id) != "1" || reader.field(name) != "a, b" ||
+      reader.field(note) != "say \"hi\"")
+    throw runtime_error("Quoted fields were not parsed");
+  if (!reader.Next() || reader.field(id) != "2" || reader.field(name) != "two\nlines" ||
+      !reader.field(note).empty() || !reader.field(-1).empty())
+    throw runtime_error("Multi line or short record was not parsed");
+  if (reader.Next() || reader.count() != 2)
+    throw runtime_error("Blank lines should be skipped");
+}
+
+std::string TileFile(const TileHierarchy& hierarchy, const PointLL& ll) {
+  const auto& level = hierarchy.levels().rbegin()->second;
+  GraphId tile(level.tiles.TileId(ll), hierarchy.levels().rbegin()->first, 0);
+  auto file_name = GraphTile::FileSuffix(tile, hierarchy);
+  return kTransitDir + '/' + file_name.substr(0, file_name.size() - 3) + "pbf";
+}
+
+void TestBuild() {
+  boost::filesystem::remove_all(kTransitDir);
+  boost::property_tree::ptree pt;
+  pt.put("mjolnir.tile_dir", "test/gtfs_tiles");
+  pt.put("mjolnir.transit_dir", kTransitDir);
+  pt.put("mjolnir.concurrency", 2);
+  GTFSBuilder::Build(pt, { "test/data/gtfs/sample" });
+
+  TileHierarchy hierarchy("test/gtfs_tiles");
+  auto file_name = TileFile(hierarchy, PointLL(5.1101f, 52.0894f));
+  if (!boost::filesystem::exists(file_name))
+    throw runtime_error("Utrecht tile was not written");
+  Transit transit = TransitPbf(file_name).Read();
+
+  // The station is not a stop and Driebergen is in the next tile over
+  if (transit.stops_size() != 2 || transit.stops(0).onestop_id() != "sample:cs" ||
+      transit.stops(0).name() != "Centraal, Utrecht" || !transit.stops(0).wheelchair_boarding() ||
+      GraphId(transit.stops(1).graphid()).id() != 1 || transit.stops(0).timezone() == 0)
+    throw runtime_error("Stops were not built correctly");
+  if (transit.routes_size() != 2 || transit.routes(0).name() != "12" ||
+      transit.routes(0).route_color() != 0xFF0000 || transit.routes(1).name() != "Intercity" ||
+      transit.routes(1).vehicle_type() != Transit_VehicleType::Transit_VehicleType_kRail)
+    throw runtime_error("Routes were not built correctly");
+  if (transit.shapes_size() != 1 || transit.shapes(0).shape_id() != 1)
+    throw runtime_error("Shapes were not built correctly");
+
+  // The trip with an unsupported route type is skipped
+  if (transit.stop_pairs_size() != 5)
+    throw runtime_error("Expected 5 stop pairs but got " + std::to_string(transit.stop_pairs_size()));
+
+  // Shaped pairs measure distance along the shape in increasing order
+  const auto& first = transit.stop_pairs(0);
+  const auto& second = transit.stop_pairs(1);
+  if (first.origin_departure_time() != 8 * 3600 || first.destination_arrival_time() != 8 * 3600 + 300 ||
+      first.shape_id() != 1 || first.origin_dist_traveled() > 1.0f ||
+      !(first.destination_dist_traveled() < second.destination_dist_traveled()) ||
+      first.destination_dist_traveled() != second.origin_dist_traveled() ||
+      first.block_id() == 0 || !first.wheelchair_accessible() || first.bikes_allowed() ||
+      first.trip_headsign() != "Driebergen" || first.service_except_dates_size() != 1)
+    throw runtime_error("Shaped stop pairs were not built correctly");
+
+  // Times after midnight and times at stops which aren't timepoints
+  const auto& night = transit.stop_pairs(2);
+  if (night.origin_departure_time() != 24 * 3600 + 600 ||
+      night.destination_arrival_time() != 24 * 3600 + 1200 ||
+      night.service_added_dates_size() != 2 ||
+      night.service_start_date() == night.service_end_date())
+    throw runtime_error("Interpolated or dates only stop pair was not built correctly");
+
+  // Stop times out of sequence order, a stop headsign and a different tile
+  const auto& intercity = transit.stop_pairs(4);
+  if (intercity.origin_departure_time() != 9 * 3600 + 120 || intercity.route_index() != 1 ||
+      intercity.trip_headsign() != "Amsterdam C." || intercity.shape_id() != 0 ||
+      intercity.destination_onestop_id() != "sample:ams" ||
+      GraphId(intercity.destination_graphid()).tileid() == GraphId(intercity.origin_graphid()).tileid())
+    throw runtime_error("Stop pair to another tile was not built correctly");
+
+  // Tiles with only arrivals still have their stops
+  Transit driebergen = TransitPbf(TileFile(hierarchy, PointLL(5.2812f, 52.0525f))).Read();
+  if (driebergen.stops_size() != 1 || driebergen.stop_pairs_size() != 0)
+    throw runtime_error("Arrival only tile was not built correctly");
+}
+
+// Trip, block and line ids of the stop pairs in the Utrecht tile
+std::vector<uint32_t> Ids(const std::vector<std::string>& feeds, const unsigned int concurrency) {
+  boost::filesystem::remove_all(kTransitDir);
+  boost::property_tree::ptree pt;
+  pt.put("mjolnir.tile_dir", "test/gtfs_tiles");
+  pt.put("mjolnir.transit_dir", kTransitDir);
+  pt.put("mjolnir.concurrency", concurrency);
+  GTFSBuilder::Build(pt, feeds);
+
+  TileHierarchy hierarchy("test/gtfs_tiles");
+  Transit transit = TransitPbf(TileFile(hierarchy, PointLL(5.1101f, 52.0894f))).Read();
+  std::vector<uint32_t> ids;
+  for (const auto& pair : transit.stop_pairs()) {
+    ids.push_back(pair.trip_id());
+    ids.push_back(pair.block_id());
+    ids.push_back(pair.line_id());
+  }
+  return ids;
+}
+
+void TestReproducibleIds() {
+  // A second feed with its own name
+  const std::string other = "test/gtfs_other";
+  boost::filesystem::remove_all(other);
+  boost::filesystem::create_directories(other);
+  for (boost::filesystem::directory_iterator i("test/data/gtfs/sample"), end; i != end; ++i) {
+    boost::filesystem::copy_file(i->path(), other + '/' + i->path().filename().string());
+  }
+
+  auto expected = Ids({ "test/data/gtfs/sample", other }, 1);
+  if (expected.size() != 2 * 5 * 3)
+    throw runtime_error("Both feeds should have their stop pairs in the tile");
+  // The trips of the second feed are numbered after those of the first
+  if (expected[0] >= expected[5 * 3])
+    throw runtime_error("Trip ids should follow the order of the feeds");
+  for (size_t i = 0; i < 4; i++) {
+    if (Ids({ "test/data/gtfs/sample", other }, 4) != expected)
+      throw runtime_error("Ids should not depend on the number of threads");
+  }
+  boost::filesystem::remove_all(other);
+}
+
+}
+
+int main() {
+  test::suite suite("gtfsbuilder");
+
+  suite.test(TEST_CASE(TestCsvReader));
+  suite.test(TEST_CASE(TestBuild));
+  suite.test(TEST_CASE(TestReproducibleIds));
+
+  return suite.tear_down();
+}
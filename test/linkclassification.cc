@@ -0,0 +1,145 @@
+#include "test.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <valhalla/baldr/graphconstants.h>
+#include <valhalla/midgard/sequence.h>
+#include "mjolnir/dataquality.h"
+#include "mjolnir/linkclassification.h"
+#include "mjolnir/node_expander.h"
+#include "mjolnir/osmway.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+using namespace valhalla::midgard;
+
+namespace {
+
+const std::string kWaysFile = "test_link_ways.bin";
+const std::string kEdgesFile = "test_link_edges.bin";
+
+class test_data_quality : public DataQuality {
+ public:
+  using DataQuality::unconnectedlinks_;
+};
+
+struct edge_t {
+  uint32_t source;
+  uint32_t target;
+  RoadClass road_class;
+  bool link;
+  bool driveable;
+};
+
+// Reclassify the links of a graph of one edge per way, ways are numbered
+// from 1. Returns the class of each edge afterwards.
+std::vector<RoadClass> Reclassify(const std::vector<edge_t>& graph, test_data_quality& stats,
+                                  const unsigned int threads = 1) {
+  {
+    sequence<OSMWay> ways(kWaysFile, true);
+    sequence<Edge> edges(kEdgesFile, true);
+    for (uint32_t i = 0; i < graph.size(); i++) {
+      ways.push_back(OSMWay{i + 1});
+      Edge edge{i, i * 2};
+      edge.attributes = {};
+      edge.attributes.llcount = 2;
+      edge.attributes.importance = static_cast<uint32_t>(graph[i].road_class);
+      edge.attributes.driveableforward = graph[i].driveable;
+      edge.attributes.driveablereverse = graph[i].driveable;
+      edge.attributes.link = graph[i].link;
+      edge.sourcenode_ = graph[i].source;
+      edge.targetnode_ = graph[i].target;
+      edges.push_back(edge);
+    }
+  }
+  ReclassifyLinks(kWaysFile, kEdgesFile, stats, threads);
+
+  std::vector<RoadClass> classes;
+  sequence<Edge> edges(kEdgesFile, false);
+  for (auto itr = edges.begin(); itr != edges.end(); ++itr) {
+    Edge edge = *itr;
+    classes.push_back(static_cast<RoadClass>(edge.attributes.importance));
+  }
+  std::remove(kWaysFile.c_str());
+  std::remove(kEdgesFile.c_str());
+  return classes;
+}
+
+// A motorway ramp onto a primary road gets the class of the primary road
+void TestTwoClasses() {
+  test_data_quality stats;
+  auto classes = Reclassify({
+    { 0, 1, RoadClass::kMotorway, false, true },
+    { 1, 2, RoadClass::kMotorway, true, true },
+    { 2, 3, RoadClass::kPrimary, false, true } }, stats);
+  if (classes[1] != RoadClass::kPrimary || classes[0] != RoadClass::kMotorway ||
+      classes[2] != RoadClass::kPrimary || !stats.unconnectedlinks_.empty())
+    throw runtime_error("A link should get the second best class it connects");
+}
+
+// Links that only meet other links are one ramp. All of it gets the class,
+// the interior too.
+void TestChainedRamps() {
+  test_data_quality stats;
+  auto classes = Reclassify({
+    { 0, 1, RoadClass::kMotorway, false, true },
+    { 1, 2, RoadClass::kMotorway, true, true },
+    { 2, 3, RoadClass::kMotorway, true, true },
+    { 3, 4, RoadClass::kMotorway, true, true },
+    { 4, 5, RoadClass::kSecondary, false, true },
+    // Footways where two links meet end them like any non-link edge. Without
+    // a second driveable class the links are left alone.
+    { 20, 21, RoadClass::kMotorway, false, true },
+    { 21, 22, RoadClass::kMotorway, true, true },
+    { 22, 23, RoadClass::kMotorway, true, true },
+    { 22, 25, RoadClass::kServiceOther, false, false },
+    { 22, 26, RoadClass::kServiceOther, false, false },
+    { 23, 24, RoadClass::kTertiary, false, true } }, stats);
+  if (classes[1] != RoadClass::kSecondary || classes[2] != RoadClass::kSecondary ||
+      classes[3] != RoadClass::kSecondary)
+    throw runtime_error("Every link of a chain should get its class");
+  if (classes[6] != RoadClass::kMotorway || classes[7] != RoadClass::kMotorway)
+    throw runtime_error("Links should not continue through a node with non-link edges");
+}
+
+// A cloverleaf loop from a motorway onto a trunk road, with a collector
+// branching off the loop to a tertiary road, and a ramp that goes nowhere
+void TestCloverleaf() {
+  for (unsigned int threads : { 1u, 4u }) {
+    test_data_quality stats;
+    auto classes = Reclassify({
+      { 0, 1, RoadClass::kMotorway, false, true },
+      { 1, 2, RoadClass::kMotorway, false, true },
+      { 10, 11, RoadClass::kTrunk, false, true },
+      { 11, 12, RoadClass::kTrunk, false, true },
+      { 1, 20, RoadClass::kMotorway, true, true },
+      { 20, 21, RoadClass::kMotorway, true, true },
+      { 21, 11, RoadClass::kMotorway, true, true },
+      { 21, 30, RoadClass::kMotorway, true, true },
+      { 30, 31, RoadClass::kTertiary, false, true },
+      { 2, 40, RoadClass::kMotorway, true, true } }, stats, threads);
+
+    // The branch does not downgrade the loop below the trunk
+    for (size_t i = 4; i < 8; i++) {
+      if (classes[i] != RoadClass::kTrunk)
+        throw runtime_error("The loop should get the class of the trunk");
+    }
+    if (classes[9] != RoadClass::kMotorway || stats.unconnectedlinks_.size() != 1 ||
+        stats.unconnectedlinks_.count(10) != 1)
+      throw runtime_error("A ramp that goes nowhere should be reported and left alone");
+  }
+}
+
+}
+
+int main() {
+  test::suite suite("linkclassification");
+
+  suite.test(TEST_CASE(TestTwoClasses));
+  suite.test(TEST_CASE(TestChainedRamps));
+  suite.test(TEST_CASE(TestCloverleaf));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,93 @@
+#include "test.h"
+
+#include <cstdint>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include "mjolnir/metrics.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+
+void TestRegistry() {
+  Counter& counter = Metrics::Get().counter("test.registry");
+  if (&counter != &Metrics::Get().counter("test.registry"))
+    throw std::runtime_error("A name should always give the same counter");
+
+  Gauge& gauge = Metrics::Get().gauge("test.gauge");
+  gauge.Set(10);
+  gauge.Add(-3);
+  if (gauge.value() != 7)
+    throw std::runtime_error("Gauge should go up and down");
+
+  Timer& timer = Metrics::Get().timer("test.timer");
+  timer.Record(std::chrono::milliseconds(200));
+  timer.Record(std::chrono::milliseconds(500));
+  if (timer.count() != 2 || timer.seconds() < 0.69 || timer.seconds() > 0.71 ||
+      timer.max_seconds() < 0.49 || timer.max_seconds() > 0.51)
+    throw std::runtime_error("Timer should keep the count, total and longest duration");
+}
+
+void TestThreads() {
+  Counter& counter = Metrics::Get().counter("test.threads");
+  std::vector<std::shared_ptr<std::thread> > threads(4);
+  for (auto& thread : threads) {
+    thread.reset(new std::thread([]() {
+      for (size_t i = 0; i < 100000; ++i) {
+        Metrics::Get().counter("test.threads").Add();
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
+  if (counter.value() != 400000)
+    throw std::runtime_error("Concurrent adds lost a count");
+}
+
+void TestExport() {
+  Metrics::Get().counter("test.export").Add(42);
+  Metrics::Get().timer("test.export_timer").Record(std::chrono::seconds(1));
+  std::string json = Metrics::Get().JsonLine();
+  if (json.find("\"test.export\":42") == std::string::npos || json.find('\n') != std::string::npos)
+    throw std::runtime_error("Json line should hold the counter: " + json);
+
+  std::string text = Metrics::Get().Prometheus();
+  if (text.find("# TYPE mjolnir_test_export_total counter\nmjolnir_test_export_total 42\n") == std::string::npos ||
+      text.find("mjolnir_test_export_timer_seconds_count 1\n") == std::string::npos)
+    throw std::runtime_error("Prometheus text should hold the counter and timer: " + text);
+}
+
+void TestExporterInterval() {
+  const std::string file_name = "test/metrics_export.json";
+  boost::property_tree::ptree pt;
+  pt.put("mjolnir.metrics.file", file_name);
+  pt.put("mjolnir.metrics.interval", 0.0f);
+  {
+    MetricsExporter exporter(pt);
+  }
+  if (boost::filesystem::exists(file_name))
+    throw std::runtime_error("An interval of 0 should not write metrics");
+
+  pt.put("mjolnir.metrics.interval", 0.01f);
+  {
+    MetricsExporter exporter(pt);
+  }
+  bool written = boost::filesystem::file_size(file_name) > 0;
+  boost::filesystem::remove(file_name);
+  if (!written)
+    throw std::runtime_error("Metrics should be written when the exporter stops");
+}
+
+int main() {
+  test::suite suite("metrics");
+
+  suite.test(TEST_CASE(TestRegistry));
+  suite.test(TEST_CASE(TestThreads));
+  suite.test(TEST_CASE(TestExport));
+  suite.test(TEST_CASE(TestExporterInterval));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,243 @@
+#include "test.h"
+
+#include <cstdint>
+#include <fstream>
+#include <boost/filesystem/operations.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <valhalla/baldr/graphtile.h>
+#include <valhalla/midgard/sequence.h>
+#include "mjolnir/buildsnapshot.h"
+#include "mjolnir/osmchange.h"
+#include "mjolnir/osmdata.h"
+#include "mjolnir/osmway.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+using namespace valhalla::midgard;
+
+namespace {
+
+const std::string kChangeFile = "test/osmchange_test.osc";
+const std::string kSnapshotTiles = "test/osmchange_tiles";
+const std::string kSnapshotDir = "test/osmchange_snapshot";
+
+void WriteChange(const std::string& body) {
+  std::ofstream osc(kChangeFile);
+  osc << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      << "<osmChange version=\"0.6\" generator=\"test\">\n" << body << "</osmChange>\n";
+}
+
+GraphId LocalTile(const TileHierarchy& hierarchy, const PointLL& ll) {
+  const auto& level = hierarchy.levels().rbegin()->second;
+  return GraphId(level.tiles.TileId(ll), level.level, 0);
+}
+
+void WriteFile(const std::string& file_name, const std::string& body) {
+  auto dir = boost::filesystem::path(file_name).parent_path();
+  if (!dir.empty()) {
+    boost::filesystem::create_directories(dir);
+  }
+  std::ofstream file(file_name, std::ios::trunc);
+  file << body;
+}
+
+std::string ReadFile(const std::string& file_name) {
+  std::ifstream file(file_name);
+  return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+}
+
+void TestNodes() {
+  WriteChange("<modify><node id=\"1\" version=\"2\" lat=\"52.0894\" lon=\"5.1101\"/></modify>\n"
+              "<delete><node id=\"2\" version=\"3\"/></delete>\n");
+  OSMChange change;
+  change.Load(kChangeFile);
+  if (change.empty())
+    throw runtime_error("Changed nodes were not loaded");
+
+  TileHierarchy hierarchy("test/tiles");
+  auto tiles = change.DirtyTiles(hierarchy, {});
+  if (tiles.size() != 9 || tiles.find(LocalTile(hierarchy, PointLL(5.1101f, 52.0894f))) == tiles.end())
+    throw runtime_error("The tile of the moved node and its neighbours should be dirty");
+}
+
+void TestWays() {
+  WriteChange("<delete><way id=\"10\" version=\"2\"/></delete>\n"
+              "<modify><relation id=\"20\" version=\"4\">"
+              "<member type=\"way\" ref=\"11\" role=\"from\"/>"
+              "<member type=\"node\" ref=\"3\" role=\"via\"/></relation></modify>\n");
+  OSMChange change;
+  change.Load(kChangeFile);
+
+  // Ways of the previous build, one deleted, one in a restriction and one untouched
+  const std::vector<std::pair<uint64_t, PointLL> > way_locations{
+    { 10, PointLL(5.1101f, 52.0894f) }, { 11, PointLL(4.8952f, 52.3702f) },
+    { 12, PointLL(-73.9857f, 40.7484f) } };
+  {
+    sequence<OSMWay> ways("test_osmchange_ways.bin", true);
+    sequence<OSMWayNode> way_nodes("test_osmchange_way_nodes.bin", true);
+    for (size_t i = 0; i < way_locations.size(); ++i) {
+      ways.push_back(OSMWay{way_locations[i].first});
+      OSMWayNode way_node{};
+      way_node.node.osmid = 100 + i;
+      way_node.node.lng = way_locations[i].second.lng();
+      way_node.node.lat = way_locations[i].second.lat();
+      way_node.way_index = i;
+      way_nodes.push_back(way_node);
+    }
+  }
+
+  TileHierarchy hierarchy("test/tiles");
+  auto tiles = change.DirtyTiles(hierarchy, { { "test_osmchange_ways.bin", "test_osmchange_way_nodes.bin" } });
+  if (tiles.find(LocalTile(hierarchy, PointLL(5.1101f, 52.0894f))) == tiles.end() ||
+      tiles.find(LocalTile(hierarchy, PointLL(4.8952f, 52.3702f))) == tiles.end())
+    throw runtime_error("Tiles of deleted ways and ways of changed relations should be dirty");
+  if (tiles.find(LocalTile(hierarchy, PointLL(-73.9857f, 40.7484f))) != tiles.end())
+    throw runtime_error("Tiles of unchanged ways should not be dirty");
+  boost::filesystem::remove("test_osmchange_ways.bin");
+  boost::filesystem::remove("test_osmchange_way_nodes.bin");
+}
+
+// Members a relation lost and those of a deleted relation are only in the
+// previous build
+void TestRelationMembers() {
+  WriteChange("<modify><relation id=\"20\" version=\"5\">"
+              "<member type=\"way\" ref=\"11\" role=\"from\"/></relation></modify>\n"
+              "<delete><relation id=\"21\" version=\"2\"/></delete>\n");
+  OSMChange change;
+  change.Load(kChangeFile);
+  {
+    sequence<OSMRelationMember> members("test_osmchange_relation_members.bin", true);
+    members.push_back({ 20, 11, OSMType::kWay });
+    members.push_back({ 20, 3, OSMType::kNode });
+    members.push_back({ 20, 12, OSMType::kWay });
+    members.push_back({ 21, 13, OSMType::kWay });
+    members.push_back({ 22, 14, OSMType::kWay });
+  }
+  change.AddRelationMembers("test_osmchange_relation_members.bin");
+
+  // One node in a tile of its own for each way, the one of 14 is unchanged
+  const std::vector<std::pair<uint64_t, PointLL> > way_locations{
+    { 11, PointLL(4.8952f, 52.3702f) }, { 12, PointLL(5.1101f, 52.0894f) },
+    { 13, PointLL(-73.9857f, 40.7484f) }, { 14, PointLL(2.3522f, 48.8566f) } };
+  {
+    sequence<OSMWay> ways("test_osmchange_ways.bin", true);
+    sequence<OSMWayNode> way_nodes("test_osmchange_way_nodes.bin", true);
+    for (size_t i = 0; i < way_locations.size(); ++i) {
+      ways.push_back(OSMWay{way_locations[i].first});
+      OSMWayNode way_node{};
+      way_node.node.osmid = 100 + i;
+      way_node.node.lng = way_locations[i].second.lng();
+      way_node.node.lat = way_locations[i].second.lat();
+      way_node.way_index = i;
+      way_nodes.push_back(way_node);
+    }
+  }
+  TileHierarchy hierarchy("test/tiles");
+  auto tiles = change.DirtyTiles(hierarchy, { { "test_osmchange_ways.bin", "test_osmchange_way_nodes.bin" } });
+  for (size_t i = 0; i < 3; ++i) {
+    if (tiles.find(LocalTile(hierarchy, way_locations[i].second)) == tiles.end())
+      throw runtime_error("Members the changed relations had before should be dirty");
+  }
+  if (tiles.find(LocalTile(hierarchy, way_locations[3].second)) != tiles.end())
+    throw runtime_error("Members of unchanged relations should not be dirty");
+  boost::filesystem::remove("test_osmchange_relation_members.bin");
+  boost::filesystem::remove("test_osmchange_ways.bin");
+  boost::filesystem::remove("test_osmchange_way_nodes.bin");
+}
+
+// An update restores the tiles of the snapshot and saves the rebuilt ones
+// over it, a failed save leaves it as it was
+void TestSnapshot() {
+  boost::filesystem::remove_all(kSnapshotTiles);
+  boost::filesystem::remove_all(kSnapshotDir);
+  boost::property_tree::ptree pt;
+  pt.put("tile_dir", kSnapshotTiles);
+  pt.put("snapshot_dir", kSnapshotDir + "/");
+  TileHierarchy hierarchy(kSnapshotTiles);
+  const auto& level = hierarchy.levels().rbegin()->second;
+  GraphId changed(level.tiles.TileId(PointLL(5.1101f, 52.0894f)), level.level, 0);
+  GraphId unchanged(level.tiles.TileId(PointLL(4.8952f, 52.3702f)), level.level, 0);
+  GraphId removed(level.tiles.TileId(PointLL(-73.9857f, 40.7484f)), level.level, 0);
+  auto tile_file = [&hierarchy](const std::string& dir, const GraphId& tile) {
+    return dir + "/" + GraphTile::FileSuffix(tile, hierarchy);
+  };
+  const std::string kWays = "test_osmchange_snapshot_ways.bin";
+  const std::vector<std::string> files{ kWays };
+
+  BuildSnapshot snapshot(pt);
+  WriteFile(tile_file(kSnapshotTiles, changed), "first");
+  WriteFile(tile_file(kSnapshotTiles, unchanged), "first");
+  WriteFile(tile_file(kSnapshotTiles, removed), "first");
+  if (!snapshot.configured() || snapshot.exists(files))
+    throw runtime_error("There should be no snapshot before one is saved");
+  snapshot.Save(files);
+  if (snapshot.exists(files))
+    throw runtime_error("A snapshot without its files should not be saved");
+  WriteFile(kWays, "first ways");
+  snapshot.Save(files);
+  if (!snapshot.exists(files) || ReadFile(snapshot.file(kWays)) != "first ways")
+    throw runtime_error("The snapshot should hold the tiles and files");
+
+  // The next build removes the working files before it writes them again
+  boost::filesystem::remove_all(kSnapshotTiles);
+  boost::filesystem::remove(kWays);
+  WriteFile(kWays, "second ways");
+  snapshot.Restore();
+  if (ReadFile(tile_file(kSnapshotTiles, unchanged)) != "first" ||
+      ReadFile(snapshot.file(kWays)) != "first ways")
+    throw runtime_error("Restoring should copy the tiles of the snapshot");
+  WriteFile(tile_file(kSnapshotTiles, changed), "second");
+  WriteFile(tile_file(kSnapshotTiles, unchanged), "not rebuilt");
+  boost::filesystem::remove(tile_file(kSnapshotTiles, removed));
+  std::set<GraphId> rebuilt{ changed, removed };
+  snapshot.Save(files, &rebuilt);
+  if (ReadFile(tile_file(kSnapshotDir, changed)) != "second" ||
+      ReadFile(tile_file(kSnapshotDir, unchanged)) != "first" ||
+      boost::filesystem::exists(tile_file(kSnapshotDir, removed)) ||
+      ReadFile(snapshot.file(kWays)) != "second ways")
+    throw runtime_error("Only the rebuilt tiles should replace those of the snapshot");
+  if (boost::filesystem::exists(kSnapshotDir + ".staging") ||
+      boost::filesystem::exists(kSnapshotDir + ".previous"))
+    throw runtime_error("The staging dir should have been renamed into place");
+
+  // Tiles later stages write to do not change the snapshot
+  WriteFile(tile_file(kSnapshotTiles, changed), "validated");
+  if (ReadFile(tile_file(kSnapshotDir, changed)) != "second")
+    throw runtime_error("The snapshot should not share tiles with the tile dir");
+  boost::filesystem::remove(kWays);
+  boost::filesystem::remove_all(kSnapshotTiles);
+  boost::filesystem::remove_all(kSnapshotDir);
+}
+
+void TestBadFile() {
+  for (const auto& file_name : { std::string("test/no_such_change.osc"), kChangeFile }) {
+    // Truncated after the first node
+    WriteChange("<modify><node id=\"1\" version=\"2\" lat=\"52.0894\" lon=\"5.1101\"/>");
+    OSMChange change;
+    try {
+      change.Load(file_name);
+    }
+    catch (const std::exception&) {
+      if (!change.empty())
+        throw runtime_error("A file that could not be read should not change anything");
+      continue;
+    }
+    throw runtime_error("Loading a missing or malformed file should throw");
+  }
+  boost::filesystem::remove(kChangeFile);
+}
+
+int main() {
+  test::suite suite("osmchange");
+
+  suite.test(TEST_CASE(TestNodes));
+  suite.test(TEST_CASE(TestWays));
+  suite.test(TEST_CASE(TestRelationMembers));
+  suite.test(TEST_CASE(TestSnapshot));
+  suite.test(TEST_CASE(TestBadFile));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,59 @@
+#include "test.h"
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+#include "mjolnir/osmdata.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+
+void TestWayMap() {
+  OSMWayMap ways;
+  ways.emplace(30, { 5, 6, 7 });
+  ways.emplace(10, { 1, 2 });
+  ways.emplace(30, { 8 });
+  ways.sort();
+
+  if (ways.size() != 2)
+    throw std::runtime_error("Duplicate way should only be kept once");
+
+  OSMWayMap::nodes_t nodes;
+  if (!ways.find(30, nodes) || nodes.size() != 3 || *nodes.begin() != 5)
+    throw std::runtime_error("First of the duplicate ways should be kept");
+  std::vector<uint64_t> ids(nodes.begin(), nodes.end());
+  if (ids != std::vector<uint64_t>{ 5, 6, 7 })
+    throw std::runtime_error("Way nodes are not in order");
+  if (!ways.find(10, nodes) || nodes.size() != 2)
+    throw std::runtime_error("Way was not found");
+  if (ways.find(20, nodes) || ways.find(40, nodes))
+    throw std::runtime_error("Missing way should not be found");
+}
+
+void TestShapeMap() {
+  OSMShapeMap shapes;
+  shapes.set_nodes({ 9, 3, 3, 7 });
+  if (shapes.set(4, PointLL(1.0f, 1.0f)))
+    throw std::runtime_error("Unneeded node should not be set");
+  if (!shapes.set(3, PointLL(1.0f, 2.0f)) || !shapes.set(9, PointLL(3.0f, 4.0f)) ||
+      !shapes.set(3, PointLL(1.0f, 2.0f)))
+    throw std::runtime_error("Needed node should be set");
+  if (shapes.size() != 2)
+    throw std::runtime_error("Nodes should only be counted once");
+  if (shapes.at(9).lat() != 4.0f || shapes.at(3).lng() != 1.0f)
+    throw std::runtime_error("Wrong shape for node");
+
+  bool threw = false;
+  try { shapes.at(7); } catch (const std::out_of_range&) { threw = true; }
+  if (!threw)
+    throw std::runtime_error("Node without shape should throw");
+}
+
+int main() {
+  test::suite suite("osmdata");
+
+  suite.test(TEST_CASE(TestWayMap));
+  suite.test(TEST_CASE(TestShapeMap));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,161 @@
+#include "test.h"
+
+#include "mjolnir/transitindex.h"
+
+#include <fstream>
+#include <string>
+#include <cstdio>
+
+#include <valhalla/baldr/graphid.h>
+
+using namespace std;
+using namespace valhalla::mjolnir;
+using namespace valhalla::baldr;
+
+namespace {
+
+// Monday 2016-02-01
+constexpr uint32_t kMonday = 2457420;
+
+void AddPair(Transit& transit, const uint32_t origin, const uint32_t dest,
+             const uint32_t trip, const uint32_t departure, const bool weekdays) {
+  auto* pair = transit.add_stop_pairs();
+  pair->set_origin_graphid(GraphId(10, 2, origin));
+  pair->set_destination_graphid(GraphId(10, 2, dest));
+  pair->set_trip_id(trip);
+  pair->set_route_index(trip % 2);
+  pair->set_origin_departure_time(departure);
+  pair->set_destination_arrival_time(departure + 300);
+  pair->set_service_start_date(kMonday);
+  pair->set_service_end_date(kMonday + 13);
+  for (uint32_t d = 0; d < 7; d++) {
+    pair->add_service_days_of_week(weekdays ? d < 5 : d >= 5);
+  }
+}
+
+void Write(const Transit& transit, const std::string& file_name) {
+  std::fstream stream(file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+  transit.SerializeToOstream(&stream);
+}
+
+// Three stops, departures out of order and a continuation file
+void WriteTile(const std::string& file_name) {
+  Transit transit;
+  for (uint32_t i = 0; i < 3; i++) {
+    auto* stop = transit.add_stops();
+    stop->set_onestop_id("s" + std::to_string(i));
+    stop->set_graphid(GraphId(10, 2, i));
+  }
+  AddPair(transit, 0, 1, 2, 9 * 3600, true);
+  AddPair(transit, 0, 1, 1, 8 * 3600, true);
+  AddPair(transit, 1, 2, 1, 8 * 3600 + 360, true);
+  AddPair(transit, 0, 1, 3, 8 * 3600, false);
+  transit.mutable_stop_pairs(0)->add_service_except_dates(kMonday + 7);
+  transit.mutable_stop_pairs(3)->add_service_added_dates(kMonday + 2);
+  // Pairs from stops in other tiles are not indexed
+  auto* other = transit.add_stop_pairs();
+  other->set_origin_graphid(GraphId(11, 2, 0));
+  other->set_destination_graphid(GraphId(10, 2, 0));
+  Write(transit, file_name);
+
+  Transit continuation;
+  AddPair(continuation, 2, 0, 4, 7 * 3600, true);
+  Write(continuation, file_name + ".0");
+}
+
+void TestDepartures() {
+  std::string file_name = "test/transit_index.pbf";
+  std::remove((file_name + ".idx").c_str());
+  WriteTile(file_name);
+
+  TransitIndex index(file_name);
+  if (index.stop_count() != 3 || index.size() != 5)
+    throw runtime_error("Wrong number of stops or departures indexed");
+
+  auto all = index.Departures(0, 0, 24 * 3600);
+  if (all.size() != 3 || all[0]->trip_id != 1 || all[1]->trip_id != 3 || all[2]->trip_id != 2)
+    throw runtime_error("Departures should be ordered by time");
+  if (index.Departures(0, 8 * 3600 + 1, 9 * 3600).size() != 0 ||
+      index.Departures(0, 8 * 3600 + 1, 9 * 3600 + 1).size() != 1)
+    throw runtime_error("Time window is not respected");
+
+  // Weekend only service, except and added dates
+  if (index.Departures(0, 0, 24 * 3600, kMonday).size() != 2 ||
+      index.Departures(0, 0, 24 * 3600, kMonday + 5).size() != 1 ||
+      index.Departures(0, 0, 24 * 3600, kMonday + 7).size() != 1 ||
+      index.Departures(0, 0, 24 * 3600, kMonday + 2).size() != 3 ||
+      index.Departures(0, 0, 24 * 3600, kMonday + 14).size() != 0)
+    throw runtime_error("Service dates are not respected");
+
+  // Continuation files are indexed and decoded from the right file
+  auto cont = index.Departures(2, 0, 24 * 3600);
+  Transit_StopPair pair;
+  if (cont.size() != 1)
+    throw runtime_error("Continuation file was not indexed");
+  index.StopPair(*cont[0], pair);
+  if (pair.trip_id() != 4 || pair.destination_graphid() != GraphId(10, 2, 0))
+    throw runtime_error("Stop pair was not decoded from the continuation file");
+  if (index.Departures(3, 0, 24 * 3600).size() != 0)
+    throw runtime_error("Unknown stop should have no departures");
+}
+
+void TestRebuild() {
+  std::string file_name = "test/transit_index.pbf";
+  WriteTile(file_name);
+  { TransitIndex index(file_name); }
+
+  // A saved index is loaded as is
+  TransitIndex loaded(file_name);
+  if (loaded.size() != 5)
+    throw runtime_error("Saved index was not loaded");
+
+  // Changing the tile rebuilds the index
+  std::remove((file_name + ".0").c_str());
+  TransitIndex rebuilt(file_name);
+  if (rebuilt.size() != 4 || rebuilt.Departures(2, 0, 24 * 3600).size() != 0)
+    throw runtime_error("Index was not rebuilt after the tile changed");
+}
+
+// More continuation files than would fit in 6 bits
+void TestManyFiles() {
+  std::string file_name = "test/transit_index_many.pbf";
+  std::remove((file_name + ".idx").c_str());
+  Transit transit;
+  auto* stop = transit.add_stops();
+  stop->set_onestop_id("s0");
+  stop->set_graphid(GraphId(10, 2, 0));
+  Write(transit, file_name);
+  constexpr uint32_t kFiles = 70;
+  for (uint32_t f = 0; f < kFiles; f++) {
+    Transit continuation;
+    AddPair(continuation, 0, 1, f, f * 60, true);
+    Write(continuation, file_name + "." + std::to_string(f));
+  }
+
+  TransitIndex index(file_name);
+  auto departures = index.Departures(0, 0, 24 * 3600);
+  if (departures.size() != kFiles)
+    throw runtime_error("Every continuation file should be indexed");
+  Transit_StopPair pair;
+  index.StopPair(*departures.back(), pair);
+  if (pair.trip_id() != kFiles - 1)
+    throw runtime_error("Stop pair was decoded from the wrong continuation file");
+
+  std::remove(file_name.c_str());
+  std::remove((file_name + ".idx").c_str());
+  for (uint32_t f = 0; f < kFiles; f++) {
+    std::remove((file_name + "." + std::to_string(f)).c_str());
+  }
+}
+
+}
+
+int main() {
+  test::suite suite("transitindex");
+
+  suite.test(TEST_CASE(TestDepartures));
+  suite.test(TEST_CASE(TestRebuild));
+  suite.test(TEST_CASE(TestManyFiles));
+
+  return suite.tear_down();
+}
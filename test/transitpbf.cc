@@ -0,0 +1,108 @@
+#include "test.h"
+
+#include "mjolnir/transitpbf.h"
+
+#include <cstdio>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <unistd.h>
+
+using namespace std;
+using namespace valhalla::mjolnir;
+
+namespace {
+
+// Write a small transit tile to disk
+void WriteTile(const std::string& file_name, const size_t stop_pairs) {
+  Transit transit;
+  for (uint32_t i = 0; i < 3; i++) {
+    auto* stop = transit.add_stops();
+    stop->set_name("stop " + std::to_string(i));
+    stop->set_graphid(i);
+  }
+  for (uint32_t i = 0; i < stop_pairs; i++) {
+    auto* pair = transit.add_stop_pairs();
+    pair->set_origin_graphid(i % 3);
+    pair->set_destination_graphid((i + 1) % 3);
+    pair->set_trip_id(i);
+    pair->add_service_days_of_week(true);
+  }
+  transit.add_routes()->set_name("route");
+  transit.add_shapes()->set_shape_id(1);
+  std::fstream stream(file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+  transit.SerializeToOstream(&stream);
+}
+
+void TestReadWithoutStopPairs() {
+  WriteTile("test/transit_header.pbf", 10);
+  TransitPbf pbf("test/transit_header.pbf");
+  Transit transit = pbf.ReadWithoutStopPairs();
+  if (transit.stops_size() != 3 || transit.routes_size() != 1 ||
+      transit.shapes_size() != 1)
+    throw runtime_error("Stops, routes or shapes were not read");
+  if (transit.stop_pairs_size() != 0)
+    throw runtime_error("Stop pairs should have been skipped");
+  if (transit.stops(2).name() != "stop 2")
+    throw runtime_error("Stop was not read correctly");
+  if (pbf.Read().stop_pairs_size() != 10)
+    throw runtime_error("Full read should include the stop pairs");
+}
+
+void TestStreamStopPairs() {
+  WriteTile("test/transit_pairs.pbf", 1000);
+  TransitPbf pbf("test/transit_pairs.pbf");
+  StopPairReader reader(pbf);
+  Transit_StopPair pair;
+  uint32_t trip = 0;
+  while (reader.Next(pair)) {
+    if (pair.trip_id() != trip || pair.origin_graphid() != trip % 3)
+      throw runtime_error("Stop pairs out of order or incorrect");
+    if (pair.service_days_of_week_size() != 1)
+      throw runtime_error("Stop pair was not cleared before decoding");
+    trip++;
+  }
+  if (reader.count() != 1000 || trip != 1000)
+    throw runtime_error("Wrong number of stop pairs streamed");
+}
+
+void TestEmpty() {
+  WriteTile("test/transit_empty.pbf", 0);
+  TransitPbf pbf("test/transit_empty.pbf");
+  StopPairReader reader(pbf);
+  Transit_StopPair pair;
+  if (reader.Next(pair) || reader.count() != 0)
+    throw runtime_error("Empty tile should have no stop pairs");
+
+  bool threw = false;
+  try { TransitPbf missing("test/not_a_transit_tile.pbf"); } catch (...) { threw = true; }
+  if (!threw)
+    throw runtime_error("Missing file should throw");
+}
+
+// Protobuf can't address past INT_MAX bytes so bigger tiles are refused
+// rather than read short. The file is sparse, nothing is written.
+void TestTooLarge() {
+  std::string file_name = "test/transit_too_large.pbf";
+  std::fstream(file_name, std::ios::out | std::ios::trunc | std::ios::binary);
+  if (truncate(file_name.c_str(), static_cast<off_t>(std::numeric_limits<int>::max()) + 1) != 0)
+    throw runtime_error("Couldn't size the large tile");
+  bool threw = false;
+  try { TransitPbf pbf(file_name); } catch (const std::runtime_error&) { threw = true; }
+  std::remove(file_name.c_str());
+  if (!threw)
+    throw runtime_error("Tile over INT_MAX bytes should throw");
+}
+
+}
+
+int main() {
+  test::suite suite("transitpbf");
+
+  suite.test(TEST_CASE(TestReadWithoutStopPairs));
+  suite.test(TEST_CASE(TestStreamStopPairs));
+  suite.test(TEST_CASE(TestEmpty));
+  suite.test(TEST_CASE(TestTooLarge));
+
+  return suite.tear_down();
+}
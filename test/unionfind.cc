@@ -0,0 +1,65 @@
+#include "test.h"
+
+#include <cstdint>
+#include <thread>
+#include <memory>
+#include <vector>
+#include "mjolnir/unionfind.h"
+
+using namespace std;
+using namespace valhalla::mjolnir;
+
+constexpr uint32_t kSetSize = 100000;
+
+void TestUnion() {
+  UnionFind sets(10);
+  if (sets.size() != 10 || sets.Find(7) != 7)
+    throw std::runtime_error("Indexes should start in their own set");
+
+  if (!sets.Union(7, 3) || !sets.Union(9, 7) || sets.Union(3, 9))
+    throw std::runtime_error("Union should only merge different sets");
+  if (sets.Find(9) != 3 || sets.Find(7) != 3 || sets.Find(5) != 5)
+    throw std::runtime_error("Representative should be the smallest index");
+
+  sets.Union(5, 1);
+  sets.Union(9, 5);
+  for (auto i : { 1, 3, 5, 7, 9 }) {
+    if (sets.Find(i) != 1)
+      throw std::runtime_error("Merged sets should share a representative");
+  }
+}
+
+void TestThreads() {
+  // Chain the even and odd indexes together from several threads at once
+  UnionFind sets(kSetSize);
+  std::vector<std::shared_ptr<std::thread> > threads(4);
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].reset(new std::thread([&sets, t]() {
+      for (uint32_t i = t; i + 2 < kSetSize; i += 4) {
+        sets.Union(i + 2, i);
+      }
+      uint32_t r = t;
+      for (uint32_t i = 0; i < kSetSize / 4; ++i) {
+        r = (r * 1103515245 + 12345) % (kSetSize - 2);
+        sets.Union(r, r + 2);
+      }
+    }));
+  }
+  for (auto& thread : threads) {
+    thread->join();
+  }
+
+  for (uint32_t i = 0; i < kSetSize; ++i) {
+    if (sets.Find(i) != i % 2)
+      throw std::runtime_error("Concurrent unions lost a merge");
+  }
+}
+
+int main() {
+  test::suite suite("unionfind");
+
+  suite.test(TEST_CASE(TestUnion));
+  suite.test(TEST_CASE(TestThreads));
+
+  return suite.tear_down();
+}
@@ -0,0 +1,271 @@
+#ifndef VALHALLA_MJOLNIR_BUILDPIPELINE_H
+#define VALHALLA_MJOLNIR_BUILDPIPELINE_H
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/tilehierarchy.h>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * Tiles handed from a stage that writes them to a stage that works tile by
+ * tile, so that the second stage can run while the first is still going.
+ */
+class TileFeed {
+ public:
+  /**
+   * Constructor. The feed starts empty and open.
+   * @param  name  Name of the feed, its depth is the gauge
+   *               pipeline.<name>_depth.
+   */
+  TileFeed(const std::string& name = "tile_feed");
+
+  /**
+   * Add a tile. Safe to call from several threads.
+   * @param  tile_id  Tile that is ready.
+   */
+  void Push(const baldr::GraphId& tile_id);
+
+  /**
+   * No more tiles will be added. The producing stage must close the feed
+   * even when it fails so that its consumers finish.
+   */
+  void Close();
+
+  /**
+   * Wait for the next tile. Safe to call from several threads.
+   * @param  tile_id  Set to the next tile.
+   * @return Returns false once the feed is closed and every tile was taken.
+   */
+  bool Pop(baldr::GraphId& tile_id);
+
+ private:
+  std::mutex lock_;
+  std::condition_variable ready_;
+  std::deque<baldr::GraphId> tiles_;
+  bool closed_;
+  std::string gauge_;
+};
+
+/**
+ * The local tiles a build has written so far, for a stage that works on the
+ * tiles while the build is still writing them and that also reads the tiles
+ * around the one it works on. A tile is ready once it and the tiles next to
+ * it that are planned have been written. Reads further out wait for the
+ * tile they need.
+ */
+class BuiltTiles {
+ public:
+  /**
+   * Constructor.
+   * @param  hierarchy  Tile hierarchy of the build, tiles are local tiles.
+   */
+  BuiltTiles(const baldr::TileHierarchy& hierarchy);
+
+  /**
+   * Set the tiles the build will write, before it writes any. Tiles that
+   * are not planned are never waited for.
+   * @param  tiles  Tiles to be written.
+   */
+  void Plan(const std::set<baldr::GraphId>& tiles);
+
+  /**
+   * A tile was written and will not be written again by the build. Safe to
+   * call from several threads.
+   * @param  tile_id  Tile that was written.
+   */
+  void Add(const baldr::GraphId& tile_id);
+
+  /**
+   * The build is over. Waits end and the built tiles that are not ready
+   * yet become ready, as their neighbors will not be built. The build must
+   * close even when it fails.
+   */
+  void Close();
+
+  /**
+   * Wait for a tile to be written.
+   * @param  tile_id  Tile or an id within it.
+   * @return Returns false if the tile is not planned or the build closed
+   *         without writing it.
+   */
+  bool Wait(const baldr::GraphId& tile_id) const;
+
+  /**
+   * Get the tiles that are ready, in the order they became ready. The
+   * feed is closed with the build.
+   * @return Returns the feed.
+   */
+  TileFeed& ready();
+
+ private:
+  std::vector<baldr::GraphId> Neighbors(const baldr::GraphId& tile_id) const;
+
+  baldr::TileHierarchy hierarchy_;
+  mutable std::mutex lock_;
+  mutable std::condition_variable written_;
+  bool planned_;
+  bool closed_;
+  std::set<baldr::GraphId> built_;
+  // Tiles next to each planned tile, itself included, not yet written
+  std::unordered_map<baldr::GraphId, uint32_t> pending_;
+  TileFeed ready_;
+};
+
+/**
+ * Resources used by the whole process up to a point in time. Bytes read and
+ * written are those the process fetched from or sent to storage, so pages
+ * of memory mapped files count when they are read in or written back.
+ */
+struct ResourceUsage {
+  double wall_seconds;
+  double cpu_seconds;
+  uint64_t peak_rss;          // In bytes, since the last ResetPeak
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+
+  /**
+   * Get the resources used so far.
+   * @return Returns the current usage.
+   */
+  static ResourceUsage Now();
+
+  /**
+   * Start the peak RSS over from the current RSS. Only possible on linux.
+   * @return Returns false if the peak is still that of the whole process.
+   */
+  static bool ResetPeak();
+
+  /**
+   * Get the peak RSS of the whole process, which is not reset.
+   * @return Returns the peak in bytes.
+   */
+  static uint64_t ProcessPeak();
+};
+
+/**
+ * Resources used by a stage or by a step of a stage. CPU time and bytes are
+ * process wide, so for stages that overlap they include the work of the
+ * other stage. Peak RSS is the high water mark since the stage and those
+ * overlapping it started, or that of the whole process if it could not be
+ * reset.
+ */
+struct StageTiming {
+  std::string name;
+  bool ran;
+  double seconds;
+  double cpu_seconds;
+  uint64_t peak_rss;
+  uint64_t bytes_read;
+  uint64_t bytes_written;
+};
+
+/**
+ * Compare a build report with the report of an earlier build. The stages
+ * and the tile bytes of the reports are compared, stages not in both are
+ * skipped. Measures too small in the baseline to compare are skipped too.
+ * Each regression is logged.
+ * @param  report     Report of this build.
+ * @param  baseline   Report of the earlier build.
+ * @param  threshold  Fraction a measure may grow before it regressed.
+ * @return Returns the number of measures that regressed.
+ */
+size_t CompareReport(const boost::property_tree::ptree& report,
+                     const boost::property_tree::ptree& baseline,
+                     const float threshold);
+
+/**
+ * Called by a stage when it starts its next step, with the name of the step.
+ */
+using StepCallback = std::function<void(const std::string&)>;
+
+/**
+ * Runs the stages of a graph build in the order they are added. The stages
+ * to run are listed in mjolnir.stages, all of them if it is not set. A stage
+ * may overlap the stage added before it: the two start together and the
+ * next stage waits for both of them. The overlapping stage usually consumes
+ * a TileFeed that the stage before it fills.
+ */
+class BuildPipeline {
+ public:
+  /**
+   * Constructor.
+   * @param  pt  Property tree containing the full configuration.
+   */
+  BuildPipeline(const boost::property_tree::ptree& pt);
+
+  /**
+   * Add a stage.
+   * @param  name     Name of the stage, as listed in mjolnir.stages.
+   * @param  run      Work of the stage.
+   * @param  overlap  Run at the same time as the stage added before.
+   */
+  void Add(const std::string& name, const std::function<void()>& run,
+           const bool overlap = false);
+
+  /**
+   * Is a stage configured to run.
+   * @param  name  Name of the stage.
+   * @return Returns true if the stage runs.
+   */
+  bool enabled(const std::string& name) const;
+
+  /**
+   * Get a callback that times the steps of a stage. Each call ends the
+   * current step of the stage and starts the named one. The last step ends
+   * with the stage.
+   * @param  name  Name of a stage that was added.
+   * @return Returns the callback, safe to use from the stage's threads.
+   */
+  StepCallback Steps(const std::string& name);
+
+  /**
+   * Run the enabled stages. If a stage throws, the stages running alongside
+   * it are waited for and the exception is rethrown.
+   * @return Returns the resources used by each stage, in the order added,
+   *         each followed by its steps named stage/step.
+   */
+  std::vector<StageTiming> Run();
+
+ private:
+  struct Stage {
+    std::string name;
+    std::function<void()> run;
+    bool overlap;
+  };
+
+  // Current step of a stage, none if the name is empty
+  struct OpenStep {
+    std::string name;
+    ResourceUsage start;
+  };
+
+  void RunStage(const size_t index, std::exception_ptr& error);
+  void EndStep(const size_t index, const ResourceUsage& now);
+
+  bool all_;
+  std::set<std::string> enabled_;
+  std::vector<Stage> stages_;
+  std::vector<StageTiming> timings_;
+
+  std::mutex steps_lock_;
+  std::vector<OpenStep> open_steps_;
+  std::vector<std::vector<StageTiming> > steps_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_BUILDPIPELINE_H
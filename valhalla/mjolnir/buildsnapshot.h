@@ -0,0 +1,79 @@
+#ifndef VALHALLA_MJOLNIR_BUILDSNAPSHOT_H
+#define VALHALLA_MJOLNIR_BUILDSNAPSHOT_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/tilehierarchy.h>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * What an update starts from: the enhanced local level of the previous
+ * build and the intermediate files it was built from, kept together in
+ * mjolnir.snapshot_dir. A new snapshot is put together in a staging dir
+ * next to it and renamed into place, so a failed or interrupted build
+ * leaves the previous snapshot, or none and the next build is a full one.
+ */
+class BuildSnapshot {
+ public:
+  /**
+   * Constructor.
+   * @param  pt  Property tree containing the mjolnir configuration.
+   */
+  BuildSnapshot(const boost::property_tree::ptree& pt);
+
+  /**
+   * Is a snapshot dir configured.
+   * @return Returns true if there is somewhere to keep snapshots.
+   */
+  bool configured() const;
+
+  /**
+   * Is there a snapshot to update from.
+   * @param  files  Names of the intermediate files it must hold.
+   * @return Returns true if the local level and the files are there.
+   */
+  bool exists(const std::vector<std::string>& files) const;
+
+  /**
+   * Get the path of an intermediate file of the snapshot.
+   * @param  name  Name of the file in the working dir.
+   * @return Returns the path of the file in the snapshot.
+   */
+  std::string file(const std::string& name) const;
+
+  /**
+   * Replace the local level in the tile dir with that of the snapshot.
+   */
+  void Restore() const;
+
+  /**
+   * Replace the snapshot with the local level of the tile dir and the
+   * intermediate files. Tiles and files the new snapshot shares with the
+   * previous one or with the working dir are hard linked where possible.
+   * The working files must be removed, not truncated, before they are
+   * written again so that the snapshot keeps them. If a file is missing
+   * the snapshot is left as it was.
+   * @param  files    Intermediate files in the working dir.
+   * @param  rebuilt  If not null only these local tiles are taken from the
+   *                  tile dir, the others are kept from the snapshot.
+   */
+  void Save(const std::vector<std::string>& files,
+            const std::set<baldr::GraphId>* rebuilt = nullptr) const;
+
+ protected:
+  std::string dir_;
+  baldr::TileHierarchy hierarchy_;
+  uint8_t level_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_BUILDSNAPSHOT_H
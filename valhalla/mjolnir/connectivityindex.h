@@ -0,0 +1,205 @@
+#ifndef VALHALLA_MJOLNIR_CONNECTIVITYINDEX_H
+#define VALHALLA_MJOLNIR_CONNECTIVITYINDEX_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/mjolnir/unionfind.h>
+
+namespace valhalla {
+namespace baldr {
+class GraphTile;
+}
+namespace mjolnir {
+
+/**
+ * Travel modes the node connectivity is computed for. Nodes are connected
+ * by an edge the mode can use in either direction.
+ */
+enum class ConnectivityMode : uint8_t {
+  kAuto = 0,
+  kPedestrian = 1
+};
+constexpr uint32_t kConnectivityModeCount = 2;
+
+/**
+ * Connected components of the local level graph. Computed once, right after
+ * the graph is built, and saved next to the tiles so that later passes can
+ * look connectivity up instead of expanding the graph to find it.
+ *
+ * Tiles are connected if any edge joins them. Their ids match the ids
+ * written by connectivitymap: one more than the smallest tile id of the
+ * connected set, 0 if the tile does not exist. Nodes get a component per
+ * mode, numbered from 1 in the order of their first node. Nodes added to a
+ * tile after the index was built (transit stops) have no component (0).
+ *
+ * The saved index records when it was built and the level, tile and node
+ * counts it was built from. It is purged along with the tiles when the
+ * graph is rebuilt.
+ */
+class ConnectivityIndex {
+ public:
+  /**
+   * Constructor. The index is empty until it is loaded.
+   */
+  ConnectivityIndex();
+
+  /**
+   * Compute the connectivity of the local level tiles and save it.
+   * @param  pt  Property tree containing the mjolnir configuration.
+   */
+  static void Build(const boost::property_tree::ptree& pt);
+
+  /**
+   * Get the file the index is saved to.
+   * @param  pt  Property tree containing the mjolnir configuration.
+   * @return Returns the path of the index file.
+   */
+  static std::string FileName(const boost::property_tree::ptree& pt);
+
+  /**
+   * Load a saved index. An index of another level or tiling is rejected.
+   * @param  file_name  Path of the index file.
+   * @param  hierarchy  Tile hierarchy the index has to match.
+   * @return Returns true if the index was loaded. If not the index is empty.
+   */
+  bool Load(const std::string& file_name, const baldr::TileHierarchy& hierarchy);
+
+  /**
+   * Save the index.
+   * @param  file_name  Path of the index file.
+   */
+  void Save(const std::string& file_name) const;
+
+  /**
+   * Is the index empty (not built or not loaded).
+   * @return Returns true if there is no connectivity information.
+   */
+  bool empty() const;
+
+  /**
+   * Get the id of the build the index was computed in.
+   * @return Returns the time the index was built, seconds since the epoch.
+   */
+  uint32_t build_id() const;
+
+  /**
+   * Was the index built from this tile. The tile may have gained nodes
+   * since (transit stops) but must still have every node of the index.
+   * @param  tile  Local level graph tile.
+   * @return Returns true if the components of the tile's nodes can be used.
+   */
+  bool matches(const baldr::GraphTile* tile) const;
+
+  /**
+   * Get the connectivity id of a local level tile.
+   * @param  tileid  Tile id.
+   * @return Returns the id of the connected tiles, 0 if the tile does not exist.
+   */
+  uint32_t tile_id(const uint32_t tileid) const;
+
+  /**
+   * Get the component of a local level node.
+   * @param  node  Node Id.
+   * @param  mode  Mode of travel.
+   * @return Returns the component, 0 if the node is not in the index.
+   */
+  uint32_t component(const baldr::GraphId& node, const ConnectivityMode mode) const;
+
+  /**
+   * Get the number of nodes in a component.
+   * @param  component  Component.
+   * @param  mode       Mode of travel.
+   * @return Returns the number of nodes, 0 for an unknown component.
+   */
+  uint32_t component_size(const uint32_t component, const ConnectivityMode mode) const;
+
+  /**
+   * Does a component contain a road of higher class than tertiary that the
+   * mode can use.
+   * @param  component  Component.
+   * @param  mode       Mode of travel.
+   * @return Returns true if the component has a major road.
+   */
+  bool has_major_road(const uint32_t component, const ConnectivityMode mode) const;
+
+  /**
+   * Get the number of components.
+   * @param  mode  Mode of travel.
+   * @return Returns the number of components.
+   */
+  uint32_t component_count(const ConnectivityMode mode) const;
+
+ private:
+  friend class ConnectivityBuilder;
+
+  uint32_t build_id_;
+  uint8_t level_;
+
+  // First node of each tile in the node arrays, plus the total at the end
+  std::vector<uint32_t> node_offsets_;
+
+  // Connectivity id per tile
+  std::vector<uint32_t> tile_ids_;
+
+  // Per mode: component per node, and size and major road flag per
+  // component (index 0 is unused)
+  std::vector<uint32_t> components_[kConnectivityModeCount];
+  std::vector<uint32_t> sizes_[kConnectivityModeCount];
+  std::vector<uint8_t> major_[kConnectivityModeCount];
+};
+
+/**
+ * Computes a ConnectivityIndex tile by tile. Tiles can be added from
+ * several threads and in any order, so the index can be computed while the
+ * tiles are being written.
+ */
+class ConnectivityBuilder {
+ public:
+  /**
+   * Constructor.
+   * @param  pt          Property tree containing the mjolnir configuration.
+   * @param  capacities  Upper bound of the node count of each local level
+   *                     tile, indexed by tile id.
+   */
+  ConnectivityBuilder(const boost::property_tree::ptree& pt,
+                      const std::vector<uint32_t>& capacities);
+
+  /**
+   * Merge the nodes of a local level tile with the nodes its edges end at.
+   * Safe to call from several threads as long as each tile is added once.
+   * @param  tile  Graph tile.
+   */
+  void Add(const baldr::GraphTile* tile);
+
+  /**
+   * Number the components of the added tiles and save the index.
+   */
+  void Finish();
+
+ private:
+  std::string file_name_;
+  uint8_t level_;
+
+  // First node slot of each tile, plus the total at the end. Slots past
+  // the node count of a tile are unused.
+  std::vector<uint32_t> slots_;
+
+  // Node count of each added tile
+  std::vector<uint32_t> counts_;
+  std::vector<uint8_t> added_;
+
+  UnionFind tiles_;
+  std::unique_ptr<UnionFind> nodes_[kConnectivityModeCount];
+  std::vector<uint8_t> major_[kConnectivityModeCount];
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_CONNECTIVITYINDEX_H
@@ -0,0 +1,75 @@
+#ifndef VALHALLA_MJOLNIR_CSVREADER_H_
+#define VALHALLA_MJOLNIR_CSVREADER_H_
+
+#include <string>
+#include <vector>
+#include <fstream>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * Streaming reader for comma separated files with a header row, such as the
+ * text files within a GTFS feed. Records are read one at a time so files of
+ * any size can be processed. Handles quoted fields (including embedded
+ * commas, quotes and line breaks), CRLF line endings and a UTF-8 BOM.
+ */
+class CsvReader {
+ public:
+  /**
+   * Constructor. Opens the file and reads the header row.
+   * @param  file_name  File to read.
+   * @throws std::runtime_error if the file cannot be opened
+   */
+  CsvReader(const std::string& file_name);
+
+  /**
+   * Read the next record.
+   * @return  Returns false when there are no more records.
+   */
+  bool Next();
+
+  /**
+   * Get the index of a column given its name in the header row.
+   * @param  name  Column name.
+   * @return  Returns the column index or -1 if there is no such column.
+   */
+  int column(const std::string& name) const;
+
+  /**
+   * Get a field of the current record.
+   * @param  index  Column index (from column()).
+   * @return  Returns the field or an empty string if the column is missing
+   *          or the record is too short.
+   */
+  const std::string& field(const int index) const;
+
+  /**
+   * Get a field of the current record by column name. Prefer column() and
+   * field(index) inside loops.
+   * @param  name  Column name.
+   * @return  Returns the field or an empty string if the column is missing.
+   */
+  const std::string& field(const std::string& name) const;
+
+  /**
+   * Get the number of records read so far.
+   * @return  Returns the count of records.
+   */
+  size_t count() const;
+
+ protected:
+  // Read a record into fields. Returns false at the end of the file
+  bool ReadRecord(std::vector<std::string>& fields);
+
+  std::ifstream file_;
+  std::string line_;
+  std::vector<std::string> header_;
+  std::vector<std::string> fields_;
+  size_t count_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_CSVREADER_H_
@@ -0,0 +1,140 @@
+#ifndef VALHALLA_MJOLNIR_CURLER_H_
+#define VALHALLA_MJOLNIR_CURLER_H_
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <sstream>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <boost/filesystem/path.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <curl/curl.h>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * Content addressed cache of raw responses so reruns don't have to hit the
+ * server again. Files are named by a hash of the url (without the api key)
+ * and start with the url itself so a hash collision is just a miss.
+ */
+class ResponseCache {
+ public:
+  /**
+   * Constructor. Caching is off unless the config has a cache_dir.
+   * @param  pt  Config with the optional cache_dir and api_key.
+   */
+  ResponseCache(const boost::property_tree::ptree& pt);
+
+  /**
+   * Get a cached response.
+   * @param  url   Url of the request.
+   * @param  body  Set to the cached response.
+   * @return  Returns false if the url is not cached.
+   */
+  bool get(const std::string& url, std::string& body) const;
+
+  /**
+   * Cache a response. It is written off to the side and moved into place so
+   * no one reads half a file.
+   * @param  url   Url of the request.
+   * @param  body  Response.
+   */
+  void put(const std::string& url, const std::string& body) const;
+
+ protected:
+  std::string strip(std::string url) const;
+  boost::filesystem::path path(const std::string& key) const;
+
+  std::string cache_dir_;
+  std::string api_key_;
+};
+
+/**
+ * Fetches many json urls at once over a curl multi handle. Each url starts
+ * a chain whose further pages (meta.next) are queued as the responses come
+ * in. Failed requests are retried after a random delay, which doubles with
+ * each try, without holding up the others. A request which still fails
+ * after max_tries is given up on.
+ */
+class Curler {
+ public:
+  using handler_t = std::function<void (size_t, const boost::property_tree::ptree&)>;
+
+  /**
+   * Constructor.
+   * @param  pt     Config with the optional api_key, max_in_flight
+   *                (default 8) and max_tries (default 10).
+   * @param  cache  Cache of responses. Must outlive the curler.
+   * @throws std::runtime_error if curl cannot be set up
+   */
+  Curler(const boost::property_tree::ptree& pt, const ResponseCache& cache);
+
+  ~Curler();
+
+  Curler(const Curler&) = delete;
+  Curler& operator=(const Curler&) = delete;
+
+  /**
+   * Fetch a single url, no paging.
+   * @param  url          Url to fetch.
+   * @param  retry_if_no  Retry unless the response has this key.
+   * @return  Returns the response, empty if it was given up on.
+   */
+  boost::property_tree::ptree operator()(const std::string& url, const std::string& retry_if_no = "");
+
+  /**
+   * Fetch urls and the further pages of their responses.
+   * @param  urls         Urls which each start a chain.
+   * @param  retry_if_no  Retry unless the response has this key.
+   * @param  handler      Gets the index of the url that started the chain
+   *                      along with each page of the response.
+   * @param  follow_next  Queue the meta.next page of each response.
+   * @return  Returns the number of requests given up on.
+   */
+  size_t operator()(const std::vector<std::string>& urls, const std::string& retry_if_no,
+                    const handler_t& handler, bool follow_next = true);
+
+ protected:
+  using clock_t = std::chrono::steady_clock;
+  struct request_t {
+    size_t chain;
+    std::string url;
+    size_t tries;
+    clock_t::time_point not_before;
+  };
+  struct transfer_t {
+    CURL* connection;
+    char error[CURL_ERROR_SIZE];
+    std::stringstream result;
+    request_t request;
+  };
+
+  // Has to parse and have the required info
+  static bool parse(const std::string& body, const std::string& retry_if_no,
+                    boost::property_tree::ptree& pt);
+
+  // Hand the response over and queue the next page of the chain
+  void done(const request_t& request, const boost::property_tree::ptree& pt,
+            const handler_t& handler, bool follow_next, std::deque<request_t>& pending);
+
+  void assert_curl(CURLcode code, const std::string& msg);
+  static size_t write_callback(char *in, size_t block_size, size_t blocks, std::stringstream *out);
+
+  std::shared_ptr<CURLM> multi_;
+  std::vector<std::unique_ptr<transfer_t> > transfers_;
+  std::vector<transfer_t*> idle_;
+  const ResponseCache& cache_;
+  std::string api_key_;
+  size_t max_tries_;
+  std::default_random_engine generator_;
+  std::uniform_int_distribution<size_t> distribution_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_CURLER_H_
@@ -66,37 +66,124 @@ struct NodeStatusInfo {
  */
 uint32_t GetBestNonFerryClass(const std::map<Edge, size_t>& edges);
 
+/**
+ * The driveable and ferry edges of the graph grouped by node so that the
+ * searches never go back to the edge, node and way files. Nodes are
+ * renumbered consecutively and each edge has its cost (seconds) and length
+ * computed up front. The edges and their grouping are kept in files next
+ * to the edges file, only the node numbering and a few bytes per node are
+ * held in memory.
+ */
+class FerryGraph {
+ public:
+  struct FerryEdge {
+    uint32_t edge_index;     // Index in the edges file
+    uint32_t sourcenode;     // Graph node index of the source
+    uint32_t targetnode;     // Graph node index of the target
+    float seconds;           // Time to traverse the edge
+    float length;            // Length in meters
+    uint8_t importance;
+    uint8_t driveableforward : 1;
+    uint8_t driveablereverse : 1;
+    uint8_t ferry            : 1;
+    uint8_t link             : 1;
+    uint8_t spare            : 4;
+  };
+
+  /**
+   * Load the graph with one sequential pass over the edges, ways and
+   * way nodes.
+   * @param  file_prefix  Prefix of the files the graph is kept in. They
+   *                      are removed when the graph is destroyed.
+   */
+  FerryGraph(sequence<OSMWay>& ways, sequence<OSMWayNode>& way_nodes,
+             sequence<Edge>& edges, const std::string& file_prefix);
+  ~FerryGraph();
+
+  FerryGraph(const FerryGraph&) = delete;
+  FerryGraph& operator=(const FerryGraph&) = delete;
+
+  // Number of nodes
+  uint32_t node_count() const;
+
+  // Edges from a node. The files are only read once the graph is loaded so
+  // the searches can share it across threads.
+  sequence<uint32_t>::iterator begin(const uint32_t node) const;
+  sequence<uint32_t>::iterator end(const uint32_t node) const;
+  FerryEdge edge(const uint32_t edge) const;
+
+  // Node index (first Node in the nodes file) of a graph node
+  uint32_t position(const uint32_t node) const;
+
+  // Best class of the driveable non-ferry, non-link edges at a node,
+  // kAbsurdRoadClass if there are none
+  uint32_t best_class(const uint32_t node) const;
+
+  // Does a node have ferry edges and driveable non-ferry edges
+  bool ferry_edge(const uint32_t node) const;
+  bool non_ferry_edge(const uint32_t node) const;
+
+ protected:
+  std::string edges_file_;
+  std::string adjacency_file_;
+  mutable sequence<FerryEdge> edges_;
+  mutable sequence<uint32_t> adjacency_;
+  std::vector<uint32_t> positions_;
+  std::vector<uint32_t> offsets_;
+  std::vector<uint8_t> best_class_;
+  std::vector<uint8_t> ferry_;
+};
+
+/**
+ * Search state of ShortestPath. Reused across searches on a thread so its
+ * arrays only grow to the largest search rather than being allocated for
+ * every ferry endpoint.
+ */
+struct FerrySearch {
+  std::vector<NodeLabel> node_labels;
+  std::vector<std::pair<float, uint32_t> > adjset;
+
+  // Open addressing table of node status. Only the slots used by the last
+  // search are reset.
+  std::vector<uint32_t> keys;
+  std::vector<NodeStatusInfo> status;
+  std::vector<uint32_t> used;
+
+  void clear();
+  NodeStatusInfo& operator[](const uint32_t node);
+  const NodeStatusInfo* find(const uint32_t node) const;
+};
+
 /**
  * Form the shortest path from the start node until a node that
- * touches the specified road classification.
+ * touches the specified road classification. Nodes are FerryGraph nodes.
+ * The graph is not changed, edges along the path that need a better
+ * classification are added to reclassify.
  */
-uint32_t ShortestPath(const uint32_t start_node_idx,
-                      const uint32_t node_idx,
-                      sequence<OSMWay>& ways,
-                      sequence<OSMWayNode>& way_nodes,
-                      sequence<Edge>& edges,
-                      sequence<Node>& nodes,
-                      const bool inbound, const uint32_t rc);
+void ShortestPath(const uint32_t start_node_idx,
+                  const uint32_t node_idx,
+                  const FerryGraph& graph,
+                  const bool inbound, const uint32_t rc,
+                  FerrySearch& search,
+                  std::vector<uint32_t>& reclassify);
 
 /**
- * Check if the ferry included in this node bundle is short. Must be
+ * Check if the ferry at this node is short. Must be
  * just one edge and length < 2 km. This prevents forming connections
  * to what are most likely river crossing ferries.
  */
-bool ShortFerry(const uint32_t node_index, node_bundle& bundle,
-                sequence<Edge>& edges, sequence<Node>& nodes,
-                sequence<OSMWay>& ways,
-                sequence<OSMWayNode>& way_nodes);
+bool ShortFerry(const uint32_t node_idx, const FerryGraph& graph);
 
 /**
  * Reclassify edges from a ferry along the shortest path to the
- * specified road classification.
+ * specified road classification. Ferry terminals are searched in parallel
+ * against the classification before any edge is changed.
  */
 void ReclassifyFerryConnections(const std::string& ways_file,
                                 const std::string& way_nodes_file,
-                                const std::string& nodes_file,
                                 const std::string& edges_file,
-                                const uint32_t rc, DataQuality& stats);
+                                const uint32_t rc, DataQuality& stats,
+                                const unsigned int thread_count = 1);
 
 }
 }
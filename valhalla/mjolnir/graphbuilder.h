@@ -1,10 +1,14 @@
 #ifndef VALHALLA_MJOLNIR_GRAPHBUILDER_H
 #define VALHALLA_MJOLNIR_GRAPHBUILDER_H
 
+#include <functional>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <boost/property_tree/ptree.hpp>
 
+#include <valhalla/baldr/graphid.h>
 #include <valhalla/baldr/signinfo.h>
 
 #include <valhalla/mjolnir/osmdata.h>
@@ -14,6 +18,20 @@
 namespace valhalla {
 namespace mjolnir {
 
+/**
+ * Lets other stages follow the local level tiles as GraphBuilder writes
+ * them. tiles_planned is called once, before any tile is written, with the
+ * number of node records of each tile (an upper bound of its node count).
+ * tile_built is called from the builder threads right after a tile is
+ * stored. step is called with the name of each step of the build as it
+ * starts. Any of them may be left empty.
+ */
+struct BuildObserver {
+  std::function<void(const std::map<baldr::GraphId, size_t>&)> tiles_planned;
+  std::function<void(const baldr::GraphId&)> tile_built;
+  std::function<void(const std::string&)> step;
+};
+
 /**
  * Class used to construct temporary data used to build the initial graph.
  */
@@ -27,9 +45,27 @@ class GraphBuilder {
    * @param  osmdata        OSM data used to build the graph.
    * @param  ways_file      where to store the ways so they arent in memory
    * @param  way_nodes_file where to store the nodes so they arent in memory
+   * @param  observer       told about the tiles as they are written
+   * @param  rebuild        if not null only these local tiles are written,
+   *                        the others are left as they are on disk. The
+   *                        tiles with edges into them in the new graph are
+   *                        added to the set.
    */
   static void Build(const boost::property_tree::ptree& pt, const OSMData& osmdata,
-      const std::string& ways_file, const std::string& way_nodes_file);
+      const std::string& ways_file, const std::string& way_nodes_file,
+      const BuildObserver& observer = BuildObserver(),
+      std::set<baldr::GraphId>* rebuild = nullptr);
+
+  /**
+   * Add the local tiles with edges into the tiles to rebuild. Their edges
+   * end at nodes whose ids can change when a tile is rebuilt. Used with the
+   * nodes and edges of the previous build, Build adds those of the new one.
+   * @param  nodes_file  nodes written by a build, sorted into tiles
+   * @param  edges_file  edges written by the same build
+   * @param  rebuild     local tiles to rebuild, the connected ones are added
+   */
+  static void AddConnectedTiles(const std::string& nodes_file, const std::string& edges_file,
+                                std::set<baldr::GraphId>& rebuild);
 
   static std::string GetRef(const std::string& way_ref, const std::string& relation_ref);
 
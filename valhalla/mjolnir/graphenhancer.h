@@ -1,8 +1,12 @@
 #ifndef VALHALLA_MJOLNIR_GRAPHENHANCER_H
 #define VALHALLA_MJOLNIR_GRAPHENHANCER_H
 
+#include <set>
 #include <boost/property_tree/ptree.hpp>
 
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/mjolnir/buildpipeline.h>
+
 namespace valhalla {
 namespace mjolnir {
 
@@ -14,9 +18,21 @@ class GraphEnhancer {
 
   /**
    * Enhance the local level graph tile information.
-   * @param pt   property tree containing the heirarchy configuration
+   * @param pt     property tree containing the heirarchy configuration
+   * @param only   if not null only these local tiles are enhanced
+   */
+  static void Enhance(const boost::property_tree::ptree& pt,
+                      const std::set<baldr::GraphId>* only = nullptr);
+
+  /**
+   * Enhance the local level graph tiles while they are being built, each
+   * once it and the tiles next to it are built. Unreachable edges are found
+   * by expanding the graph, as the connectivity index needs every tile.
+   * @param pt     property tree containing the heirarchy configuration
+   * @param built  tiles built so far, returns once it is closed and every
+   *               tile it made ready is enhanced
    */
-  static void Enhance(const boost::property_tree::ptree& pt);
+  static void Enhance(const boost::property_tree::ptree& pt, BuiltTiles& built);
 
 };
 
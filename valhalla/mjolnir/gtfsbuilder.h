@@ -0,0 +1,34 @@
+#ifndef VALHALLA_MJOLNIR_GTFSBUILDER_H
+#define VALHALLA_MJOLNIR_GTFSBUILDER_H
+
+#include <string>
+#include <vector>
+#include <boost/property_tree/ptree.hpp>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * Class used to build transit pbf tiles from local GTFS feeds. The tiles are
+ * the same as those fetched from Transitland so TransitBuilder can add them
+ * to the graph without any network access.
+ */
+class GTFSBuilder {
+ public:
+
+  /**
+   * Read the GTFS feeds and write transit pbf tiles to mjolnir.transit_dir.
+   * Feeds are parsed in parallel using mjolnir.concurrency threads.
+   * @param pt     Property tree containing the hierarchy configuration
+   *               and the transit directory.
+   * @param feeds  Directories holding the extracted text files of each feed.
+   */
+  static void Build(const boost::property_tree::ptree& pt,
+                    const std::vector<std::string>& feeds);
+
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_GTFSBUILDER_H
@@ -17,11 +17,14 @@ uint32_t GetBestNonLinkClass(const std::map<Edge, size_t>& edges);
 
 // Reclassify links (ramps and turn channels). OSM usually classifies links as
 // the best classification, while to more effectively create shortcuts it is
-// better to "downgrade" link edges to the lower classification.
+// better to "downgrade" link edges to the lower classification. Links that
+// meet at nodes without non-link edges are connected, and all of them get
+// the second best class of the driveable roads they connect. Connected
+// links are found and classified in parallel using thread_count threads.
 void ReclassifyLinks(const std::string& ways_file,
-                     const std::string& nodes_file,
                      const std::string& edges_file,
-                     DataQuality& stats);
+                     DataQuality& stats,
+                     const unsigned int thread_count = 1);
 }
 }
 #endif  // VALHALLA_MJOLNIR_NODE_EXPANDER_H_
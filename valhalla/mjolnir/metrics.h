@@ -0,0 +1,209 @@
+#ifndef VALHALLA_MJOLNIR_METRICS_H
+#define VALHALLA_MJOLNIR_METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <boost/property_tree/ptree.hpp>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * A count that only goes up, such as elements parsed or bytes written.
+ */
+class Counter {
+ public:
+  Counter();
+
+  /**
+   * Add to the count. Safe to call from several threads.
+   * @param  n  Amount to add.
+   */
+  void Add(const uint64_t n = 1) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /**
+   * Get the count.
+   * @return Returns the count.
+   */
+  uint64_t value() const;
+
+ private:
+  std::atomic<uint64_t> value_;
+};
+
+/**
+ * A value that goes up and down, such as tiles remaining or a queue depth.
+ */
+class Gauge {
+ public:
+  Gauge();
+
+  /**
+   * Set the value. Safe to call from several threads.
+   * @param  value  New value.
+   */
+  void Set(const int64_t value) {
+    value_.store(value, std::memory_order_relaxed);
+  }
+
+  /**
+   * Add to the value. Safe to call from several threads.
+   * @param  n  Amount to add, negative to subtract.
+   */
+  void Add(const int64_t n) {
+    value_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  /**
+   * Get the value.
+   * @return Returns the value.
+   */
+  int64_t value() const;
+
+ private:
+  std::atomic<int64_t> value_;
+};
+
+/**
+ * Durations of something that happens many times, such as waits for a lock.
+ * Keeps the number of durations, their total and the longest.
+ */
+class Timer {
+ public:
+  Timer();
+
+  /**
+   * Add a duration. Safe to call from several threads.
+   * @param  duration  How long it took.
+   */
+  void Record(const std::chrono::steady_clock::duration& duration);
+
+  /**
+   * Get the number of durations recorded.
+   * @return Returns the count.
+   */
+  uint64_t count() const;
+
+  /**
+   * Get the total of the durations.
+   * @return Returns the total in seconds.
+   */
+  double seconds() const;
+
+  /**
+   * Get the longest duration.
+   * @return Returns the longest in seconds.
+   */
+  double max_seconds() const;
+
+ private:
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> nanoseconds_;
+  std::atomic<uint64_t> max_nanoseconds_;
+};
+
+/**
+ * Registry of the metrics the stages of a build update. Metrics are created
+ * when first asked for and never removed, so a reference to one stays valid.
+ * Looking one up takes a lock: code that updates a metric often should look
+ * it up once and keep the reference.
+ */
+class Metrics {
+ public:
+  /**
+   * Get the registry of the process.
+   * @return Returns the registry.
+   */
+  static Metrics& Get();
+
+  /**
+   * Get a counter, creating it if needed.
+   * @param  name  Name of the counter, dotted by stage (parse.ways).
+   * @return Returns the counter.
+   */
+  Counter& counter(const std::string& name);
+
+  /**
+   * Get a gauge, creating it if needed.
+   * @param  name  Name of the gauge, dotted by stage.
+   * @return Returns the gauge.
+   */
+  Gauge& gauge(const std::string& name);
+
+  /**
+   * Get a timer, creating it if needed.
+   * @param  name  Name of the timer, dotted by stage.
+   * @return Returns the timer.
+   */
+  Timer& timer(const std::string& name);
+
+  /**
+   * Get all the metrics as a single line of json, without the newline.
+   * @return Returns the time in seconds since the epoch and the value of
+   *         each metric.
+   */
+  std::string JsonLine() const;
+
+  /**
+   * Get all the metrics in the Prometheus text format. Names get the prefix
+   * mjolnir_ and dots become underscores.
+   * @return Returns the metrics, one sample per line.
+   */
+  std::string Prometheus() const;
+
+ private:
+  Metrics();
+
+  mutable std::mutex lock_;
+  std::map<std::string, std::unique_ptr<Counter> > counters_;
+  std::map<std::string, std::unique_ptr<Gauge> > gauges_;
+  std::map<std::string, std::unique_ptr<Timer> > timers_;
+};
+
+/**
+ * Writes the metrics to a file on its own thread so that long builds can be
+ * followed. Configured with mjolnir.metrics: file to write to, format json
+ * (a line is appended each time) or prometheus (the file is replaced each
+ * time) and interval in seconds (default 10). Does nothing without a file
+ * or with an interval under a millisecond.
+ */
+class MetricsExporter {
+ public:
+  /**
+   * Constructor. Starts writing if a file is configured.
+   * @param  pt  Property tree containing the full configuration.
+   */
+  MetricsExporter(const boost::property_tree::ptree& pt);
+
+  /**
+   * Destructor. Writes the metrics a last time and stops.
+   */
+  ~MetricsExporter();
+
+ private:
+  void Run();
+  void Write() const;
+
+  std::string file_name_;
+  bool prometheus_;
+  std::chrono::milliseconds interval_;
+
+  std::mutex lock_;
+  std::condition_variable stop_;
+  bool stopped_;
+  std::unique_ptr<std::thread> thread_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_METRICS_H
@@ -0,0 +1,82 @@
+#ifndef VALHALLA_MJOLNIR_OSMCHANGE_H
+#define VALHALLA_MJOLNIR_OSMCHANGE_H
+
+#include <cstdint>
+#include <set>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <valhalla/baldr/graphid.h>
+#include <valhalla/baldr/tilehierarchy.h>
+#include <valhalla/midgard/pointll.h>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * The elements an OSM change file (.osc) creates, modifies or deletes, used
+ * to find the local tiles an update has to rebuild.
+ */
+class OSMChange {
+ public:
+  /**
+   * Constructor. The change is empty.
+   */
+  OSMChange();
+
+  /**
+   * Add the elements of a change file. The file is streamed, not read into
+   * memory. Throws if it cannot be read.
+   * @param  file_name  OSM change file.
+   */
+  void Load(const std::string& file_name);
+
+  /**
+   * Add the members the changed relations had in a build. A change file
+   * only lists the members a relation has now, so members it lost and
+   * those of deleted relations are found in the previous build.
+   * @param  relation_members_file  Relation members written by the parser.
+   */
+  void AddRelationMembers(const std::string& relation_members_file);
+
+  /**
+   * Get the local tiles touched by the change, with their neighbours. These
+   * are the tiles holding the new location of a changed node and the tiles
+   * a changed node or way went through in the ways and way nodes files of
+   * the previous or the current build. The neighbours cover what the
+   * enhancer reads around a tile: the road density within 2 km and the
+   * tiles at the ends of edges, if the tiles connected to the dirty tiles
+   * are added too (GraphBuilder::AddConnectedTiles). The unreachable and
+   * not thru searches are bounded by a number of nodes, not a distance. A
+   * tile further out can only see a change through them by crossing a
+   * whole neighbour on minor roads. It then keeps its flags until the next
+   * full build.
+   * @param  hierarchy      Tile hierarchy.
+   * @param  intermediates  Pairs of ways and way nodes files to look in.
+   * @return Returns the local tiles.
+   */
+  std::set<baldr::GraphId> DirtyTiles(const baldr::TileHierarchy& hierarchy,
+      const std::vector<std::pair<std::string, std::string> >& intermediates) const;
+
+  /**
+   * Does the change touch anything.
+   * @return Returns true if no element was changed.
+   */
+  bool empty() const;
+
+ protected:
+  // Changed nodes and ways, including the members of changed relations
+  std::unordered_set<uint64_t> nodes_;
+  std::unordered_set<uint64_t> ways_;
+  std::unordered_set<uint64_t> relations_;
+
+  // Where created and modified nodes are now
+  std::vector<midgard::PointLL> locations_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_OSMCHANGE_H
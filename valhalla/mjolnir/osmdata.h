@@ -6,6 +6,7 @@
 #include <vector>
 #include <map>
 #include <memory>
+#include <unordered_map>
 
 #include <valhalla/mjolnir/osmnode.h>
 #include <valhalla/mjolnir/osmway.h>
@@ -31,8 +32,106 @@ using BikeMap = std::unordered_multimap<uint64_t, OSMBike>;
 
 using OSMStringMap = std::unordered_map<uint64_t, std::string>;
 
-using OSMShapeMap = std::unordered_map<uint64_t, PointLL>;
-using OSMWayMap = std::unordered_map<uint64_t, std::list<uint64_t>>;
+/**
+ * Shape of the nodes used by admin boundary ways. The node Ids are kept in
+ * a sorted array and the shape of each node is stored at the same rank so
+ * there is no per node allocation.
+ */
+class OSMShapeMap {
+ public:
+  /**
+   * Set the nodes whose shape is needed. Clears any shape already set.
+   * @param  osmids  Node Ids, in any order and with duplicates.
+   */
+  void set_nodes(std::vector<uint64_t>&& osmids);
+
+  /**
+   * Set the shape of a node.
+   * @param  osmid  Node Id.
+   * @param  ll     Lng,lat of the node.
+   * @return  Returns false if the node is not needed.
+   */
+  bool set(const uint64_t osmid, const PointLL& ll);
+
+  /**
+   * Get the shape of a node.
+   * @param  osmid  Node Id.
+   * @return  Returns the lng,lat of the node.
+   * @throws std::out_of_range if the node was not found
+   */
+  const PointLL& at(const uint64_t osmid) const;
+
+  /**
+   * Get the number of nodes whose shape has been set.
+   * @return  Returns the count of nodes with shape.
+   */
+  size_t size() const;
+
+ protected:
+  std::vector<uint64_t> osmids_;
+  std::vector<PointLL> shapes_;
+  std::vector<bool> found_;
+  size_t count_ = 0;
+};
+
+/**
+ * Node Ids of admin boundary ways. The node Ids of all ways are stored in
+ * one array and each way holds an offset into it. Ways are sorted by Id
+ * once all are added so they can be found by binary search.
+ */
+class OSMWayMap {
+ public:
+  // Node Ids of a single way
+  struct nodes_t {
+    const uint64_t* first;
+    const uint64_t* last;
+    const uint64_t* begin() const { return first; }
+    const uint64_t* end() const { return last; }
+    size_t size() const { return last - first; }
+  };
+
+  /**
+   * Add a way. Only the first way with a given Id is kept.
+   * @param  osmid  Way Id.
+   * @param  nodes  Node Ids of the way.
+   */
+  void emplace(const uint64_t osmid, const std::vector<uint64_t>& nodes);
+
+  /**
+   * Sort the ways by Id. Must be called after adding ways and before
+   * finding them.
+   */
+  void sort();
+
+  /**
+   * Find the node Ids of a way.
+   * @param  osmid  Way Id.
+   * @param  nodes  Node Ids of the way if it is found.
+   * @return  Returns false if the way was not added.
+   */
+  bool find(const uint64_t osmid, nodes_t& nodes) const;
+
+  /**
+   * Get all node Ids of all ways, including duplicates.
+   * @return  Returns the node Ids.
+   */
+  const std::vector<uint64_t>& node_ids() const;
+
+  /**
+   * Get the number of ways.
+   * @return  Returns the count of ways.
+   */
+  size_t size() const;
+
+ protected:
+  struct way_t {
+    uint64_t osmid;
+    uint64_t offset;
+    uint32_t count;
+  };
+  std::vector<way_t> ways_;
+  std::vector<uint64_t> nodes_;
+};
 
 enum class OSMType : uint8_t {
     kNode,
@@ -46,6 +145,14 @@ struct OSMWayNode {
   size_t way_shape_node_index;
 };
 
+// A way or node member of a relation the parser used, kept so an update
+// knows what a relation referred to before it changed
+struct OSMRelationMember {
+  uint64_t relation_id;
+  uint64_t member_id;
+  OSMType member_type;
+};
+
 /**
  * Simple container for OSM data.
  * Populated by the PBF parser and sent into GraphBuilder.
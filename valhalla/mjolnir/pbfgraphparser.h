@@ -1,6 +1,7 @@
 #ifndef VALHALLA_MJOLNIR_PBFGRAPHPARSER_H
 #define VALHALLA_MJOLNIR_PBFGRAPHPARSER_H
 
+#include <functional>
 #include <string>
 #include <vector>
 #include <boost/property_tree/ptree.hpp>
@@ -22,9 +23,15 @@ class PBFGraphParser {
    * @param  input_files    the protobuf files to parse
    * @param  ways_file      where to store the ways so they arent in memory
    * @param  way_nodes_file where to store the nodes so they arent in memory
+   * @param  step           called with the name of each pass as it starts
+   * @param  relation_members_file  where to store the members of the
+   *                        relations used, sorted by relation. Not stored
+   *                        if empty.
    */
   static OSMData Parse(const boost::property_tree::ptree& pt, const std::vector<std::string>& input_files,
-      const std::string& ways_file, const std::string& way_nodes_file);
+      const std::string& ways_file, const std::string& way_nodes_file,
+      const std::function<void(const std::string&)>& step = nullptr,
+      const std::string& relation_members_file = "");
 
 };
 
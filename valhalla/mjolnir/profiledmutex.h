@@ -0,0 +1,95 @@
+#ifndef VALHALLA_MJOLNIR_PROFILEDMUTEX_H
+#define VALHALLA_MJOLNIR_PROFILEDMUTEX_H
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include <valhalla/mjolnir/metrics.h>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * A mutex that can record how it is contended. When enabled each lock call
+ * is recorded against the file and line it was made from: how often it was
+ * acquired and contended, a histogram of the time waited for it and the
+ * time it was held. The totals also go to the lock.<name>.wait and
+ * lock.<name>.hold timers of the metrics. When disabled locking costs a
+ * branch over a plain std::mutex. Locks taken by std::lock_guard are
+ * recorded against the line in the standard library that calls lock.
+ */
+class ProfiledMutex {
+ public:
+  /**
+   * Constructor.
+   * @param  name     Name of the lock in the report and the metrics.
+   * @param  enabled  Record how the lock is used.
+   */
+  ProfiledMutex(const std::string& name, const bool enabled);
+
+  /**
+   * Lock the mutex. The call site defaults to the caller's.
+   * @param  file  File of the call site.
+   * @param  line  Line of the call site.
+   */
+  void lock(const char* file = __builtin_FILE(), const int line = __builtin_LINE()) {
+    if (enabled_) {
+      Acquire(file, line);
+    } else {
+      mutex_.lock();
+    }
+  }
+
+  /**
+   * Unlock the mutex.
+   */
+  void unlock() {
+    if (enabled_) {
+      Release();
+    }
+    mutex_.unlock();
+  }
+
+  /**
+   * Log what was recorded since the last report, busiest call site first,
+   * and start over. Call it between passes, when no thread holds the lock.
+   * @param  pass  Name of the pass that used the lock.
+   */
+  void Report(const std::string& pass);
+
+  // Wait time buckets, in microseconds: below 1, then below each power of 2
+  static constexpr size_t kWaitBuckets = 24;
+
+ private:
+  struct Site {
+    uint64_t acquisitions = 0;
+    uint64_t contended = 0;
+    std::chrono::steady_clock::duration wait{0};
+    std::chrono::steady_clock::duration max_wait{0};
+    std::chrono::steady_clock::duration hold{0};
+    uint64_t waits[kWaitBuckets] = {};
+  };
+
+  void Acquire(const char* file, const int line);
+  void Release();
+
+  std::mutex mutex_;
+  std::string name_;
+  bool enabled_;
+
+  // Only changed by the thread holding the mutex
+  std::map<std::pair<const char*, int>, Site> sites_;
+  Site* holder_;
+  std::chrono::steady_clock::time_point held_since_;
+  Timer* wait_timer_;
+  Timer* hold_timer_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_PROFILEDMUTEX_H
@@ -0,0 +1,120 @@
+#ifndef VALHALLA_MJOLNIR_TRANSITINDEX_H_
+#define VALHALLA_MJOLNIR_TRANSITINDEX_H_
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "mjolnir/transitpbf.h"
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * A departure within a schedule index. Holds what is needed to answer
+ * questions about stops, routes and times. The full stop pair can be
+ * decoded from the transit tile using the offset.
+ */
+struct ScheduleEntry {
+  uint64_t destination_graphid;
+  uint64_t offset;              // Offset of the stop pair within its file
+  uint32_t departure_time;      // Seconds from midnight
+  uint32_t arrival_time;        // Seconds from midnight
+  uint32_t trip_id;
+  uint32_t line_id;
+  uint32_t service_start_date;  // Julian day
+  uint32_t service_end_date;    // Julian day
+  uint16_t route_index;
+  uint16_t file;                // 0 for .pbf, n for the .pbf.(n-1) continuation
+  uint8_t days_of_week;         // Bit per day of week, Monday is bit 0
+  uint8_t has_except_dates : 1;
+  uint8_t has_added_dates  : 1;
+};
+
+/**
+ * Binary schedule index of a transit tile. Departures are grouped by the
+ * id of their origin stop within the tile and sorted by departure time so
+ * a stop and time window is a binary search away. The index is saved next
+ * to the tile (.pbf.idx) and rebuilt whenever the tile changes.
+ */
+class TransitIndex {
+ public:
+  /**
+   * Constructor. Loads the index of a transit tile, building and saving it
+   * first if it is missing or out of date.
+   * @param  pbf_file  Transit tile (.pbf). Continuation files are included.
+   * @throws std::runtime_error if the tile cannot be read
+   */
+  TransitIndex(const std::string& pbf_file);
+
+  /**
+   * Get the number of stops in the tile.
+   * @return  Returns the stop count.
+   */
+  uint32_t stop_count() const;
+
+  /**
+   * Get the number of departures in the tile.
+   * @return  Returns the number of indexed stop pairs.
+   */
+  size_t size() const;
+
+  /**
+   * Get the departures from a stop within a time window.
+   * @param  stop_id  Id of the stop within the tile (the id of its graphid).
+   * @param  begin    Earliest departure time in seconds from midnight.
+   * @param  end      Departures must be before this time.
+   * @param  date     Only departures running on this date (julian day),
+   *                  0 for any date.
+   * @return  Returns the departures in order of departure time.
+   */
+  std::vector<const ScheduleEntry*> Departures(const uint32_t stop_id,
+                                               const uint32_t begin,
+                                               const uint32_t end,
+                                               const uint32_t date = 0) const;
+
+  /**
+   * Check if a departure runs on a given date, including any added or
+   * removed service dates.
+   * @param  entry  Departure from this index.
+   * @param  date   Julian day.
+   * @return  Returns true if the departure runs on the date.
+   */
+  bool RunsOn(const ScheduleEntry& entry, const uint32_t date) const;
+
+  /**
+   * Decode the full stop pair of a departure from the transit tile.
+   * @param  entry  Departure from this index.
+   * @param  pair   Stop pair to decode into.
+   */
+  void StopPair(const ScheduleEntry& entry, Transit_StopPair& pair) const;
+
+  /**
+   * Build the index of a transit tile and save it.
+   * @param  pbf_file    Transit tile (.pbf).
+   * @param  index_file  File to write the index to.
+   * @throws std::runtime_error if the tile cannot be read or has more
+   *         continuation files than ScheduleEntry::file can number
+   */
+  static void Build(const std::string& pbf_file, const std::string& index_file);
+
+ protected:
+  // Load a saved index, returns false if it is missing or out of date
+  bool Load(const std::string& index_file);
+
+  // Continuation files belonging to the tile, in order
+  static std::vector<std::string> Files(const std::string& pbf_file);
+
+  std::string pbf_file_;
+  std::vector<uint32_t> offsets_;
+  std::vector<ScheduleEntry> entries_;
+
+  // Files are only mapped when a full stop pair is needed
+  mutable std::vector<std::unique_ptr<TransitPbf> > files_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_TRANSITINDEX_H_
@@ -0,0 +1,126 @@
+#ifndef VALHALLA_MJOLNIR_TRANSITPBF_H_
+#define VALHALLA_MJOLNIR_TRANSITPBF_H_
+
+#include <string>
+#include <cstdint>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/io/coded_stream.h>
+
+#include "proto/transit.pb.h"
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * Read only memory map of a transit pbf tile. Parsing works directly on the
+ * mapped bytes so the file is never copied into an intermediate buffer.
+ */
+class TransitPbf {
+ public:
+  /**
+   * Constructor. Maps the file into memory.
+   * @param  file_name   Transit pbf file (.pbf or a .pbf.n continuation)
+   * @param  sequential  The file is read front to back. Pass false when
+   *                     stop pairs are read here and there by offset.
+   * @throws std::runtime_error if the file cannot be opened or mapped or
+   *                            is larger than INT_MAX bytes, which is as
+   *                            much as protobuf can read from one stream
+   */
+  TransitPbf(const std::string& file_name, const bool sequential = true);
+
+  /**
+   * Destructor. Unmaps the file.
+   */
+  ~TransitPbf();
+
+  TransitPbf(const TransitPbf&) = delete;
+  TransitPbf& operator=(const TransitPbf&) = delete;
+
+  /**
+   * Get the name of the mapped file.
+   * @return  Returns the file name.
+   */
+  const std::string& file_name() const;
+
+  /**
+   * Get the size of the mapped file in bytes.
+   * @return  Returns the file size.
+   */
+  size_t size() const;
+
+  /**
+   * Parse the entire tile including all of the stop pairs.
+   * @return  Returns the transit tile.
+   * @throws std::runtime_error if the file cannot be parsed
+   */
+  Transit Read() const;
+
+  /**
+   * Parse the stops, routes and shapes of the tile. Stop pairs are skipped,
+   * use a StopPairReader to stream through those.
+   * @return  Returns the transit tile without any stop pairs.
+   * @throws std::runtime_error if the file cannot be parsed
+   */
+  Transit ReadWithoutStopPairs() const;
+
+  /**
+   * Decode a single stop pair at a known position within the file.
+   * @param  offset  Offset of the stop pair as given by StopPairReader.
+   * @param  pair    Stop pair to decode into. It is cleared first.
+   * @throws std::runtime_error if there is no stop pair at the offset
+   */
+  void ReadStopPair(const size_t offset, Transit_StopPair& pair) const;
+
+ protected:
+  friend class StopPairReader;
+
+  std::string file_name_;
+  const char* data_;
+  size_t size_;
+};
+
+/**
+ * Streams through the stop pairs of a mapped transit tile decoding them one
+ * at a time. Only a single stop pair is ever held in memory.
+ */
+class StopPairReader {
+ public:
+  /**
+   * Constructor.
+   * @param  pbf  Mapped transit tile. Must outlive the reader.
+   */
+  StopPairReader(const TransitPbf& pbf);
+
+  /**
+   * Decode the next stop pair in the tile.
+   * @param  pair  Stop pair to decode into. It is cleared first.
+   * @return  Returns false when there are no more stop pairs.
+   * @throws std::runtime_error if a stop pair cannot be parsed
+   */
+  bool Next(Transit_StopPair& pair);
+
+  /**
+   * Get the number of stop pairs decoded so far.
+   * @return  Returns the count of decoded stop pairs.
+   */
+  size_t count() const;
+
+  /**
+   * Get the position within the file of the last decoded stop pair so it
+   * can be decoded again later with TransitPbf::ReadStopPair.
+   * @return  Returns the offset of the stop pair.
+   */
+  size_t offset() const;
+
+ private:
+  const TransitPbf& pbf_;
+  google::protobuf::io::ArrayInputStream array_;
+  google::protobuf::io::CodedInputStream coded_;
+  size_t count_;
+  size_t offset_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_TRANSITPBF_H_
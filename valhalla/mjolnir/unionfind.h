@@ -0,0 +1,54 @@
+#ifndef VALHALLA_MJOLNIR_UNIONFIND_H
+#define VALHALLA_MJOLNIR_UNIONFIND_H
+
+#include <cstdint>
+#include <atomic>
+#include <vector>
+
+namespace valhalla {
+namespace mjolnir {
+
+/**
+ * Disjoint sets over the indexes [0, size) that many threads can merge at
+ * once without locking. Sets are always linked under their smallest index so
+ * the representative of a set does not depend on the order of the unions.
+ */
+class UnionFind {
+ public:
+  /**
+   * Constructor. Every index starts in its own set.
+   * @param  size  Number of indexes.
+   */
+  UnionFind(const uint32_t size);
+
+  /**
+   * Get the representative (smallest index) of the set holding an index.
+   * Compresses the path to the representative as it goes.
+   * @param  index  Index to find.
+   * @return Returns the representative of the set.
+   */
+  uint32_t Find(uint32_t index);
+
+  /**
+   * Merge the sets holding two indexes.
+   * @param  a  Index in the first set.
+   * @param  b  Index in the second set.
+   * @return Returns true if the sets were merged, false if they were the
+   *         same set already.
+   */
+  bool Union(uint32_t a, uint32_t b);
+
+  /**
+   * Get the number of indexes.
+   * @return Returns the number of indexes.
+   */
+  uint32_t size() const;
+
+ private:
+  std::vector<std::atomic<uint32_t> > parents_;
+};
+
+}
+}
+
+#endif  // VALHALLA_MJOLNIR_UNIONFIND_H